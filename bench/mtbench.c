@@ -0,0 +1,603 @@
+// bench/mtbench.c
+// mtbench: reproducible benchmarks for the command line tools.
+//
+// Builds deterministic FAT12/16/32 images (fixed serial, seeded file
+// contents) at several sizes and fill levels, then times mformat, mcp
+// (single, batch, large file), mdir (flat and recursive), mdel, mmd and
+// minfo by running the real binaries.  Each benchmark starts from a fresh
+// copy of its base image.  Results go out as JSON: ops/sec, MB/s, peak RSS
+// of the tools and, where ptrace is available, system calls per run.
+// The tools and the base images allocate by MTOOLS_ALLOC (-a), which the
+// results record, so that two runs compare allocation policies.
+// --counts leaves the timings out and records only what does not depend
+// on the machine's speed (ops, bytes, system calls): bench/baseline.json.
+//
+// Build: see Makefile (`make bench`)
+// Usage: mtbench [-b BINDIR] [-w WORKDIR] [-o OUT.json] [-r REPEAT]
+//                [-f FILTER] [-a POLICY] [--quick] [--counts]
+
+#define _FILE_OFFSET_BITS 64
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <signal.h>
+#include <sys/ptrace.h>
+#endif
+
+#include "mtools.h"
+
+#define MAX_CMDS     512
+#define MAX_ARGS     8
+#define MAX_SAMPLES  64
+#define BENCH_EPOCH  "1700000000"     // fixed volume serial for mformat
+
+typedef struct {
+    const char *name;
+    int      fat;
+    uint32_t kib;            // image size
+    int      fill;           // percent of the data area pre-filled
+    uint32_t fill_file;      // size of each fill file
+    uint32_t small;          // batch file size
+    uint32_t batch;          // files per batch / mdel / mmd run
+    uint32_t large;          // large-file size
+    uint32_t flat;           // entries in the mdir flat directory
+} ImageCfg;
+
+static const ImageCfg configs[] = {
+    { "fat12-1440k",     12,   1440,  0,   8 << 10, 2 << 10,  40, 256 << 10, 100 },
+    { "fat12-1440k-50",  12,   1440, 50,   8 << 10, 2 << 10,  40, 256 << 10, 100 },
+    { "fat16-64m",       16,  65536,  0,  64 << 10, 4 << 10, 200,   8 << 20, 500 },
+    { "fat16-64m-50",    16,  65536, 50,  64 << 10, 4 << 10, 200,   8 << 20, 500 },
+    { "fat32-256m",      32, 262144,  0, 256 << 10, 4 << 10, 200,  32 << 20, 1000 },
+    { "fat32-256m-50",   32, 262144, 50, 256 << 10, 4 << 10, 200,  32 << 20, 1000 },
+};
+
+typedef struct {
+    char *argv[MAX_ARGS];
+} Cmd;
+
+typedef struct {
+    Cmd      cmd[MAX_CMDS];
+    int      n;
+    uint64_t ops;
+    uint64_t bytes;
+} Plan;
+
+typedef struct {
+    double   sec;
+    double   cpu;            // user + system time of the tools
+    long     rss_kb;
+} Sample;
+
+static const char *bindir  = "build";
+static const char *workdir = "build/bench";
+#define MAX_FILTERS  64
+
+static const char *filters[MAX_FILTERS];
+static int         nfilters;
+static int         repeat  = 5;
+static int         quick;
+static int         counts_only;
+static int         can_trace = 1;
+
+static char base_img[PATH_MAX], work_img[PATH_MAX];
+
+// --- helpers ---
+static void die(const char *what, int err) {
+    fprintf(stderr, "mtbench: %s: %s\n", what, strerror(err));
+    exit(1);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static char *xstrdup(const char *s) {
+    char *p = strdup(s);
+    if (!p) die("strdup", ENOMEM);
+    return p;
+}
+
+// Deterministic file contents (xorshift64, seeded per file)
+static void fill_data(uint8_t *buf, size_t len, uint64_t seed) {
+    uint64_t x = seed * 0x9E3779B97F4A7C15ull + 1;
+    for (size_t i = 0; i < len; i += 8) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        size_t n = len - i < 8 ? len - i : 8;
+        memcpy(buf + i, &x, n);
+    }
+}
+
+static void write_host_file(const char *path, size_t len, uint64_t seed) {
+    uint8_t *buf = malloc(len ? len : 1);
+    if (!buf) die("malloc", ENOMEM);
+    fill_data(buf, len, seed);
+    FILE *f = fopen(path, "wb");
+    if (!f || fwrite(buf, 1, len, f) != len || fclose(f) != 0) die(path, errno);
+    free(buf);
+}
+
+static void copy_file(const char *from, const char *to) {
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in < 0 || out < 0) die(in < 0 ? from : to, errno);
+    static uint8_t buf[1 << 20];
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) > 0)
+        if (write(out, buf, (size_t)n) != n) die(to, errno);
+    if (n < 0) die(from, errno);
+    close(in);
+    if (close(out) != 0) die(to, errno);
+}
+
+static void make_sized(const char *path, uint64_t bytes) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)bytes) != 0) die(path, errno);
+    close(fd);
+}
+
+// --- running the tools ---
+static void plan_add(Plan *p, const char *tool, ...) {
+    if (p->n == MAX_CMDS) die("plan", E2BIG);
+    Cmd *c = &p->cmd[p->n++];
+    char exe[PATH_MAX];
+    snprintf(exe, sizeof(exe), "%s/%s", bindir, tool);
+    c->argv[0] = xstrdup(exe);
+    va_list ap;
+    va_start(ap, tool);
+    int i = 1;
+    for (const char *a; i < MAX_ARGS - 1 && (a = va_arg(ap, const char *)) != NULL; ++i)
+        c->argv[i] = xstrdup(a);
+    va_end(ap);
+    c->argv[i] = NULL;
+}
+
+static void plan_free(Plan *p) {
+    for (int i = 0; i < p->n; ++i)
+        for (int j = 0; p->cmd[i].argv[j]; ++j) free(p->cmd[i].argv[j]);
+    p->n = 0;
+}
+
+static void child_exec(const Cmd *c, int trace) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) { dup2(null, 1); dup2(null, 2); close(null); }
+#ifdef __linux__
+    if (trace) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+    }
+#else
+    (void)trace;
+#endif
+    execv(c->argv[0], c->argv);
+    _exit(127);
+}
+
+static void check_status(const Cmd *c, int status) {
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) return;
+    fprintf(stderr, "mtbench: command failed (status %d):", status);
+    for (int j = 0; c->argv[j]; ++j) fprintf(stderr, " %s", c->argv[j]);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+// Run every command of the plan once; returns wall time and peak RSS.
+static Sample run_plan(const Plan *p) {
+    Sample s = { 0, 0, 0 };
+    double t0 = now();
+    for (int i = 0; i < p->n; ++i) {
+        pid_t pid = fork();
+        if (pid < 0) die("fork", errno);
+        if (pid == 0) child_exec(&p->cmd[i], 0);
+        int status;
+        struct rusage ru;
+        if (wait4(pid, &status, 0, &ru) < 0) die("wait4", errno);
+        check_status(&p->cmd[i], status);
+        if (ru.ru_maxrss > s.rss_kb) s.rss_kb = ru.ru_maxrss;
+        s.cpu += (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) +
+                 (double)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+    }
+    s.sec = now() - t0;
+    return s;
+}
+
+// System calls made by the plan, or -1 when tracing is not possible.
+static long count_syscalls(const Plan *p) {
+#ifdef __linux__
+    long total = 0;
+    for (int i = 0; i < p->n && can_trace; ++i) {
+        pid_t pid = fork();
+        if (pid < 0) die("fork", errno);
+        if (pid == 0) child_exec(&p->cmd[i], 1);
+        int status;
+        if (waitpid(pid, &status, 0) < 0) die("waitpid", errno);
+        if (!WIFSTOPPED(status) ||
+            ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL)) != 0) {
+            can_trace = 0;                  // e.g. ptrace disabled by policy
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            break;
+        }
+        long stops = 0;
+        int sig = 0;
+        for (;;) {
+            if (ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)sig) != 0) break;
+            if (waitpid(pid, &status, 0) < 0) die("waitpid", errno);
+            if (WIFEXITED(status) || WIFSIGNALED(status)) break;
+            sig = 0;
+            if (WSTOPSIG(status) == (SIGTRAP | 0x80)) ++stops;
+            else if (WSTOPSIG(status) != SIGTRAP) sig = WSTOPSIG(status);
+        }
+        check_status(&p->cmd[i], status);
+        total += (stops + 1) / 2;           // entry and exit stops; exit_group has no exit
+    }
+    return can_trace ? total : -1;
+#else
+    (void)p;
+    return -1;
+#endif
+}
+
+// --- images ---
+static void must(int rc, const char *what) {
+    if (rc) { fprintf(stderr, "mtbench: %s: %s\n", what, mt_strerror(rc)); exit(1); }
+}
+
+static void put_file(mt_image *img, const char *path, uint32_t len, uint64_t seed) {
+    uint8_t *buf = malloc(len ? len : 1);
+    if (!buf) die("malloc", ENOMEM);
+    fill_data(buf, len, seed);
+    must(mt_write(img, path, buf, len, 0), path);
+    free(buf);
+}
+
+// Base image: formatted, filled to cfg->fill percent, plus the fixtures
+// the benchmarks read or delete.
+static void build_base(const ImageCfg *cfg) {
+    char fat[8];
+    snprintf(fat, sizeof(fat), "%d", cfg->fat);
+    make_sized(base_img, (uint64_t)cfg->kib << 10);
+    Plan *p = calloc(1, sizeof(*p));
+    if (!p) die("calloc", ENOMEM);
+    plan_add(p, "mformat", "-i", base_img, "-F", fat, NULL);
+    run_plan(p);
+    plan_free(p);
+    free(p);
+
+    mt_image *img;
+    must(mt_open(&img, base_img, MT_RDWR | (mt_env_flags() & MT_ALLOC_MASK), NULL), base_img);
+    mt_batch_begin(img);
+    uint64_t target = ((uint64_t)cfg->kib << 10) * (uint64_t)cfg->fill / 100;
+    if (target) must(mt_mkdir(img, "::/FILL"), "::/FILL");
+    for (uint64_t used = 0, i = 0; used + cfg->fill_file <= target; used += cfg->fill_file, ++i) {
+        char path[64];
+        snprintf(path, sizeof(path), "::/FILL/F%05llu.BIN", (unsigned long long)i);
+        put_file(img, path, cfg->fill_file, 1000 + i);
+    }
+
+    must(mt_mkdir(img, "::/FLAT"), "::/FLAT");
+    for (uint32_t i = 0; i < cfg->flat; ++i) {
+        char path[64];
+        snprintf(path, sizeof(path), "::/FLAT/E%05u.DAT", i);
+        put_file(img, path, 0, 0);
+    }
+    // Tree for the recursive listing: 4 x 4 directories, 5 files each
+    must(mt_mkdir(img, "::/TREE"), "::/TREE");
+    for (int a = 0; a < 4; ++a) {
+        char path[64];
+        snprintf(path, sizeof(path), "::/TREE/D%d", a);
+        must(mt_mkdir(img, path), path);
+        for (int b = 0; b < 4; ++b) {
+            snprintf(path, sizeof(path), "::/TREE/D%d/S%d", a, b);
+            must(mt_mkdir(img, path), path);
+            for (int f = 0; f < 5; ++f) {
+                snprintf(path, sizeof(path), "::/TREE/D%d/S%d/F%d.TXT", a, b, f);
+                put_file(img, path, 512, (uint64_t)(a * 100 + b * 10 + f));
+            }
+        }
+    }
+    must(mt_mkdir(img, "::/DEL"), "::/DEL");
+    for (uint32_t i = 0; i < cfg->batch; ++i) {
+        char path[64];
+        snprintf(path, sizeof(path), "::/DEL/D%05u.DAT", i);
+        put_file(img, path, cfg->small, 5000 + i);
+    }
+    must(mt_mkdir(img, "::/IN"), "::/IN");
+    must(mt_batch_end(img), "batch");
+    must(mt_close(img), base_img);
+}
+
+// --- benchmarks ---
+typedef void (*PlanFn)(const ImageCfg *cfg, Plan *p);
+
+static void plan_mformat(const ImageCfg *cfg, Plan *p) {
+    char fat[8];
+    snprintf(fat, sizeof(fat), "%d", cfg->fat);
+    plan_add(p, "mformat", "-i", work_img, "-F", fat, NULL);
+    p->ops = 1;
+    p->bytes = 0;
+}
+
+static void plan_mcp_single(const ImageCfg *cfg, Plan *p) {
+    char src[PATH_MAX];
+    snprintf(src, sizeof(src), "%s/small0.bin", workdir);
+    plan_add(p, "mcp", "-i", work_img, src, "::/IN/ONE.BIN", NULL);
+    p->ops = 1;
+    p->bytes = cfg->small;
+}
+
+static void plan_mcp_batch(const ImageCfg *cfg, Plan *p) {
+    for (uint32_t i = 0; i < cfg->batch; ++i) {
+        char src[PATH_MAX], dst[64];
+        snprintf(src, sizeof(src), "%s/small%u.bin", workdir, i);
+        snprintf(dst, sizeof(dst), "::/IN/B%05u.BIN", i);
+        plan_add(p, "mcp", "-i", work_img, src, dst, NULL);
+    }
+    p->ops = cfg->batch;
+    p->bytes = (uint64_t)cfg->batch * cfg->small;
+}
+
+static void plan_mcp_large(const ImageCfg *cfg, Plan *p) {
+    char src[PATH_MAX];
+    snprintf(src, sizeof(src), "%s/large.bin", workdir);
+    plan_add(p, "mcp", "-i", work_img, src, "::/IN/LARGE.BIN", NULL);
+    p->ops = 1;
+    p->bytes = cfg->large;
+}
+
+static void plan_mdir_flat(const ImageCfg *cfg, Plan *p) {
+    (void)cfg;
+    for (int i = 0; i < 10; ++i) plan_add(p, "mdir", "-i", work_img, "::/FLAT", NULL);
+    p->ops = 10;
+    p->bytes = 0;
+}
+
+// One mdir -R over the tree; an op is one directory listed
+static void plan_mdir_recursive(const ImageCfg *cfg, Plan *p) {
+    (void)cfg;
+    plan_add(p, "mdir", "-i", work_img, "-R", "::/TREE", NULL);
+    p->ops = 1 + 4 + 4 * 4;
+    p->bytes = 0;
+}
+
+static void plan_mdel(const ImageCfg *cfg, Plan *p) {
+    for (uint32_t i = 0; i < cfg->batch; ++i) {
+        char path[64];
+        snprintf(path, sizeof(path), "::/DEL/D%05u.DAT", i);
+        plan_add(p, "mdel", "-i", work_img, path, NULL);
+    }
+    p->ops = cfg->batch;
+    p->bytes = 0;
+}
+
+static void plan_mmd(const ImageCfg *cfg, Plan *p) {
+    for (uint32_t i = 0; i < cfg->batch; ++i) {
+        char path[64];
+        snprintf(path, sizeof(path), "::/IN/M%05u", i);
+        plan_add(p, "mmd", "-i", work_img, path, NULL);
+    }
+    p->ops = cfg->batch;
+    p->bytes = 0;
+}
+
+static void plan_minfo(const ImageCfg *cfg, Plan *p) {
+    (void)cfg;
+    for (int i = 0; i < 10; ++i) plan_add(p, "minfo", "-i", work_img, NULL);
+    p->ops = 10;
+    p->bytes = 0;
+}
+
+typedef struct {
+    const char *name;
+    PlanFn      plan;
+    int         fresh;      // starts from an empty (unformatted) image
+} Bench;
+
+static const Bench benches[] = {
+    { "mformat",        plan_mformat,        1 },
+    { "mcp_single",     plan_mcp_single,     0 },
+    { "mcp_batch",      plan_mcp_batch,      0 },
+    { "mcp_large",      plan_mcp_large,      0 },
+    { "mdir_flat",      plan_mdir_flat,      0 },
+    { "mdir_recursive", plan_mdir_recursive, 0 },
+    { "mdel",           plan_mdel,           0 },
+    { "mmd",            plan_mmd,            0 },
+    { "minfo",          plan_minfo,          0 },
+};
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double median(double *v, int n) {
+    qsort(v, (size_t)n, sizeof(double), cmp_double);
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static void reset_work(const ImageCfg *cfg, const Bench *b) {
+    if (b->fresh) make_sized(work_img, (uint64_t)cfg->kib << 10);
+    else          copy_file(base_img, work_img);
+}
+
+static int selected(const ImageCfg *cfg, const Bench *b) {
+    if (b->fresh && cfg->fill) return 0;            // formatting ignores the fill level
+    char id[128];
+    snprintf(id, sizeof(id), "%s/%s", cfg->name, b->name);
+    for (int i = 0; i < nfilters; ++i)
+        if (strstr(id, filters[i])) return 1;
+    return nfilters == 0;
+}
+
+#define NBENCH (sizeof(benches) / sizeof(benches[0]))
+
+typedef struct {
+    Plan   plan;
+    double secs[MAX_SAMPLES], cpus[MAX_SAMPLES], ops[MAX_SAMPLES], mbs[MAX_SAMPLES];
+    long   rss;
+} Run;
+
+static void report(FILE *out, int *first, const ImageCfg *cfg, const Bench *b, Run *r, long sys) {
+    const Plan *p = &r->plan;
+    fprintf(out, "%s\n    {\"name\": \"%s/%s\", \"bench\": \"%s\", \"image\": \"%s\", \"fat\": %d, "
+                 "\"image_kib\": %u, \"fill\": %d,\n",
+            *first ? "" : ",", cfg->name, b->name, b->name, cfg->name, cfg->fat, cfg->kib, cfg->fill);
+    fprintf(out, "     \"ops\": %llu, \"bytes\": %llu, \"commands\": %d,",
+            (unsigned long long)p->ops, (unsigned long long)p->bytes, p->n);
+    if (counts_only) {
+        fprintf(out, " \"syscalls\": %ld}", sys);
+        *first = 0;
+        return;
+    }
+    fprintf(out, "\n     \"seconds\": [");
+    for (int i = 0; i < repeat; ++i) fprintf(out, "%s%.6f", i ? ", " : "", r->secs[i]);
+    fprintf(out, "],\n     \"cpu_seconds\": [");
+    for (int i = 0; i < repeat; ++i) fprintf(out, "%s%.6f", i ? ", " : "", r->cpus[i]);
+    fprintf(out, "],\n     \"ops_per_sec\": %.2f, ", median(r->ops, repeat));
+    if (p->bytes) fprintf(out, "\"mb_per_sec\": %.2f, ", median(r->mbs, repeat));
+    else          fprintf(out, "\"mb_per_sec\": null, ");
+    if (sys >= 0) fprintf(out, "\"syscalls\": %ld, ", sys);
+    else          fprintf(out, "\"syscalls\": null, ");
+    fprintf(out, "\"peak_rss_kb\": %ld}", r->rss);
+    *first = 0;
+}
+
+// All selected benchmarks of one image.  The runs are interleaved (one
+// round over every benchmark per repetition) so that a slow phase of the
+// machine spreads over all medians instead of skewing one benchmark.
+static void run_config(FILE *out, int *first, const ImageCfg *cfg) {
+    Run *runs = calloc(NBENCH, sizeof(Run));
+    if (!runs) die("calloc", ENOMEM);
+    for (size_t b = 0; b < NBENCH; ++b)
+        if (selected(cfg, &benches[b])) benches[b].plan(cfg, &runs[b].plan);
+
+    for (int i = 0; i < repeat; ++i) {
+        for (size_t b = 0; b < NBENCH; ++b) {
+            Run *r = &runs[b];
+            if (!r->plan.n) continue;
+            reset_work(cfg, &benches[b]);
+            Sample s = run_plan(&r->plan);
+            r->secs[i] = s.sec;
+            r->cpus[i] = s.cpu;
+            r->ops[i]  = (double)r->plan.ops / s.sec;
+            r->mbs[i]  = (double)r->plan.bytes / 1e6 / s.sec;
+            if (s.rss_kb > r->rss) r->rss = s.rss_kb;
+        }
+    }
+
+    for (size_t b = 0; b < NBENCH; ++b) {
+        Run *r = &runs[b];
+        if (!r->plan.n) continue;
+        long sys = -1;
+        if (can_trace) {
+            reset_work(cfg, &benches[b]);
+            sys = count_syscalls(&r->plan);
+        }
+        if (counts_only && sys < 0) die("--counts: system calls cannot be traced here", EPERM);
+        report(out, first, cfg, &benches[b], r, sys);
+        if (counts_only) fprintf(stderr, "  %-32s %10ld syscalls\n", benches[b].name, sys);
+        else             fprintf(stderr, "  %-32s %10.1f ops/s\n", benches[b].name, median(r->ops, repeat));
+        plan_free(&r->plan);
+    }
+    free(runs);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: mtbench [-b BINDIR] [-w WORKDIR] [-o OUT.json] [-r REPEAT] [-f FILTER] [-a POLICY]\n"
+        "               [--quick] [--counts]\n"
+        "  -b BINDIR   directory holding the tools (default build)\n"
+        "  -w WORKDIR  scratch directory for images (default build/bench)\n"
+        "  -o OUT      write JSON results to OUT (default stdout)\n"
+        "  -r REPEAT   timed runs per benchmark, median reported (default 5)\n"
+        "  -f FILTER   only benchmarks whose \"image/bench\" name contains FILTER\n"
+        "              (may be repeated)\n"
+        "  -a POLICY   allocation policy: first, next, best or near (default\n"
+        "              MTOOLS_ALLOC, else first)\n"
+        "  --quick     one run, FAT12 and FAT16 images only\n"
+        "  --counts    no timed runs: ops, bytes and system calls only (the\n"
+        "              machine-independent baseline)\n");
+}
+
+int main(int argc, char **argv) {
+    const char *out_path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-b") && i + 1 < argc)      bindir = argv[++i];
+        else if (!strcmp(argv[i], "-w") && i + 1 < argc) workdir = argv[++i];
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc) out_path = argv[++i];
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc) repeat = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc && nfilters < MAX_FILTERS)
+            filters[nfilters++] = argv[++i];
+        else if (!strcmp(argv[i], "-a") && i + 1 < argc && mt_alloc_policy(argv[i + 1]) >= 0)
+            setenv("MTOOLS_ALLOC", argv[++i], 1);
+        else if (!strcmp(argv[i], "--quick"))            quick = 1;
+        else if (!strcmp(argv[i], "--counts"))           counts_only = 1;
+        else { usage(); return 1; }
+    }
+    if (quick) repeat = 1;
+    if (repeat < 1 || repeat > MAX_SAMPLES) { usage(); return 1; }
+    if (counts_only) repeat = 0;
+
+    // The tools must touch the image directly and produce identical images
+    unsetenv("MTOOLS_SOCKET");
+    unsetenv("MTOOLS_JOURNAL");
+    setenv("SOURCE_DATE_EPOCH", BENCH_EPOCH, 1);
+
+    if (mkdir(workdir, 0755) != 0 && errno != EEXIST) die(workdir, errno);
+    snprintf(base_img, sizeof(base_img), "%s/base.img", workdir);
+    snprintf(work_img, sizeof(work_img), "%s/work.img", workdir);
+
+    FILE *out = stdout;
+    if (out_path && !(out = fopen(out_path, "w"))) die(out_path, errno);
+
+    struct utsname u;
+    uname(&u);
+    fprintf(out, "{\n  \"version\": 1,\n  \"host\": {\"sysname\": \"%s\", \"release\": \"%s\", "
+                 "\"machine\": \"%s\"},\n  \"repeat\": %d,\n  \"alloc\": \"%s\",\n  \"results\": [",
+            u.sysname, u.release, u.machine, repeat, mt_alloc_name(mt_env_flags()));
+
+    int first = 1;
+    for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); ++c) {
+        const ImageCfg *cfg = &configs[c];
+        if (quick && cfg->fat == 32) continue;
+        int any = 0;
+        for (size_t b = 0; b < NBENCH; ++b)
+            any |= selected(cfg, &benches[b]);
+        if (!any) continue;
+        fprintf(stderr, "%s\n", cfg->name);
+
+        // Host-side source files for mcp
+        for (uint32_t i = 0; i < cfg->batch; ++i) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/small%u.bin", workdir, i);
+            write_host_file(path, cfg->small, 9000 + i);
+        }
+        char large[PATH_MAX];
+        snprintf(large, sizeof(large), "%s/large.bin", workdir);
+        write_host_file(large, cfg->large, 7);
+
+        build_base(cfg);
+        run_config(out, &first, cfg);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout && fclose(out) != 0) die(out_path, errno);
+    unlink(base_img);
+    unlink(work_img);
+    return 0;
+}
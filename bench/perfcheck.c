@@ -0,0 +1,311 @@
+// bench/perfcheck.c
+// perfcheck: compare an mtbench result file against a stored baseline and
+// fail when a benchmark got slower than the allowed threshold.
+//
+// Timings only compare between runs on the same machine: the checked-in
+// bench/baseline.json holds counts alone (mtbench --counts), and the
+// timed reference is a run made locally (`make perf-reference`).  Where
+// either file lacks the timings, only the system calls are compared.
+//
+// Throughput is compared as the median of the per-run ops/sec.  A drop only
+// counts when it is larger than the threshold *and* larger than the run to
+// run noise (NOISE_K scaled median absolute deviations), so a single slow
+// run on a busy machine does not fail the gate.  System call counts are
+// deterministic and compared directly against a factor.
+//
+// `make perfcheck` writes the suspects to a list (-l), re-measures only
+// those and checks again (-p: a partial run), so a regression has to show
+// up in two separate runs to fail the gate.
+//
+// Build: see Makefile (`make perfcheck`)
+// Usage: perfcheck [-t THRESHOLD%] [-s SYSCALL_FACTOR] [-l LIST] [-p]
+//                  BASELINE.json CURRENT.json
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+
+#define MAX_RESULTS  256
+#define MAX_SAMPLES  64
+#define NOISE_K      3.0
+#define MAD_SCALE    1.4826     // MAD -> standard deviation for normal noise
+
+typedef struct {
+    char   name[128];
+    double ops;
+    int    nsec;
+    double sec[MAX_SAMPLES];
+    double syscalls;             // < 0: not measured
+} Result;
+
+typedef struct {
+    Result r[MAX_RESULTS];
+    int    n;
+} ResultSet;
+
+// --- a small JSON reader, enough for mtbench output ---
+typedef struct {
+    const char *p;
+    const char *file;
+} Parser;
+
+static int fail(Parser *ps, const char *what) {
+    fprintf(stderr, "perfcheck: %s: %s\n", ps->file, what);
+    return -1;
+}
+
+static void ws(Parser *ps) {
+    while (*ps->p == ' ' || *ps->p == '\n' || *ps->p == '\r' || *ps->p == '\t') ps->p++;
+}
+
+static int string(Parser *ps, char *out, size_t size) {
+    ws(ps);
+    if (*ps->p != '"') return fail(ps, "string expected");
+    size_t n = 0;
+    for (ps->p++; *ps->p && *ps->p != '"'; ps->p++) {
+        if (*ps->p == '\\' && ps->p[1]) ps->p++;
+        if (out && n + 1 < size) out[n++] = *ps->p;
+    }
+    if (*ps->p != '"') return fail(ps, "unterminated string");
+    ps->p++;
+    if (out) out[n] = '\0';
+    return 0;
+}
+
+// Numbers and null (returned as -1)
+static int number(Parser *ps, double *out) {
+    ws(ps);
+    if (strncmp(ps->p, "null", 4) == 0) { ps->p += 4; *out = -1; return 0; }
+    char *end;
+    errno = 0;
+    *out = strtod(ps->p, &end);
+    if (end == ps->p || errno) return fail(ps, "number expected");
+    ps->p = end;
+    return 0;
+}
+
+static int skip_value(Parser *ps);
+
+// Calls member() for each key of an object; member must consume the value.
+static int object(Parser *ps, int (*member)(Parser *, const char *, void *), void *ctx) {
+    ws(ps);
+    if (*ps->p != '{') return fail(ps, "object expected");
+    ps->p++;
+    ws(ps);
+    if (*ps->p == '}') { ps->p++; return 0; }
+    for (;;) {
+        char key[64];
+        if (string(ps, key, sizeof(key)) != 0) return -1;
+        ws(ps);
+        if (*ps->p != ':') return fail(ps, "':' expected");
+        ps->p++;
+        if ((member ? member(ps, key, ctx) : skip_value(ps)) != 0) return -1;
+        ws(ps);
+        if (*ps->p == ',') { ps->p++; continue; }
+        if (*ps->p == '}') { ps->p++; return 0; }
+        return fail(ps, "',' or '}' expected");
+    }
+}
+
+// Calls elem() for each element of an array; elem must consume the value.
+static int array(Parser *ps, int (*elem)(Parser *, void *), void *ctx) {
+    ws(ps);
+    if (*ps->p != '[') return fail(ps, "array expected");
+    ps->p++;
+    ws(ps);
+    if (*ps->p == ']') { ps->p++; return 0; }
+    for (;;) {
+        if ((elem ? elem(ps, ctx) : skip_value(ps)) != 0) return -1;
+        ws(ps);
+        if (*ps->p == ',') { ps->p++; continue; }
+        if (*ps->p == ']') { ps->p++; return 0; }
+        return fail(ps, "',' or ']' expected");
+    }
+}
+
+static int skip_value(Parser *ps) {
+    ws(ps);
+    double d;
+    switch (*ps->p) {
+    case '{': return object(ps, NULL, NULL);
+    case '[': return array(ps, NULL, NULL);
+    case '"': return string(ps, NULL, 0);
+    case 't': if (strncmp(ps->p, "true", 4) == 0)  { ps->p += 4; return 0; } break;
+    case 'f': if (strncmp(ps->p, "false", 5) == 0) { ps->p += 5; return 0; } break;
+    default:  return number(ps, &d);
+    }
+    return fail(ps, "value expected");
+}
+
+static int sample_elem(Parser *ps, void *ctx) {
+    Result *r = ctx;
+    double d;
+    if (number(ps, &d) != 0) return -1;
+    if (r->nsec < MAX_SAMPLES && d > 0) r->sec[r->nsec++] = d;
+    return 0;
+}
+
+static int result_member(Parser *ps, const char *key, void *ctx) {
+    Result *r = ctx;
+    if (strcmp(key, "name") == 0)     return string(ps, r->name, sizeof(r->name));
+    if (strcmp(key, "ops") == 0)      return number(ps, &r->ops);
+    if (strcmp(key, "syscalls") == 0) return number(ps, &r->syscalls);
+    if (strcmp(key, "seconds") == 0)  return array(ps, sample_elem, r);
+    return skip_value(ps);
+}
+
+static int result_elem(Parser *ps, void *ctx) {
+    ResultSet *set = ctx;
+    if (set->n == MAX_RESULTS) return fail(ps, "too many results");
+    Result *r = &set->r[set->n];
+    memset(r, 0, sizeof(*r));
+    r->syscalls = -1;
+    if (object(ps, result_member, r) != 0) return -1;
+    if (r->name[0] && (r->nsec || r->syscalls >= 0)) set->n++;
+    return 0;
+}
+
+static int top_member(Parser *ps, const char *key, void *ctx) {
+    if (strcmp(key, "results") == 0) return array(ps, result_elem, ctx);
+    return skip_value(ps);
+}
+
+static int load(const char *path, ResultSet *set) {
+    FILE *f = fopen(path, "rb");
+    if (!f) { fprintf(stderr, "perfcheck: %s: %s\n", path, strerror(errno)); return -1; }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buf = malloc((size_t)len + 1);
+    if (!buf || fread(buf, 1, (size_t)len, f) != (size_t)len) {
+        fprintf(stderr, "perfcheck: %s: read failed\n", path);
+        fclose(f);
+        free(buf);
+        return -1;
+    }
+    buf[len] = '\0';
+    fclose(f);
+
+    Parser ps = { buf, path };
+    set->n = 0;
+    int rc = object(&ps, top_member, set);
+    free(buf);
+    return rc;
+}
+
+// --- statistics ---
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double median(const double *v, int n) {
+    double t[MAX_SAMPLES];
+    memcpy(t, v, (size_t)n * sizeof(double));
+    qsort(t, (size_t)n, sizeof(double), cmp_double);
+    return n % 2 ? t[n / 2] : (t[n / 2 - 1] + t[n / 2]) / 2;
+}
+
+static double mad(const double *v, int n, double med) {
+    double d[MAX_SAMPLES];
+    for (int i = 0; i < n; ++i) d[i] = fabs(v[i] - med);
+    return median(d, n);
+}
+
+// Per-run ops/sec of a result, with its median and MAD.
+static void throughput(const Result *r, double *med, double *dev) {
+    double ops[MAX_SAMPLES];
+    for (int i = 0; i < r->nsec; ++i) ops[i] = r->ops / r->sec[i];
+    *med = median(ops, r->nsec);
+    *dev = mad(ops, r->nsec, *med);
+}
+
+static const Result *find(const ResultSet *set, const char *name) {
+    for (int i = 0; i < set->n; ++i)
+        if (strcmp(set->r[i].name, name) == 0) return &set->r[i];
+    return NULL;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: perfcheck [-t THRESHOLD%%] [-s SYSCALL_FACTOR] [-l LIST] [-p] BASELINE.json CURRENT.json\n"
+        "  -t THRESHOLD  allowed throughput drop in percent (default 10)\n"
+        "  -s FACTOR     allowed growth of the system call count (default 2)\n"
+        "  -l LIST       write the names of regressed benchmarks to LIST\n"
+        "  -p            CURRENT is a partial run: ignore benchmarks it lacks\n");
+}
+
+int main(int argc, char **argv) {
+    double threshold = 10, sys_factor = 2;
+    const char *list_path = NULL;
+    int partial = 0;
+    const char *files[2];
+    int nfiles = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc)      threshold = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc) sys_factor = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-l") && i + 1 < argc) list_path = argv[++i];
+        else if (!strcmp(argv[i], "-p"))                 partial = 1;
+        else if (argv[i][0] != '-' && nfiles < 2)        files[nfiles++] = argv[i];
+        else { usage(); return 2; }
+    }
+    if (nfiles != 2 || threshold <= 0 || sys_factor < 1) { usage(); return 2; }
+
+    static ResultSet base, cur;
+    if (load(files[0], &base) != 0 || load(files[1], &cur) != 0) return 2;
+    FILE *list = NULL;
+    if (list_path && !(list = fopen(list_path, "w"))) {
+        fprintf(stderr, "perfcheck: %s: %s\n", list_path, strerror(errno));
+        return 2;
+    }
+
+    int regressions = 0, compared = 0;
+    printf("%-34s %11s %11s %8s %9s %9s  %s\n",
+           "benchmark", "base ops/s", "ops/s", "change", "base sys", "syscalls", "verdict");
+    for (int i = 0; i < cur.n; ++i) {
+        const Result *c = &cur.r[i], *b = find(&base, c->name);
+        if (!b) {
+            printf("%-34s %11s %11s %8s %9s %9s  new\n", c->name, "-", "-", "-", "-", "-");
+            continue;
+        }
+        double bm = 0, bd = 0, cm = 0, cd = 0, change = 0, noise = 0;
+        int timed = b->nsec && c->nsec;
+        if (timed) {
+            throughput(b, &bm, &bd);
+            throughput(c, &cm, &cd);
+            change = (cm - bm) / bm * 100;
+            noise = NOISE_K * MAD_SCALE * (bd > cd ? bd : cd);
+        }
+
+        const char *verdict = "ok";
+        if (timed && change < -threshold && bm - cm > noise) {
+            verdict = "SLOWER";
+        } else if (c->syscalls >= 0 && b->syscalls > 0 && c->syscalls > b->syscalls * sys_factor) {
+            verdict = "SYSCALLS";
+        }
+        if (strcmp(verdict, "ok") != 0) {
+            ++regressions;
+            if (list) fprintf(list, "%s\n", c->name);
+        }
+        ++compared;
+        if (timed)
+            printf("%-34s %11.1f %11.1f %+7.1f%% %9.0f %9.0f  %s\n",
+                   c->name, bm, cm, change, b->syscalls, c->syscalls, verdict);
+        else
+            printf("%-34s %11s %11s %8s %9.0f %9.0f  %s\n",
+                   c->name, "-", "-", "-", b->syscalls, c->syscalls, verdict);
+    }
+    for (int i = 0; i < base.n && !partial; ++i)
+        if (!find(&cur, base.r[i].name))
+            printf("%-34s %11s %11s %8s %9s %9s  missing\n", base.r[i].name, "-", "-", "-", "-", "-");
+
+    if (list && fclose(list) != 0) {
+        fprintf(stderr, "perfcheck: %s: %s\n", list_path, strerror(errno));
+        return 2;
+    }
+    printf("\n%d compared, %d regressed (threshold %.0f%%, syscalls x%.1f)\n",
+           compared, regressions, threshold, sys_factor);
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,269 @@
+// src/digest.c
+// SHA-256 (FIPS 180-4), XXH64 (seed 0) and CRC-32 (IEEE 802.3, as zlib and
+// crc32(1) compute it); see digest.h.
+
+#include <string.h>
+
+#include "digest.h"
+
+static const char *const names[DG_ALGOS] = { "crc32", "xxh64", "sha256" };
+
+int dg_algo(const char *name) {
+    for (int i = 0; i < DG_ALGOS; ++i)
+        if (strcmp(name, names[i]) == 0) return i;
+    return -1;
+}
+
+const char *dg_name(int algo) { return names[algo]; }
+
+int dg_hex_len(int algo) {
+    return algo == DG_SHA256 ? 64 : algo == DG_XXH64 ? 16 : 8;
+}
+
+static void put_hex(char *out, const uint8_t *p, size_t n) {
+    static const char hx[] = "0123456789abcdef";
+    for (size_t i = 0; i < n; ++i) {
+        out[2 * i]     = hx[p[i] >> 4];
+        out[2 * i + 1] = hx[p[i] & 15];
+    }
+    out[2 * n] = '\0';
+}
+
+// --- CRC-32, a byte at a time through a 256-entry table ---
+static const uint32_t crc_tab[256] = {
+    0x00000000u, 0x77073096u, 0xEE0E612Cu, 0x990951BAu, 0x076DC419u, 0x706AF48Fu,
+    0xE963A535u, 0x9E6495A3u, 0x0EDB8832u, 0x79DCB8A4u, 0xE0D5E91Eu, 0x97D2D988u,
+    0x09B64C2Bu, 0x7EB17CBDu, 0xE7B82D07u, 0x90BF1D91u, 0x1DB71064u, 0x6AB020F2u,
+    0xF3B97148u, 0x84BE41DEu, 0x1ADAD47Du, 0x6DDDE4EBu, 0xF4D4B551u, 0x83D385C7u,
+    0x136C9856u, 0x646BA8C0u, 0xFD62F97Au, 0x8A65C9ECu, 0x14015C4Fu, 0x63066CD9u,
+    0xFA0F3D63u, 0x8D080DF5u, 0x3B6E20C8u, 0x4C69105Eu, 0xD56041E4u, 0xA2677172u,
+    0x3C03E4D1u, 0x4B04D447u, 0xD20D85FDu, 0xA50AB56Bu, 0x35B5A8FAu, 0x42B2986Cu,
+    0xDBBBC9D6u, 0xACBCF940u, 0x32D86CE3u, 0x45DF5C75u, 0xDCD60DCFu, 0xABD13D59u,
+    0x26D930ACu, 0x51DE003Au, 0xC8D75180u, 0xBFD06116u, 0x21B4F4B5u, 0x56B3C423u,
+    0xCFBA9599u, 0xB8BDA50Fu, 0x2802B89Eu, 0x5F058808u, 0xC60CD9B2u, 0xB10BE924u,
+    0x2F6F7C87u, 0x58684C11u, 0xC1611DABu, 0xB6662D3Du, 0x76DC4190u, 0x01DB7106u,
+    0x98D220BCu, 0xEFD5102Au, 0x71B18589u, 0x06B6B51Fu, 0x9FBFE4A5u, 0xE8B8D433u,
+    0x7807C9A2u, 0x0F00F934u, 0x9609A88Eu, 0xE10E9818u, 0x7F6A0DBBu, 0x086D3D2Du,
+    0x91646C97u, 0xE6635C01u, 0x6B6B51F4u, 0x1C6C6162u, 0x856530D8u, 0xF262004Eu,
+    0x6C0695EDu, 0x1B01A57Bu, 0x8208F4C1u, 0xF50FC457u, 0x65B0D9C6u, 0x12B7E950u,
+    0x8BBEB8EAu, 0xFCB9887Cu, 0x62DD1DDFu, 0x15DA2D49u, 0x8CD37CF3u, 0xFBD44C65u,
+    0x4DB26158u, 0x3AB551CEu, 0xA3BC0074u, 0xD4BB30E2u, 0x4ADFA541u, 0x3DD895D7u,
+    0xA4D1C46Du, 0xD3D6F4FBu, 0x4369E96Au, 0x346ED9FCu, 0xAD678846u, 0xDA60B8D0u,
+    0x44042D73u, 0x33031DE5u, 0xAA0A4C5Fu, 0xDD0D7CC9u, 0x5005713Cu, 0x270241AAu,
+    0xBE0B1010u, 0xC90C2086u, 0x5768B525u, 0x206F85B3u, 0xB966D409u, 0xCE61E49Fu,
+    0x5EDEF90Eu, 0x29D9C998u, 0xB0D09822u, 0xC7D7A8B4u, 0x59B33D17u, 0x2EB40D81u,
+    0xB7BD5C3Bu, 0xC0BA6CADu, 0xEDB88320u, 0x9ABFB3B6u, 0x03B6E20Cu, 0x74B1D29Au,
+    0xEAD54739u, 0x9DD277AFu, 0x04DB2615u, 0x73DC1683u, 0xE3630B12u, 0x94643B84u,
+    0x0D6D6A3Eu, 0x7A6A5AA8u, 0xE40ECF0Bu, 0x9309FF9Du, 0x0A00AE27u, 0x7D079EB1u,
+    0xF00F9344u, 0x8708A3D2u, 0x1E01F268u, 0x6906C2FEu, 0xF762575Du, 0x806567CBu,
+    0x196C3671u, 0x6E6B06E7u, 0xFED41B76u, 0x89D32BE0u, 0x10DA7A5Au, 0x67DD4ACCu,
+    0xF9B9DF6Fu, 0x8EBEEFF9u, 0x17B7BE43u, 0x60B08ED5u, 0xD6D6A3E8u, 0xA1D1937Eu,
+    0x38D8C2C4u, 0x4FDFF252u, 0xD1BB67F1u, 0xA6BC5767u, 0x3FB506DDu, 0x48B2364Bu,
+    0xD80D2BDAu, 0xAF0A1B4Cu, 0x36034AF6u, 0x41047A60u, 0xDF60EFC3u, 0xA867DF55u,
+    0x316E8EEFu, 0x4669BE79u, 0xCB61B38Cu, 0xBC66831Au, 0x256FD2A0u, 0x5268E236u,
+    0xCC0C7795u, 0xBB0B4703u, 0x220216B9u, 0x5505262Fu, 0xC5BA3BBEu, 0xB2BD0B28u,
+    0x2BB45A92u, 0x5CB36A04u, 0xC2D7FFA7u, 0xB5D0CF31u, 0x2CD99E8Bu, 0x5BDEAE1Du,
+    0x9B64C2B0u, 0xEC63F226u, 0x756AA39Cu, 0x026D930Au, 0x9C0906A9u, 0xEB0E363Fu,
+    0x72076785u, 0x05005713u, 0x95BF4A82u, 0xE2B87A14u, 0x7BB12BAEu, 0x0CB61B38u,
+    0x92D28E9Bu, 0xE5D5BE0Du, 0x7CDCEFB7u, 0x0BDBDF21u, 0x86D3D2D4u, 0xF1D4E242u,
+    0x68DDB3F8u, 0x1FDA836Eu, 0x81BE16CDu, 0xF6B9265Bu, 0x6FB077E1u, 0x18B74777u,
+    0x88085AE6u, 0xFF0F6A70u, 0x66063BCAu, 0x11010B5Cu, 0x8F659EFFu, 0xF862AE69u,
+    0x616BFFD3u, 0x166CCF45u, 0xA00AE278u, 0xD70DD2EEu, 0x4E048354u, 0x3903B3C2u,
+    0xA7672661u, 0xD06016F7u, 0x4969474Du, 0x3E6E77DBu, 0xAED16A4Au, 0xD9D65ADCu,
+    0x40DF0B66u, 0x37D83BF0u, 0xA9BCAE53u, 0xDEBB9EC5u, 0x47B2CF7Fu, 0x30B5FFE9u,
+    0xBDBDF21Cu, 0xCABAC28Au, 0x53B39330u, 0x24B4A3A6u, 0xBAD03605u, 0xCDD70693u,
+    0x54DE5729u, 0x23D967BFu, 0xB3667A2Eu, 0xC4614AB8u, 0x5D681B02u, 0x2A6F2B94u,
+    0xB40BBE37u, 0xC30C8EA1u, 0x5A05DF1Bu, 0x2D02EF8Du
+};
+
+static void crc_update(Digest *d, const uint8_t *p, size_t n) {
+    uint32_t c = d->u.crc;
+    while (n--) c = crc_tab[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    d->u.crc = c;
+}
+
+// --- XXH64 ---
+#define P1 0x9E3779B185EBCA87ull
+#define P2 0xC2B2AE3D27D4EB4Full
+#define P3 0x165667B19E3779F9ull
+#define P4 0x85EBCA77C2B2AE63ull
+#define P5 0x27D4EB2F165667C5ull
+
+static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t rd64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i) v = (v << 8) | p[i];
+    return v;
+}
+
+static uint32_t rd32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t in) {
+    return rotl(acc + in * P2, 31) * P1;
+}
+
+static uint64_t xxh_merge(uint64_t h, uint64_t v) {
+    return (h ^ xxh_round(0, v)) * P1 + P4;
+}
+
+static void xxh_update(Digest *d, const uint8_t *p, size_t n) {
+    uint64_t *v = d->u.xxh.v;
+    size_t have = (size_t)(d->len % 32);
+    if (have) {
+        size_t k = 32 - have < n ? 32 - have : n;
+        memcpy(d->u.xxh.buf + have, p, k);
+        p += k;
+        n -= k;
+        if (have + k < 32) return;
+        for (int i = 0; i < 4; ++i) v[i] = xxh_round(v[i], rd64(d->u.xxh.buf + 8 * i));
+    }
+    for (; n >= 32; p += 32, n -= 32)
+        for (int i = 0; i < 4; ++i) v[i] = xxh_round(v[i], rd64(p + 8 * i));
+    memcpy(d->u.xxh.buf, p, n);
+}
+
+static uint64_t xxh_final(const Digest *d) {
+    const uint64_t *v = d->u.xxh.v;
+    uint64_t h;
+    if (d->len >= 32) {
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+        for (int i = 0; i < 4; ++i) h = xxh_merge(h, v[i]);
+    } else {
+        h = v[2] + P5;                          // v[2] is still the seed
+    }
+    h += d->len;
+    const uint8_t *p = d->u.xxh.buf;
+    size_t n = (size_t)(d->len % 32);
+    for (; n >= 8; p += 8, n -= 8) h = rotl(h ^ xxh_round(0, rd64(p)), 27) * P1 + P4;
+    if (n >= 4) {
+        h = rotl(h ^ (uint64_t)rd32(p) * P1, 23) * P2 + P3;
+        p += 4;
+        n -= 4;
+    }
+    for (; n; ++p, --n) h = rotl(h ^ *p * P5, 11) * P1;
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// --- SHA-256 ---
+static const uint32_t K[64] = {
+    0x428a2f98u, 0x71374491u, 0xb5c0fbcfu, 0xe9b5dba5u, 0x3956c25bu, 0x59f111f1u, 0x923f82a4u, 0xab1c5ed5u,
+    0xd807aa98u, 0x12835b01u, 0x243185beu, 0x550c7dc3u, 0x72be5d74u, 0x80deb1feu, 0x9bdc06a7u, 0xc19bf174u,
+    0xe49b69c1u, 0xefbe4786u, 0x0fc19dc6u, 0x240ca1ccu, 0x2de92c6fu, 0x4a7484aau, 0x5cb0a9dcu, 0x76f988dau,
+    0x983e5152u, 0xa831c66du, 0xb00327c8u, 0xbf597fc7u, 0xc6e00bf3u, 0xd5a79147u, 0x06ca6351u, 0x14292967u,
+    0x27b70a85u, 0x2e1b2138u, 0x4d2c6dfcu, 0x53380d13u, 0x650a7354u, 0x766a0abbu, 0x81c2c92eu, 0x92722c85u,
+    0xa2bfe8a1u, 0xa81a664bu, 0xc24b8b70u, 0xc76c51a3u, 0xd192e819u, 0xd6990624u, 0xf40e3585u, 0x106aa070u,
+    0x19a4c116u, 0x1e376c08u, 0x2748774cu, 0x34b0bcb5u, 0x391c0cb3u, 0x4ed8aa4au, 0x5b9cca4fu, 0x682e6ff3u,
+    0x748f82eeu, 0x78a5636fu, 0x84c87814u, 0x8cc70208u, 0x90befffau, 0xa4506cebu, 0xbef9a3f7u, 0xc67178f2u
+};
+
+static uint32_t ror(uint32_t x, int r) { return (x >> r) | (x << (32 - r)); }
+
+static void sha_block(uint32_t h[8], const uint8_t *p) {
+    uint32_t w[64], s[8];
+    for (int i = 0; i < 16; ++i)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(s, h, sizeof(s));
+    for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = s[7] + (ror(s[4], 6) ^ ror(s[4], 11) ^ ror(s[4], 25)) +
+                      ((s[4] & s[5]) ^ (~s[4] & s[6])) + K[i] + w[i];
+        uint32_t t2 = (ror(s[0], 2) ^ ror(s[0], 13) ^ ror(s[0], 22)) +
+                      ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+        memmove(s + 1, s, 7 * sizeof(*s));
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; ++i) h[i] += s[i];
+}
+
+static void sha_update(Digest *d, const uint8_t *p, size_t n) {
+    size_t have = (size_t)(d->len % 64);
+    if (have) {
+        size_t k = 64 - have < n ? 64 - have : n;
+        memcpy(d->u.sha.buf + have, p, k);
+        p += k;
+        n -= k;
+        if (have + k < 64) return;
+        sha_block(d->u.sha.h, d->u.sha.buf);
+    }
+    for (; n >= 64; p += 64, n -= 64) sha_block(d->u.sha.h, p);
+    memcpy(d->u.sha.buf, p, n);
+}
+
+static void sha_final(Digest *d, uint8_t out[32]) {
+    uint64_t bits = d->len * 8;
+    size_t have = (size_t)(d->len % 64);
+    uint8_t *b = d->u.sha.buf;
+    b[have++] = 0x80;
+    if (have > 56) {
+        memset(b + have, 0, 64 - have);
+        sha_block(d->u.sha.h, b);
+        have = 0;
+    }
+    memset(b + have, 0, 56 - have);
+    for (int i = 0; i < 8; ++i) b[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha_block(d->u.sha.h, b);
+    for (int i = 0; i < 8; ++i) {
+        out[4 * i]     = (uint8_t)(d->u.sha.h[i] >> 24);
+        out[4 * i + 1] = (uint8_t)(d->u.sha.h[i] >> 16);
+        out[4 * i + 2] = (uint8_t)(d->u.sha.h[i] >> 8);
+        out[4 * i + 3] = (uint8_t)d->u.sha.h[i];
+    }
+}
+
+// --- common ---
+void dg_init(Digest *d, int algo) {
+    static const uint32_t sha_iv[8] = {
+        0x6a09e667u, 0xbb67ae85u, 0x3c6ef372u, 0xa54ff53au,
+        0x510e527fu, 0x9b05688cu, 0x1f83d9abu, 0x5be0cd19u
+    };
+    memset(d, 0, sizeof(*d));
+    d->algo = algo;
+    if (algo == DG_CRC32) {
+        d->u.crc = 0xFFFFFFFFu;
+    } else if (algo == DG_XXH64) {
+        d->u.xxh.v[0] = P1 + P2;
+        d->u.xxh.v[1] = P2;
+        d->u.xxh.v[2] = 0;
+        d->u.xxh.v[3] = 0 - P1;
+    } else {
+        memcpy(d->u.sha.h, sha_iv, sizeof(sha_iv));
+    }
+}
+
+void dg_update(Digest *d, const void *data, size_t len) {
+    if (d->algo == DG_CRC32) crc_update(d, data, len);
+    else if (d->algo == DG_XXH64) xxh_update(d, data, len);
+    else sha_update(d, data, len);
+    d->len += len;
+}
+
+void dg_final(Digest *d, char hex[DG_HEX_MAX]) {
+    uint8_t out[32];
+    size_t n;
+    if (d->algo == DG_CRC32) {
+        uint32_t c = d->u.crc ^ 0xFFFFFFFFu;
+        for (int i = 0; i < 4; ++i) out[i] = (uint8_t)(c >> (24 - 8 * i));
+        n = 4;
+    } else if (d->algo == DG_XXH64) {
+        uint64_t h = xxh_final(d);
+        for (int i = 0; i < 8; ++i) out[i] = (uint8_t)(h >> (56 - 8 * i));
+        n = 8;
+    } else {
+        sha_final(d, out);
+        n = 32;
+    }
+    put_hex(hex, out, n);
+}
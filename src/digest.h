@@ -0,0 +1,33 @@
+// src/digest.h
+// Content digests for mdigest: SHA-256, XXH64 and CRC-32 (IEEE), fed
+// incrementally, printed as lower-case hex the way sha256sum, xxh64sum
+// and crc32 print them.  No state outside the Digest.
+
+#ifndef MTOOLS_DIGEST_H
+#define MTOOLS_DIGEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum { DG_CRC32, DG_XXH64, DG_SHA256, DG_ALGOS };
+
+#define DG_HEX_MAX 65           // longest hex digest (SHA-256) plus NUL
+
+typedef struct {
+    int      algo;
+    uint64_t len;               // bytes fed so far
+    union {
+        uint32_t crc;
+        struct { uint64_t v[4]; uint8_t buf[32]; } xxh;
+        struct { uint32_t h[8]; uint8_t buf[64]; } sha;
+    } u;
+} Digest;
+
+int  dg_algo(const char *name);         // "sha256", "xxh64", "crc32"; -1 if unknown
+const char *dg_name(int algo);
+int  dg_hex_len(int algo);              // 64, 16, 8
+void dg_init(Digest *d, int algo);
+void dg_update(Digest *d, const void *data, size_t len);
+void dg_final(Digest *d, char hex[DG_HEX_MAX]);
+
+#endif
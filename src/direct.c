@@ -0,0 +1,266 @@
+// src/direct.c
+// O_DIRECT image access for the fatvol engine (MT_DIRECT).
+//
+// With O_DIRECT the kernel moves data straight between the device and
+// user memory, so every request must start, end and sit in memory on the
+// device's logical block size.  Aligned requests go through as they are
+// (staged in the aligned bounce buffer when the caller's memory is not);
+// the sub-block pieces, in practice 512-byte FAT and directory sectors,
+// are merged into a FV_DIO_WINDOW staging window that is read once and
+// written back as one request: when a piece falls outside it, before an
+// overlapping read or write, and from fv_qwait().
+//
+// Both buffers come from one allocation, aligned by hand since the
+// caller's allocator (mt_allocator) promises no more than malloc.
+
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "fatvol.h"
+
+#define NO_WINDOW UINT64_MAX
+
+typedef struct {
+    uint8_t *buf;              // FV_DIO_WINDOW bytes
+    uint64_t off;              // image offset, NO_WINDOW when empty
+    uint32_t len;              // bytes inside the image
+    uint32_t lo, hi;           // dirty bytes (lo == hi: clean)
+    uint64_t used;             // LRU stamp
+} Window;
+
+struct FvDio {
+    uint32_t align;            // logical block size of the device
+    uint8_t *mem;              // the allocation
+    uint8_t *bounce;           // FV_IO_MAX bytes
+    Window   win[FV_DIO_WINDOWS];
+    uint64_t clock;
+};
+
+static uint64_t down(const FvDio *d, uint64_t x) { return x & ~(uint64_t)(d->align - 1); }
+static uint64_t up(const FvDio *d, uint64_t x)   { return down(d, x + d->align - 1); }
+
+// pread/pwrite the whole range; a read stops early at the end of the
+// image and *done tells how far it got.
+static int dio_io(FatVol *v, int write, uint8_t *p, size_t len, uint64_t off, size_t *done) {
+    size_t got = 0;
+    while (got < len) {
+        v->st.syscalls++;
+        ssize_t n = write ? pwrite(v->fd, p + got, len - got, (off_t)(off + got))
+                          : pread(v->fd, p + got, len - got, (off_t)(off + got));
+        if (n < 0) { if (errno == EINTR) continue; return -errno; }
+        if (n == 0) break;
+        got += (size_t)n;
+    }
+    if (done) *done = got;
+    return (write && got < len) ? -EIO : 0;
+}
+
+static int overlaps(const Window *w, uint64_t off, size_t len) {
+    return w->off != NO_WINDOW && off < w->off + FV_DIO_WINDOW && w->off < off + len;
+}
+
+static int dirty_overlap(const Window *w, uint64_t off, size_t len) {
+    return w->lo < w->hi && off < w->off + w->hi && w->off + w->lo < off + len;
+}
+
+static Window *find(FvDio *d, uint64_t off) {
+    uint64_t at = off & ~(uint64_t)(FV_DIO_WINDOW - 1);
+    for (int i = 0; i < FV_DIO_WINDOWS; ++i)
+        if (d->win[i].off == at) return &d->win[i];
+    return NULL;
+}
+
+int fv_dio_spill(FatVol *v) {
+    FvDio *d = v->dio;
+    int rc = 0;
+    for (int i = 0; d && i < FV_DIO_WINDOWS && rc == 0; ++i) {
+        Window *w = &d->win[i];
+        if (w->lo == w->hi) continue;
+        uint64_t a = down(d, w->lo), b = up(d, w->hi);
+        w->lo = w->hi = 0;
+        rc = dio_io(v, 1, w->buf + a, (size_t)(b - a), w->off + a, NULL);
+    }
+    return rc;
+}
+
+// The window covering off, loaded into the least recently used one.  A
+// dirty victim is written back through fv_qwait(), which first lets
+// queued data reach the image, so the sectors written at flush time
+// still land after the data they describe.
+static int window_at(FatVol *v, uint64_t off, Window **out) {
+    FvDio *d = v->dio;
+    Window *w = find(d, off);
+    if (!w) {
+        w = &d->win[0];
+        for (int i = 1; i < FV_DIO_WINDOWS; ++i)
+            if (d->win[i].used < w->used) w = &d->win[i];
+        int rc;
+        if (w->lo < w->hi && (rc = fv_qwait(v)) != 0) return rc;
+        w->off = NO_WINDOW;
+        uint64_t at = off & ~(uint64_t)(FV_DIO_WINDOW - 1);
+        size_t got;
+        if ((rc = dio_io(v, 0, w->buf, FV_DIO_WINDOW, at, &got)) != 0) return rc;
+        if (got < FV_DIO_WINDOW) memset(w->buf + got, 0, FV_DIO_WINDOW - got);   // past the end
+        v->st.sectors_read += got / 512;
+        w->off = at;
+        w->len = (uint32_t)got;
+    }
+    w->used = ++d->clock;
+    *out = w;
+    return 0;
+}
+
+int fv_dio_start(FatVol *v) {
+    struct stat st;
+    uint32_t align = 4096;          // safe for files on any local file system
+    v->st.syscalls++;
+    if (fstat(v->fd, &st) != 0) return -errno;
+#ifdef BLKSSZGET
+    int bs;
+    if (S_ISBLK(st.st_mode) && ioctl(v->fd, BLKSSZGET, &bs) == 0 && bs > 0) align = (uint32_t)bs;
+#endif
+    if (align > FV_DIO_ALIGN_MAX || (align & (align - 1))) return -EINVAL;
+    // O_DIRECT cannot write the last block of a file that ends inside one
+    if (S_ISREG(st.st_mode) && st.st_size % align) return -EINVAL;
+
+    FvDio *d = fv_alloc(v, sizeof(*d));
+    if (!d) return -ENOMEM;
+    memset(d, 0, sizeof(*d));
+    if (!(d->mem = fv_alloc(v, FV_IO_MAX + FV_DIO_WINDOWS * FV_DIO_WINDOW + FV_DIO_ALIGN_MAX))) {
+        fv_free(v, d);
+        return -ENOMEM;
+    }
+    uintptr_t p = ((uintptr_t)d->mem + FV_DIO_ALIGN_MAX - 1) & ~(uintptr_t)(FV_DIO_ALIGN_MAX - 1);
+    d->bounce = (uint8_t *)p;
+    for (int i = 0; i < FV_DIO_WINDOWS; ++i) {
+        d->win[i].buf = d->bounce + FV_IO_MAX + (size_t)i * FV_DIO_WINDOW;
+        d->win[i].off = NO_WINDOW;
+    }
+    d->align = align;
+    v->dio = d;
+    return 0;
+}
+
+void fv_dio_close(FatVol *v) {
+    if (!v->dio) return;
+    fv_free(v, v->dio->mem);
+    fv_free(v, v->dio);
+    v->dio = NULL;
+}
+
+int fv_dio_direct(FatVol *v, uint64_t off, size_t len, int write) {
+    FvDio *d = v->dio;
+    if ((off | len) & (d->align - 1)) return 0;
+    for (int i = 0; i < FV_DIO_WINDOWS; ++i) {
+        Window *w = &d->win[i];
+        if (!overlaps(w, off, len)) continue;
+        if (!write) {
+            if (dirty_overlap(w, off, len)) return 0;
+        } else {
+            if (w->lo < w->hi) return 0;    // the window is written back first
+            w->off = NO_WINDOW;             // would go stale
+        }
+    }
+    return 1;
+}
+
+int fv_dio_read(FatVol *v, void *buf, size_t len, uint64_t off) {
+    FvDio *d = v->dio;
+    uint8_t *p = buf;
+    int rc;
+    // Sector reads fill a window: neighbouring FAT and directory sectors
+    // then come from memory, and updating them costs no read
+    uint64_t at = off & ~(uint64_t)(FV_DIO_WINDOW - 1);
+    Window *w = find(d, off);
+    if (off + len <= at + FV_DIO_WINDOW && (w || ((off | len) & (d->align - 1)))) {
+        if ((rc = window_at(v, off, &w)) != 0) return rc;
+        if (off + len > at + w->len) return -EIO;       // short image
+        memcpy(p, w->buf + (off - at), len);
+        return 0;
+    }
+    for (int i = 0; i < FV_DIO_WINDOWS; ++i)
+        if (dirty_overlap(&d->win[i], off, len) && (rc = fv_qwait(v)) != 0) return rc;
+    while (len) {
+        uint64_t a = down(d, off);
+        size_t span = (size_t)(up(d, off + len) - a);
+        if (span > FV_IO_MAX) span = FV_IO_MAX;
+        size_t n = span - (size_t)(off - a), got;
+        if (n > len) n = len;
+        if (a == off && n == span && !((uintptr_t)p & (d->align - 1))) {
+            if ((rc = dio_io(v, 0, p, n, off, &got)) != 0) return rc;
+            if (got < n) return -EIO;                    // short image
+        } else {
+            if ((rc = dio_io(v, 0, d->bounce, span, a, &got)) != 0) return rc;
+            if (got < (size_t)(off - a) + n) return -EIO;
+            memcpy(p, d->bounce + (off - a), n);
+        }
+        p += n; off += n; len -= n;
+    }
+    return 0;
+}
+
+int fv_dio_write(FatVol *v, const void *buf, size_t len, uint64_t off) {
+    FvDio *d = v->dio;
+    const uint8_t *p = buf;
+    int rc;
+    while (len) {
+        size_t n;
+        uint32_t head = (uint32_t)(off & (d->align - 1));
+        if (head || len < d->align) {
+            // a piece of one block: merge it into its window
+            Window *w;
+            n = d->align - head;
+            if (n > len) n = len;
+            if ((rc = window_at(v, off, &w)) != 0) return rc;
+            uint32_t at = (uint32_t)(off - w->off);
+            memcpy(w->buf + at, p, n);
+            if (w->lo == w->hi) { w->lo = at; w->hi = at + (uint32_t)n; }
+            else {
+                if (at < w->lo) w->lo = at;
+                if (at + n > w->hi) w->hi = at + (uint32_t)n;
+            }
+        } else {
+            n = (size_t)down(d, len < FV_IO_MAX ? len : FV_IO_MAX);
+            for (int i = 0; i < FV_DIO_WINDOWS; ++i) {
+                // keep overlapping windows current: the block-aligned dirty
+                // span of one never reaches into these whole blocks unless
+                // it was dirtied there, and then it is written back first
+                Window *w = &d->win[i];
+                if (!overlaps(w, off, n)) continue;
+                if (dirty_overlap(w, off, n) && (rc = fv_qwait(v)) != 0) return rc;
+                uint64_t a = off > w->off ? off : w->off;
+                uint64_t b = off + n < w->off + FV_DIO_WINDOW ? off + n : w->off + FV_DIO_WINDOW;
+                memcpy(w->buf + (a - w->off), p + (a - off), (size_t)(b - a));
+            }
+            const uint8_t *src = p;
+            if ((uintptr_t)p & (d->align - 1)) {
+                memcpy(d->bounce, p, n);
+                src = d->bounce;
+            }
+            if ((rc = dio_io(v, 1, (uint8_t *)src, n, off, NULL)) != 0) return rc;
+        }
+        p += n; off += n; len -= n;
+    }
+    return 0;
+}
+
+// [off, off + len) became a hole: windows holding it must read zeros too
+void fv_dio_zeroed(FatVol *v, uint64_t off, uint64_t len) {
+    for (int i = 0; i < FV_DIO_WINDOWS; ++i) {
+        Window *w = &v->dio->win[i];
+        if (!overlaps(w, off, (size_t)len)) continue;
+        uint64_t a = off > w->off ? off : w->off;
+        uint64_t b = off + len < w->off + FV_DIO_WINDOW ? off + len : w->off + FV_DIO_WINDOW;
+        memset(w->buf + (a - w->off), 0, (size_t)(b - a));
+    }
+}
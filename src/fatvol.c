@@ -0,0 +1,1474 @@
+// src/fatvol.c
+// FAT12/16/32 volume engine behind libmtools (see fatvol.h).
+// Metadata sectors (FAT #0 and directories) go through a small CLOCK
+// cache; dirty FAT sectors are mirrored to every FAT copy on flush.
+// All image offsets are 64-bit, so FAT32 volumes up to 2 TiB (2^32
+// sectors of 512 bytes) work.
+
+#define _FILE_OFFSET_BITS 64
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE             // O_DIRECT
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fatvol.h"
+
+static inline uint16_t rd_le16(const uint8_t *p) {
+    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+static inline uint32_t rd_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+static inline void wr_le16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8);
+}
+static inline void wr_le32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24);
+}
+
+// --- I/O trace (MT_TRACE) ---
+static const char *const phase_names[MT_PHASES] = {
+    "other", "bpb", "scan", "alloc", "write", "read", "flush"
+};
+
+const char *fv_phase_name(int phase) {
+    return (phase >= 0 && phase < MT_PHASES) ? phase_names[phase] : "?";
+}
+
+// One line per request: TOOL PID R|W OFFSET LENGTH PHASE (see mtrace.c)
+static int trace_flush(FatVol *v) {
+    if (!v->trace_path || v->trace_n == 0) return 0;
+    FILE *f = fopen(v->trace_path, "a");
+    if (!f) return -errno;
+    long pid = (long)getpid();
+    for (uint32_t i = 0; i < v->trace_n; ++i) {
+        const FvTraceRec *r = &v->trace[i];
+        fprintf(f, "%s %ld %c %llu %u %s\n", v->trace_tool, pid, r->write ? 'W' : 'R',
+                (unsigned long long)r->off, r->len, phase_names[r->phase]);
+    }
+    v->trace_n = 0;
+    return fclose(f) == 0 ? 0 : -errno;
+}
+
+static void trace_rec(FatVol *v, int write, uint64_t off, size_t len) {
+    if (v->trace_n == FV_TRACE_RECS && (!v->trace_path || trace_flush(v) != 0)) {
+        v->trace_dropped++;
+        return;
+    }
+    FvTraceRec *r = &v->trace[v->trace_n++];
+    r->off   = off;
+    r->len   = (uint32_t)len;
+    r->write = (uint8_t)write;
+    r->phase = (uint8_t)v->phase;
+}
+
+int fv_trace_attach(FatVol *v, const char *path, const char *tool) {
+    if (!v->trace) return -EINVAL;               // not opened with MT_TRACE
+    size_t n = strlen(path) + 1;
+    fv_free(v, v->trace_path);
+    if (!(v->trace_path = fv_alloc(v, n))) return -ENOMEM;
+    memcpy(v->trace_path, path, n);
+    snprintf(v->trace_tool, sizeof(v->trace_tool), "%s", tool && *tool ? tool : "-");
+    for (char *p = v->trace_tool; *p; ++p)
+        if (*p == ' ' || *p == '\t' || *p == '\n') *p = '_';
+    return 0;
+}
+
+// --- raw I/O ---
+// Offsets are relative to the volume; every call is counted in v->st.
+static uint64_t io_sectors(const FatVol *v, size_t len) {
+    uint32_t bps = v->bytes_per_sector ? v->bytes_per_sector : 512;   // 512 before the BPB
+    return (len + bps - 1) / bps;
+}
+
+void fv_io_account(FatVol *v, int write, uint64_t abs_off, size_t len) {
+    if (write) v->st.sectors_written += io_sectors(v, len);
+    else       v->st.sectors_read += io_sectors(v, len);
+    if (v->trace) trace_rec(v, write, abs_off, len);
+}
+
+int fv_pread(FatVol *v, void *buf, size_t len, uint64_t off) {
+    uint8_t *p = buf;
+    int rc;
+    if (v->ring && (rc = fv_qfence(v, off, len)) != 0) return rc;
+    off += v->offset;
+    fv_io_account(v, 0, off, len);
+    if (v->dio) return fv_dio_read(v, buf, len, off);
+    if (v->ovl) return fv_ovl_read(v, buf, len, off);
+    while (len) {
+        v->st.syscalls++;
+        ssize_t n = pread(v->fd, p, len, (off_t)off);
+        if (n < 0) { if (errno == EINTR) continue; return -errno; }
+        if (n == 0) return -EIO;     // short image
+        p += n; len -= (size_t)n; off += (uint64_t)n;
+    }
+    return 0;
+}
+
+int fv_pwrite(FatVol *v, const void *buf, size_t len, uint64_t off) {
+    const uint8_t *p = buf;
+    int rc;
+    if (v->ring && (rc = fv_qfence(v, off, len)) != 0) return rc;
+    off += v->offset;
+    fv_io_account(v, 1, off, len);
+    if (v->dio) return fv_dio_write(v, buf, len, off);
+    if (v->ovl && (rc = fv_ovl_prepare(v, off, len)) != 0) return rc;
+    while (len) {
+        v->st.syscalls++;
+        ssize_t n = pwrite(v->fd, p, len, (off_t)off);
+        if (n < 0) { if (errno == EINTR) continue; return -errno; }
+        p += n; len -= (size_t)n; off += (uint64_t)n;
+    }
+    return 0;
+}
+
+int fv_punch(FatVol *v, uint64_t off, uint64_t len) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    int rc;
+    if (v->no_punch) return -EOPNOTSUPP;
+    if (v->ring && (rc = fv_qfence(v, off, len)) != 0) return rc;
+    off += v->offset;
+    if (v->ovl && (rc = fv_ovl_prepare(v, off, len)) != 0) return rc;   // a hole in the overlay
+    v->st.syscalls++;
+    if (fallocate(v->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)off, (off_t)len) == 0) {
+        if (v->dio) fv_dio_zeroed(v, off, len);
+        v->st.sectors_punched += len / v->bytes_per_sector;
+        return 0;
+    }
+    if (errno != EOPNOTSUPP && errno != ENOSYS && errno != ENODEV) return -errno;
+#endif
+    v->no_punch = 1;
+    return -EOPNOTSUPP;
+}
+
+// --- phase timing (MT_STATS) ---
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+int fv_phase(FatVol *v, int phase) {
+    int old = v->phase;
+    if (v->timed) {
+        uint64_t t = now_ns();
+        v->st.phase_ns[old] += t - v->phase_t0;
+        v->phase_t0 = t;
+    }
+    v->phase = phase;
+    return old;
+}
+
+// --- geometry ---
+static int parse_geometry(FatVol *v) {
+    const uint8_t *b = v->boot;
+    v->bytes_per_sector    = rd_le16(&b[11]);
+    v->sectors_per_cluster = b[13];
+    uint32_t reserved      = rd_le16(&b[14]);
+    v->num_fats            = b[16];
+    v->root_entries        = rd_le16(&b[17]);
+    uint32_t tot16         = rd_le16(&b[19]);
+    v->fat_size_sectors    = rd_le16(&b[22]);
+    uint32_t tot32         = rd_le32(&b[32]);
+    int fat32_layout       = (v->fat_size_sectors == 0);
+    if (fat32_layout) {
+        v->fat_size_sectors = rd_le32(&b[36]);   // BPB_FATSz32
+        v->root_clus        = rd_le32(&b[44]);   // BPB_RootClus
+        v->fsinfo_lba       = rd_le16(&b[48]);   // BPB_FSInfo
+    }
+
+    if (v->bytes_per_sector < 512 || v->bytes_per_sector > 4096 ||
+        (v->bytes_per_sector & (v->bytes_per_sector - 1)))
+        return -EINVAL;
+    if (v->sectors_per_cluster == 0 || v->num_fats == 0 || v->fat_size_sectors == 0) return -EINVAL;
+    if (fat32_layout ? v->root_entries != 0 : v->root_entries == 0) return -EINVAL;
+
+    v->total_sectors    = tot16 ? tot16 : tot32;
+    v->cluster_bytes    = v->bytes_per_sector * v->sectors_per_cluster;
+    v->root_dir_sectors = (v->root_entries * 32u + v->bytes_per_sector - 1) / v->bytes_per_sector;
+    v->first_fat_lba    = reserved;
+    uint64_t root_lba   = reserved + (uint64_t)v->num_fats * v->fat_size_sectors;
+    if (v->total_sectors <= root_lba + v->root_dir_sectors) return -EINVAL;
+    v->first_root_lba   = (uint32_t)root_lba;
+    v->first_data_lba   = v->first_root_lba + v->root_dir_sectors;
+    v->total_clusters   = (v->total_sectors - v->first_data_lba) / v->sectors_per_cluster;
+    if (v->length && (uint64_t)v->total_sectors * v->bytes_per_sector > v->length)
+        return -EINVAL;                 // file system larger than its partition
+
+    // The type follows from the cluster count alone (Microsoft's rule)
+    if (v->total_clusters < 4085)       v->fat_bits = 12;
+    else if (v->total_clusters < 65525) v->fat_bits = 16;
+    else                                v->fat_bits = 32;
+    if ((v->fat_bits == 32) != fat32_layout) return -ENOTSUP;
+    if (v->fat_bits == 32) {
+        if (v->total_clusters > 0x0FFFFFF5u) v->total_clusters = 0x0FFFFFF5u;
+        if (v->root_clus < 2 || v->root_clus >= v->total_clusters + 2) return -EINVAL;
+        if (v->fsinfo_lba == 0 || v->fsinfo_lba >= reserved) v->fsinfo_lba = 0;
+    }
+
+    // Never address clusters the FAT has no entry for
+    uint64_t fat_entries = (uint64_t)v->fat_size_sectors * v->bytes_per_sector * 8 / (unsigned)v->fat_bits;
+    if (fat_entries < 3) return -EINVAL;
+    if (v->total_clusters > fat_entries - 2) v->total_clusters = (uint32_t)(fat_entries - 2);
+    return 0;
+}
+
+// --- sector cache ---
+static uint32_t hash_lba(const FatVol *v, uint32_t lba) {
+    return (lba * 2654435761u) & (v->hash_cap - 1);
+}
+
+static void cache_unlink(FatVol *v, uint32_t slot) {
+    FvSec *s = &v->cache[slot];
+    uint32_t *pp = &v->hash[hash_lba(v, s->lba)];
+    while (*pp) {
+        if (*pp == slot + 1) { *pp = s->next; break; }
+        pp = &v->cache[*pp - 1].next;
+    }
+    s->valid = 0;
+    s->next = 0;
+}
+
+int fv_write_sector(FatVol *v, uint32_t lba, const uint8_t *data) {
+    uint64_t bps = v->bytes_per_sector;
+    int rc = fv_qwrite(v, data, bps, (uint64_t)lba * bps);
+    if (rc) return rc;
+    // Mirror FAT #0 sectors into the remaining FAT copies
+    if (lba >= v->first_fat_lba && lba < v->first_fat_lba + v->fat_size_sectors) {
+        for (uint32_t fi = 1; fi < v->num_fats; ++fi) {
+            uint64_t m = (uint64_t)lba + (uint64_t)fi * v->fat_size_sectors;
+            rc = fv_qwrite(v, data, bps, m * bps);
+            if (rc) return rc;
+        }
+    }
+    return 0;
+}
+
+static int write_back(FatVol *v, FvSec *s) {
+    int rc = fv_write_sector(v, s->lba, s->data);
+    if (rc) return rc;
+    s->dirty = 0;
+    return 0;
+}
+
+static int cache_victim(FatVol *v, uint32_t *slot) {
+    if (v->cache_used < v->cache_cap) { *slot = v->cache_used++; return 0; }
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        // CLOCK: skip referenced sectors once; write back dirty victims.
+        // A journaled volume may only evict clean sectors; when all are
+        // dirty it commits early, splitting the batch (see journal.c).
+        for (uint32_t n = 0; n < 2 * v->cache_cap + 1; ++n) {
+            uint32_t i = v->clock_hand;
+            v->clock_hand = (v->clock_hand + 1) % v->cache_cap;
+            FvSec *s = &v->cache[i];
+            if (s->ref) { s->ref = 0; continue; }
+            if (s->dirty) {
+                if (v->jfd >= 0) continue;
+                int rc = write_back(v, s);
+                if (rc) return rc;
+            }
+            cache_unlink(v, i);
+            *slot = i;
+            return 0;
+        }
+        // Cache full of uncommitted sectors: commit early and retry.  The
+        // batch then reaches the journal in parts and is no longer atomic.
+        if (v->jfd < 0) break;
+        int rc = fvj_commit(v);
+        if (rc) return rc;
+    }
+    return -EIO;
+}
+
+int fv_sector(FatVol *v, uint32_t lba, int for_write, uint8_t **out) {
+    if (lba >= v->total_sectors) return -EINVAL;
+    if (for_write && !v->writable) return -EROFS;
+
+    uint32_t h = hash_lba(v, lba);
+    for (uint32_t i = v->hash[h]; i; i = v->cache[i - 1].next) {
+        FvSec *s = &v->cache[i - 1];
+        if (s->lba == lba) {
+            v->st.cache_hits++;
+            s->ref = 1;
+            if (for_write) s->dirty = 1;
+            *out = s->data;
+            return 0;
+        }
+    }
+
+    v->st.cache_misses++;
+    uint32_t slot;
+    int rc = cache_victim(v, &slot);
+    if (rc) return rc;
+    FvSec *s = &v->cache[slot];
+    rc = fv_pread(v, s->data, v->bytes_per_sector, (uint64_t)lba * v->bytes_per_sector);
+    if (rc) return rc;
+    if (v->jmap_n) fvj_lookup(v, lba, s->data);
+    s->lba   = lba;
+    s->valid = 1;
+    s->ref   = 1;
+    s->dirty = (uint8_t)(for_write != 0);
+    s->next  = v->hash[h];
+    v->hash[h] = slot + 1;
+    *out = s->data;
+    return 0;
+}
+
+// Drop cached copies of sectors that are about to be overwritten directly.
+static void cache_invalidate(FatVol *v, uint32_t lba, uint32_t count) {
+    for (uint32_t l = lba; l < lba + count; ++l) {
+        for (uint32_t i = v->hash[hash_lba(v, l)]; i; i = v->cache[i - 1].next) {
+            if (v->cache[i - 1].lba == l) {
+                v->cache[i - 1].dirty = 0;
+                v->cache[i - 1].ref = 0;
+                cache_unlink(v, i - 1);
+                break;
+            }
+        }
+    }
+}
+
+// FAT32 FSInfo sector: free cluster count and next-free hint
+#define FSI_LEAD   0x41615252u
+#define FSI_STRUC  0x61417272u
+
+static void load_fsinfo(FatVol *v) {
+    uint8_t *sec;
+    if (!v->fsinfo_lba || fv_sector(v, v->fsinfo_lba, 0, &sec) != 0) return;
+    if (rd_le32(sec) != FSI_LEAD || rd_le32(sec + 484) != FSI_STRUC) {
+        v->fsinfo_lba = 0;
+        return;
+    }
+    uint32_t count = rd_le32(sec + 488), next = rd_le32(sec + 492);
+    if (count <= v->total_clusters) v->free_count = count;
+    if (next >= 2 && next < v->total_clusters + 2) v->free_hint = next;
+}
+
+static int store_fsinfo(FatVol *v) {
+    uint8_t *sec;
+    int rc = fv_sector(v, v->fsinfo_lba, 1, &sec);
+    if (rc) return rc;
+    wr_le32(sec + 488, v->free_count);
+    wr_le32(sec + 492, v->free_hint);
+    v->fsinfo_dirty = 0;
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int fv_write_dirty(FatVol *v) {
+    uint64_t *order = NULL;
+    uint32_t n = 0;
+    // Under O_DIRECT, ascending LBAs let neighbouring sectors share one
+    // read-modify-write of their block
+    if (v->dio && (order = fv_alloc(v, (size_t)v->cache_used * sizeof(*order)))) {
+        for (uint32_t i = 0; i < v->cache_used; ++i)
+            if (v->cache[i].valid && v->cache[i].dirty)
+                order[n++] = (uint64_t)v->cache[i].lba << 32 | i;
+        qsort(order, n, sizeof(*order), cmp_u64);
+    }
+    int rc = 0;
+    for (uint32_t k = 0; k < (order ? n : v->cache_used) && rc == 0; ++k) {
+        FvSec *s = &v->cache[order ? (uint32_t)order[k] : k];
+        if (s->valid && s->dirty) rc = write_back(v, s);
+    }
+    fv_free(v, order);
+    return rc;
+}
+
+// MT_PUNCH: once a flush has recorded them as free, punch the freed
+// clusters out of the image, one request per run of adjacent clusters.
+static int punch_freed(FatVol *v) {
+    if (!v->punch || v->punch_lo >= v->punch_hi) return 0;
+    int rc = 0;
+    uint32_t run = 0, n = 0;
+    for (uint32_t c = v->punch_lo; c <= v->punch_hi && rc == 0; ++c) {
+        if (c < v->punch_hi && (v->punch[c >> 3] & (1u << (c & 7)))) {
+            if (n++ == 0) run = c;
+            continue;
+        }
+        if (n) rc = fv_punch(v, fv_cluster_offset(v, run), (uint64_t)n * v->cluster_bytes);
+        n = 0;
+    }
+    memset(v->punch + (v->punch_lo >> 3), 0, ((v->punch_hi - 1) >> 3) - (v->punch_lo >> 3) + 1);
+    v->punch_lo = UINT32_MAX;
+    v->punch_hi = 0;
+    return rc == -EOPNOTSUPP ? 0 : rc;          // nothing to give back on this medium
+}
+
+static int flush(FatVol *v) {
+    fv_qbarrier(v);                         // metadata only after queued data
+    if (v->fsinfo_dirty && v->fsinfo_lba) {
+        int rc = store_fsinfo(v);
+        if (rc) return rc;
+    }
+    if (v->jfd >= 0) return fvj_commit(v);
+    return fv_write_dirty(v);
+}
+
+int fv_flush(FatVol *v) {
+    if (!v->writable || v->batch) return 0;
+    int ph = fv_phase(v, MT_PHASE_FLUSH);
+    int rc = flush(v);
+    int qrc = fv_qwait(v);
+    if (rc == 0) rc = qrc;
+    if (rc == 0) rc = punch_freed(v);
+    fv_phase(v, ph);
+    return rc;
+}
+
+// --- memory ---
+static void *default_alloc(void *ctx, size_t size) { (void)ctx; return malloc(size); }
+static void  default_free(void *ctx, void *p)      { (void)ctx; free(p); }
+
+void *fv_alloc(FatVol *v, size_t size) { return v->mem.alloc(v->mem.ctx, size); }
+void  fv_free(FatVol *v, void *p)      { if (p) v->mem.free(v->mem.ctx, p); }
+
+static void *fv_zalloc(FatVol *v, size_t size) {
+    void *p = fv_alloc(v, size);
+    if (p) memset(p, 0, size);
+    return p;
+}
+
+void fv_batch_begin(FatVol *v) {
+    v->batch++;
+}
+
+int fv_batch_end(FatVol *v) {
+    if (v->batch > 0 && --v->batch > 0) return 0;
+    return fv_flush(v);
+}
+
+int fv_open(FatVol *v, const char *path, const char *overlay, int flags,
+            const mt_allocator *mem) {
+    int writable = (flags & MT_RDWR) != 0;
+    memset(v, 0, sizeof(*v));
+    v->jfd = -1;
+    v->no_ring = (flags & MT_SYNCIO) != 0;
+    v->alloc = flags & MT_ALLOC_MASK;
+    v->timed = (flags & MT_STATS) != 0;
+    if (v->timed) v->phase_t0 = now_ns();
+    v->phase = MT_PHASE_BPB;
+    if (mem && mem->alloc && mem->free) {
+        v->mem = *mem;
+    } else {
+        v->mem.alloc = default_alloc;
+        v->mem.free  = default_free;
+    }
+    char file[4096];
+    int rc = fv_locate(path, file, sizeof(file), &v->offset, &v->length);
+    if (rc) return rc;
+    if (overlay) {
+        // the image is only read; v->fd is the overlay that takes the writes
+        if (flags & MT_DIRECT) return -EINVAL;
+        v->fd = -1;
+        if ((rc = fv_ovl_open(v, file, overlay, writable)) != 0) {
+            if (v->fd >= 0) close(v->fd);
+            fv_ovl_close(v);
+            return rc;
+        }
+    } else {
+        v->st.syscalls++;
+        v->fd = open(file, (writable ? O_RDWR : O_RDONLY) | ((flags & MT_DIRECT) ? O_DIRECT : 0));
+        if (v->fd < 0) return -errno;
+    }
+    if ((flags & MT_DIRECT) && (rc = fv_dio_start(v)) != 0) {
+        close(v->fd);
+        return rc;
+    }
+    if ((flags & MT_TRACE) && !(v->trace = fv_alloc(v, FV_TRACE_RECS * sizeof(FvTraceRec)))) {
+        fv_dio_close(v);
+        fv_ovl_close(v);
+        if (v->fd >= 0) close(v->fd);
+        return -ENOMEM;
+    }
+    v->writable = writable;
+
+    rc = fv_pread(v, v->boot, sizeof(v->boot), 0);
+    if (rc == 0) rc = parse_geometry(v);
+    if (rc) { fv_close(v); return rc; }
+
+    v->cache_cap = FV_CACHE_SECTORS;
+    v->hash_cap  = FV_CACHE_SECTORS * 2;
+    v->cache     = fv_zalloc(v, (size_t)v->cache_cap * sizeof(FvSec));
+    v->hash      = fv_zalloc(v, (size_t)v->hash_cap * sizeof(uint32_t));
+    v->cache_mem = fv_alloc(v, (size_t)v->cache_cap * v->bytes_per_sector);
+    if (!v->cache || !v->hash || !v->cache_mem) { fv_close(v); return -ENOMEM; }
+    for (uint32_t i = 0; i < v->cache_cap; ++i)
+        v->cache[i].data = v->cache_mem + (size_t)i * v->bytes_per_sector;
+    v->punch_lo = UINT32_MAX;
+    if ((flags & MT_PUNCH) && writable &&
+        !(v->punch = fv_zalloc(v, ((size_t)v->total_clusters + 2 + 7) / 8))) {
+        fv_close(v);
+        return -ENOMEM;
+    }
+
+    // Replay a leftover journal; keep journaling if asked to
+    // (with an overlay, next to the overlay: that is where the writes go)
+    rc = fvj_attach(v, overlay ? overlay : file, writable && (flags & MT_JOURNAL));
+    if (rc) { fv_close(v); return rc; }
+
+    v->free_hint  = 2;
+    v->free_count = UINT32_MAX;
+    load_fsinfo(v);
+    fv_phase(v, MT_PHASE_OTHER);
+    return 0;
+}
+
+// Start over from the boot sector, after something rewrote the metadata
+// behind the cache (resize.c): the cache, the name indexes and the
+// per-cluster bitmaps are dropped.  Dirty sectors are lost: flush first.
+int fv_reload(FatVol *v) {
+    memset(v->hash, 0, (size_t)v->hash_cap * sizeof(uint32_t));
+    for (uint32_t i = 0; i < v->cache_used; ++i) {
+        v->cache[i].valid = 0;
+        v->cache[i].dirty = 0;
+        v->cache[i].next = 0;
+    }
+    v->cache_used = 0;
+    v->clock_hand = 0;
+    fv_dirx_free(v);
+
+    int rc = fv_pread(v, v->boot, sizeof(v->boot), 0);
+    if (rc == 0) rc = parse_geometry(v);
+    if (rc) return rc;
+    size_t bits = ((size_t)v->total_clusters + 2 + 7) / 8;
+    if (v->punch) {
+        fv_free(v, v->punch);
+        v->punch_lo = UINT32_MAX;
+        v->punch_hi = 0;
+        if (!(v->punch = fv_zalloc(v, bits))) return -ENOMEM;
+    }
+    if (v->pending_free) {
+        fv_free(v, v->pending_free);
+        if (!(v->pending_free = fv_zalloc(v, bits))) return -ENOMEM;
+    }
+    v->free_hint  = 2;
+    v->free_count = UINT32_MAX;
+    v->fsinfo_dirty = 0;
+    load_fsinfo(v);
+    return 0;
+}
+
+int fv_close(FatVol *v) {
+    int rc = 0;
+    v->batch = 0;
+    int ph = fv_phase(v, MT_PHASE_FLUSH);
+    if (v->fd >= 0 && v->cache && v->writable) rc = flush(v);
+    int qrc = fv_qwait(v);
+    if (rc == 0) rc = qrc;
+    if (rc == 0) rc = punch_freed(v);
+    fv_qclose(v);
+    fv_dio_close(v);
+    fv_ovl_close(v);
+    if (v->jfd >= 0 || v->jpath || v->pending_free || v->jmap) {
+        int jrc = fvj_detach(v);
+        if (rc == 0) rc = jrc;
+    }
+    if (v->fd >= 0) {
+        v->st.syscalls++;
+        if (close(v->fd) != 0 && rc == 0) rc = -errno;
+    }
+    fv_phase(v, ph == MT_PHASE_BPB ? ph : MT_PHASE_OTHER);
+    if (v->st_sink) {                       // mt_stats holds only uint64_t
+        const uint64_t *src = (const uint64_t *)&v->st;
+        uint64_t *dst = (uint64_t *)v->st_sink;
+        for (size_t i = 0; i < sizeof(mt_stats) / sizeof(uint64_t); ++i) dst[i] += src[i];
+        v->st_sink = NULL;
+    }
+    fv_dirx_free(v);
+    if (v->trace) {
+        int trc = trace_flush(v);
+        if (rc == 0) rc = trc;
+        fv_free(v, v->trace);
+        fv_free(v, v->trace_path);
+        v->trace = NULL;
+        v->trace_path = NULL;
+    }
+    if (v->mem.free) {
+        fv_free(v, v->cache);
+        fv_free(v, v->hash);
+        fv_free(v, v->cache_mem);
+        fv_free(v, v->punch);
+    }
+    v->cache = NULL; v->hash = NULL; v->cache_mem = NULL; v->punch = NULL;
+    v->fd = -1;
+    return rc;
+}
+
+// --- FAT access (12/16/32) ---
+#define FAT32_MASK 0x0FFFFFFFu   // the top 4 bits of a FAT32 entry are reserved
+
+uint32_t fv_eoc(const FatVol *v) {
+    return (v->fat_bits == 12) ? 0x0FFF : (v->fat_bits == 16) ? 0xFFFF : FAT32_MASK;
+}
+int fv_is_eoc(const FatVol *v, uint32_t val) {
+    return val >= fv_eoc(v) - 7;
+}
+
+int fv_fat_get(FatVol *v, uint32_t clus, uint32_t *val) {
+    if (clus < 2 || clus >= v->total_clusters + 2) return -EINVAL;
+    uint32_t bps = v->bytes_per_sector;
+    uint8_t *sec, *sec2;
+    int rc;
+
+    if (v->fat_bits == 12) {
+        uint32_t byte_offset = clus + clus / 2;
+        uint32_t lba = v->first_fat_lba + byte_offset / bps;
+        uint32_t off = byte_offset % bps;
+        if ((rc = fv_sector(v, lba, 0, &sec)) != 0) return rc;
+        uint16_t pair = sec[off];
+        if (off + 1 < bps) {
+            pair |= (uint16_t)(sec[off + 1] << 8);
+        } else {
+            if ((rc = fv_sector(v, lba + 1, 0, &sec2)) != 0) return rc;
+            pair |= (uint16_t)(sec2[0] << 8);
+        }
+        *val = (clus & 1) ? (pair >> 4) : (pair & 0x0FFF);
+    } else if (v->fat_bits == 16) {
+        uint32_t fat_offset = clus * 2;
+        if ((rc = fv_sector(v, v->first_fat_lba + fat_offset / bps, 0, &sec)) != 0) return rc;
+        *val = rd_le16(sec + fat_offset % bps);
+    } else {
+        uint64_t fat_offset = (uint64_t)clus * 4;
+        if ((rc = fv_sector(v, v->first_fat_lba + (uint32_t)(fat_offset / bps), 0, &sec)) != 0) return rc;
+        *val = rd_le32(sec + fat_offset % bps) & FAT32_MASK;
+    }
+    return 0;
+}
+
+int fv_fat_set(FatVol *v, uint32_t clus, uint32_t val) {
+    if (clus < 2 || clus >= v->total_clusters + 2) return -EINVAL;
+    uint32_t bps = v->bytes_per_sector;
+    uint8_t *sec, *sec2;
+    int rc;
+
+    if (v->fat_bits == 12) {
+        uint32_t byte_offset = clus + clus / 2;
+        uint32_t lba = v->first_fat_lba + byte_offset / bps;
+        uint32_t off = byte_offset % bps;
+        if ((rc = fv_sector(v, lba, 1, &sec)) != 0) return rc;
+        uint8_t *hi;
+        if (off + 1 < bps) {
+            hi = &sec[off + 1];
+        } else {
+            if ((rc = fv_sector(v, lba + 1, 1, &sec2)) != 0) return rc;
+            hi = &sec2[0];
+        }
+        if (clus & 1) {   // high 12 bits
+            sec[off] = (uint8_t)((sec[off] & 0x0F) | ((val & 0x0F) << 4));
+            *hi      = (uint8_t)((val >> 4) & 0xFF);
+        } else {          // low 12 bits
+            sec[off] = (uint8_t)(val & 0xFF);
+            *hi      = (uint8_t)((*hi & 0xF0) | ((val >> 8) & 0x0F));
+        }
+    } else if (v->fat_bits == 16) {
+        uint32_t fat_offset = clus * 2;
+        if ((rc = fv_sector(v, v->first_fat_lba + fat_offset / bps, 1, &sec)) != 0) return rc;
+        wr_le16(sec + fat_offset % bps, (uint16_t)val);
+    } else {
+        uint64_t fat_offset = (uint64_t)clus * 4;
+        if ((rc = fv_sector(v, v->first_fat_lba + (uint32_t)(fat_offset / bps), 1, &sec)) != 0) return rc;
+        uint8_t *p = sec + fat_offset % bps;
+        wr_le32(p, (rd_le32(p) & ~FAT32_MASK) | (val & FAT32_MASK));
+    }
+    return 0;
+}
+
+// Clusters freed since the last journal commit must not be reused before
+// it: the committed metadata may still point at them.
+static int pending_free(const FatVol *v, uint32_t c) {
+    return v->pending_free && (v->pending_free[c >> 3] & (1u << (c & 7)));
+}
+
+// Find the first allocatable cluster in [lo, hi) (want 0: the first one
+// that is not).  FAT16/32 entries are examined a whole sector at a time,
+// so scanning a large FAT costs one cache lookup per sector rather than
+// one per cluster.
+static int scan_fat(FatVol *v, uint32_t lo, uint32_t hi, int want, uint32_t *out) {
+    if (v->fat_bits == 12) {
+        for (uint32_t c = lo; c < hi; ++c) {
+            uint32_t val;
+            int rc = fv_fat_get(v, c, &val);
+            if (rc) return rc;
+            if ((val == 0 && !pending_free(v, c)) == want) {
+                v->st.alloc_probes += c - lo + 1;
+                *out = c;
+                return 0;
+            }
+        }
+        v->st.alloc_probes += hi - lo;
+        return -ENOSPC;
+    }
+    uint32_t bps = v->bytes_per_sector;
+    uint32_t esz = (uint32_t)v->fat_bits / 8;
+    uint32_t per_sec = bps / esz;
+    for (uint32_t c = lo; c < hi; ) {
+        uint8_t *sec;
+        uint64_t fat_offset = (uint64_t)c * esz;
+        int rc = fv_sector(v, v->first_fat_lba + (uint32_t)(fat_offset / bps), 0, &sec);
+        if (rc) return rc;
+        uint32_t i = (uint32_t)(fat_offset % bps) / esz;
+        for (; i < per_sec && c < hi; ++i, ++c) {
+            uint32_t val = (esz == 2) ? rd_le16(sec + i * 2) : (rd_le32(sec + i * 4) & FAT32_MASK);
+            if ((val == 0 && !pending_free(v, c)) == want) {
+                v->st.alloc_probes += c - lo + 1;
+                *out = c;
+                return 0;
+            }
+        }
+    }
+    v->st.alloc_probes += hi - lo;
+    return -ENOSPC;
+}
+
+static int scan_free(FatVol *v, uint32_t lo, uint32_t hi, uint32_t *out) {
+    return scan_fat(v, lo, hi, 1, out);
+}
+
+// MT_ALLOC_BEST: the start of the smallest run of free clusters that
+// holds nclus, else of the longest run.  A pass over the whole FAT (an
+// exact fit ends it early); 0 (the free hint) when nothing is free.
+static uint32_t best_run(FatVol *v, uint32_t nclus) {
+    uint32_t end = v->total_clusters + 2, best = 0, best_len = 0;
+    for (uint32_t c = 2; c < end; ) {
+        uint32_t a, b;
+        if (scan_fat(v, c, end, 1, &a) != 0) break;
+        if (scan_fat(v, a, end, 0, &b) != 0) b = end;
+        uint32_t len = b - a;
+        int fits = len >= nclus, best_fits = best_len >= nclus;
+        if (fits ? (!best_fits || len < best_len) : (!best_fits && len > best_len)) {
+            best = a;
+            best_len = len;
+        }
+        if (len == nclus) break;
+        c = b;
+    }
+    return best;
+}
+
+// MT_ALLOC_NEAR: the cluster after the last one of directory dir, so
+// that a file lands right behind the directory that names it.  dir 0 is
+// the root: on FAT32 its chain starts at root_clus, the fixed FAT12/16
+// root sits before the data area and its files start at the front.
+static uint32_t near_dir(FatVol *v, uint32_t dir) {
+    uint32_t end = v->total_clusters + 2, c = dir ? dir : v->root_clus, next, n = 0;
+    if (c < 2) return 2;
+    while (fv_fat_get(v, c, &next) == 0 && next >= 2 && next < end && !fv_is_eoc(v, next) &&
+           ++n < v->total_clusters)
+        c = next;
+    return c + 1 < end ? c + 1 : 2;
+}
+
+// Where the first cluster of nclus new ones for directory dir is looked
+// for, by the volume's allocation policy (0 = the free hint).
+static uint32_t alloc_start(FatVol *v, uint32_t dir, uint32_t nclus) {
+    switch (v->alloc) {
+    case MT_ALLOC_BEST: return best_run(v, nclus ? nclus : 1);
+    case MT_ALLOC_NEAR: return near_dir(v, dir);
+    default:            return 0;
+    }
+}
+
+// First-fit scan starting at `from` (0 = the volume's free hint), wrapping
+// around once; marks the cluster end-of-chain.  The policies of
+// alloc_start only choose `from`.
+static int alloc_cluster(FatVol *v, uint32_t from, uint32_t *out) {
+    uint32_t end = v->total_clusters + 2;
+    if (from == 0) from = v->free_hint;
+    if (from < 2 || from >= end) from = 2;
+
+    uint32_t c;
+    int rc = scan_free(v, from, end, &c);
+    if (rc == -ENOSPC && from > 2) rc = scan_free(v, 2, from, &c);
+    if (rc) return rc;
+    if ((rc = fv_fat_set(v, c, fv_eoc(v))) != 0) return rc;
+    if (v->punch) v->punch[c >> 3] &= (uint8_t)~(1u << (c & 7));   // in use again
+    if (c >= v->free_hint) v->free_hint = (c + 1 < end) ? c + 1 : 2;
+    // FSInfo counts are advisory: a stale zero just becomes "unknown"
+    v->free_count = (v->free_count && v->free_count != UINT32_MAX) ? v->free_count - 1 : UINT32_MAX;
+    v->fsinfo_dirty = 1;
+    *out = c;
+    return 0;
+}
+
+int fv_alloc_cluster(FatVol *v, uint32_t from, uint32_t *out) {
+    int ph = fv_phase(v, MT_PHASE_ALLOC);
+    int rc = alloc_cluster(v, from, out);
+    fv_phase(v, ph);
+    return rc;
+}
+
+static int free_chain(FatVol *v, uint32_t first) {
+    uint32_t c = first, n = 0;
+    while (c >= 2 && c < v->total_clusters + 2) {
+        uint32_t next;
+        int rc = fv_fat_get(v, c, &next);
+        if (rc) return rc;
+        if (next == 0) break;                       // already free
+        if ((rc = fv_fat_set(v, c, 0)) != 0) return rc;
+        if (v->pending_free) v->pending_free[c >> 3] |= (uint8_t)(1u << (c & 7));
+        if (v->punch) {
+            v->punch[c >> 3] |= (uint8_t)(1u << (c & 7));
+            if (c < v->punch_lo) v->punch_lo = c;
+            if (c >= v->punch_hi) v->punch_hi = c + 1;
+        }
+        if (c < v->free_hint && v->alloc != MT_ALLOC_NEXT) v->free_hint = c;   // next fit: roving
+        if (v->free_count != UINT32_MAX) v->free_count++;
+        v->fsinfo_dirty = 1;
+        if (fv_is_eoc(v, next) || ++n > v->total_clusters) break;
+        c = next;
+    }
+    return 0;
+}
+
+int fv_free_chain(FatVol *v, uint32_t first) {
+    int ph = fv_phase(v, MT_PHASE_ALLOC);
+    int rc = free_chain(v, first);
+    fv_phase(v, ph);
+    return rc;
+}
+
+int fv_chain_extents(FatVol *v, uint32_t first, uint32_t *out) {
+    uint32_t c = first, n = 0, steps = 0;
+    *out = 0;
+    if (c >= 2 && c < v->total_clusters + 2) n = 1;
+    while (n && c >= 2 && c < v->total_clusters + 2) {
+        uint32_t next;
+        int rc = fv_fat_get(v, c, &next);
+        if (rc) return rc;
+        if (next < 2 || fv_is_eoc(v, next) || ++steps > v->total_clusters) break;
+        if (next != c + 1) n++;
+        c = next;
+    }
+    *out = n;
+    return 0;
+}
+
+uint64_t fv_cluster_offset(const FatVol *v, uint32_t clus) {
+    uint64_t lba = (uint64_t)v->first_data_lba + (uint64_t)(clus - 2) * v->sectors_per_cluster;
+    return lba * v->bytes_per_sector;
+}
+
+// --- directory entries ---
+uint32_t fv_ent_cluster(const uint8_t *ent) {
+    return ((uint32_t)rd_le16(ent + 20) << 16 | rd_le16(ent + 26)) & FAT32_MASK;
+}
+void fv_ent_set_cluster(uint8_t *ent, uint32_t clus) {
+    wr_le16(ent + 26, (uint16_t)clus);
+    wr_le16(ent + 20, (uint16_t)(clus >> 16));    // FstClusHI: zero on FAT12/16
+}
+
+void fv_ent_name(const uint8_t *ent, char out[13]) {
+    int n = 0, i;
+    for (i = 0; i < 8 && ent[i] != ' '; ++i)
+        out[n++] = (char)((i == 0 && ent[0] == 0x05) ? 0xE5 : ent[i]);
+    if (ent[8] != ' ') {
+        out[n++] = '.';
+        for (i = 8; i < 11 && ent[i] != ' '; ++i) out[n++] = (char)ent[i];
+    }
+    out[n] = '\0';
+}
+
+void fv_dir_begin(FvDirPos *p, uint32_t dir) {
+    p->dir  = dir;
+    p->idx  = 0;
+    p->clus = dir;
+    p->base = 0;
+    p->first = 0;
+}
+
+int fv_dir_ent(FatVol *v, FvDirPos *p, int for_write, uint8_t **ent) {
+    uint32_t bps = v->bytes_per_sector;
+    uint32_t lba, off;
+    int rc;
+
+    if (p->dir == 0 && v->root_clus) {      // FAT32: the root is a chain
+        p->dir = p->clus = v->root_clus;
+        p->base = 0;
+    }
+    if (p->dir == 0) {
+        if (p->idx >= v->root_entries) return -ENOENT;
+        lba = v->first_root_lba + (p->idx * FV_DIRENT_SIZE) / bps;
+        off = (p->idx * FV_DIRENT_SIZE) % bps;
+    } else {
+        uint32_t epc = v->cluster_bytes / FV_DIRENT_SIZE;
+        if (p->idx < p->base) { p->clus = p->dir; p->base = 0; }   // rewind
+        while (p->idx >= p->base + epc) {
+            uint32_t next;
+            if ((rc = fv_fat_get(v, p->clus, &next)) != 0) return rc;
+            if (next < 2 || fv_is_eoc(v, next) || next >= v->total_clusters + 2) return -ENOENT;
+            p->clus = next;
+            p->base += epc;
+        }
+        uint32_t byte = (p->idx - p->base) * FV_DIRENT_SIZE;
+        lba = (uint32_t)(fv_cluster_offset(v, p->clus) / bps) + byte / bps;
+        off = byte % bps;
+    }
+
+    uint8_t *sec;
+    if ((rc = fv_sector(v, lba, for_write, &sec)) != 0) return rc;
+    v->st.dirents_scanned++;
+    *ent = sec + off;
+    return 0;
+}
+
+static int zero_cluster(FatVol *v, uint32_t clus);
+
+// Grow a chain directory by one zeroed cluster linked after last.
+int fv_dir_extend(FatVol *v, uint32_t last, uint32_t *clus) {
+    uint32_t c;
+    int rc;
+    if ((rc = fv_alloc_cluster(v, last + 1, &c)) != 0) return rc;
+    if ((rc = zero_cluster(v, c)) != 0) { fv_fat_set(v, c, 0); return rc; }
+    if ((rc = fv_fat_set(v, last, c)) != 0) return rc;
+    *clus = c;
+    return 0;
+}
+
+// --- paths ---
+static const char *skip_prefix(const char *path) {
+    if (path[0] == ':' && path[1] == ':') path += 2;
+    return path;
+}
+static int is_sep(char c) { return c == '/' || c == '\\'; }
+
+static int is_dots(const char *s, size_t len) {
+    return (len == 1 && s[0] == '.') || (len == 2 && s[0] == '.' && s[1] == '.');
+}
+
+// Walk every directory component of path; the last component is returned
+// in name/name_len when want_last is set, otherwise it is walked as well.
+static int walk_path(FatVol *v, const char *path, int want_last, uint32_t *dir,
+                const char **name, size_t *name_len) {
+    const char *p = skip_prefix(path);
+    uint32_t cur = 0;
+    int have_last = 0;
+
+    while (*p) {
+        while (is_sep(*p)) ++p;
+        if (!*p) break;
+        const char *start = p;
+        while (*p && !is_sep(*p)) ++p;
+        size_t len = (size_t)(p - start);
+        const char *rest = p;
+        while (is_sep(*rest)) ++rest;
+
+        // Trailing dots and spaces are not part of a FAT name
+        if (!is_dots(start, len))
+            while (len && (start[len - 1] == '.' || start[len - 1] == ' ')) --len;
+        if (len == 0) return -EINVAL;
+        if (want_last && !*rest) {
+            if (is_dots(start, len)) return -EINVAL;   // "." and ".." cannot be created/removed
+            *name = start;
+            *name_len = len;
+            have_last = 1;
+            break;
+        }
+        if (len == 1 && start[0] == '.') continue;
+        if (cur == 0 && len == 2 && start[0] == '.' && start[1] == '.') continue;  // root/..
+
+        FvDirPos pos;
+        uint8_t *e;
+        int rc;
+        if ((rc = fv_dir_lookup(v, cur, start, len, &pos)) != 0) return rc;
+        if ((rc = fv_dir_ent(v, &pos, 0, &e)) != 0) return rc;
+        if (!(e[11] & FV_ATTR_DIR)) return -ENOTDIR;
+        cur = fv_ent_cluster(e);
+    }
+    if (want_last && !have_last) return -EISDIR;   // path names the root
+    *dir = cur;
+    return 0;
+}
+
+static int walk(FatVol *v, const char *path, int want_last, uint32_t *dir,
+                const char **name, size_t *name_len) {
+    int ph = fv_phase(v, MT_PHASE_SCAN);
+    int rc = walk_path(v, path, want_last, dir, name, name_len);
+    fv_phase(v, ph);
+    return rc;
+}
+
+int fv_resolve_dir(FatVol *v, const char *path, uint32_t *dir) {
+    return walk(v, path, 0, dir, NULL, NULL);
+}
+
+int fv_resolve_parent(FatVol *v, const char *path, uint32_t *dir, const char **name, size_t *len) {
+    return walk(v, path, 1, dir, name, len);
+}
+
+// --- file operations ---
+static long read_chain(FatVol *v, uint32_t first, uint32_t size, uint64_t off, void *buf, size_t len) {
+    if (off >= size) return 0;
+    if (len > size - off) len = (size_t)(size - off);
+
+    uint32_t c = first;
+    uint64_t skip = off / v->cluster_bytes;
+    for (uint64_t i = 0; i < skip; ++i) {
+        int rc = fv_fat_get(v, c, &c);
+        if (rc) return rc;
+        if (c < 2 || fv_is_eoc(v, c)) return -EIO;   // chain shorter than size
+    }
+
+    // Runs of consecutive clusters become one request each
+    uint8_t *dst = buf, *run_dst = buf;
+    uint64_t run_off = 0;
+    size_t done = 0, run_len = 0;
+    uint32_t in = (uint32_t)(off % v->cluster_bytes);
+    int rc = 0;
+    if (len >= FV_URING_MIN) fv_qstart(v);
+    while (done < len) {
+        if (c < 2 || c >= v->total_clusters + 2) { rc = -EIO; break; }
+        size_t n = v->cluster_bytes - in;
+        if (n > len - done) n = len - done;
+        uint64_t pos = fv_cluster_offset(v, c) + in;
+        if (run_len && pos == run_off + run_len && run_len + n <= FV_IO_MAX) {
+            run_len += n;
+        } else {
+            if (run_len && (rc = fv_qread(v, run_dst, run_len, run_off)) != 0) break;
+            run_dst = dst + done;
+            run_off = pos;
+            run_len = n;
+        }
+        done += n;
+        in = 0;
+        if (done < len && (rc = fv_fat_get(v, c, &c)) != 0) break;
+    }
+    if (rc == 0 && run_len) rc = fv_qread(v, run_dst, run_len, run_off);
+    int qrc = fv_qwait(v);                  // the data is in buf from here on
+    if (rc || (rc = qrc) != 0) return rc;
+    return (long)done;
+}
+
+long fv_read(FatVol *v, uint32_t first, uint32_t size, uint64_t off, void *buf, size_t len) {
+    int ph = fv_phase(v, MT_PHASE_READ);
+    long n = read_chain(v, first, size, off, buf, len);
+    if (n > 0) v->st.bytes_copied += (uint64_t)n;
+    fv_phase(v, ph);
+    return n;
+}
+
+int fv_read_stream(FatVol *v, uint32_t first, uint32_t size, mt_sink_cb sink, void *ctx) {
+    uint32_t cb = v->cluster_bytes;
+    size_t chunk = FV_STREAM_CHUNK - FV_STREAM_CHUNK % cb;
+    if (chunk < cb) chunk = cb;
+    if (size < chunk) chunk = size ? size : 1;
+    uint8_t *buf = fv_alloc(v, chunk);
+    if (!buf) return -ENOMEM;
+
+    // One walk of the chain; runs of consecutive clusters are one request
+    uint32_t c = first, done = 0;
+    int rc = 0;
+    while (rc == 0 && done < size) {
+        size_t n = size - done < chunk ? size - done : chunk;
+        int ph = fv_phase(v, MT_PHASE_READ);
+        uint64_t run_off = 0;
+        size_t fill = 0, run_at = 0, run_len = 0;
+        if (n >= FV_URING_MIN) fv_qstart(v);
+        while (fill < n) {
+            if (c < 2 || c >= v->total_clusters + 2) { rc = -EIO; break; }
+            size_t take = n - fill < cb ? n - fill : cb;
+            uint64_t pos = fv_cluster_offset(v, c);
+            if (run_len && pos == run_off + run_len && run_len + take <= FV_IO_MAX) {
+                run_len += take;
+            } else {
+                if (run_len && (rc = fv_qread(v, buf + run_at, run_len, run_off)) != 0) break;
+                run_at  = fill;
+                run_off = pos;
+                run_len = take;
+            }
+            fill += take;
+            if (done + fill < size && (rc = fv_fat_get(v, c, &c)) != 0) break;
+        }
+        if (rc == 0 && run_len) rc = fv_qread(v, buf + run_at, run_len, run_off);
+        int qrc = fv_qwait(v);
+        if (rc == 0) rc = qrc;
+        fv_phase(v, ph);
+        if (rc) break;
+        v->st.bytes_copied += n;
+        done += (uint32_t)n;
+        rc = sink(ctx, buf, n);                 // its time is its own
+    }
+    fv_free(v, buf);
+    return rc;
+}
+
+static int zero_cluster(FatVol *v, uint32_t clus) {
+    uint32_t lba = (uint32_t)(fv_cluster_offset(v, clus) / v->bytes_per_sector);
+    for (uint32_t s = 0; s < v->sectors_per_cluster; ++s) {
+        uint8_t *sec;
+        int rc = fv_sector(v, lba + s, 1, &sec);
+        if (rc) return rc;
+        memset(sec, 0, v->bytes_per_sector);
+    }
+    return 0;
+}
+
+static int all_zero(const uint8_t *p, size_t len) {
+    return p[0] == 0 && memcmp(p, p + 1, len - 1) == 0;
+}
+
+// Store a run of clusters; a run of zeros becomes a hole when it can.
+static int put_run(FatVol *v, const uint8_t *src, size_t len, uint64_t off, int zero) {
+    if (zero) {
+        int rc = fv_punch(v, off, len);
+        if (rc != -EOPNOTSUPP) return rc;
+    }
+    return fv_qwrite(v, src, len, off);
+}
+
+// A cluster chain being written.  The clusters of the chain starting at
+// reuse (0: none) are written over in place, so that only the FAT entries
+// where the new chain leaves the old one change: a longer file goes on
+// with clusters allocated after its last one, a shorter one has the rest
+// of the old chain freed.
+typedef struct {
+    uint32_t first, prev, from;
+    uint32_t reuse, old;        // the chain written over; its next cluster
+    uint32_t grown;             // first cluster allocated past it
+} ChainW;
+
+static void chain_begin(ChainW *w, uint32_t reuse, uint32_t from) {
+    memset(w, 0, sizeof(*w));
+    w->reuse = w->old = reuse;
+    w->from = from;
+}
+
+// Append len bytes to the chain.  len is a whole number of clusters but
+// in the last call, whose last cluster is zero-padded.  The clusters of
+// one call come from one first-fit scan after the previous one, so a
+// stream written call by call still lands in contiguous runs.  data may be
+// reused once this returns.
+static int chain_put(FatVol *v, ChainW *w, const uint8_t *data, size_t len, int sparse) {
+    if (len == 0) return 0;
+    int ph = fv_phase(v, MT_PHASE_WRITE);
+
+    uint32_t cb = v->cluster_bytes;
+    uint32_t nclus = (uint32_t)((len + cb - 1) / cb);
+    uint32_t end = v->total_clusters + 2;
+    uint8_t *tail = NULL;
+    const uint8_t *run_src = NULL;
+    uint64_t run_off = 0;
+    size_t run_len = 0;
+    int run_zero = 0;
+    int rc = 0;
+    if (len >= FV_URING_MIN) fv_qstart(v);
+    for (uint32_t i = 0; i < nclus; ++i) {
+        uint32_t c;
+        if (w->old >= 2 && w->old < end) {
+            c = w->old;                         // already linked from prev
+            if ((rc = fv_fat_get(v, c, &w->old)) != 0) break;
+            if (fv_is_eoc(v, w->old)) w->old = 0;
+        } else {
+            if ((rc = fv_alloc_cluster(v, w->from, &c)) != 0) break;
+            if (!w->grown) w->grown = c;
+            if (w->prev && (rc = fv_fat_set(v, w->prev, c)) != 0) {
+                if (c != w->grown) fv_free_chain(v, c);     // chain_end frees from grown on
+                break;
+            }
+        }
+        if (!w->prev) w->first = c;
+        w->prev = c;
+        w->from = c + 1;
+
+        size_t off = (size_t)i * cb;
+        size_t left = len - off;
+        const uint8_t *src = data + off;
+        uint64_t pos = fv_cluster_offset(v, c);
+        cache_invalidate(v, (uint32_t)(pos / v->bytes_per_sector), v->sectors_per_cluster);
+        if (left < cb) {
+            // zero-pad the last cluster
+            if (!(tail = fv_zalloc(v, cb))) { rc = -ENOMEM; break; }
+            memcpy(tail, src, left);
+            src = tail;
+        }
+        // Runs of consecutive clusters, all data or (sparse) all zeros,
+        // become one request each
+        int zero = sparse && !v->no_punch && all_zero(src, cb);
+        if (run_len && zero == run_zero && pos == run_off + run_len && src == run_src + run_len &&
+            (zero || run_len + cb <= FV_IO_MAX)) {
+            run_len += cb;
+            continue;
+        }
+        if (run_len && (rc = put_run(v, run_src, run_len, run_off, run_zero)) != 0) break;
+        run_src  = src;
+        run_off  = pos;
+        run_len  = cb;
+        run_zero = zero;
+    }
+    if (rc == 0 && run_len) rc = put_run(v, run_src, run_len, run_off, run_zero);
+    int qrc = fv_qwait(v);
+    if (rc == 0) rc = qrc;
+    fv_free(v, tail);
+    fv_phase(v, ph);
+    return rc;
+}
+
+// Done (rc 0): free what is left of the old chain.  Failed: give back the
+// clusters added past it; the reused part stays the file's.
+static int chain_end(FatVol *v, ChainW *w, int rc) {
+    uint32_t end = v->total_clusters + 2;
+    if (rc == 0 && w->old >= 2 && w->old < end) {
+        if (w->prev) rc = fv_fat_set(v, w->prev, fv_eoc(v));
+        if (rc == 0) rc = fv_free_chain(v, w->old);
+    } else if (rc && w->grown) {
+        uint32_t c = w->reuse, next;
+        while (c >= 2 && c < end && fv_fat_get(v, c, &next) == 0 && next != w->grown) c = next;
+        if (w->reuse) fv_fat_set(v, c, fv_eoc(v));
+        fv_free_chain(v, w->grown);
+        if (!w->reuse) w->first = 0;
+    }
+    if (rc == 0 && !w->prev) w->first = 0;      // empty file
+    return rc;
+}
+
+static int write_chain(FatVol *v, const uint8_t *data, uint32_t size, int sparse, uint32_t reuse,
+                       uint32_t from, uint32_t *first) {
+    ChainW w;
+    chain_begin(&w, reuse, from);
+    int rc = chain_end(v, &w, chain_put(v, &w, data, size, sparse));
+    *first = w.first;
+    if (rc == 0) v->st.bytes_copied += size;
+    return rc;
+}
+
+// Find or create the entry a file is written to.  *reuse is the chain to
+// write over: the old one, unless the journal needs it kept until the
+// commit, when the new data goes elsewhere.
+static int put_begin(FatVol *v, uint32_t dir, const char *name, size_t len, int flags,
+                     FvDirPos *pos, uint32_t *reuse, int *created) {
+    uint8_t *e;
+    *reuse = 0;
+    *created = 0;
+    if (!v->writable) return -EROFS;
+    int rc = fv_dir_lookup(v, dir, name, len, pos);
+    if (rc == 0) {
+        if (!(flags & MT_OVERWRITE)) return -EEXIST;
+        if ((rc = fv_dir_ent(v, pos, 1, &e)) != 0) return rc;
+        if (e[11] & FV_ATTR_DIR) return -EISDIR;
+        uint32_t old = fv_ent_cluster(e);
+        if (!v->pending_free) {
+            *reuse = old;                       // overwritten in place
+        } else if (old) {
+            if ((rc = fv_free_chain(v, old)) != 0) return rc;
+            fv_ent_set_cluster(e, 0);
+            wr_le32(e + 28, 0);
+        }
+        return 0;
+    }
+    if (rc != -ENOENT) return rc;
+    if ((rc = fv_dir_create(v, dir, name, len, pos)) != 0) return rc;
+    *created = 1;
+    return 0;
+}
+
+// The DOS date and time of now (local time, 2-second steps), pinned by
+// SOURCE_DATE_EPOCH like mformat's serial so that images are reproducible
+static void dos_now(uint16_t *date, uint16_t *time_) {
+    const char *epoch = getenv("SOURCE_DATE_EPOCH");
+    time_t t = (epoch && *epoch) ? (time_t)strtoll(epoch, NULL, 10) : time(NULL);
+    struct tm lt;
+    if (!localtime_r(&t, &lt) || lt.tm_year < 80) {
+        *date = (1 << 5) | 1;                   // 1980-01-01 00:00:00
+        *time_ = 0;
+        return;
+    }
+    if (lt.tm_year > 207) lt.tm_year = 207;
+    *date  = (uint16_t)(((lt.tm_year - 80) << 9) | ((lt.tm_mon + 1) << 5) | lt.tm_mday);
+    *time_ = (uint16_t)((lt.tm_hour << 11) | (lt.tm_min << 5) | (lt.tm_sec / 2));
+}
+
+// Stamp a new entry created, written and accessed at date/time_
+static void stamp_new(uint8_t *e, uint16_t date, uint16_t time_) {
+    memset(e + 13, 0, FV_DIRENT_SIZE - 13);
+    wr_le16(e + 14, time_);
+    wr_le16(e + 16, date);
+    wr_le16(e + 18, date);
+    wr_le16(e + 22, time_);
+    wr_le16(e + 24, date);
+}
+
+static int put_end(FatVol *v, FvDirPos *pos, uint32_t first, uint32_t size, int created) {
+    // A new entry is stamped created now.  An overwritten one keeps its
+    // name, case bits, attributes and creation time, and is stamped
+    // written (and so accessed) now.
+    uint8_t *e;
+    uint16_t date, time_;
+    int rc = fv_dir_ent(v, pos, 1, &e);
+    if (rc) return rc;
+    dos_now(&date, &time_);
+    if (created) {
+        stamp_new(e, date, time_);
+        e[11] = FV_ATTR_ARCHIVE;
+    } else {
+        e[11] |= FV_ATTR_ARCHIVE;
+        wr_le16(e + 18, date);
+        wr_le16(e + 22, time_);
+        wr_le16(e + 24, date);
+    }
+    fv_ent_set_cluster(e, first);
+    wr_le32(e + 28, size);
+    return fv_flush(v);
+}
+
+int fv_put(FatVol *v, uint32_t dir, const char *name, size_t len, const void *data, uint32_t size,
+           int flags) {
+    FvDirPos pos;
+    uint32_t reuse, first;
+    int created;
+    int rc = put_begin(v, dir, name, len, flags, &pos, &reuse, &created);
+    if (rc) return rc;
+    uint32_t nclus = (uint32_t)(((uint64_t)size + v->cluster_bytes - 1) / v->cluster_bytes);
+    uint32_t from = (reuse || !nclus) ? 0 : alloc_start(v, dir, nclus);
+    if ((rc = write_chain(v, data, size, (flags & MT_SPARSE) != 0, reuse, from, &first)) != 0) {
+        if (created) fv_dir_remove(v, &pos);
+        return rc;
+    }
+    return put_end(v, &pos, first, size, created);
+}
+
+int fv_put_stream(FatVol *v, uint32_t dir, const char *name, size_t len, mt_source_cb src, void *ctx,
+                  int flags, uint64_t *size_out) {
+    FvDirPos pos;
+    uint32_t reuse;
+    int created;
+    int rc = put_begin(v, dir, name, len, flags, &pos, &reuse, &created);
+    if (rc) return rc;
+
+    // Whole clusters per chunk, so that only the last one is padded
+    size_t chunk = FV_STREAM_CHUNK - FV_STREAM_CHUNK % v->cluster_bytes;
+    if (chunk < v->cluster_bytes) chunk = v->cluster_bytes;
+    uint8_t *buf = fv_alloc(v, chunk);
+    if (!buf) rc = -ENOMEM;
+
+    ChainW w;
+    uint64_t size = 0;
+    int eof = 0;
+    chain_begin(&w, reuse, reuse ? 0 : alloc_start(v, dir, (uint32_t)(chunk / v->cluster_bytes)));
+    while (rc == 0 && !eof) {
+        size_t fill = 0;
+        while (fill < chunk) {
+            long n = src(ctx, buf + fill, chunk - fill);
+            if (n < 0) { rc = (int)n; break; }
+            if (n == 0) { eof = 1; break; }
+            fill += (size_t)n;
+        }
+        if (rc) break;
+        if ((size += fill) > UINT32_MAX) { rc = -EFBIG; break; }
+        rc = chain_put(v, &w, buf, fill, (flags & MT_SPARSE) != 0);
+    }
+    fv_free(v, buf);
+    if ((rc = chain_end(v, &w, rc)) != 0) {
+        if (created) fv_dir_remove(v, &pos);
+        return rc;
+    }
+    v->st.bytes_copied += size;
+    if (size_out) *size_out = size;
+    return put_end(v, &pos, w.first, (uint32_t)size, created);
+}
+
+int fv_unlink(FatVol *v, uint32_t dir, const char *name, size_t len) {
+    if (!v->writable) return -EROFS;
+    FvDirPos pos;
+    int rc = fv_dir_lookup(v, dir, name, len, &pos);
+    if (rc) return rc;
+    uint8_t *e;
+    if ((rc = fv_dir_ent(v, &pos, 0, &e)) != 0) return rc;
+    if (e[11] & FV_ATTR_DIR) return -EISDIR;
+    uint32_t first = fv_ent_cluster(e);
+    if ((rc = fv_dir_remove(v, &pos)) != 0) return rc;
+    if (first && (rc = fv_free_chain(v, first)) != 0) return rc;
+    // A directory gone mostly to tombstones is compacted in the same flush
+    if ((rc = fv_dir_compact(v, dir, FV_COMPACT_RATIO, NULL, NULL)) != 0) return rc;
+    return fv_flush(v);
+}
+
+int fv_mkdir(FatVol *v, uint32_t dir, const char *name, size_t len, uint32_t *clus_out) {
+    if (!v->writable) return -EROFS;
+    FvDirPos pos;
+    int rc = fv_dir_lookup(v, dir, name, len, &pos);
+    if (rc == 0) return -EEXIST;
+    if (rc != -ENOENT) return rc;
+    if ((rc = fv_dir_create(v, dir, name, len, &pos)) != 0) return rc;
+
+    // Allocate one cluster for the new directory, zero it, add . and ..
+    uint32_t clus;
+    rc = fv_alloc_cluster(v, alloc_start(v, dir, 1), &clus);
+    if (rc) { fv_dir_remove(v, &pos); return rc; }
+    if ((rc = zero_cluster(v, clus)) != 0) {
+        fv_free_chain(v, clus);
+        fv_dir_remove(v, &pos);
+        return rc;
+    }
+
+    // the directory and its "." and ".." are all stamped created now
+    uint8_t *e;
+    uint16_t date, time_;
+    dos_now(&date, &time_);
+    FvDirPos dots;
+    fv_dir_begin(&dots, clus);
+    if ((rc = fv_dir_ent(v, &dots, 1, &e)) != 0) return rc;
+    memset(e, ' ', 11); e[0] = '.';
+    e[11] = FV_ATTR_DIR;
+    stamp_new(e, date, time_);
+    fv_ent_set_cluster(e, clus);
+    dots.idx = 1;
+    if ((rc = fv_dir_ent(v, &dots, 1, &e)) != 0) return rc;
+    memset(e, ' ', 11); e[0] = e[1] = '.';
+    e[11] = FV_ATTR_DIR;
+    stamp_new(e, date, time_);
+    fv_ent_set_cluster(e, dir);     // 0 for the root, FAT32 included
+
+    if ((rc = fv_dir_ent(v, &pos, 1, &e)) != 0) return rc;
+    stamp_new(e, date, time_);
+    e[11] = FV_ATTR_DIR;
+    fv_ent_set_cluster(e, clus);
+    if (clus_out) *clus_out = clus;
+    return fv_flush(v);
+}
+
+int fv_rmdir(FatVol *v, uint32_t dir, const char *name, size_t len) {
+    if (!v->writable) return -EROFS;
+    FvDirPos pos, sub;
+    FvLfn lfn;
+    uint8_t *e;
+    int rc = fv_dir_lookup(v, dir, name, len, &pos);
+    if (rc) return rc;
+    if ((rc = fv_dir_ent(v, &pos, 0, &e)) != 0) return rc;
+    if (!(e[11] & FV_ATTR_DIR)) return -ENOTDIR;
+    uint32_t clus = fv_ent_cluster(e);
+    if (!clus) return -EIO;                 // would be the root
+
+    // Empty: nothing but . and ..
+    for (fv_dir_begin(&sub, clus); (rc = fv_dir_next(v, &sub, &lfn, &e)) == 0; sub.idx++)
+        if (e[0] != '.') return -ENOTEMPTY;
+    if (rc != -ENOENT) return rc;
+
+    if ((rc = fv_dir_remove(v, &pos)) != 0) return rc;
+    if ((rc = fv_free_chain(v, clus)) != 0) return rc;
+    fv_dirx_drop(v, clus);                  // the cluster may hold another directory next
+    if ((rc = fv_dir_compact(v, dir, FV_COMPACT_RATIO, NULL, NULL)) != 0) return rc;
+    return fv_flush(v);
+}
+
+int fv_set_time(FatVol *v, uint32_t dir, const char *name, size_t len, uint16_t date, uint16_t time) {
+    if (!v->writable) return -EROFS;
+    FvDirPos pos;
+    uint8_t *e;
+    int rc = fv_dir_lookup(v, dir, name, len, &pos);
+    if (rc) return rc;
+    if ((rc = fv_dir_ent(v, &pos, 1, &e)) != 0) return rc;
+    wr_le16(e + 18, date);
+    wr_le16(e + 22, time);
+    wr_le16(e + 24, date);
+    return fv_flush(v);
+}
@@ -0,0 +1,334 @@
+// src/fatvol.h
+// Internal FAT volume engine behind libmtools (mtools.h): BPB geometry, a
+// cached sector layer for FAT and directory sectors, FAT chains, directory
+// traversal and the file operations the public API is built from.
+//
+// Conventions:
+//  - Functions return 0 on success or a negative errno value (-ENOENT, ...).
+//  - Names come in as UTF-8 (pointer + length); on disk they are VFAT long
+//    names (UTF-16) with an 8.3 alias, or plain 8.3 names (11 bytes, space
+//    padded, upper case) when the name fits.
+//  - Directories are named by their first cluster; 0 is the root directory
+//    (the fixed FAT12/16 root, or the RootClus chain on FAT32).
+//  - Metadata changes stay in the cache until fv_flush(); file data is
+//    written straight through.  With MT_JOURNAL the flush is a journal
+//    commit (journal.c) instead of unordered in-place writes.
+
+#ifndef MTOOLS_FATVOL_H
+#define MTOOLS_FATVOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mtools.h"
+
+#define FV_DIRENT_SIZE    32
+#define FV_DELETED        0xE5
+#define FV_CACHE_SECTORS  4096u   // metadata sectors kept warm per volume
+#define FV_LFN_MAX        255      // UTF-16 units in a long name
+#define FV_DIR_MAX_ENTS   65536u   // FAT limit on entries per directory
+#define FV_DIR_INDEXES    8        // directories with a name index per volume
+#define FV_TRACE_RECS     4096     // trace records buffered before they are appended
+#define FV_IO_MAX         (1u << 20)    // largest coalesced data request
+#define FV_URING_DEPTH    32            // io_uring requests in flight
+#define FV_URING_SLOT     (128u << 10)  // bounce buffer per request
+#define FV_URING_MIN      (256u << 10)  // transfers from this size use the ring
+#define FV_STREAM_CHUNK   (4u << 20)    // streamed file data per allocation or read batch
+#define FV_DIO_WINDOW     (64u << 10)   // MT_DIRECT staging window for sub-block writes
+#define FV_DIO_ALIGN_MAX  4096u         // largest O_DIRECT block size supported
+#define FV_DIO_WINDOWS    4             // staging windows (least recently used goes)
+#define FV_COMPACT_RATIO  50            // % of tombstones that makes mdel compact a directory
+#define FV_COMPACT_MIN    128           // ... once it has at least this many
+
+enum { FV_ATTR_READONLY=0x01, FV_ATTR_HIDDEN=0x02, FV_ATTR_SYSTEM=0x04,
+       FV_ATTR_VOLUME=0x08,   FV_ATTR_DIR=0x10,    FV_ATTR_ARCHIVE=0x20,
+       FV_ATTR_LFN=0x0F };
+
+typedef struct {
+    uint32_t lba;
+    uint32_t next;      // hash chain (slot index + 1, 0 = end)
+    uint8_t  valid;
+    uint8_t  dirty;
+    uint8_t  ref;       // CLOCK reference bit
+    uint8_t *data;
+} FvSec;
+
+typedef struct FvDirIndex FvDirIndex;
+typedef struct FvRing FvRing;
+typedef struct FvDio FvDio;
+typedef struct FvOvl FvOvl;
+
+// One traced image request (MT_TRACE)
+typedef struct {
+    uint64_t off;                  // byte offset in the image file
+    uint32_t len;
+    uint8_t  write;
+    uint8_t  phase;
+} FvTraceRec;
+
+typedef struct {
+    int      fd;
+    uint64_t offset;               // partition start within the file (bytes)
+    uint64_t length;               // partition size, 0 = unknown
+    int      writable;
+    int      batch;                // nesting depth of fv_batch_begin()
+    mt_allocator mem;
+    uint8_t  boot[512];
+
+    // Geometry
+    uint32_t bytes_per_sector;
+    uint32_t sectors_per_cluster;
+    uint32_t cluster_bytes;
+    uint32_t num_fats;
+    uint32_t root_entries;
+    uint32_t root_dir_sectors;
+    uint32_t fat_size_sectors;     // per FAT (BPB_FATSz16 or BPB_FATSz32)
+    uint32_t first_fat_lba;
+    uint32_t first_root_lba;
+    uint32_t first_data_lba;       // first cluster (#2)
+    uint32_t total_sectors;
+    uint32_t total_clusters;
+    int      fat_bits;             // 12, 16 or 32
+    uint32_t root_clus;            // FAT32 root directory cluster, 0 otherwise
+
+    // Allocation state; mirrored into the FAT32 FSInfo sector on flush
+    uint32_t fsinfo_lba;           // 0 when there is none
+    uint32_t free_hint;            // where the next allocation scan starts
+    int      alloc;                // MT_ALLOC_* policy for new chains
+    uint32_t free_count;           // UINT32_MAX when unknown
+    int      fsinfo_dirty;
+
+    // Sector cache (FAT + directory sectors)
+    FvSec   *cache;
+    uint8_t *cache_mem;
+    uint32_t cache_cap;
+    uint32_t cache_used;
+    uint32_t *hash;                // bucket -> slot index + 1
+    uint32_t hash_cap;             // power of two
+    uint32_t clock_hand;
+
+    // Name indexes of recently used directories (vfat.c)
+    FvDirIndex *dirx;              // FV_DIR_INDEXES slots, allocated lazily
+    uint32_t    dirx_next;         // round-robin replacement
+
+    // Counters (mtools.h); the current phase is charged up to phase_t0
+    mt_stats st;
+    mt_stats *st_sink;             // receives st on close
+    int      timed;                // MT_STATS
+    int      phase;
+    uint64_t phase_t0;
+
+    // I/O trace (MT_TRACE): records are appended to trace_path when the
+    // buffer fills and on close; without a path yet, overflow is dropped
+    FvTraceRec *trace;
+    uint32_t    trace_n;
+    uint64_t    trace_dropped;
+    char       *trace_path;
+    char        trace_tool[16];
+
+    // Queued bulk I/O (uring.c); NULL until a bulk transfer starts it
+    FvRing  *ring;
+    int      no_ring;              // MT_SYNCIO, or io_uring is unavailable
+    int      qerr;                 // first failed request since fv_qwait
+
+    // O_DIRECT staging (direct.c); NULL unless opened with MT_DIRECT
+    FvDio   *dio;
+
+    // Copy-on-write overlay (overlay.c); NULL unless opened with one.
+    // fd is then the overlay file, and unchanged sectors come from the base
+    FvOvl   *ovl;
+
+    // Hole punching: MT_SPARSE writes and, with MT_PUNCH, the clusters
+    // freed since the last flush (bitmap over cluster numbers)
+    int      no_punch;             // the image cannot have holes
+    uint8_t *punch;
+    uint32_t punch_lo, punch_hi;   // set bits lie in [lo, hi)
+
+    // Metadata journal (journal.c); jfd < 0 when disabled
+    int      jfd;
+    char    *jpath;
+    uint32_t jseq;
+    uint64_t jsize;
+    uint8_t *pending_free;         // clusters freed since the last commit
+    uint32_t *jmap_lba;            // read-only opens: committed sectors the
+    uint8_t  *jmap;                // image may lack yet, sorted by lba
+    uint32_t  jmap_n;
+} FatVol;
+
+// Position of one entry inside a directory.
+typedef struct {
+    uint32_t dir;       // first cluster of the directory (0 = fixed root)
+    uint32_t idx;       // entry index (the 8.3 entry of a long name)
+    uint32_t first;     // first slot of the entry's long name, else idx
+    uint32_t clus;      // cluster holding entry `base` (chain directories)
+    uint32_t base;      // index of the first entry in clus
+} FvDirPos;
+
+// path is an image spec (see fv_locate); overlay, unless NULL, is a file
+// that takes every write while the image itself is only read
+int  fv_open(FatVol *v, const char *path, const char *overlay, int flags,
+             const mt_allocator *mem);  // MT_* flags
+int  fv_flush(FatVol *v);
+int  fv_close(FatVol *v);   // flushes when writable
+// Drop every cached view of the metadata and re-read the boot sector and
+// FSInfo (after a flush: dirty sectors are discarded)
+int  fv_reload(FatVol *v);
+
+// Group several operations into one flush (one journal commit).
+void fv_batch_begin(FatVol *v);
+int  fv_batch_end(FatVol *v);
+
+// Switch the phase the elapsed time is charged to; returns the previous
+// one so that callers can restore it.
+int  fv_phase(FatVol *v, int phase);
+
+const char *fv_phase_name(int phase);
+
+// Append the trace to path, tagged with tool (see mt_trace_attach)
+int  fv_trace_attach(FatVol *v, const char *path, const char *tool);
+
+// Counted (and traced) I/O on the volume; off is relative to the volume start.
+int  fv_pread(FatVol *v, void *buf, size_t len, uint64_t off);
+int  fv_pwrite(FatVol *v, const void *buf, size_t len, uint64_t off);
+void fv_io_account(FatVol *v, int write, uint64_t abs_off, size_t len);
+
+// Queued I/O (uring.c): up to FV_URING_DEPTH requests in flight on an
+// io_uring once fv_qstart() set one up, else plain pread/pwrite.  Write
+// buffers may be reused at once; read data is in place after fv_qwait(),
+// which returns the first error since the last wait.  fv_qbarrier()
+// orders the next request after all queued ones (metadata after data).
+int  fv_qstart(FatVol *v);
+int  fv_qread(FatVol *v, void *buf, size_t len, uint64_t off);
+int  fv_qwrite(FatVol *v, const void *buf, size_t len, uint64_t off);
+void fv_qbarrier(FatVol *v);
+int  fv_qfence(FatVol *v, uint64_t off, size_t len);   // wait for overlapping requests
+int  fv_qwait(FatVol *v);
+void fv_qclose(FatVol *v);
+
+// O_DIRECT access (direct.c), behind fv_pread/fv_pwrite when v->dio is set;
+// offsets are absolute.  Sub-block writes wait in a staging window that
+// fv_qwait() writes back.  fv_dio_direct() tells whether a request may
+// bypass the staging (aligned, and clear of any unwritten window).
+int  fv_dio_start(FatVol *v);
+void fv_dio_close(FatVol *v);
+int  fv_dio_read(FatVol *v, void *buf, size_t len, uint64_t off);
+int  fv_dio_write(FatVol *v, const void *buf, size_t len, uint64_t off);
+int  fv_dio_direct(FatVol *v, uint64_t off, size_t len, int write);
+int  fv_dio_spill(FatVol *v);
+void fv_dio_zeroed(FatVol *v, uint64_t off, uint64_t len);
+
+// Copy-on-write overlays (overlay.c), behind fv_pread/fv_pwrite when
+// v->ovl is set; offsets are absolute.  fv_ovl_prepare() claims a range
+// for the overlay before it is written (-ENOSPC past the base);
+// fv_ovl_sync() writes the sector bitmap back, from fv_qwait().
+int  fv_ovl_open(FatVol *v, const char *base, const char *overlay, int writable);
+void fv_ovl_close(FatVol *v);
+int  fv_ovl_read(FatVol *v, void *buf, size_t len, uint64_t off);
+int  fv_ovl_prepare(FatVol *v, uint64_t off, uint64_t len);
+int  fv_ovl_sync(FatVol *v);
+int  fv_ovl_flatten(const char *base, const char *overlay, const char *out);
+int  fv_clone(const char *src, const char *dst);     // dst must not exist
+
+// Make [off, off + len) of the volume a hole that reads back as zeros;
+// -EOPNOTSUPP (and no further attempts) when the image cannot have holes.
+int  fv_punch(FatVol *v, uint64_t off, uint64_t len);
+
+void *fv_alloc(FatVol *v, size_t size);
+void  fv_free(FatVol *v, void *p);
+
+// Cached sector access. for_write marks the sector dirty.
+int  fv_sector(FatVol *v, uint32_t lba, int for_write, uint8_t **out);
+// Write one sector in place, mirrored into every FAT copy for FAT sectors.
+int  fv_write_sector(FatVol *v, uint32_t lba, const uint8_t *data);
+// Write every dirty cached sector in place and mark it clean.
+int  fv_write_dirty(FatVol *v);
+
+// FAT access
+int  fv_fat_get(FatVol *v, uint32_t clus, uint32_t *val);
+int  fv_fat_set(FatVol *v, uint32_t clus, uint32_t val);
+int  fv_is_eoc(const FatVol *v, uint32_t val);
+uint32_t fv_eoc(const FatVol *v);
+int  fv_alloc_cluster(FatVol *v, uint32_t from, uint32_t *out);   // from 0 = free_hint
+int  fv_free_chain(FatVol *v, uint32_t first);
+int  fv_chain_extents(FatVol *v, uint32_t first, uint32_t *out);  // runs of consecutive clusters
+uint64_t fv_cluster_offset(const FatVol *v, uint32_t clus);
+
+// Directory entries
+uint32_t fv_ent_cluster(const uint8_t *ent);
+void fv_ent_set_cluster(uint8_t *ent, uint32_t clus);
+void fv_ent_name(const uint8_t *ent, char out[13]);     // "NAME.EXT"
+void fv_dir_begin(FvDirPos *p, uint32_t dir);
+int  fv_dir_ent(FatVol *v, FvDirPos *p, int for_write, uint8_t **ent);  // -ENOENT at end
+// Append one zeroed cluster to the chain directory ending at `last`.
+int  fv_dir_extend(FatVol *v, uint32_t last, uint32_t *clus);
+
+// VFAT names and directory slots (vfat.c)
+typedef struct {
+    uint16_t name[FV_LFN_MAX + 1];
+    uint32_t len;                  // 0: the entry has no (valid) long name
+} FvLfn;
+
+uint8_t fv_lfn_checksum(const uint8_t name11[11]);
+size_t fv_lfn_utf8(const FvLfn *l, char *out, size_t size);
+// Next live 8.3 entry at or after p->idx, with its long name; p->first is
+// set.  -ENOENT at the end of the directory.
+int  fv_dir_next(FatVol *v, FvDirPos *p, FvLfn *lfn, uint8_t **ent);
+// Find name (long or 8.3, case-insensitive) in dir.
+int  fv_dir_lookup(FatVol *v, uint32_t dir, const char *name, size_t len, FvDirPos *p);
+// Create the slots for a new name: long-name entries plus an 8.3 entry
+// holding just the short name (or alias); the caller fills in the rest.
+int  fv_dir_create(FatVol *v, uint32_t dir, const char *name, size_t len, FvDirPos *p);
+// Delete the entry at p along with its long-name slots.
+int  fv_dir_remove(FatVol *v, FvDirPos *p);
+// Squeeze the deleted slots out of dir and free the clusters this empties;
+// with min_ratio, only when at least min_ratio % of the used slots (and
+// FV_COMPACT_MIN) are deleted.  *slots and *clusters (may be NULL) tell
+// what was reclaimed.
+int  fv_dir_compact(FatVol *v, uint32_t dir, uint32_t min_ratio, uint32_t *slots, uint32_t *clusters);
+// Forget the name index of dir (a directory that was removed)
+void fv_dirx_drop(FatVol *v, uint32_t dir);
+void fv_dirx_free(FatVol *v);
+
+// Paths
+int  fv_resolve_dir(FatVol *v, const char *path, uint32_t *dir);
+// Resolve all but the last component; *name/*len point into path.
+int  fv_resolve_parent(FatVol *v, const char *path, uint32_t *dir, const char **name, size_t *len);
+
+// File operations (dir = parent directory)
+long fv_read(FatVol *v, uint32_t first, uint32_t size, uint64_t off, void *buf, size_t len);
+// The whole file, handed to sink FV_STREAM_CHUNK bytes at a time
+int  fv_read_stream(FatVol *v, uint32_t first, uint32_t size, mt_sink_cb sink, void *ctx);
+int  fv_put(FatVol *v, uint32_t dir, const char *name, size_t len, const void *data, uint32_t size,
+            int flags);                         // MT_OVERWRITE, MT_SPARSE
+// fv_put with the data pulled from src, FV_STREAM_CHUNK bytes at a time
+int  fv_put_stream(FatVol *v, uint32_t dir, const char *name, size_t len, mt_source_cb src,
+                   void *ctx, int flags, uint64_t *size_out);
+int  fv_unlink(FatVol *v, uint32_t dir, const char *name, size_t len);
+int  fv_mkdir(FatVol *v, uint32_t dir, const char *name, size_t len, uint32_t *clus_out);
+int  fv_rmdir(FatVol *v, uint32_t dir, const char *name, size_t len);   // -ENOTEMPTY
+// Set the write date and time (DOS format) of an entry; the access date too
+int  fv_set_time(FatVol *v, uint32_t dir, const char *name, size_t len, uint16_t date, uint16_t time);
+
+// Image specs (partition.c): "FILE", "FILE@@partN" (MBR/GPT partition N) or
+// "FILE@@OFFSET".  Yields the host file and the partition's byte range.
+int  fv_locate(const char *spec, char *file, size_t file_size, uint64_t *offset, uint64_t *length);
+
+// Journal (journal.c): sidecar "<image>.mtj" holding committed batches of
+// metadata sector images.  fvj_attach replays whatever it finds into the
+// image, or on a read-only open into memory: fvj_lookup then copies the
+// committed version of a sector to out and returns 1 (0: the image's).
+int  fvj_attach(FatVol *v, const char *image, int enable);
+int  fvj_commit(FatVol *v);
+int  fvj_checkpoint(FatVol *v);   // image synced, journal emptied; 0 without one
+int  fvj_lookup(FatVol *v, uint32_t lba, uint8_t *out);
+int  fvj_detach(FatVol *v);
+
+// Resizing (resize.c): rewrite the volume in place for total sectors,
+// moving the clusters that do not fit first (*moved counts them).
+// -ERANGE if the new cluster count needs another FAT type, -ENOSPC if the
+// data does not fit.  Not journaled.  fv_resize_min() gives the smallest
+// size the data fits in.
+int  fv_resize(FatVol *v, uint32_t total, uint32_t *moved);
+int  fv_resize_min(FatVol *v, uint32_t *total);
+
+#endif
@@ -0,0 +1,361 @@
+// src/journal.c
+// Optional write-ahead journal for metadata (MT_JOURNAL).
+//
+// A flush normally writes dirty FAT and directory sectors in place, in no
+// particular order; a crash in between can leave leaked or cross-linked
+// clusters.  With the journal, a flush instead appends every dirty sector
+// image of the batch to the sidecar "<image>.mtj", fdatasync()s that one
+// file (the commit point), and only then writes the sectors in place
+// without waiting for them.  The next writable open replays every
+// committed batch, so the image always reflects a whole number of batches.
+// A batch is atomic only as long as its dirty sectors fit the sector
+// cache: when the cache fills up with them, cache_victim() commits what
+// it has early, and the batch goes to the journal as two or more records.
+//
+// A read-only open never writes the image: it reads the committed sectors
+// into memory (jmap) and serves them in place of the image's (fvj_lookup).
+// Writers hold an exclusive flock() on the journal while they replay,
+// commit and checkpoint, and readers a shared one while they read it, so
+// a reader never sees a batch half appended or a journal half emptied.
+//
+// Record layout (host byte order):
+//   JHdr | count * uint32 lba | count * sector | JTail (crc32 of all before)
+// A torn or corrupt record ends replay.  File data is still written straight
+// to free clusters before the commit, so a crash can lose the contents of a
+// new file but never corrupt the FAT or directories.
+//
+// The journal is checkpointed (image fsync()ed, journal truncated) once it
+// grows past MTJ_CHECKPOINT_BYTES; a non-journaling writer checkpoints and
+// removes it on open.
+
+#define _FILE_OFFSET_BITS 64
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE         // flock
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "fatvol.h"
+
+#define MTJ_MAGIC             0x314A544Du   // "MTJ1"
+#define MTJ_COMMIT            0x434A544Du   // "MTJC"
+#define MTJ_CHECKPOINT_BYTES  (1u << 20)
+#define MTJ_MAX_COUNT         (1u << 20)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t count;
+    uint32_t sector_size;
+} JHdr;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t crc;
+} JTail;
+
+static uint32_t crc32_update(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; ++k) crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+    }
+    return ~crc;
+}
+
+// Journal system calls are counted with the image's (v->st.syscalls)
+static int read_all(FatVol *v, int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len) {
+        v->st.syscalls++;
+        ssize_t n = read(fd, p, len);
+        if (n < 0) { if (errno == EINTR) continue; return -errno; }
+        if (n == 0) return -ENODATA;      // torn record
+        p += n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_all(FatVol *v, int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len) {
+        v->st.syscalls++;
+        ssize_t n = write(fd, p, len);
+        if (n < 0) { if (errno == EINTR) continue; return -errno; }
+        p += n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+// The journal lock.  flock() fails only for want of kernel memory or on
+// file systems without locks; carry on unlocked there.
+static void jlock(FatVol *v, int fd, int op) {
+    v->st.syscalls++;
+    while (flock(fd, op) != 0 && errno == EINTR) {}
+}
+
+// Read-only opens: append a committed sector to v->jmap
+static int map_add(FatVol *v, uint32_t lba, const uint8_t *data, uint32_t *cap) {
+    uint32_t bps = v->bytes_per_sector;
+    if (v->jmap_n == *cap) {
+        uint32_t ncap = *cap ? *cap * 2 : 64;
+        uint32_t *l = fv_alloc(v, (size_t)ncap * sizeof(*l));
+        uint8_t *d = fv_alloc(v, (size_t)ncap * bps);
+        if (!l || !d) { fv_free(v, l); fv_free(v, d); return -ENOMEM; }
+        if (v->jmap_n) {
+            memcpy(l, v->jmap_lba, (size_t)v->jmap_n * sizeof(*l));
+            memcpy(d, v->jmap, (size_t)v->jmap_n * bps);
+        }
+        fv_free(v, v->jmap_lba);
+        fv_free(v, v->jmap);
+        v->jmap_lba = l;
+        v->jmap = d;
+        *cap = ncap;
+    }
+    v->jmap_lba[v->jmap_n] = lba;
+    memcpy(v->jmap + (size_t)v->jmap_n++ * bps, data, bps);
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Sort v->jmap by lba for fvj_lookup, keeping the newest copy of each
+static int map_sort(FatVol *v) {
+    uint32_t bps = v->bytes_per_sector, n = v->jmap_n, k = 0;
+    if (n == 0) return 0;
+    uint64_t *order = fv_alloc(v, (size_t)n * sizeof(*order));
+    uint32_t *l = fv_alloc(v, (size_t)n * sizeof(*l));
+    uint8_t *d = fv_alloc(v, (size_t)n * bps);
+    if (!order || !l || !d) { fv_free(v, order); fv_free(v, l); fv_free(v, d); return -ENOMEM; }
+    for (uint32_t i = 0; i < n; ++i) order[i] = (uint64_t)v->jmap_lba[i] << 32 | i;
+    qsort(order, n, sizeof(*order), cmp_u64);
+    for (uint32_t i = 0; i < n; ++i) {
+        if (i + 1 < n && order[i + 1] >> 32 == order[i] >> 32) continue;   // a later copy follows
+        l[k] = (uint32_t)(order[i] >> 32);
+        memcpy(d + (size_t)k++ * bps, v->jmap + (size_t)(uint32_t)order[i] * bps, bps);
+    }
+    fv_free(v, order);
+    fv_free(v, v->jmap_lba);
+    fv_free(v, v->jmap);
+    v->jmap_lba = l;
+    v->jmap = d;
+    v->jmap_n = k;
+    return 0;
+}
+
+// Apply every complete record in fd (from its start) to the image, or
+// with map set, to v->jmap.  *valid_end is set to the end of the last
+// good record.
+static int replay(FatVol *v, int fd, int map, off_t *valid_end) {
+    uint32_t mcap = 0;
+    uint32_t bps = v->bytes_per_sector;
+    uint8_t *buf = NULL;
+    size_t cap = 0;
+    int rc = 0;
+
+    *valid_end = 0;
+    if (lseek(fd, 0, SEEK_SET) < 0) return -errno;
+    for (;;) {
+        JHdr h;
+        if (read_all(v, fd, &h, sizeof(h)) != 0) break;
+        if (h.magic != MTJ_MAGIC || h.sector_size != bps || h.count == 0 || h.count > MTJ_MAX_COUNT)
+            break;
+
+        size_t body = (size_t)h.count * (4 + bps);
+        if (body > cap) {
+            fv_free(v, buf);
+            if (!(buf = fv_alloc(v, body))) { rc = -ENOMEM; break; }
+            cap = body;
+        }
+        JTail t;
+        if (read_all(v, fd, buf, body) != 0 || read_all(v, fd, &t, sizeof(t)) != 0) break;
+        uint32_t crc = crc32_update(crc32_update(0, &h, sizeof(h)), buf, body);
+        if (t.magic != MTJ_COMMIT || t.seq != h.seq || t.crc != crc) break;
+
+        const uint8_t *lbas = buf;
+        const uint8_t *data = buf + (size_t)h.count * 4;
+        for (uint32_t i = 0; i < h.count; ++i) {
+            uint32_t lba;
+            memcpy(&lba, lbas + (size_t)i * 4, 4);
+            if (lba >= v->total_sectors) { rc = -EINVAL; break; }
+            if (map) rc = map_add(v, lba, data + (size_t)i * bps, &mcap);
+            else     rc = fv_write_sector(v, lba, data + (size_t)i * bps);
+            if (rc) break;
+        }
+        if (rc) break;
+        v->jseq = h.seq + 1;
+        *valid_end += (off_t)(sizeof(h) + body + sizeof(t));
+    }
+    fv_free(v, buf);
+    return rc;
+}
+
+// Make everything applied so far durable and empty the journal.
+static int checkpoint(FatVol *v, int jfd) {
+    int rc = fv_qwait(v);                   // fsync covers completed writes only
+    if (rc) return rc;
+    v->st.syscalls += 3;
+    if (fsync(v->fd) != 0) return -errno;
+    if (ftruncate(jfd, 0) != 0 || lseek(jfd, 0, SEEK_SET) < 0) return -errno;
+    if (v->jfd == jfd) v->jsize = 0;
+    return 0;
+}
+
+int fvj_attach(FatVol *v, const char *image, int enable) {
+    // one journal per file system: partitions get "<image>@<offset>.mtj"
+    size_t n = strlen(image) + sizeof("@18446744073709551615.mtj");
+    if (!(v->jpath = fv_alloc(v, n))) return -ENOMEM;
+    if (v->offset) snprintf(v->jpath, n, "%s@%llu.mtj", image, (unsigned long long)v->offset);
+    else           snprintf(v->jpath, n, "%s.mtj", image);
+
+    int rc = 0;
+    int fd = open(v->jpath, v->writable ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && !v->writable) {
+        // A writer may still be running: read its committed batches
+        // under the shared lock and leave both files alone
+        jlock(v, fd, LOCK_SH);
+        off_t valid_end;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) rc = replay(v, fd, 1, &valid_end);
+        jlock(v, fd, LOCK_UN);
+        if (rc == 0) rc = map_sort(v);
+        close(fd);
+        fd = -1;
+        if (rc) return rc;
+    } else if (fd >= 0) {
+        // A previous writer left committed batches behind: replay them
+        jlock(v, fd, LOCK_EX);
+        off_t valid_end = 0;
+        if (fstat(fd, &st) != 0) rc = -errno;
+        else if (st.st_size > 0) rc = replay(v, fd, 0, &valid_end);
+        int qrc = fv_qwait(v);
+        if (rc == 0) rc = qrc;
+        if (rc == 0 && st.st_size > 0 && !enable) {
+            rc = checkpoint(v, fd);
+            if (rc == 0) unlink(v->jpath);
+        } else if (rc == 0 && valid_end < st.st_size) {
+            // drop a torn tail so new records directly follow the good ones
+            if (ftruncate(fd, valid_end) != 0) rc = -errno;
+        }
+        jlock(v, fd, LOCK_UN);
+        if (rc) { close(fd); return rc; }
+        // sectors read before the replay (the boot sector) are unchanged:
+        // only FAT and directory sectors are ever journaled
+    }
+
+    if (!enable) {
+        if (fd >= 0) close(fd);
+        fv_free(v, v->jpath);
+        v->jpath = NULL;
+        return 0;
+    }
+
+    if (fd < 0 && (fd = open(v->jpath, O_RDWR | O_CREAT, 0644)) < 0) return -errno;
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (end < 0) { rc = -errno; close(fd); return rc; }
+    v->jfd   = fd;
+    v->jsize = (uint64_t)end;
+
+    size_t bits = ((size_t)v->total_clusters + 2 + 7) / 8;
+    if (!(v->pending_free = fv_alloc(v, bits))) return -ENOMEM;
+    memset(v->pending_free, 0, bits);
+
+    if (v->jsize >= MTJ_CHECKPOINT_BYTES) return checkpoint(v, fd);
+    return 0;
+}
+
+int fvj_commit(FatVol *v) {
+    uint32_t bps = v->bytes_per_sector;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < v->cache_used; ++i)
+        if (v->cache[i].valid && v->cache[i].dirty) count++;
+    if (count == 0) return 0;
+
+    JHdr h = { MTJ_MAGIC, v->jseq, count, bps };
+    size_t body = (size_t)count * (4 + bps);
+    size_t total = sizeof(h) + body + sizeof(JTail);
+    uint8_t *rec = fv_alloc(v, total);
+    if (!rec) return -ENOMEM;
+
+    memcpy(rec, &h, sizeof(h));
+    uint8_t *lbas = rec + sizeof(h);
+    uint8_t *data = lbas + (size_t)count * 4;
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < v->cache_used; ++i) {
+        FvSec *s = &v->cache[i];
+        if (!s->valid || !s->dirty) continue;
+        memcpy(lbas + (size_t)k * 4, &s->lba, 4);
+        memcpy(data + (size_t)k * bps, s->data, bps);
+        k++;
+    }
+    JTail t = { MTJ_COMMIT, h.seq, crc32_update(0, rec, sizeof(h) + body) };
+    memcpy(rec + sizeof(h) + body, &t, sizeof(t));
+
+    // Commit point: the record is durable once this fdatasync returns
+    jlock(v, v->jfd, LOCK_EX);
+    int rc = write_all(v, v->jfd, rec, total);
+    v->st.syscalls++;
+    if (rc == 0 && fdatasync(v->jfd) != 0) rc = -errno;
+    fv_free(v, rec);
+    if (rc == 0) {
+        v->jseq++;
+        v->jsize += total;
+        // Apply in place; ordering no longer matters
+        rc = fv_write_dirty(v);
+    }
+    if (rc == 0) {
+        memset(v->pending_free, 0, ((size_t)v->total_clusters + 2 + 7) / 8);
+        if (v->jsize >= MTJ_CHECKPOINT_BYTES) rc = checkpoint(v, v->jfd);
+    }
+    jlock(v, v->jfd, LOCK_UN);
+    return rc;
+}
+
+int fvj_checkpoint(FatVol *v) {
+    if (v->jfd < 0) return 0;
+    jlock(v, v->jfd, LOCK_EX);
+    int rc = checkpoint(v, v->jfd);
+    jlock(v, v->jfd, LOCK_UN);
+    return rc;
+}
+
+int fvj_lookup(FatVol *v, uint32_t lba, uint8_t *out) {
+    uint32_t lo = 0, hi = v->jmap_n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (v->jmap_lba[mid] < lba) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == v->jmap_n || v->jmap_lba[lo] != lba) return 0;
+    memcpy(out, v->jmap + (size_t)lo * v->bytes_per_sector, v->bytes_per_sector);
+    return 1;
+}
+
+int fvj_detach(FatVol *v) {
+    int rc = 0;
+    // An empty journal has nothing to replay; don't leave it lying around
+    if (v->jfd >= 0 && v->jsize == 0 && v->jpath) unlink(v->jpath);
+    if (v->jfd >= 0 && close(v->jfd) != 0) rc = -errno;
+    v->jfd = -1;
+    fv_free(v, v->jpath);
+    fv_free(v, v->pending_free);
+    fv_free(v, v->jmap_lba);
+    fv_free(v, v->jmap);
+    v->jpath = NULL;
+    v->pending_free = NULL;
+    v->jmap_lba = NULL;
+    v->jmap = NULL;
+    v->jmap_n = 0;
+    return rc;
+}
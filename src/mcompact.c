@@ -0,0 +1,150 @@
+// src/mcompact.c
+// mcompact: squeeze the slots of deleted entries (0xE5) out of the
+// directories of a FAT12/16/32 image, so that scans stop walking past them,
+// and free the directory clusters this empties.  mdel already does it for a
+// directory once most of it is deleted; mcompact does every directory of a
+// tree, whatever is left.
+// Build: see Makefile (links libmtools)
+// Usage: mcompact -i IMAGE [--overlay FILE] [--stats] [--direct] [-n] [::/DIR]
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mtools.h"
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s -i IMAGE [--overlay FILE] [--stats] [--direct] [-n] [::/DIR]\n"
+        "  -i IMAGE        image file (IMAGE@@partN selects a partition)\n"
+        "  --overlay FILE  leave IMAGE as it is and write the changes to FILE\n"
+        "  --stats         report I/O and timing counters on stderr\n"
+        "  --direct        O_DIRECT image access (block and loop devices)\n"
+        "  -n              DIR only, not the directories below it\n"
+        "  ::/DIR          where to start (default: the root directory)\n",
+        prog);
+}
+
+typedef struct {
+    char   **names;
+    size_t   count, cap;
+    int      oom;
+} Subdirs;
+
+static int add_subdir(void *ctx, const mt_entry *e) {
+    Subdirs *s = ctx;
+    if (!(e->attr & MT_ATTR_DIR) || (e->attr & MT_ATTR_VOLUME)) return 0;
+    if (!strcmp(e->name, ".") || !strcmp(e->name, "..")) return 0;
+    if (s->count == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 16;
+        char **n = realloc(s->names, cap * sizeof(*n));
+        if (!n) return s->oom = 1;
+        s->names = n;
+        s->cap = cap;
+    }
+    if (!(s->names[s->count] = strdup(e->name))) return s->oom = 1;
+    s->count++;
+    return 0;
+}
+
+static uint32_t dirs, slots, clusters;
+
+// Compact path, then (unless flat) each directory below it
+static int compact(mt_image *img, const char *path, int flat) {
+    uint32_t s, c;
+    int rc = mt_compact(img, path, &s, &c);
+    if (rc) {
+        fprintf(stderr, "%s: %s\n", path, mt_strerror(rc));
+        return rc;
+    }
+    dirs++;
+    slots += s;
+    clusters += c;
+    if (flat) return 0;
+
+    // List first: compaction moves entries under a running listing
+    Subdirs sub = {0};
+    rc = mt_readdir(img, path, add_subdir, &sub);
+    if (rc == 0 && sub.oom) rc = -ENOMEM;
+    if (rc) fprintf(stderr, "%s: %s\n", path, mt_strerror(rc));
+    for (size_t i = 0; i < sub.count; ++i) {
+        if (rc == 0) {
+            size_t n = strlen(path) + strlen(sub.names[i]) + 2;
+            char *child = malloc(n);
+            if (!child) {
+                fprintf(stderr, "Out of memory\n");
+                rc = -ENOMEM;
+            } else {
+                size_t pl = strlen(path);
+                int slash = pl && path[pl - 1] != '/' && path[pl - 1] != ':';
+                snprintf(child, n, "%s%s%s", path, slash ? "/" : "", sub.names[i]);
+                rc = compact(img, child, 0);
+                free(child);
+            }
+        }
+        free(sub.names[i]);
+    }
+    free(sub.names);
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    const char *image = NULL, *ovl = NULL, *dir = "::/";
+    int want_stats = 0, dio = 0, flat = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else if (strcmp(argv[i], "--overlay") == 0 && i + 1 < argc) {
+            ovl = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            want_stats = 1;
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            dio = MT_DIRECT;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            flat = 1;
+        } else if (strncmp(argv[i], "::", 2) == 0) {
+            dir = argv[i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!image) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    int stats_fmt = mt_env_stats(want_stats);
+    mt_image *img;
+    int rc = mt_open_overlay(&img, image, ovl, MT_RDWR | dio | mt_env_flags() | (stats_fmt ? MT_STATS : 0), NULL);
+    if (rc != 0) {
+        fprintf(stderr, "open image %s: %s\n", image, mt_strerror(rc));
+        return 1;
+    }
+    mt_stats stats = {0};
+    if (stats_fmt) mt_stats_attach(img, &stats);
+    mt_trace_attach(img, mt_env_trace(), "mcompact");
+
+    // One flush (one journal commit) for the whole tree
+    mt_batch_begin(img);
+    rc = compact(img, dir, flat);
+    int brc = mt_batch_end(img);
+    if (rc == 0 && brc != 0) {
+        fprintf(stderr, "%s: %s\n", image, mt_strerror(brc));
+        rc = brc;
+    }
+    int crc = mt_close(img);
+    if (rc == 0 && crc != 0) {
+        fprintf(stderr, "%s: %s\n", image, mt_strerror(crc));
+        rc = crc;
+    }
+    if (stats_fmt) mt_stats_print(stderr, "mcompact", &stats, stats_fmt);
+    if (rc != 0) return 1;
+    printf("Compacted %u director%s: %u deleted slot%s removed, %u cluster%s freed\n",
+           dirs, dirs == 1 ? "y" : "ies", slots, slots == 1 ? "" : "s",
+           clusters, clusters == 1 ? "" : "s");
+    return 0;
+}
@@ -1,157 +1,270 @@
+// src/mcp.c
+// Minimal "mtools-like" mcp: copy a host file into a FAT12/16/32 image.
+// FILE "-" is standard input, which may be a pipe: the data is written as
+// it arrives.
+// Build: see Makefile (links libmtools)
+// Usage: mcp -i IMAGE [--overlay FILE] [--overwrite] [--alloc POLICY] [--stats] [--direct] FILE [::DEST]
+
+#define _FILE_OFFSET_BITS 64
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE             // SEEK_DATA, SEEK_HOLE
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mtools.h"
+#include "mtproto.h"
 
 #define VERSION "0.0.2"
-#define SECTOR_SIZE 512
-#define DIR_ENTRY_SIZE 32
-#define DELETED_MARKER 0xE5
+
+static int stats_fmt;           // MT_STATS_*: report on stderr
+static int direct;              // stats, MTOOLS_TRACE, O_DIRECT or an overlay: bypass mtoolsd
+static int dio;                 // --direct: MT_DIRECT
+static int env_flags;           // mt_env_flags(), with the --alloc policy
+static const char *ovl;         // --overlay FILE
+static mt_stats stats;
 
 void usage(const char *progname) {
-    fprintf(stderr, "Usage: %s -i <image> [--overwrite] <file>\n", progname);
+    fprintf(stderr, "Usage: %s -i <image> [--overlay <file>] [--overwrite] [--alloc first|next|best|near]\n"
+                    "           [--stats] [--direct] <file> [::DEST]\n"
+                    "       %s -i <image> [options] - ::DEST      (from standard input)\n", progname, progname);
     exit(1);
 }
 
-void format_83(char *out, const char *in) {
-    memset(out, ' ', 11);
-    const char *dot = strchr(in, '.');
-    size_t name_len = dot ? (size_t)(dot - in) : strlen(in);
-    size_t ext_len  = dot ? strlen(dot + 1) : 0;
+static const char *base_name(const char *path) {
+    const char *b = path;
+    for (const char *p = path; *p; ++p)
+        if (*p == '/' || *p == '\\') b = p + 1;
+    return b;
+}
 
-    for (size_t i = 0; i < name_len && i < 8; i++) {
-        out[i] = toupper((unsigned char)in[i]);
+// Destination path inside the image: DEST as given, DEST/<basename> when
+// DEST names a directory ("::/DIR/"), or <basename> in the root.
+static void dest_path(char *out, size_t outsz, const char *src, const char *dest) {
+    if (!dest || strcmp(dest, "::") == 0 || strcmp(dest, "::/") == 0) {
+        snprintf(out, outsz, "::/%s", base_name(src));
+    } else {
+        size_t n = strlen(dest);
+        if (dest[n - 1] == '/' || dest[n - 1] == '\\')
+            snprintf(out, outsz, "%s%s", dest, base_name(src));
+        else
+            snprintf(out, outsz, "%s", dest);
     }
-    if (dot) {
-        for (size_t i = 0; i < ext_len && i < 3; i++) {
-            out[8 + i] = toupper((unsigned char)dot[1 + i]);
-        }
+}
+
+static int read_range(int fd, uint8_t *p, size_t len, off_t off) {
+    while (len) {
+        ssize_t n = pread(fd, p, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n; len -= (size_t)n; off += n;
     }
+    return 0;
 }
 
-bool find_entry(FILE *fp, uint32_t rootDirOffset, int rootEntryCount, const char *target83, long *foundOffset) {
-    fseek(fp, rootDirOffset, SEEK_SET);
-    for (int i = 0; i < rootEntryCount; i++) {
-        long entryPos = ftell(fp);
-        uint8_t entry[DIR_ENTRY_SIZE];
-        fread(entry, 1, DIR_ENTRY_SIZE, fp);
+// Load the whole source file. Returns NULL (message printed) on failure.
+// FAT caps a file at 4 GiB - 1.  The buffer starts out zeroed and only
+// the data extents of a sparse source are read (SEEK_DATA/SEEK_HOLE).
+static uint8_t *load_file(const char *src, uint32_t *size_out) {
+    int fd = open(src, O_RDONLY);
+    if (fd < 0) {
+        perror("open source file");
+        return NULL;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size > (off_t)UINT32_MAX) {
+        fprintf(stderr, "Error: %s is larger than a FAT file can be\n", src);
+        close(fd);
+        return NULL;
+    }
+    uint8_t *data = (size >= 0) ? calloc(size ? (size_t)size : 1, 1) : NULL;
+    int rc = data ? 0 : -1;
+    for (off_t pos = 0; rc == 0 && pos < size; ) {
+        off_t beg = lseek(fd, pos, SEEK_DATA), end = size;
+        if (beg < 0 && errno == ENXIO) break;            // a hole up to the end
+        if (beg < 0) beg = pos;                           // no SEEK_DATA: read it all
+        else if ((end = lseek(fd, beg, SEEK_HOLE)) < 0 || end > size) end = size;
+        rc = read_range(fd, data + beg, (size_t)(end - beg), beg);
+        pos = end;
+    }
+    close(fd);
+    if (rc != 0) {
+        fprintf(stderr, "Error: cannot read %s\n", src);
+        free(data);
+        return NULL;
+    }
+    *size_out = (uint32_t)size;
+    return data;
+}
 
-        if (entry[0] == 0x00 || entry[0] == DELETED_MARKER) continue;
+// Copy through mtoolsd. Returns the exit code, or -1 if no daemon served it.
+static int mcp_daemon(const char *image, const char *src, const char *dest,
+                      const uint8_t *data, uint32_t size, bool overwrite) {
+    if (size > MTP_MAX_DATA) return -1;
+    int sfd = mtc_connect();
+    if (sfd < 0) return -1;
 
-        if (memcmp(entry, target83, 11) == 0) {
-            if (foundOffset) *foundOffset = entryPos;
-            return true;
-        }
+    int st = mtc_call(sfd, MTP_PUT, MTP_F_SPARSE | (overwrite ? MTP_F_OVERWRITE : 0), image,
+                      dest, data, size, NULL, NULL);
+    close(sfd);
+
+    if (st < 0 || st == ENOTSUP) return -1;
+    if (st == EEXIST) {
+        fprintf(stderr, "Error: File %s already exists. Use --overwrite to replace it.\n", src);
+        return 1;
+    }
+    if (st != 0) {
+        fprintf(stderr, "Error: %s: %s\n", src, strerror(st));
+        return 1;
+    }
+    printf("Copied %s into image (%u bytes)\n", src, size);
+    return 0;
+}
+
+static long read_stdin(void *ctx, void *buf, size_t len) {
+    (void)ctx;
+    for (;;) {
+        ssize_t n = read(STDIN_FILENO, buf, len);
+        if (n >= 0) return (long)n;
+        if (errno != EINTR) return -errno;
     }
-    return false;
 }
 
-int mcp(const char *image, const char *src, bool overwrite) {
-    FILE *fp = fopen(image, "r+b");
-    if (!fp) {
-        perror("fopen image");
+// Copy standard input, of unknown length, straight into the image; the
+// daemon takes whole files only, so this is always direct.
+static int mcp_stdin(const char *image, const char *dest, bool overwrite) {
+    mt_image *img;
+    int rc = mt_open_overlay(&img, image, ovl, MT_RDWR | dio | env_flags | (stats_fmt ? MT_STATS : 0), NULL);
+    if (rc != 0) {
+        fprintf(stderr, "open image %s: %s\n", image, mt_strerror(rc));
+        return 1;
+    }
+    if (stats_fmt) mt_stats_attach(img, &stats);
+    mt_trace_attach(img, mt_env_trace(), "mcp");
+
+    uint64_t size = 0;
+    rc = mt_write_from(img, dest, read_stdin, NULL, MT_SPARSE | (overwrite ? MT_OVERWRITE : 0), &size);
+    int crc = mt_close(img);
+    if (rc == 0) rc = crc;
+    if (stats_fmt) mt_stats_print(stderr, "mcp", &stats, stats_fmt);
+    if (rc == -EEXIST) {
+        fprintf(stderr, "Error: File %s already exists. Use --overwrite to replace it.\n", dest);
+        return 1;
+    }
+    if (rc != 0) {
+        fprintf(stderr, "Error: %s: %s\n", dest, mt_strerror(rc));
         return 1;
     }
+    printf("Copied standard input into image (%llu bytes)\n", (unsigned long long)size);
+    return 0;
+}
+
+int mcp(const char *image, const char *src, const char *dest_arg, bool overwrite) {
+    char dest[1024];
+    dest_path(dest, sizeof(dest), src, dest_arg);
+
+    uint32_t size = 0;
+    uint8_t *data = load_file(src, &size);
+    if (!data) return 1;
+
+    int rc = direct ? -1 : mcp_daemon(image, src, dest, data, size, overwrite);
+    if (rc >= 0) {
+        free(data);
+        return rc;
+    }
 
-    FILE *in = fopen(src, "rb");
-    if (!in) {
-        perror("fopen source file");
-        fclose(fp);
+    mt_image *img;
+    rc = mt_open_overlay(&img, image, ovl, MT_RDWR | dio | env_flags | (stats_fmt ? MT_STATS : 0), NULL);
+    if (rc != 0) {
+        fprintf(stderr, "open image %s: %s\n", image, mt_strerror(rc));
+        free(data);
         return 1;
     }
+    if (stats_fmt) mt_stats_attach(img, &stats);
+    mt_trace_attach(img, mt_env_trace(), "mcp");
 
-    // Read BPB
-    fseek(fp, 11, SEEK_SET);
-    uint16_t bytesPerSector;
-    fread(&bytesPerSector, 2, 1, fp);
-    fseek(fp, 13, SEEK_SET);
-    uint8_t sectorsPerCluster;
-    fread(&sectorsPerCluster, 1, 1, fp);
-    uint16_t reservedSectors;
-    fread(&reservedSectors, 2, 1, fp);
-    uint8_t numFATs;
-    fread(&numFATs, 1, 1, fp);
-    uint16_t rootEntryCount;
-    fread(&rootEntryCount, 2, 1, fp);
-    fseek(fp, 22, SEEK_SET);
-    uint16_t sectorsPerFAT;
-    fread(&sectorsPerFAT, 2, 1, fp);
-
-    uint32_t rootDirOffset = (reservedSectors + numFATs * sectorsPerFAT) * bytesPerSector;
-
-    // Format filename
-    char target83[12];
-    format_83(target83, src);
-
-    long existingOffset = 0;
-    bool alreadyExists = find_entry(fp, rootDirOffset, rootEntryCount, target83, &existingOffset);
+    mt_entry existing;
+    bool alreadyExists = (mt_stat(img, dest, &existing) == 0);
 
     if (alreadyExists && !overwrite) {
         fprintf(stderr, "Error: File %s already exists. Use --overwrite to replace it.\n", src);
-        fclose(fp);
-        fclose(in);
+        mt_close(img);
+        free(data);
+        if (stats_fmt) mt_stats_print(stderr, "mcp", &stats, stats_fmt);
         return 1;
     }
-
-    if (alreadyExists && overwrite) {
+    if (alreadyExists) {
         printf("Overwriting %s in image...\n", src);
-        // TODO: implement cluster clearing, FAT update, etc.
-        fseek(fp, existingOffset, SEEK_SET);
-    } else {
-        // Find empty entry
-        fseek(fp, rootDirOffset, SEEK_SET);
-        for (int i = 0; i < rootEntryCount; i++) {
-            long entryPos = ftell(fp);
-            uint8_t entry[DIR_ENTRY_SIZE];
-            fread(entry, 1, DIR_ENTRY_SIZE, fp);
-
-            if (entry[0] == 0x00 || entry[0] == DELETED_MARKER) {
-                fseek(fp, entryPos, SEEK_SET);
-                break;
-            }
-        }
     }
 
-    // Write filename
-    fwrite(target83, 1, 11, fp);
-
-    // Write dummy metadata and content placeholder
-    fputc(0x20, fp); // file attribute = archive
-    fseek(fp, 22, SEEK_CUR); // skip time/date
-    fputc(0x02, fp); // starting cluster (simplified)
-    fputc(0x00, fp);
-    fseek(in, 0, SEEK_END);
-    long size = ftell(in);
-    fseek(in, 0, SEEK_SET);
-    fwrite(&size, 4, 1, fp);
-
-    printf("Copied %s into image (%ld bytes)\n", src, size);
+    rc = mt_write(img, dest, data, (size_t)size, MT_SPARSE | (overwrite ? MT_OVERWRITE : 0));
+    free(data);
+    int crc = mt_close(img);
+    if (rc == 0) rc = crc;
+    if (stats_fmt) mt_stats_print(stderr, "mcp", &stats, stats_fmt);
+    if (rc != 0) {
+        fprintf(stderr, "Error: %s: %s\n", src, mt_strerror(rc));
+        return 1;
+    }
 
-    fclose(fp);
-    fclose(in);
+    printf("Copied %s into image (%u bytes)\n", src, size);
     return 0;
 }
 
 int main(int argc, char *argv[]) {
     const char *image = NULL;
     const char *file = NULL;
+    const char *dest = NULL;
     bool overwrite = false;
+    int want_stats = 0, alloc = -1;
 
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-i")) {
             if (++i >= argc) usage(argv[0]);
             image = argv[i];
+        } else if (!strcmp(argv[i], "--overlay")) {
+            if (++i >= argc) usage(argv[0]);
+            ovl = argv[i];
         } else if (!strcmp(argv[i], "--overwrite")) {
             overwrite = true;
+        } else if (!strcmp(argv[i], "--alloc")) {
+            if (++i >= argc || (alloc = mt_alloc_policy(argv[i])) < 0) usage(argv[0]);
+        } else if (!strcmp(argv[i], "--stats")) {
+            want_stats = 1;
+        } else if (!strcmp(argv[i], "--direct")) {
+            dio = MT_DIRECT;
+        } else if (!strcmp(argv[i], "--version")) {
+            printf("mcp version %s\n", VERSION);
+            return 0;
         } else if (!file) {
             file = argv[i];
+        } else if (!dest) {
+            dest = argv[i];
         } else {
             usage(argv[0]);
         }
     }
 
     if (!image || !file) usage(argv[0]);
-    return mcp(image, file, overwrite);
-}
\ No newline at end of file
+    stats_fmt = mt_env_stats(want_stats);
+    env_flags = mt_env_flags();
+    if (alloc >= 0) env_flags = (env_flags & ~MT_ALLOC_MASK) | alloc;
+    // The daemon allocates by its own policy and does not journal
+    direct = stats_fmt || mt_env_trace() || ovl || ((dio | env_flags) & (MT_DIRECT | MT_ALLOC_MASK | MT_JOURNAL));
+    if (strcmp(file, "-") == 0) {
+        // Standard input has no name to fall back on
+        if (!dest || !strcmp(dest, "::") || !strcmp(dest, "::/")) usage(argv[0]);
+        size_t n = strlen(dest);
+        if (dest[n - 1] == '/' || dest[n - 1] == '\\') {
+            fprintf(stderr, "Error: standard input needs a file name in the image, not %s\n", dest);
+            return 1;
+        }
+        return mcp_stdin(image, dest, overwrite);
+    }
+    return mcp(image, file, dest, overwrite);
+}
@@ -1,99 +1,75 @@
+// src/mdel.c
+// Minimal "mtools-like" mdel: delete a file from a FAT12/16/32 image and free
+// its clusters.
+// Build: see Makefile (links libmtools)
+// Usage: mdel -i IMAGE [--overlay FILE] [--stats] [--direct] [--punch] [::/]PATH
+
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "mtools.h"
+#include "mtproto.h"
 
 #define VERSION "0.0.1"
-#define SECTOR_SIZE 512
-#define DIR_ENTRY_SIZE 32
-#define DELETED_MARKER 0xE5
 
-#include <ctype.h>  // For toupper()
+static int stats_fmt;           // MT_STATS_*: report on stderr
+static int direct;              // stats, MTOOLS_TRACE, O_DIRECT, --punch or an overlay: bypass mtoolsd
+static int dio;                 // --direct: MT_DIRECT
+static int punch;               // --punch: MT_PUNCH
+static const char *ovl;         // --overlay FILE
+static mt_stats stats;
 
 void usage(const char *progname) {
-    fprintf(stderr, "Usage: %s -i <image> <filename>\n", progname);
+    fprintf(stderr, "Usage: %s -i <image> [--overlay <file>] [--stats] [--direct] [--punch] <filename>\n", progname);
     exit(1);
 }
 
-void format_83(char *out, const char *in) {
-    memset(out, ' ', 11);
-    const char *dot = strchr(in, '.');
-    size_t name_len = dot ? (size_t)(dot - in) : strlen(in);
-    size_t ext_len  = dot ? strlen(dot + 1) : 0;
-
-    for (size_t i = 0; i < name_len && i < 8; i++) {
-        out[i] = toupper((unsigned char)in[i]);
-    }
-    if (dot) {
-        for (size_t i = 0; i < ext_len && i < 3; i++) {
-            out[8 + i] = toupper((unsigned char)dot[1 + i]);
-        }
-    }
-}
-
+// Returns 1 when deleted, 0 when not found, -1 on any other error.
 int del(const char *image, const char *target) {
-    FILE *fp = fopen(image, "r+b");
-    if (!fp) {
-        perror("fopen");
-        return 0;
-    }
-
-    // Read BPB to locate root directory
-    fseek(fp, 11, SEEK_SET);  // BPB offset
-    uint16_t bytesPerSector;
-    fread(&bytesPerSector, 2, 1, fp);
-
-    uint8_t sectorsPerCluster;
-    fread(&sectorsPerCluster, 1, 1, fp);
-
-    uint16_t reservedSectors;
-    fread(&reservedSectors, 2, 1, fp);
-
-    uint8_t numFATs;
-    fread(&numFATs, 1, 1, fp);
-
-    uint16_t rootEntryCount;
-    fread(&rootEntryCount, 2, 1, fp);
-
-    uint16_t totalSectors16;
-    fread(&totalSectors16, 2, 1, fp);
-
-    fseek(fp, 22, SEEK_SET);  // BPB_FATSz16
-    uint16_t sectorsPerFAT;
-    fread(&sectorsPerFAT, 2, 1, fp);
-
-    uint32_t rootDirOffset = (reservedSectors + numFATs * sectorsPerFAT) * bytesPerSector;
-
-    // Convert to 8.3 format
-    char target83[12];
-    format_83(target83, target);
-
-    // Scan root directory
-    fseek(fp, rootDirOffset, SEEK_SET);
-    for (int i = 0; i < rootEntryCount; i++) {
-        long entryPos = ftell(fp);
-        uint8_t entry[DIR_ENTRY_SIZE];
-        fread(entry, 1, DIR_ENTRY_SIZE, fp);
-
-        if (entry[0] == 0x00 || entry[0] == DELETED_MARKER) continue;
-
-        if (memcmp(entry, target83, 11) == 0) {
-            fseek(fp, entryPos, SEEK_SET);
-            fputc(DELETED_MARKER, fp);
+    // Hand the request to mtoolsd when one is running
+    int sfd = direct ? -1 : mtc_connect();
+    if (sfd >= 0) {
+        int st = mtc_call(sfd, MTP_DEL, 0, image, target, NULL, 0, NULL, NULL);
+        close(sfd);
+        if (st == 0) {
             printf("Deleted: %s\n", target);
-            fclose(fp);
             return 1;
         }
+        if (st == ENOENT) return 0;
+        // anything else: fall back to direct access
     }
 
-    fclose(fp);
-    return 0;
+    mt_image *img;
+    int rc = mt_open_overlay(&img, image, ovl, MT_RDWR | dio | punch | mt_env_flags() | (stats_fmt ? MT_STATS : 0), NULL);
+    if (rc != 0) {
+        fprintf(stderr, "open image %s: %s\n", image, mt_strerror(rc));
+        return -1;
+    }
+    if (stats_fmt) mt_stats_attach(img, &stats);
+    mt_trace_attach(img, mt_env_trace(), "mdel");
+    rc = mt_unlink(img, target);
+    int crc = mt_close(img);
+    if (rc == 0) rc = crc;
+    if (stats_fmt) mt_stats_print(stderr, "mdel", &stats, stats_fmt);
+
+    if (rc == -ENOENT) return 0;
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", target, mt_strerror(rc));
+        return -1;
+    }
+    printf("Deleted: %s\n", target);
+    return 1;
 }
 
 
 int main(int argc, char *argv[]) {
     const char *image = NULL;
     const char *target = NULL;
+    int want_stats = 0;
 
     if (argc == 2 && strcmp(argv[1], "--version") == 0) {
         printf("%s version %s\n", argv[0], VERSION);
@@ -105,6 +81,15 @@ int main(int argc, char *argv[]) {
         if (!strcmp(argv[i], "-i")) {
             if (++i >= argc) usage(argv[0]);
             image = argv[i];
+        } else if (!strcmp(argv[i], "--overlay")) {
+            if (++i >= argc) usage(argv[0]);
+            ovl = argv[i];
+        } else if (!strcmp(argv[i], "--stats")) {
+            want_stats = 1;
+        } else if (!strcmp(argv[i], "--direct")) {
+            dio = MT_DIRECT;
+        } else if (!strcmp(argv[i], "--punch")) {
+            punch = MT_PUNCH;
         } else if (!target) {
             target = argv[i];
         } else {
@@ -113,11 +98,14 @@ int main(int argc, char *argv[]) {
     }
 
     if (!image || !target) usage(argv[0]);
+    stats_fmt = mt_env_stats(want_stats);
+    direct = stats_fmt || mt_env_trace() || punch || ovl || ((dio | mt_env_flags()) & (MT_DIRECT | MT_JOURNAL));
 
-    if (!del(image, target)) {
+    int rc = del(image, target);
+    if (rc == 0) {
         fprintf(stderr, "File not found: %s\n", target);
         return 1;
     }
 
-    return 0;
-}
\ No newline at end of file
+    return rc > 0 ? 0 : 1;
+}
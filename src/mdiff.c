@@ -0,0 +1,455 @@
+// src/mdiff.c
+// mdiff: why do two FAT12/16/32 images differ?  Compares the boot sectors
+// field by field, then (same geometry) the reserved sectors, the FAT, the
+// fixed root directory and the data area, reporting differing ranges;
+// then walks both directory trees at once and lists added, removed and
+// changed files.  Large blocks are compared with memcmp and ranges that
+// are holes in both host files are skipped unread; a file whose cluster
+// chain is the same in both images and holds no differing cluster is
+// known to be equal without reading it.
+// Build: see Makefile (links libmtools)
+// Usage: mdiff [-v] [-q] A.IMG B.IMG          (exit 0 same, 1 different, 2 trouble)
+
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE             // SEEK_DATA
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "mtools.h"
+#include "digest.h"
+
+#define BLOCK     (4u << 20)    // bytes compared per read
+#define MAX_LIST  10            // ranges listed per area without -v
+
+static int verbose, quiet;
+static int differ;              // anything at all
+
+static inline uint16_t rd_le16(const uint8_t *p) {
+    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+static inline uint32_t rd_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+typedef struct {
+    const char    *spec;
+    mt_image      *img;
+    int            fd;
+    uint64_t       base;        // file system offset in the host file
+    const uint8_t *boot;
+    uint32_t       bps, spc, rsvd, nfats, root_ents, fat_sz, tot_sec;
+    int            fat32, fat_bits;
+    uint64_t       fat_off, root_off, data_off;
+    uint32_t       clusters;    // data clusters
+    uint8_t       *fat;         // the first FAT
+} Img;
+
+static int open_img(Img *m, const char *spec) {
+    char file[4096];
+    uint64_t len;
+    memset(m, 0, sizeof(*m));
+    m->spec = spec;
+    m->fd = -1;
+    int rc = mt_open(&m->img, spec, MT_RDONLY | mt_env_flags(), NULL);
+    if (rc == 0) rc = mt_locate(spec, file, sizeof(file), &m->base, &len);
+    if (rc == 0 && (m->fd = open(file, O_RDONLY)) < 0) rc = -errno;
+    if (rc) {
+        fprintf(stderr, "%s: %s\n", spec, mt_strerror(rc));
+        return rc;
+    }
+    const uint8_t *b = m->boot = mt_boot_sector(m->img);
+    m->bps       = rd_le16(b + 11);
+    m->spc       = b[13];
+    m->rsvd      = rd_le16(b + 14);
+    m->nfats     = b[16];
+    m->root_ents = rd_le16(b + 17);
+    m->tot_sec   = rd_le16(b + 19) ? rd_le16(b + 19) : rd_le32(b + 32);
+    m->fat_sz    = rd_le16(b + 22) ? rd_le16(b + 22) : rd_le32(b + 36);
+    m->fat32     = m->root_ents == 0 && rd_le16(b + 22) == 0;
+    uint32_t root_secs = (m->root_ents * 32 + m->bps - 1) / m->bps;
+    uint32_t data_sec  = m->rsvd + m->nfats * m->fat_sz + root_secs;
+    m->clusters  = (m->tot_sec - data_sec) / m->spc;
+    m->fat_bits  = m->clusters < 4085 ? 12 : m->clusters < 65525 ? 16 : 32;
+    m->fat_off   = (uint64_t)m->rsvd * m->bps;
+    m->root_off  = m->fat_off + (uint64_t)m->nfats * m->fat_sz * m->bps;
+    m->data_off  = (uint64_t)data_sec * m->bps;
+    return 0;
+}
+
+static void close_img(Img *m) {
+    if (m->img) mt_close(m->img);
+    if (m->fd >= 0) close(m->fd);
+    free(m->fat);
+}
+
+static int read_at(const Img *m, uint8_t *p, size_t len, uint64_t off) {
+    while (len) {
+        ssize_t n = pread(m->fd, p, len, (off_t)(m->base + off));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -errno;
+        if (n == 0) {                           // short file: the rest reads as zeros
+            memset(p, 0, len);
+            return 0;
+        }
+        p += n; len -= (size_t)n; off += (uint64_t)n;
+    }
+    return 0;
+}
+
+static uint32_t fat_get(const Img *m, uint32_t c) {
+    if (m->fat_bits == 12) {
+        uint16_t v = rd_le16(m->fat + c + c / 2);
+        return (c & 1) ? v >> 4 : v & 0xFFF;
+    }
+    if (m->fat_bits == 16) return rd_le16(m->fat + 2 * c);
+    return rd_le32(m->fat + 4 * c) & 0x0FFFFFFF;
+}
+
+static int is_eoc(const Img *m, uint32_t v) {
+    return v >= (m->fat_bits == 12 ? 0xFF8u : m->fat_bits == 16 ? 0xFFF8u : 0x0FFFFFF8u);
+}
+
+// --- differing ranges, coalesced and listed per area ---
+typedef struct {
+    const char *area, *unit, *units_name;
+    uint64_t    lo, hi, ranges, units;
+    int         open;
+} Ranges;
+
+static void range_flush(Ranges *r) {
+    if (!r->open) return;
+    r->open = 0;
+    r->ranges++;
+    r->units += r->hi - r->lo + 1;
+    differ = 1;
+    if (!quiet && (verbose || r->ranges <= MAX_LIST)) {
+        if (r->lo == r->hi) printf("%s: %s %llu differs\n", r->area, r->unit, (unsigned long long)r->lo);
+        else printf("%s: %s %llu-%llu differ\n", r->area, r->units_name,
+                    (unsigned long long)r->lo, (unsigned long long)r->hi);
+    }
+}
+
+static void range_add(Ranges *r, uint64_t u) {
+    if (r->open && u == r->hi + 1) {
+        r->hi = u;
+        return;
+    }
+    range_flush(r);
+    r->lo = r->hi = u;
+    r->open = 1;
+}
+
+static void range_end(Ranges *r) {
+    range_flush(r);
+    if (!quiet && !verbose && r->ranges > MAX_LIST)
+        printf("%s: %llu %s in %llu ranges differ in all (-v lists them)\n", r->area,
+               (unsigned long long)r->units, r->units_name, (unsigned long long)r->ranges);
+}
+
+// Where either file has data at or after off (relative); len if neither
+static uint64_t next_data(const Img *a, const Img *b, uint64_t off, uint64_t len) {
+    uint64_t next = len;
+    const Img *m[2] = { a, b };
+    for (int i = 0; i < 2; ++i) {
+        off_t d = lseek(m[i]->fd, (off_t)(m[i]->base + off), SEEK_DATA);
+        if (d < 0 && errno != ENXIO) return off;        // no SEEK_DATA: read it all
+        uint64_t rel = d < 0 ? len : (uint64_t)d - m[i]->base;
+        if (rel < next) next = rel;
+    }
+    return next < off ? off : next;
+}
+
+// Compare [off, off+len) of both images in units of unit bytes; unit i is
+// reported as first + i.  bits (may be NULL) gets a bit per differing unit.
+static int cmp_area(const Img *a, const Img *b, uint64_t off, uint64_t len, uint32_t unit,
+                    uint64_t first, Ranges *r, uint8_t *bits) {
+    size_t block = BLOCK - BLOCK % unit;
+    if (block < unit) block = unit;
+    uint8_t *pa = malloc(block), *pb = malloc(block);
+    int rc = (pa && pb) ? 0 : -ENOMEM;
+    for (uint64_t pos = 0; rc == 0 && pos < len; ) {
+        // Holes in both files are equal: skip to where either has data
+        uint64_t d = next_data(a, b, off + pos, off + len) - off;
+        if (d > pos) {
+            pos = d - d % unit;
+            if (pos >= len) break;
+        }
+        size_t n = len - pos < block ? (size_t)(len - pos) : block;
+        if ((rc = read_at(a, pa, n, off + pos)) != 0 || (rc = read_at(b, pb, n, off + pos)) != 0) break;
+        if (memcmp(pa, pb, n) != 0) {
+            for (size_t i = 0; i < n; i += unit) {
+                size_t k = n - i < unit ? n - i : unit;
+                if (memcmp(pa + i, pb + i, k) == 0) continue;
+                uint64_t u = (pos + i) / unit;
+                range_add(r, first + u);
+                if (bits) bits[u >> 3] |= (uint8_t)(1u << (u & 7));
+            }
+        }
+        pos += n;
+    }
+    free(pa);
+    free(pb);
+    range_end(r);
+    return rc;
+}
+
+// --- boot sector, by field ---
+typedef struct { int off, len; const char *name; } Field;
+
+static const Field fat16_fields[] = {
+    {0, 3, "jump"}, {3, 8, "OEM name"}, {11, 25, "BPB"}, {36, 3, "drive/signature"},
+    {39, 4, "volume ID"}, {43, 11, "volume label"}, {54, 8, "file system type"},
+    {62, 448, "boot code"}, {510, 2, "signature"}
+};
+static const Field fat32_fields[] = {
+    {0, 3, "jump"}, {3, 8, "OEM name"}, {11, 25, "BPB"}, {36, 28, "FAT32 BPB"},
+    {64, 3, "drive/signature"}, {67, 4, "volume ID"}, {71, 11, "volume label"},
+    {82, 8, "file system type"}, {90, 420, "boot code"}, {510, 2, "signature"}
+};
+
+static void cmp_boot(const Img *a, const Img *b) {
+    const Field *f = a->fat32 ? fat32_fields : fat16_fields;
+    size_t nf = a->fat32 ? sizeof(fat32_fields) / sizeof(*f) : sizeof(fat16_fields) / sizeof(*f);
+    if (a->fat32 != b->fat32) {
+        // Past the common BPB the layouts disagree: no field matches up
+        nf = 3;
+        differ = 1;
+        if (!quiet) printf("boot: FAT%s -> FAT%s layout\n", a->fat32 ? "32" : "12/16", b->fat32 ? "32" : "12/16");
+    }
+    for (size_t i = 0; i < nf; ++i) {
+        if (memcmp(a->boot + f[i].off, b->boot + f[i].off, (size_t)f[i].len) == 0) continue;
+        differ = 1;
+        if (quiet) continue;
+        if (!strcmp(f[i].name, "volume label"))
+            printf("boot: volume label \"%.11s\" -> \"%.11s\"\n", (const char *)a->boot + f[i].off,
+                   (const char *)b->boot + f[i].off);
+        else if (!strcmp(f[i].name, "volume ID"))
+            printf("boot: volume ID %08X -> %08X\n", rd_le32(a->boot + f[i].off), rd_le32(b->boot + f[i].off));
+        else
+            printf("boot: %s differs\n", f[i].name);
+    }
+}
+
+static int same_geometry(const Img *a, const Img *b) {
+    return a->bps == b->bps && a->spc == b->spc && a->rsvd == b->rsvd && a->nfats == b->nfats &&
+           a->root_ents == b->root_ents && a->fat_sz == b->fat_sz && a->tot_sec == b->tot_sec;
+}
+
+// --- the trees ---
+typedef struct {
+    char     name[MT_NAME_MAX];
+    uint8_t  attr;
+    uint32_t size, first;
+    uint16_t date, time;
+} DEnt;
+
+typedef struct {
+    DEnt  *v;
+    size_t n, cap;
+    int    oom;
+} DList;
+
+static int add_dent(void *ctx, const mt_entry *e) {
+    DList *l = ctx;
+    if (e->attr & MT_ATTR_VOLUME) return 0;
+    if (!strcmp(e->name, ".") || !strcmp(e->name, "..")) return 0;
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 64;
+        DEnt *v = realloc(l->v, cap * sizeof(*v));
+        if (!v) return l->oom = 1;
+        l->v = v;
+        l->cap = cap;
+    }
+    DEnt *d = &l->v[l->n++];
+    memcpy(d->name, e->name, sizeof(d->name));
+    d->attr  = e->attr;
+    d->size  = e->size;
+    d->first = e->first_cluster;
+    d->date  = e->date;
+    d->time  = e->time;
+    return 0;
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcasecmp(((const DEnt *)a)->name, ((const DEnt *)b)->name);
+}
+
+static int list(const Img *m, const char *path, DList *l) {
+    int rc = mt_readdir(m->img, path, add_dent, l);
+    if (rc == 0 && l->oom) rc = -ENOMEM;
+    if (rc) fprintf(stderr, "%s %s: %s\n", m->spec, path, mt_strerror(rc));
+    else qsort(l->v, l->n, sizeof(*l->v), by_name);
+    return rc;
+}
+
+static unsigned n_added, n_removed, n_changed, n_meta;
+
+static int feed(void *ctx, const void *buf, size_t len) {
+    dg_update(ctx, buf, len);
+    return 0;
+}
+
+// Do the contents of two files of the same size differ?  1/0, or -errno
+static int contents_differ(const Img *a, const Img *b, const char *path, const DEnt *x, const DEnt *y,
+                           const uint8_t *dbits) {
+    if (x->size == 0) return 0;
+    if (dbits) {
+        // The same chain with no differing cluster: equal without reading
+        uint32_t ca = x->first, cb = y->first;
+        uint32_t cbytes = a->bps * a->spc, n = (x->size + cbytes - 1) / cbytes, i;
+        for (i = 0; i < n; ++i) {
+            if (ca != cb || ca < 2 || ca >= a->clusters + 2) break;
+            if (dbits[(ca - 2) >> 3] & (1u << ((ca - 2) & 7))) break;
+            if (i + 1 < n && (ca = fat_get(a, ca), cb = fat_get(b, cb), is_eoc(a, ca))) break;
+        }
+        if (i == n) return 0;
+    }
+    // Else hash both
+    Digest da, db;
+    char ha[DG_HEX_MAX], hb[DG_HEX_MAX];
+    dg_init(&da, DG_XXH64);
+    dg_init(&db, DG_XXH64);
+    int rc = mt_read_to(a->img, path, feed, &da);
+    if (rc == 0) rc = mt_read_to(b->img, path, feed, &db);
+    if (rc) return rc;
+    dg_final(&da, ha);
+    dg_final(&db, hb);
+    return strcmp(ha, hb) != 0;
+}
+
+static void say(char tag, const char *path, int dir, const char *note) {
+    differ = 1;
+    if (!quiet) printf("%c %s%s%s%s\n", tag, path + 2, dir ? "/" : "", note ? "  " : "", note ? note : "");
+}
+
+static int walk(const Img *a, const Img *b, char *path, size_t plen, const uint8_t *dbits) {
+    DList la = {0}, lb = {0};
+    int rc = list(a, path, &la);
+    if (rc == 0) rc = list(b, path, &lb);
+    size_t i = 0, j = 0;
+    while (rc == 0 && (i < la.n || j < lb.n)) {
+        int c = i == la.n ? 1 : j == lb.n ? -1 : strcasecmp(la.v[i].name, lb.v[j].name);
+        const DEnt *x = c <= 0 ? &la.v[i] : NULL, *y = c >= 0 ? &lb.v[j] : NULL;
+        const char *name = x ? x->name : y->name;
+        size_t n = (size_t)snprintf(path + plen, 4096 - plen, "%s%s", plen > 3 ? "/" : "", name);
+        if (plen + n >= 4096) {
+            rc = -ENAMETOOLONG;
+            break;
+        }
+        if (!y) {
+            say('-', path, (x->attr & MT_ATTR_DIR) != 0, NULL);
+            n_removed++;
+        } else if (!x) {
+            say('+', path, (y->attr & MT_ATTR_DIR) != 0, NULL);
+            n_added++;
+        } else if ((x->attr & MT_ATTR_DIR) != (y->attr & MT_ATTR_DIR)) {
+            say('~', path, 0, (x->attr & MT_ATTR_DIR) ? "directory -> file" : "file -> directory");
+            n_changed++;
+        } else if (x->attr & MT_ATTR_DIR) {
+            rc = walk(a, b, path, plen + n, dbits);
+        } else {
+            char note[64];
+            int d = x->size != y->size ? 1 : contents_differ(a, b, path, x, y, dbits);
+            if (d < 0) {
+                fprintf(stderr, "%s: %s\n", path, mt_strerror(d));
+                rc = d;
+            } else if (d) {
+                if (x->size != y->size) snprintf(note, sizeof(note), "size %u -> %u", x->size, y->size);
+                say('M', path, 0, x->size != y->size ? note : NULL);
+                n_changed++;
+            } else if (x->attr != y->attr || x->date != y->date || x->time != y->time) {
+                say('m', path, 0, x->attr != y->attr ? "attributes" : "date/time");
+                n_meta++;
+            }
+        }
+        path[plen] = '\0';
+        if (c <= 0) i++;
+        if (c >= 0) j++;
+    }
+    free(la.v);
+    free(lb.v);
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    const char *sa = NULL, *sb = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) verbose = 1;
+        else if (strcmp(argv[i], "-q") == 0) quiet = 1;
+        else if (!sa) sa = argv[i];
+        else if (!sb) sb = argv[i];
+        else sa = NULL, sb = NULL, i = argc;
+    }
+    if (!sa || !sb) {
+        fprintf(stderr,
+            "Usage: %s [-v] [-q] A.IMG B.IMG\n"
+            "  -v  list every differing range, not the first %d per area\n"
+            "  -q  report nothing, just exit 1 if the images differ\n"
+            "Images may name partitions (IMAGE@@partN).  Exit status: 0 same, 1 different, 2 trouble.\n",
+            argv[0], MAX_LIST);
+        return 2;
+    }
+
+    Img a, b;
+    int rc = open_img(&a, sa);
+    if (rc == 0) rc = open_img(&b, sb);
+    else b.img = NULL, b.fd = -1, b.fat = NULL;
+    uint8_t *dbits = NULL;
+    int raw_same = 0;
+    if (rc == 0) {
+        cmp_boot(&a, &b);
+        if (!same_geometry(&a, &b)) {
+            differ = 1;
+            if (!quiet)
+                printf("geometry: %u/%u clusters of %u/%u bytes, FAT%d/FAT%d: areas not compared\n",
+                       a.clusters, b.clusters, a.bps * a.spc, b.bps * b.spc, a.fat_bits, b.fat_bits);
+        } else {
+            int before = differ;
+            Ranges rr = { "reserved", "sector", "sectors", 0, 0, 0, 0, 0 };
+            Ranges fr = { "fat", "cluster", "clusters", 0, 0, 0, 0, 0 };
+            Ranges tr = { "root", "entry", "entries", 0, 0, 0, 0, 0 };
+            Ranges dr = { "data", "cluster", "clusters", 0, 0, 0, 0, 0 };
+            size_t fat_bytes = (size_t)a.fat_sz * a.bps;
+            differ = 0;
+            // Sector 0 was compared field by field
+            rc = cmp_area(&a, &b, a.bps, a.fat_off - a.bps, a.bps, 1, &rr, NULL);
+            if (rc == 0 && (!(a.fat = malloc(fat_bytes)) || !(b.fat = malloc(fat_bytes)))) rc = -ENOMEM;
+            if (rc == 0 && (rc = read_at(&a, a.fat, fat_bytes, a.fat_off)) == 0)
+                rc = read_at(&b, b.fat, fat_bytes, b.fat_off);
+            if (rc == 0) {
+                for (uint32_t c = 2; c < a.clusters + 2; ++c)
+                    if (fat_get(&a, c) != fat_get(&b, c)) range_add(&fr, c);
+                range_end(&fr);
+            }
+            if (rc == 0 && a.root_ents)
+                rc = cmp_area(&a, &b, a.root_off, (uint64_t)a.root_ents * 32, 32, 0, &tr, NULL);
+            if (rc == 0 && !(dbits = calloc((size_t)a.clusters / 8 + 1, 1))) rc = -ENOMEM;
+            if (rc == 0)
+                rc = cmp_area(&a, &b, a.data_off, (uint64_t)a.clusters * a.bps * a.spc, a.bps * a.spc, 2,
+                              &dr, dbits);
+            raw_same = rc == 0 && !differ;
+            differ |= before;
+        }
+        if (rc) fprintf(stderr, "%s: %s\n", rc == -ENOMEM ? "mdiff" : sa, mt_strerror(rc));
+    }
+    // The same bytes everywhere but the boot sector: the same trees
+    if (rc == 0 && !raw_same) {
+        static char path[4096] = "::/";
+        rc = walk(&a, &b, path, 3, dbits);
+        if (rc == 0 && !quiet && (n_added || n_removed || n_changed || n_meta))
+            printf("%u added, %u removed, %u changed, %u with new attributes or times\n",
+                   n_added, n_removed, n_changed, n_meta);
+    }
+    free(dbits);
+    close_img(&a);
+    close_img(&b);
+    if (rc) return 2;
+    return differ ? 1 : 0;
+}
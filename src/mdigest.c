@@ -0,0 +1,376 @@
+// src/mdigest.c
+// mdigest: hash every file of a FAT12/16/32 image straight from its
+// clusters, without extracting it, and print a manifest sorted by path
+// ("DIGEST  /DIR/FILE" lines, as sha256sum prints them), or check the
+// image against one.  Files are spread over N worker processes, largest
+// first, each with its own image handle.
+// Build: see Makefile (links libmtools)
+// Usage: mdigest -i IMAGE [--overlay FILE] [--algo sha256|xxh64|crc32] [-j N]
+//                [-c MANIFEST] [--stats] [::/DIR]
+
+#define _FILE_OFFSET_BITS 64
+#define _DEFAULT_SOURCE         // MAP_ANONYMOUS
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "mtools.h"
+#include "digest.h"
+
+#define MAX_JOBS 64
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s -i IMAGE [options] [::/DIR]\n"
+        "  -i IMAGE        image file (IMAGE@@partN selects a partition)\n"
+        "  --overlay FILE  read the image through a copy-on-write overlay\n"
+        "  --algo ALGO     sha256 (default), xxh64 or crc32\n"
+        "  -j N            worker processes (default: one per CPU)\n"
+        "  -c MANIFEST     check the image against MANIFEST (\"-\": stdin)\n"
+        "  --stats         report I/O and timing counters on stderr\n"
+        "  ::/DIR          only the files below DIR\n",
+        prog);
+}
+
+typedef struct {
+    char    *path;              // "::/DIR/FILE"
+    uint32_t size;
+} File;
+
+typedef struct {
+    File  *v;
+    size_t n, cap;
+} Files;
+
+// What a worker hands back, in memory shared with the parent
+typedef struct {
+    int  err;                   // negative errno, or 0
+    char hex[DG_HEX_MAX];
+} Result;
+
+static const char *image, *ovl;
+static int algo = DG_SHA256, stats_fmt;
+
+// --- collecting the files ---
+typedef struct {
+    Files      *files;
+    const char *dir;
+    char      **subdirs;
+    size_t      nsub, capsub;
+    int         oom;
+} Walk;
+
+// Room for element n of an array of *cap; NULL when out of memory
+static void *grow(void *v, size_t n, size_t *cap, size_t size) {
+    if (n < *cap) return v;
+    size_t c = *cap ? *cap * 2 : 64;
+    void *p = realloc(v, c * size);
+    if (p) *cap = c;
+    return p;
+}
+
+static char *join(const char *dir, const char *name) {
+    size_t n = strlen(dir) + strlen(name) + 2;
+    char *p = malloc(n);
+    if (p) snprintf(p, n, "%s%s%s", dir, dir[strlen(dir) - 1] == '/' ? "" : "/", name);
+    return p;
+}
+
+static int add_entry(void *ctx, const mt_entry *e) {
+    Walk *w = ctx;
+    if (e->attr & MT_ATTR_VOLUME) return 0;
+    if (!strcmp(e->name, ".") || !strcmp(e->name, "..")) return 0;
+    char *path = join(w->dir, e->name);
+    if (!path) return w->oom = 1;
+    if (e->attr & MT_ATTR_DIR) {
+        char **v = grow(w->subdirs, w->nsub, &w->capsub, sizeof(*v));
+        if (!v) {
+            free(path);
+            return w->oom = 1;
+        }
+        w->subdirs = v;
+        w->subdirs[w->nsub++] = path;
+    } else {
+        Files *f = w->files;
+        File *v = grow(f->v, f->n, &f->cap, sizeof(*v));
+        if (!v) {
+            free(path);
+            return w->oom = 1;
+        }
+        f->v = v;
+        f->v[f->n].path = path;
+        f->v[f->n++].size = e->size;
+    }
+    return 0;
+}
+
+static int collect(mt_image *img, const char *dir, Files *files) {
+    Walk w = { files, dir, NULL, 0, 0, 0 };
+    int rc = mt_readdir(img, dir, add_entry, &w);
+    if (rc == 0 && w.oom) rc = -ENOMEM;
+    if (rc) fprintf(stderr, "%s: %s\n", dir, mt_strerror(rc));
+    for (size_t i = 0; i < w.nsub; ++i) {
+        if (rc == 0) rc = collect(img, w.subdirs[i], files);
+        free(w.subdirs[i]);
+    }
+    free(w.subdirs);
+    return rc;
+}
+
+static int by_path(const void *a, const void *b) {
+    return strcmp(((const File *)a)->path, ((const File *)b)->path);
+}
+
+static const File *sort_files;
+
+static int by_size_desc(const void *a, const void *b) {
+    uint32_t x = sort_files[*(const size_t *)a].size, y = sort_files[*(const size_t *)b].size;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// --- hashing ---
+static int feed(void *ctx, const void *buf, size_t len) {
+    dg_update(ctx, buf, len);
+    return 0;
+}
+
+// Worker k of jobs: every jobs-th file of order[], largest first
+static int work(const File *files, const size_t *order, size_t n, int k, int jobs,
+                Result *res, mt_stats *st) {
+    mt_image *img;
+    int rc = mt_open_overlay(&img, image, ovl, MT_RDONLY | mt_env_flags() | (stats_fmt ? MT_STATS : 0), NULL);
+    if (rc) {
+        fprintf(stderr, "open image %s: %s\n", image, mt_strerror(rc));
+        return rc;
+    }
+    if (stats_fmt) mt_stats_attach(img, st);
+    mt_trace_attach(img, mt_env_trace(), "mdigest");
+    for (size_t i = (size_t)k; i < n; i += (size_t)jobs) {
+        Result *r = &res[order[i]];
+        Digest d;
+        dg_init(&d, algo);
+        r->err = mt_read_to(img, files[order[i]].path, feed, &d);
+        if (r->err == 0) dg_final(&d, r->hex);
+    }
+    return mt_close(img);
+}
+
+// --- checking ---
+typedef struct {
+    char *path;                 // "/DIR/FILE", as printed
+    char *hex;
+} Line;
+
+static int line_by_path(const void *a, const void *b) {
+    return strcmp(((const Line *)a)->path, ((const Line *)b)->path);
+}
+
+// "HEX  /PATH" lines; algo from the digest length unless given
+static Line *read_manifest(const char *name, size_t *count, int *algo_io, int algo_given) {
+    FILE *f = strcmp(name, "-") ? fopen(name, "r") : stdin;
+    if (!f) {
+        perror(name);
+        return NULL;
+    }
+    Line *v = NULL, *grown;
+    size_t n = 0, cap = 0, lineno = 0;
+    char *buf = NULL;
+    size_t bufsz = 0;
+    ssize_t len;
+    int bad = 0;
+    while (!bad && (len = getline(&buf, &bufsz, f)) >= 0) {
+        lineno++;
+        while (len && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) buf[--len] = '\0';
+        if (!len) continue;
+        char *sp = strstr(buf, "  ");
+        size_t hl = sp ? (size_t)(sp - buf) : 0;
+        int a = hl == 64 ? DG_SHA256 : hl == 16 ? DG_XXH64 : hl == 8 ? DG_CRC32 : -1;
+        if (!sp || a < 0 || strspn(buf, "0123456789abcdefABCDEF") != hl || sp[2] != '/') {
+            fprintf(stderr, "%s:%zu: not a digest line\n", name, lineno);
+            bad = 1;
+        } else if (n && a != *algo_io) {
+            fprintf(stderr, "%s:%zu: digests of different lengths\n", name, lineno);
+            bad = 1;
+        } else if (algo_given && dg_hex_len(*algo_io) != (int)hl) {
+            fprintf(stderr, "%s:%zu: not a %s digest\n", name, lineno, dg_name(*algo_io));
+            bad = 1;
+        } else if (!(grown = grow(v, n, &cap, sizeof(Line))) || !((v = grown)[n].hex = strndup(buf, hl)) ||
+                   !(v[n].path = strdup(sp + 2))) {
+            fprintf(stderr, "Out of memory\n");
+            bad = 1;
+        } else {
+            for (char *p = v[n].hex; *p; ++p) if (*p >= 'A' && *p <= 'F') *p += 'a' - 'A';
+            *algo_io = a;
+            n++;
+        }
+    }
+    free(buf);
+    if (f != stdin) fclose(f);
+    if (bad) {
+        for (size_t i = 0; i < n; ++i) { free(v[i].hex); free(v[i].path); }
+        free(v);
+        return NULL;
+    }
+    qsort(v, n, sizeof(*v), line_by_path);
+    *count = n;
+    return v ? v : calloc(1, sizeof(Line));
+}
+
+int main(int argc, char **argv) {
+    const char *dir = "::/", *manifest = NULL;
+    int jobs = 0, want_stats = 0, algo_given = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else if (strcmp(argv[i], "--overlay") == 0 && i + 1 < argc) {
+            ovl = argv[++i];
+        } else if (strcmp(argv[i], "--algo") == 0 && i + 1 < argc) {
+            if ((algo = dg_algo(argv[++i])) < 0) {
+                fprintf(stderr, "Error: unknown digest %s (sha256, xxh64, crc32)\n", argv[i]);
+                return 2;
+            }
+            algo_given = 1;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+            if (jobs < 1 || jobs > MAX_JOBS) {
+                fprintf(stderr, "Error: -j takes 1 to %d\n", MAX_JOBS);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            want_stats = 1;
+        } else if (strncmp(argv[i], "::", 2) == 0) {
+            dir = argv[i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!image) {
+        usage(argv[0]);
+        return 2;
+    }
+    stats_fmt = mt_env_stats(want_stats);
+
+    Line *lines = NULL;
+    size_t nlines = 0;
+    if (manifest && !(lines = read_manifest(manifest, &nlines, &algo, algo_given))) return 2;
+
+    // Every file below dir, in manifest order
+    Files files = {0};
+    mt_image *img;
+    int rc = mt_open_overlay(&img, image, ovl, MT_RDONLY | mt_env_flags(), NULL);
+    if (rc) {
+        fprintf(stderr, "open image %s: %s\n", image, mt_strerror(rc));
+        return 1;
+    }
+    rc = collect(img, dir, &files);
+    mt_close(img);
+    if (rc) return 1;
+    qsort(files.v, files.n, sizeof(File), by_path);
+
+    // Largest first, so that the workers finish together
+    size_t n = files.n;
+    size_t *order = malloc((n ? n : 1) * sizeof(*order));
+    if (!order) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < n; ++i) order[i] = i;
+    sort_files = files.v;
+    qsort(order, n, sizeof(*order), by_size_desc);
+
+    if (!jobs) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus < 1 ? 1 : cpus > MAX_JOBS ? MAX_JOBS : (int)cpus;
+    }
+    if ((size_t)jobs > n) jobs = n ? (int)n : 1;
+
+    // Results and counters live in memory the workers share with us
+    size_t bytes = (n ? n : 1) * sizeof(Result) + (size_t)jobs * sizeof(mt_stats);
+    Result *res = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (res == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    mt_stats *wst = (mt_stats *)(res + (n ? n : 1));
+
+    if (jobs == 1) {
+        rc = work(files.v, order, n, 0, 1, res, wst);
+    } else {
+        fflush(NULL);
+        pid_t pids[MAX_JOBS];
+        int started = 0;
+        for (int k = 0; k < jobs; ++k) {
+            pid_t p = fork();
+            if (p == 0) _exit(work(files.v, order, n, k, jobs, res, &wst[k]) ? 1 : 0);
+            if (p < 0) {
+                perror("fork");
+                rc = -errno;
+                break;
+            }
+            pids[started++] = p;
+        }
+        for (int k = 0; k < started; ++k) {
+            int status;
+            while (waitpid(pids[k], &status, 0) < 0 && errno == EINTR) {}
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) rc = -EIO;
+        }
+    }
+    if (stats_fmt) {
+        mt_stats sum = {0};
+        for (int k = 0; k < jobs; ++k) {
+            uint64_t *a = (uint64_t *)&sum;
+            const uint64_t *b = (const uint64_t *)&wst[k];
+            for (size_t i = 0; i < sizeof(sum) / sizeof(uint64_t); ++i) a[i] += b[i];
+        }
+        mt_stats_print(stderr, "mdigest", &sum, stats_fmt);
+    }
+
+    int failed = rc != 0;
+    for (size_t i = 0; i < n; ++i)
+        if (res[i].err) {
+            fprintf(stderr, "%s: %s\n", files.v[i].path, mt_strerror(res[i].err));
+            failed = 1;
+        }
+
+    if (!manifest) {
+        for (size_t i = 0; i < n; ++i)
+            if (!res[i].err) printf("%s  %s\n", res[i].hex, files.v[i].path + 2);
+        return failed;
+    }
+
+    // Both sides are sorted by path: merge them
+    size_t ok = 0, bad = 0, i = 0, j = 0;
+    while (i < n || j < nlines) {
+        int c = i == n ? 1 : j == nlines ? -1 : strcmp(files.v[i].path + 2, lines[j].path);
+        if (c < 0) {
+            printf("%s: EXTRA\n", files.v[i++].path + 2);
+            bad++;
+        } else if (c > 0) {
+            printf("%s: MISSING\n", lines[j++].path);
+            bad++;
+        } else {
+            if (res[i].err) {
+                bad++;                          // reported above
+            } else if (strcmp(res[i].hex, lines[j].hex) != 0) {
+                printf("%s: FAILED\n", lines[j].path);
+                bad++;
+            } else {
+                ok++;
+            }
+            i++;
+            j++;
+        }
+    }
+    fflush(stdout);
+    fprintf(stderr, "%zu files OK, %zu differ (%s)\n", ok, bad, dg_name(algo));
+    return failed || bad;
+}
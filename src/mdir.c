@@ -1,13 +1,15 @@
-// mdir.c - Minimal directory lister for FAT12/FAT16 "super-floppy" images
-// Compile: gcc -Wall -Wextra -O2 -o mdir.exe src/mdir.c   (Windows/MinGW) or mdir (POSIX)
+// mdir.c - Minimal directory lister for FAT12/16/32 "super-floppy" images
+// Build: see Makefile (links libmtools)
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
-#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
 
-#define SECTOR_SIZE 512
+#include "mtools.h"
+#include "mtproto.h"
 
 // ---- Version/branding ----
 #define PROGRAM_NAME  "mdir"
@@ -25,34 +27,108 @@ static void print_version(void) {
     printf("There is NO WARRANTY, to the extent permitted by law.\n");
 }
 
-static inline uint16_t rd_le16(const uint8_t *p) {
-    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
-}
-static inline uint32_t rd_le32(const uint8_t *p) {
-    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
-}
+enum { FMT_TABLE, FMT_JSON, FMT_CSV, FMT_NUL };
+
+// Machine-readable output goes through one large buffer, written out
+// with write(2) when full: no stdio and no printf per entry.
+#define OUT_BUF (256u << 10)
+
+typedef struct {
+    char   *buf;
+    size_t  len;
+    int     err;
+} Out;
+
+// A name pattern, compiled once: DOS wildcards (* and ?) plus glob
+// character classes ([a-z], [!0-9]), matched without regard to ASCII case.
+enum { P_LIT, P_ANY, P_STAR, P_SET };
+
+typedef struct {
+    uint8_t kind;        // P_*
+    uint8_t c;           // P_LIT: the upper-case byte
+    uint8_t set[32];     // P_SET: bitmap over upper-cased bytes
+} PTok;
+
+typedef struct {
+    PTok  *tok;
+    size_t n;
+} Pattern;
+
+enum { SORT_NONE, SORT_NAME, SORT_SIZE, SORT_DATE, SORT_CLUSTER };
 
+// Entries kept for sorting: fixed fields plus an offset into one name arena
 typedef struct {
-    uint16_t BytsPerSec;   // offset 11
-    uint8_t  SecPerClus;   // 13
-    uint16_t RsvdSecCnt;   // 14
-    uint8_t  NumFATs;      // 16
-    uint16_t RootEntCnt;   // 17
-    uint16_t TotSec16;     // 19
-    uint8_t  Media;        // 21
-    uint16_t FATSz16;      // 22
-    uint16_t SecPerTrk;    // 24
-    uint16_t NumHeads;     // 26
-    uint32_t HiddSec;      // 28
-    uint32_t TotSec32;     // 32
-} BPB;
+    uint32_t size, first_cluster, extents;
+    uint16_t date, time;
+    uint8_t  attr;
+    char     short_name[13];
+    size_t   name;
+} Kept;
 
 typedef struct {
     int show_all; // include hidden/system
+    int format;   // FMT_*
+    Out out;
+    char prefix[1024];   // "/DIR/" of the listed directory
+    int recursive;       // -R: descend into subdirectories
+    char  *subs;         // NUL-separated subdirectories still to list
+    size_t subs_len, subs_cap;
+
+    // Filters, checked as entries are decoded
+    Pattern *include, *exclude;
+    size_t   n_include, n_exclude;
+    uint8_t  attr_set, attr_clear;      // attribute bits that must be set / clear
+    uint64_t min_size, max_size;
+    uint32_t newer, older;              // DOS date << 16 | time; older 0 = none
+
+    // Sorting, in memory once the listing is complete
+    int      sort;                      // SORT_*
+    int      reverse;
+    Kept    *kept;
+    size_t   n_kept, cap_kept;
+    char    *names;
+    size_t   names_len, names_cap;
+    int      oom;
 } Opts;
 
 static void usage(void) {
-    fprintf(stderr, "Usage: %s -i <image.img> [::] [-a] [--version]\n", PROGRAM_NAME);
+    fprintf(stderr, "Usage: %s -i <image.img> [--overlay <file>] [::[/DIR]] [-a] [--format=json|csv|nul]\n"
+                    "       [--include PAT]... [--exclude PAT]... [--attr [+-]RHSVDA]\n"
+                    "       [--min-size N[K|M|G]] [--max-size N[K|M|G]] [--newer DATE] [--older DATE]\n"
+                    "       [--sort name|size|date|cluster] [-r] [-R] [--stats] [--direct] [--version]\n"
+                    "  -R lists every subdirectory below DIR too\n"
+                    "  PAT is a DOS or glob pattern (*, ?, [a-z]) on the long or the 8.3 name;\n"
+                    "  DATE is YYYY-MM-DD[Thh:mm]; --newer keeps entries from DATE on, --older before it\n",
+                    PROGRAM_NAME);
+}
+
+static void out_flush(Out *o) {
+    for (size_t done = 0; done < o->len && !o->err; ) {
+        ssize_t n = write(STDOUT_FILENO, o->buf + done, o->len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { o->err = 1; break; }
+        done += (size_t)n;
+    }
+    o->len = 0;
+}
+
+static void out_mem(Out *o, const char *p, size_t n) {
+    if (o->len + n > OUT_BUF) out_flush(o);
+    if (n > OUT_BUF) n = OUT_BUF;           // never: names are < MT_NAME_MAX
+    memcpy(o->buf + o->len, p, n);
+    o->len += n;
+}
+
+static void out_str(Out *o, const char *s) { out_mem(o, s, strlen(s)); }
+static void out_ch(Out *o, char c)         { out_mem(o, &c, 1); }
+
+// Decimal, at least width digits
+static void out_uint(Out *o, uint32_t v, int width) {
+    char d[10];
+    int n = 0;
+    do { d[sizeof(d) - 1 - n++] = (char)('0' + v % 10); v /= 10; } while (v);
+    while (n < width) d[sizeof(d) - 1 - n++] = '0';
+    out_mem(o, d + sizeof(d) - n, (size_t)n);
 }
 
 // Decode DOS date/time
@@ -66,26 +142,6 @@ static void decode_dos_datetime(uint16_t dosDate, uint16_t dosTime,
     *s = (dosTime & 0x1F) * 2;
 }
 
-// Make 8.3 name from directory entry (skip LFN)
-static void make_83_name(const uint8_t *ent, char out[13]) {
-    char base[9], ext[4];
-    memcpy(base, ent + 0, 8);
-    memcpy(ext,  ent + 8, 3);
-    // trim trailing spaces
-    int i;
-    for (i = 7; i >= 0 && base[i] == ' '; --i) {}
-    base[i + 1] = '\0';
-    for (i = 2; i >= 0 && ext[i] == ' '; --i) {}
-    ext[i + 1] = '\0';
-    // upper-case for display (classic)
-    for (i = 0; base[i]; ++i) base[i] = (char)toupper((unsigned char)base[i]);
-    for (i = 0; ext[i];  ++i) ext[i]  = (char)toupper((unsigned char)ext[i]);
-    if (ext[0])
-        snprintf(out, 13, "%s.%s", base, ext);
-    else
-        snprintf(out, 13, "%s", base);
-}
-
 // Attribute string "RHSVDA" (V=Volume, D=Directory, A=Archive)
 static void attr_string(uint8_t a, char out[7]) {
     out[0] = (a & 0x01) ? 'R' : '-';
@@ -97,37 +153,518 @@ static void attr_string(uint8_t a, char out[7]) {
     out[6] = '\0';
 }
 
-static int read_bpb(FILE *fp, BPB *bpb, uint8_t *boot) {
-    if (fseek(fp, 0, SEEK_SET) != 0) return -1;
-    if (fread(boot, 1, SECTOR_SIZE, fp) != SECTOR_SIZE) return -1;
+static void print_header(const uint8_t *boot) {
     // minimal validation
     if (!(boot[510] == 0x55 && boot[511] == 0xAA)) {
         fprintf(stderr, "Warning: boot sector signature 0x55AA not found.\n");
     }
-    // fill BPB
-    bpb->BytsPerSec = rd_le16(&boot[11]);
-    bpb->SecPerClus = boot[13];
-    bpb->RsvdSecCnt = rd_le16(&boot[14]);
-    bpb->NumFATs    = boot[16];
-    bpb->RootEntCnt = rd_le16(&boot[17]);
-    bpb->TotSec16   = rd_le16(&boot[19]);
-    bpb->Media      = boot[21];
-    bpb->FATSz16    = rd_le16(&boot[22]);
-    bpb->SecPerTrk  = rd_le16(&boot[24]);
-    bpb->NumHeads   = rd_le16(&boot[26]);
-    bpb->HiddSec    = rd_le32(&boot[28]);
-    bpb->TotSec32   = rd_le32(&boot[32]);
-
-    if (bpb->BytsPerSec == 0 || bpb->BytsPerSec % 512 != 0) {
-        fprintf(stderr, "Unsupported bytes/sector: %u\n", bpb->BytsPerSec);
+
+    printf(" Volume in drive ::  ");
+    // Try to show volume label from boot sector first
+    // (BS_VolLab at offset 43..53 if BS_BootSig==0x29; FAT32 moves the
+    // extended BPB 28 bytes further, detected by BPB_FATSz16==0)
+    const uint8_t *ext = boot + ((boot[22] | boot[23]) ? 0 : 28);
+    if (ext[38] == 0x29) {
+        char label[12]; memcpy(label, &ext[43], 11); label[11] = '\0';
+        for (int i = 10; i >= 0 && label[i] == ' '; --i) label[i] = '\0';
+        if (label[0]) printf("%s\n\n", label);
+        else          printf("NO LABEL\n\n");
+    } else {
+        printf("\n\n");
+    }
+
+    printf("  Size      Date       Time   Attr  Name\n");
+    printf("--------  ----------  ------- ------ ------------\n");
+}
+
+static int print_entry(void *ctx, const mt_entry *e) {
+    (void)ctx;
+
+    // Volume label line (optional to show)
+    if (e->attr & 0x08) {
+        printf("          <VOL LABEL>        ------ %s\n", e->name[0] ? e->name : "(blank)");
+        return 0;
+    }
+
+    int Y, M, D, h, m, s;
+    decode_dos_datetime(e->date, e->time, &Y, &M, &D, &h, &m, &s);
+
+    char a[7]; attr_string(e->attr, a);
+
+    printf("%8u  %04d-%02d-%02d  %02d:%02d  %s  %s\n",
+           e->size, Y, M, D, h, m, a, e->name);
+    return 0;
+}
+
+// "YYYY-MM-DD" and "hh:mm:ss"
+static void out_date(Out *o, uint16_t date) {
+    out_uint(o, 1980 + ((date >> 9) & 0x7F), 4);
+    out_ch(o, '-');
+    out_uint(o, (date >> 5) & 0x0F, 2);
+    out_ch(o, '-');
+    out_uint(o, date & 0x1F, 2);
+}
+
+static void out_time(Out *o, uint16_t time) {
+    out_uint(o, (time >> 11) & 0x1F, 2);
+    out_ch(o, ':');
+    out_uint(o, (time >> 5) & 0x3F, 2);
+    out_ch(o, ':');
+    out_uint(o, (time & 0x1F) * 2, 2);
+}
+
+// A JSON string body: quotes, backslashes and control characters escaped
+static void out_json(Out *o, const char *s) {
+    const char *run = s;
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        out_mem(o, run, (size_t)(s - run));
+        run = s + 1;
+        char esc[6] = { '\\', (char)c, '0', '0', "0123456789abcdef"[c >> 4], "0123456789abcdef"[c & 15] };
+        if (c == '"' || c == '\\') {
+            out_mem(o, esc, 2);
+        } else {
+            esc[1] = 'u';
+            out_mem(o, esc, sizeof(esc));
+        }
+    }
+    out_mem(o, run, (size_t)(s - run));
+}
+
+// A CSV field, quoted (RFC 4180) when it holds a comma, quote or line break
+static void out_csv(Out *o, const char *s) {
+    if (!s[strcspn(s, ",\"\r\n")]) { out_str(o, s); return; }
+    out_ch(o, '"');
+    for (const char *q; (q = strchr(s, '"')) != NULL; s = q + 1) {
+        out_mem(o, s, (size_t)(q - s + 1));
+        out_ch(o, '"');
+    }
+    out_str(o, s);
+    out_ch(o, '"');
+}
+
+// One record per entry, the same fields in every format: path, name,
+// short_name, attr, size, date, time, first_cluster, extents.  JSON is one
+// object per line; CSV has a header row; nul ends every field with a NUL.
+static void put_header(Opts *opt) {
+    if (opt->format == FMT_CSV)
+        out_str(&opt->out, "path,name,short_name,attr,size,date,time,first_cluster,extents\r\n");
+}
+
+static int put_entry(void *ctx, const mt_entry *e) {
+    Opts *opt = ctx;
+    Out *o = &opt->out;
+    if (e->name[0] == '.' && (!e->name[1] || (e->name[1] == '.' && !e->name[2]))) return 0;
+
+    char a[7]; attr_string(e->attr, a);
+    switch (opt->format) {
+    case FMT_JSON:
+        out_str(o, "{\"path\":\"");
+        out_json(o, opt->prefix);
+        out_json(o, e->name);
+        out_str(o, "\",\"name\":\"");
+        out_json(o, e->name);
+        out_str(o, "\",\"short_name\":\"");
+        out_json(o, e->short_name);
+        out_str(o, "\",\"attr\":\"");
+        out_str(o, a);
+        out_str(o, "\",\"size\":");
+        out_uint(o, e->size, 1);
+        out_str(o, ",\"date\":\"");
+        out_date(o, e->date);
+        out_str(o, "\",\"time\":\"");
+        out_time(o, e->time);
+        out_str(o, "\",\"first_cluster\":");
+        out_uint(o, e->first_cluster, 1);
+        out_str(o, ",\"extents\":");
+        out_uint(o, e->extents, 1);
+        out_str(o, "}\n");
+        break;
+    case FMT_CSV: {
+        // the path field is the prefix and the name, quoted as one
+        char path[sizeof(opt->prefix) + MT_NAME_MAX];
+        snprintf(path, sizeof(path), "%s%s", opt->prefix, e->name);
+        out_csv(o, path);
+        out_ch(o, ',');
+        out_csv(o, e->name);
+        out_ch(o, ',');
+        out_csv(o, e->short_name);
+        out_ch(o, ',');
+        out_str(o, a);
+        out_ch(o, ',');
+        out_uint(o, e->size, 1);
+        out_ch(o, ',');
+        out_date(o, e->date);
+        out_ch(o, ',');
+        out_time(o, e->time);
+        out_ch(o, ',');
+        out_uint(o, e->first_cluster, 1);
+        out_ch(o, ',');
+        out_uint(o, e->extents, 1);
+        out_str(o, "\r\n");
+        break;
+    }
+    default:
+        out_str(o, opt->prefix);
+        out_str(o, e->name);
+        out_ch(o, '\0');
+        out_str(o, e->name);
+        out_ch(o, '\0');
+        out_str(o, e->short_name);
+        out_ch(o, '\0');
+        out_str(o, a);
+        out_ch(o, '\0');
+        out_uint(o, e->size, 1);
+        out_ch(o, '\0');
+        out_date(o, e->date);
+        out_ch(o, '\0');
+        out_time(o, e->time);
+        out_ch(o, '\0');
+        out_uint(o, e->first_cluster, 1);
+        out_ch(o, '\0');
+        out_uint(o, e->extents, 1);
+        out_ch(o, '\0');
+        break;
+    }
+    return o->err;                          // stop once stdout is gone
+}
+
+// --- filters ---
+
+static uint8_t fold(uint8_t c) {
+    return (c >= 'a' && c <= 'z') ? (uint8_t)(c - 'a' + 'A') : c;
+}
+
+static int compile_pattern(const char *src, Pattern *out) {
+    size_t len = strlen(src);
+    PTok *t = calloc(len ? len : 1, sizeof(*t));
+    if (!t) return -1;
+    size_t n = 0;
+    // DOS "*.*" means every name, with or without an extension
+    if (strcmp(src, "*.*") == 0) src = "*";
+    for (const uint8_t *p = (const uint8_t *)src; *p; ++p) {
+        PTok *k = &t[n];
+        if (*p == '*') {
+            if (n && t[n - 1].kind == P_STAR) continue;
+            k->kind = P_STAR;
+        } else if (*p == '?') {
+            k->kind = P_ANY;
+        } else if (*p == '[' && strchr((const char *)p + 1 + (p[1] == '!' || p[1] == '^') + 1, ']')) {
+            // [...] with a closing bracket; a leading ] is a member
+            int neg = (p[1] == '!' || p[1] == '^');
+            const uint8_t *q = p + 1 + neg;
+            k->kind = P_SET;
+            do {
+                uint8_t lo = fold(*q), hi = lo;
+                if (q[1] == '-' && q[2] && q[2] != ']') { hi = fold(q[2]); q += 2; }
+                for (unsigned c = lo; c <= hi; ++c) k->set[c >> 3] |= (uint8_t)(1u << (c & 7));
+            } while (*++q != ']');
+            if (neg) for (int i = 0; i < 32; ++i) k->set[i] = (uint8_t)~k->set[i];
+            p = q;
+        } else {
+            k->kind = P_LIT;
+            k->c = fold(*p);
+        }
+        n++;
+    }
+    out->tok = t;
+    out->n = n;
+    return 0;
+}
+
+// Bytes of s the token takes, 0 for no match; ? and sets take a whole
+// UTF-8 sequence
+static size_t tok_step(const PTok *k, const uint8_t *s) {
+    uint8_t c = fold(*s);
+    if (k->kind == P_LIT) return c == k->c;
+    if (k->kind == P_SET && !(k->set[c >> 3] & (1u << (c & 7)))) return 0;
+    size_t n = 1;
+    while ((s[n] & 0xC0) == 0x80) n++;
+    return n;
+}
+
+// Greedy match: on a mismatch, the last * takes one more byte
+static int pattern_match(const Pattern *p, const char *name) {
+    const uint8_t *s = (const uint8_t *)name, *star_s = NULL;
+    size_t ti = 0, star_t = 0, n;
+    while (*s) {
+        if (ti < p->n && p->tok[ti].kind == P_STAR) {
+            star_t = ++ti;
+            star_s = s;
+        } else if (ti < p->n && (n = tok_step(&p->tok[ti], s)) != 0) {
+            ti++;
+            s += n;
+        } else if (star_s) {
+            ti = star_t;
+            s = ++star_s;
+        } else {
+            return 0;
+        }
+    }
+    while (ti < p->n && p->tok[ti].kind == P_STAR) ti++;
+    return ti == p->n;
+}
+
+static int any_match(const Pattern *p, size_t n, const mt_entry *e) {
+    for (size_t i = 0; i < n; ++i)
+        if (pattern_match(&p[i], e->name) || (e->short_name[0] && pattern_match(&p[i], e->short_name)))
+            return 1;
+    return 0;
+}
+
+static int keep(const Opts *opt, const mt_entry *e) {
+    // hidden/system entries need -a, unless --attr asks for them
+    if (!opt->show_all && (e->attr & (0x02 | 0x04) & ~opt->attr_set)) return 0;
+    if ((e->attr & opt->attr_set) != opt->attr_set || (e->attr & opt->attr_clear)) return 0;
+    if (e->size < opt->min_size || e->size > opt->max_size) return 0;
+    uint32_t when = (uint32_t)e->date << 16 | e->time;
+    if (when < opt->newer || (opt->older && when >= opt->older)) return 0;
+    if (opt->n_include && !any_match(opt->include, opt->n_include, e)) return 0;
+    if (opt->n_exclude && any_match(opt->exclude, opt->n_exclude, e)) return 0;
+    return 1;
+}
+
+// "+DA-H", "D", "-D": letters after - must be clear, the others set
+static int parse_attr(const char *s, uint8_t *set, uint8_t *clear) {
+    int neg = 0;
+    for (; *s; ++s) {
+        const char *bits = "RHSVDA", *b;
+        if (*s == '+' || *s == '-') { neg = (*s == '-'); continue; }
+        if (!(b = strchr(bits, fold((uint8_t)*s)))) return -1;
+        *(neg ? clear : set) |= (uint8_t)(1u << (b - bits));
+    }
+    return 0;
+}
+
+static int parse_size(const char *s, uint64_t *out) {
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (end == s) return -1;
+    switch (fold((uint8_t)*end)) {
+    case 'K': v <<= 10; end++; break;
+    case 'M': v <<= 20; end++; break;
+    case 'G': v <<= 30; end++; break;
+    default: break;
+    }
+    if (*end) return -1;
+    *out = v;
+    return 0;
+}
+
+// YYYY-MM-DD[Thh:mm] as DOS date << 16 | time
+static int parse_date(const char *s, uint32_t *out) {
+    int Y, M, D, h = 0, m = 0, n = 0, t = 0;
+    if (sscanf(s, "%4d-%2d-%2d%n", &Y, &M, &D, &n) != 3) return -1;
+    s += n;
+    if ((*s == 'T' || *s == ' ') && sscanf(s + 1, "%2d:%2d%n", &h, &m, &t) == 2) s += 1 + t;
+    if (*s || Y < 1980 || Y > 2107 || M < 1 || M > 12 || D < 1 || D > 31 || h > 23 || m > 59) return -1;
+    *out = (uint32_t)((Y - 1980) << 9 | M << 5 | D) << 16 | (uint32_t)(h << 11 | m << 5);
+    return 0;
+}
+
+// --- sorting ---
+
+static int emit(Opts *opt, const mt_entry *e) {
+    return opt->format ? put_entry(opt, e) : print_entry(opt, e);
+}
+
+static int stash(Opts *opt, const mt_entry *e) {
+    size_t nlen = strlen(e->name) + 1;
+    if (opt->n_kept == opt->cap_kept) {
+        size_t cap = opt->cap_kept ? opt->cap_kept * 2 : 1024;
+        Kept *k = realloc(opt->kept, cap * sizeof(*k));
+        if (!k) { opt->oom = 1; return 1; }
+        opt->kept = k;
+        opt->cap_kept = cap;
+    }
+    if (opt->names_len + nlen > opt->names_cap) {
+        size_t cap = opt->names_cap ? opt->names_cap * 2 : 64u << 10;
+        while (cap < opt->names_len + nlen) cap *= 2;
+        char *nb = realloc(opt->names, cap);
+        if (!nb) { opt->oom = 1; return 1; }
+        opt->names = nb;
+        opt->names_cap = cap;
+    }
+    Kept *k = &opt->kept[opt->n_kept++];
+    k->size = e->size;
+    k->first_cluster = e->first_cluster;
+    k->extents = e->extents;
+    k->date = e->date;
+    k->time = e->time;
+    k->attr = e->attr;
+    memcpy(k->short_name, e->short_name, sizeof(k->short_name));
+    k->name = opt->names_len;
+    memcpy(opt->names + opt->names_len, e->name, nlen);
+    opt->names_len += nlen;
+    return 0;
+}
+
+static const char *sort_names;          // qsort has no context argument
+static int sort_key;
+
+static int name_cmp(const char *a, const char *b) {
+    for (; *a && fold((uint8_t)*a) == fold((uint8_t)*b); ++a, ++b) {}
+    return (int)fold((uint8_t)*a) - (int)fold((uint8_t)*b);
+}
+
+static int kept_cmp(const void *pa, const void *pb) {
+    const Kept *a = pa, *b = pb;
+    uint32_t x = 0, y = 0;
+    switch (sort_key) {
+    case SORT_SIZE:    x = a->size; y = b->size; break;
+    case SORT_DATE:    x = (uint32_t)a->date << 16 | a->time; y = (uint32_t)b->date << 16 | b->time; break;
+    case SORT_CLUSTER: x = a->first_cluster; y = b->first_cluster; break;
+    default: break;
+    }
+    if (x != y) return x < y ? -1 : 1;
+    return name_cmp(sort_names + a->name, sort_names + b->name);
+}
+
+static void emit_sorted(Opts *opt) {
+    sort_names = opt->names;
+    sort_key = opt->sort;
+    if (opt->n_kept) qsort(opt->kept, opt->n_kept, sizeof(*opt->kept), kept_cmp);
+    mt_entry e;
+    memset(&e, 0, sizeof(e));
+    for (size_t i = 0; i < opt->n_kept; ++i) {
+        const Kept *k = &opt->kept[opt->reverse ? opt->n_kept - 1 - i : i];
+        e.size = k->size;
+        e.first_cluster = k->first_cluster;
+        e.extents = k->extents;
+        e.date = k->date;
+        e.time = k->time;
+        e.attr = k->attr;
+        memcpy(e.short_name, k->short_name, sizeof(e.short_name));
+        snprintf(e.name, sizeof(e.name), "%s", opt->names + k->name);
+        if (emit(opt, &e)) break;
+    }
+}
+
+// Remember a subdirectory for -R, whether or not the filters keep it
+static int note_sub(Opts *opt, const mt_entry *e) {
+    size_t nlen = strlen(e->name) + 1;
+    if (opt->subs_len + nlen > opt->subs_cap) {
+        size_t cap = opt->subs_cap ? opt->subs_cap * 2 : 4096;
+        while (cap < opt->subs_len + nlen) cap *= 2;
+        char *grown = realloc(opt->subs, cap);
+        if (!grown) { opt->oom = 1; return 1; }
+        opt->subs = grown;
+        opt->subs_cap = cap;
+    }
+    memcpy(opt->subs + opt->subs_len, e->name, nlen);
+    opt->subs_len += nlen;
+    return 0;
+}
+
+// The listing callback: filter, then print or keep for sorting
+static int list_entry(void *ctx, const mt_entry *e) {
+    Opts *opt = ctx;
+    if (opt->recursive && (e->attr & MT_ATTR_DIR) && !(e->attr & MT_ATTR_VOLUME) &&
+        strcmp(e->name, ".") != 0 && strcmp(e->name, "..") != 0 &&
+        (opt->show_all || !(e->attr & (MT_ATTR_HIDDEN | MT_ATTR_SYSTEM))) && note_sub(opt, e))
+        return 1;
+    if (!keep(opt, e)) return 0;
+    return opt->sort ? stash(opt, e) : emit(opt, e);
+}
+
+// List through mtoolsd.
+// Returns the exit code, or -1 if no daemon served the request.
+static int daemon_list(const char *image, const char *dir, Opts *opt) {
+    int sfd = mtc_connect();
+    if (sfd < 0) return -1;
+
+    uint8_t *boot = NULL, *list = NULL;
+    uint32_t blen = 0, llen = 0;
+    const char *what = image;
+    int st = mtc_call(sfd, MTP_INFO, 0, image, NULL, NULL, 0, &boot, &blen);
+    if (st == 0 && blen == 512) {
+        what = dir;
+        st = mtc_call(sfd, MTP_LIST, opt->format ? MTP_F_EXTENTS : 0, image, dir, NULL, 0, &list, &llen);
+    }
+    close(sfd);
+    if (st < 0 || st == ENOTSUP) {          // transport trouble / let the local path explain
+        free(boot);
+        free(list);
         return -1;
     }
+    if (st != 0) {
+        fprintf(stderr, "%s: %s\n", what, strerror(st));
+        free(boot);
+        free(list);
+        return 1;
+    }
+
+    if (opt->format) put_header(opt); else print_header(boot);
+    mt_entry e;
+    for (size_t off = 0, n; off < llen; off += n) {
+        if ((n = mtp_get_entry(list + off, llen - off, &e)) == 0) break;
+        if (list_entry(opt, &e)) break;
+    }
+    if (opt->sort) emit_sorted(opt);
+    free(boot);
+    free(list);
     return 0;
 }
 
+// "::/DIR/" in front of every name, whatever slashes DIR came with
+static void set_prefix(Opts *opt, const char *dir) {
+    const char *d = dir + 2;
+    size_t n = 0;
+    opt->prefix[n++] = '/';
+    for (; *d && n + 2 < sizeof(opt->prefix); ++d) {
+        char c = (*d == '\\') ? '/' : *d;
+        if (c != '/' || opt->prefix[n - 1] != '/') opt->prefix[n++] = c;
+    }
+    if (opt->prefix[n - 1] != '/') opt->prefix[n++] = '/';
+    opt->prefix[n] = '\0';
+}
+
+// List one directory, then (with -R) each subdirectory below it, depth
+// first.  Sorting applies within every directory.  The subdirectory names
+// are kept by offset because deeper levels may move opt->subs.
+static int list_dir(mt_image *img, const char *dir, Opts *opt) {
+    size_t first = opt->subs_len;
+    int rc;
+    if (opt->format) {
+        set_prefix(opt, dir);
+        rc = mt_readdir_ex(img, dir, MT_LIST_EXTENTS, list_entry, opt);
+    } else {
+        rc = mt_readdir(img, dir, list_entry, opt);
+    }
+    if (rc == 0 && opt->oom) rc = -ENOMEM;
+    if (rc == 0 && opt->sort) emit_sorted(opt);
+    opt->n_kept = opt->names_len = 0;
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", dir, mt_strerror(rc));
+        return rc;
+    }
+
+    size_t dlen = strlen(dir);
+    int slash = dir[dlen - 1] == '/' || dir[dlen - 1] == '\\';
+    size_t end = opt->subs_len;
+    for (size_t off = first; off < end && !opt->out.err; off += strlen(opt->subs + off) + 1) {
+        char sub[sizeof(opt->prefix) + MT_NAME_MAX];
+        if ((size_t)snprintf(sub, sizeof(sub), "%s%s%s", dir, slash ? "" : "/", opt->subs + off) >= sizeof(sub)) {
+            fprintf(stderr, "%s/%s: %s\n", dir, opt->subs + off, mt_strerror(-ENAMETOOLONG));
+            rc = -ENAMETOOLONG;
+            break;
+        }
+        if (!opt->format) printf("\nDirectory of %s\n\n", sub);
+        if ((rc = list_dir(img, sub, opt)) != 0) break;
+    }
+    opt->subs_len = first;
+    return rc;
+}
+
 int main(int argc, char **argv) {
     const char *image = NULL;
+    const char *dir = "::";
     Opts opt = {0};
+    opt.max_size = UINT64_MAX;
+    const char *ovl = NULL;
+    int want_stats = 0;
+    int dio = 0;
 
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "--version") == 0 || strcmp(argv[i], "-V") == 0) {
@@ -135,10 +672,55 @@ int main(int argc, char **argv) {
             return 0;
         } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
             image = argv[++i];
+        } else if (strcmp(argv[i], "--overlay") == 0 && i + 1 < argc) {
+            ovl = argv[++i];
         } else if (strcmp(argv[i], "-a") == 0) {
             opt.show_all = 1;
-        } else if (strcmp(argv[i], "::") == 0) {
-            continue; // accept mtools-style
+        } else if (strncmp(argv[i], "--format", 8) == 0 && (argv[i][8] == '=' || (!argv[i][8] && i + 1 < argc))) {
+            const char *f = argv[i][8] ? argv[i] + 9 : argv[++i];
+            if      (strcmp(f, "json") == 0)  opt.format = FMT_JSON;
+            else if (strcmp(f, "csv") == 0)   opt.format = FMT_CSV;
+            else if (strcmp(f, "nul") == 0)   opt.format = FMT_NUL;
+            else if (strcmp(f, "table") == 0) opt.format = FMT_TABLE;
+            else { usage(); return 1; }
+        } else if ((strcmp(argv[i], "--include") == 0 || strcmp(argv[i], "--exclude") == 0) && i + 1 < argc) {
+            int inc = argv[i][2] == 'i';
+            Pattern **list = inc ? &opt.include : &opt.exclude;
+            size_t *n = inc ? &opt.n_include : &opt.n_exclude;
+            Pattern *grown = realloc(*list, (*n + 1) * sizeof(**list));
+            if (!grown || compile_pattern(argv[++i], &grown[*n]) != 0) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+            *list = grown;
+            ++*n;
+        } else if (strcmp(argv[i], "--attr") == 0 && i + 1 < argc) {
+            if (parse_attr(argv[++i], &opt.attr_set, &opt.attr_clear) != 0) { usage(); return 1; }
+        } else if (strcmp(argv[i], "--min-size") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &opt.min_size) != 0) { usage(); return 1; }
+        } else if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &opt.max_size) != 0) { usage(); return 1; }
+        } else if (strcmp(argv[i], "--newer") == 0 && i + 1 < argc) {
+            if (parse_date(argv[++i], &opt.newer) != 0) { usage(); return 1; }
+        } else if (strcmp(argv[i], "--older") == 0 && i + 1 < argc) {
+            if (parse_date(argv[++i], &opt.older) != 0) { usage(); return 1; }
+        } else if (strcmp(argv[i], "--sort") == 0 && i + 1 < argc) {
+            const char *k = argv[++i];
+            if      (strcmp(k, "name") == 0)    opt.sort = SORT_NAME;
+            else if (strcmp(k, "size") == 0)    opt.sort = SORT_SIZE;
+            else if (strcmp(k, "date") == 0)    opt.sort = SORT_DATE;
+            else if (strcmp(k, "cluster") == 0) opt.sort = SORT_CLUSTER;
+            else { usage(); return 1; }
+        } else if (strcmp(argv[i], "-r") == 0) {
+            opt.reverse = 1;
+        } else if (strcmp(argv[i], "-R") == 0) {
+            opt.recursive = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            want_stats = 1;
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            dio = MT_DIRECT;
+        } else if (strncmp(argv[i], "::", 2) == 0) {
+            dir = argv[i]; // accept mtools-style ::[/DIR]
         } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
             usage();
             return 0;
@@ -152,107 +734,46 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    FILE *fp = fopen(image, "rb");
-    if (!fp) {
-        perror("open image");
-        return 1;
-    }
-
-    uint8_t boot[SECTOR_SIZE];
-    BPB bpb;
-    if (read_bpb(fp, &bpb, boot) != 0) {
-        fclose(fp);
-        return 1;
-    }
-
-    if (bpb.RootEntCnt == 0) {
-        fprintf(stderr, "This looks like FAT32 (RootEntCnt==0). v1 lists only FAT12/16 root.\n");
-        fclose(fp);
-        return 1;
-    }
-
-    // Compute root directory position and size
-    uint32_t rootDirSectors = ((uint32_t)bpb.RootEntCnt * 32 + (bpb.BytsPerSec - 1)) / bpb.BytsPerSec;
-    if (bpb.FATSz16 == 0) {
-        fprintf(stderr, "Unexpected FATSz16=0 for FAT12/16.\n");
-        fclose(fp);
-        return 1;
-    }
-    uint32_t firstRootSector = (uint32_t)bpb.RsvdSecCnt + ((uint32_t)bpb.NumFATs * bpb.FATSz16);
-    uint64_t rootOffset = (uint64_t)firstRootSector * bpb.BytsPerSec;
-    uint64_t rootSize   = (uint64_t)rootDirSectors * bpb.BytsPerSec;
-
-    // Read root directory
-    uint8_t *root = (uint8_t*)malloc((size_t)rootSize);
-    if (!root) {
-        fprintf(stderr, "Out of memory reading root dir\n");
-        fclose(fp);
-        return 1;
-    }
-    if (fseek(fp, (long)rootOffset, SEEK_SET) != 0 ||
-        fread(root, 1, (size_t)rootSize, fp) != rootSize) {
-            fprintf(stderr, "Failed to read root directory\n");
-            free(root);
-            fclose(fp);
+    if (opt.format) {
+        set_prefix(&opt, dir);
+        if (!(opt.out.buf = malloc(OUT_BUF))) {
+            fprintf(stderr, "Out of memory\n");
             return 1;
+        }
     }
 
-    printf(" Volume in drive ::  ");
-    // Try to show volume label from boot sector first
-    // (BS_VolLab at offset 43..53 if BS_BootSig==0x29)
-    if (boot[38] == 0x29) {
-        char label[12]; memcpy(label, &boot[43], 11); label[11] = '\0';
-        for (int i = 10; i >= 0 && label[i] == ' '; --i) label[i] = '\0';
-        if (label[0]) printf("%s\n\n", label);
-        else          printf("NO LABEL\n\n");
-    } else {
-        printf("\n\n");
+    int stats_fmt = mt_env_stats(want_stats);   // mtoolsd keeps no stats or traces
+    dio |= mt_env_flags() & MT_DIRECT;          // and uses the page cache,
+    // mtoolsd lists one directory per request; -R walks the image here
+    int rc = (stats_fmt || mt_env_trace() || dio || ovl || opt.recursive) ? -1 : daemon_list(image, dir, &opt);
+    if (rc >= 0) {
+        if (opt.format) out_flush(&opt.out);
+        free(opt.out.buf);
+        free(opt.kept);
+        free(opt.names);
+        if (opt.oom) fprintf(stderr, "Out of memory\n");
+        return rc || opt.out.err || opt.oom;
     }
 
-    printf("  Size      Date       Time   Attr  Name\n");
-    printf("--------  ----------  ------- ------ ------------\n");
-
-    // Iterate 32-byte directory entries
-    size_t entries = (size_t)bpb.RootEntCnt;
-    for (size_t i = 0; i < entries; ++i) {
-        const uint8_t *ent = root + i * 32;
-        uint8_t first = ent[0];
-
-        if (first == 0x00) break;        // end of directory
-        if (first == 0xE5) continue;     // deleted
-        uint8_t attr = ent[11];
-        if (attr == 0x0F) continue;      // LFN entry (skip v1)
-
-        // Filter hidden/system unless -a
-        if (!opt.show_all && (attr & (0x02 | 0x04))) {
-            continue;
-        }
-
-        // Volume label line (optional to show)
-        if (attr & 0x08) {
-            char lbl[12]; memcpy(lbl, ent, 11); lbl[11] = '\0';
-            for (int j = 10; j >= 0 && lbl[j] == ' '; --j) lbl[j] = '\0';
-            printf("          <VOL LABEL>        ------ %s\n", lbl[0] ? lbl : "(blank)");
-            continue;
-        }
-
-        char name[13];
-        make_83_name(ent, name);
-
-        uint32_t size = rd_le32(&ent[28]);
-        uint16_t time = rd_le16(&ent[22]);
-        uint16_t date = rd_le16(&ent[24]);
-
-        int Y, M, D, h, m, s;
-        decode_dos_datetime(date, time, &Y, &M, &D, &h, &m, &s);
-
-        char a[7]; attr_string(attr, a);
-
-        printf("%8u  %04d-%02d-%02d  %02d:%02d  %s  %s\n",
-               size, Y, M, D, h, m, a, name);
+    mt_image *img;
+    rc = mt_open_overlay(&img, image, ovl, MT_RDONLY | dio | mt_env_flags() | (stats_fmt ? MT_STATS : 0), NULL);
+    if (rc != 0) {
+        fprintf(stderr, "open image: %s\n", mt_strerror(rc));
+        return 1;
     }
-
-    free(root);
-    fclose(fp);
-    return 0;
+    mt_stats stats = {0};
+    if (stats_fmt) mt_stats_attach(img, &stats);
+    mt_trace_attach(img, mt_env_trace(), PROGRAM_NAME);
+
+    if (opt.format) put_header(&opt);
+    else print_header(mt_boot_sector(img));
+    rc = list_dir(img, dir, &opt);
+    mt_close(img);
+    if (opt.format) out_flush(&opt.out);
+    free(opt.out.buf);
+    free(opt.kept);
+    free(opt.names);
+    free(opt.subs);
+    if (stats_fmt) mt_stats_print(stderr, PROGRAM_NAME, &stats, stats_fmt);
+    return rc != 0 || opt.out.err;
 }
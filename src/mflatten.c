@@ -0,0 +1,52 @@
+// src/mflatten.c
+// mflatten: merge a copy-on-write overlay (see --overlay in mcp, mdel, mmd)
+// with its base image, into a new image or into the base itself.
+// Build: see Makefile (links libmtools)
+// Usage: mflatten -i IMAGE --overlay FILE (-o OUT | --in-place)
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mtools.h"
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s -i IMAGE --overlay FILE (-o OUT | --in-place)\n"
+        "  -i IMAGE        the base image the overlay was written against\n"
+        "  --overlay FILE  the overlay holding the changes\n"
+        "  -o OUT          write the merged image to OUT (holes stay holes)\n"
+        "  --in-place      apply the changes to IMAGE itself\n",
+        prog);
+}
+
+int main(int argc, char **argv) {
+    const char *img = NULL, *ovl = NULL, *out = NULL;
+    int in_place = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            img = argv[++i];
+        } else if (strcmp(argv[i], "--overlay") == 0 && i + 1 < argc) {
+            ovl = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out = argv[++i];
+        } else if (strcmp(argv[i], "--in-place") == 0) {
+            in_place = 1;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!img || !ovl || !out == !in_place) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    int rc = mt_flatten(img, ovl, out);
+    if (rc != 0) {
+        fprintf(stderr, "Cannot flatten %s onto %s: %s\n", ovl, img, mt_strerror(rc));
+        return 1;
+    }
+    printf("Flattened %s onto %s into %s\n", ovl, img, out ? out : img);
+    return 0;
+}
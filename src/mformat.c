@@ -1,63 +1,182 @@
+#define _FILE_OFFSET_BITS 64
+#define _XOPEN_SOURCE 700
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <time.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
-#define VERSION "0.0.3"
+#include "mtools.h"
+
+#define VERSION "0.0.4"
 #define SECTOR_SIZE 512
 #define DEFAULT_IMAGE_SIZE (1474560)  // 1.44MB
+#define FLOPPY_LIMIT       (2949120)  // up to 2.88MB: FAT12 floppy layout
+#define FAT16_LIMIT        (512ull << 20)
+#define MAX_SECTORS        0xFFFFFFFFull   // 2 TiB with 512-byte sectors
 
 typedef struct {
+    int      fatBits;          // 12, 16 or 32
     uint16_t bytesPerSector;
-    uint8_t sectorsPerCluster;
+    uint8_t  sectorsPerCluster;
     uint16_t reservedSectors;
-    uint8_t numFATs;
-    uint16_t rootEntryCount;
-    uint16_t rootDirSectors;
-    uint16_t totalSectors;
-    uint16_t sectorsPerFAT;
-    uint16_t fatStart;
-    uint16_t rootStart;
-    uint16_t dataStart;
+    uint8_t  numFATs;
+    uint16_t rootEntryCount;   // 0 on FAT32
+    uint32_t rootDirSectors;
+    uint32_t totalSectors;
+    uint32_t sectorsPerFAT;
+    uint32_t clusters;
+    uint8_t  media;
+    uint32_t fatStart;
+    uint32_t rootStart;        // FAT12/16 fixed root
+    uint32_t dataStart;
 } FatLayout;
 
-// Computes layout fields based on image size
-FatLayout compute_layout_from_size(size_t image_size) {
+// Size the FAT for a given cluster size; returns the cluster count.
+static uint32_t size_fat(FatLayout *l) {
+    uint32_t fat = 1;
+    for (;;) {
+        uint64_t meta = (uint64_t)l->reservedSectors + (uint64_t)l->numFATs * fat + l->rootDirSectors;
+        if (meta >= l->totalSectors) return 0;
+        uint64_t clusters = (l->totalSectors - meta) / l->sectorsPerCluster;
+        uint64_t bytes = ((clusters + 2) * (uint64_t)l->fatBits + 7) / 8;
+        uint32_t need = (uint32_t)((bytes + SECTOR_SIZE - 1) / SECTOR_SIZE);
+        if (need <= fat) {
+            l->sectorsPerFAT = fat;
+            return (uint32_t)clusters;
+        }
+        fat = need;
+    }
+}
+
+// Computes layout fields based on image size (and an optional FAT type)
+static bool compute_layout_from_size(uint64_t image_size, int fat_bits, FatLayout *out) {
     FatLayout layout = {0};
+    uint64_t sectors = image_size / SECTOR_SIZE;
+    if (sectors > MAX_SECTORS) sectors = MAX_SECTORS;
 
+    if (!fat_bits) {
+        if (image_size <= FLOPPY_LIMIT)     fat_bits = 12;
+        else if (image_size <= FAT16_LIMIT) fat_bits = 16;
+        else                                fat_bits = 32;
+    }
+    layout.fatBits = fat_bits;
     layout.bytesPerSector = SECTOR_SIZE;
-    layout.sectorsPerCluster = 1;
-    layout.reservedSectors = 1;
+    layout.totalSectors = (uint32_t)sectors;
     layout.numFATs = 2;
-    layout.rootEntryCount = 224;
-
+    layout.reservedSectors = (fat_bits == 32) ? 32 : 1;
+    layout.rootEntryCount = (fat_bits == 32) ? 0 : (image_size <= FLOPPY_LIMIT) ? 224 : 512;
+    layout.media = (image_size <= FLOPPY_LIMIT) ? 0xF0 : 0xF8;
     layout.rootDirSectors = ((layout.rootEntryCount * 32) + (SECTOR_SIZE - 1)) / SECTOR_SIZE;
-    layout.totalSectors = (uint16_t)(image_size / SECTOR_SIZE);
-    layout.sectorsPerFAT = 9;  // standard for FAT12, 1.44MB
+
+    // Smallest power-of-two cluster that keeps the count in range for the
+    // type; FAT32 starts from Microsoft's table (4 KiB clusters up to 8 GB,
+    // 32 KiB above 32 GB) so the FAT stays a manageable size.
+    uint32_t lo = (fat_bits == 12) ? 0 : (fat_bits == 16) ? 4085 : 65525;
+    uint32_t hi = (fat_bits == 12) ? 4085 : (fat_bits == 16) ? 65525 : 0x0FFFFFF5;
+    uint32_t spc = 1;
+    if (fat_bits == 32) {
+        if (image_size > (32ull << 30))       spc = 64;
+        else if (image_size > (16ull << 30))  spc = 32;
+        else if (image_size > (8ull << 30))   spc = 16;
+        else if (image_size > (260ull << 20)) spc = 8;
+    }
+    for (; spc <= 128; spc *= 2) {
+        layout.sectorsPerCluster = (uint8_t)spc;
+        layout.clusters = size_fat(&layout);
+        if (layout.clusters < hi) break;
+    }
+    if (spc > 128 || layout.clusters < lo || layout.clusters == 0) return false;
 
     layout.fatStart = layout.reservedSectors;
     layout.rootStart = layout.fatStart + layout.numFATs * layout.sectorsPerFAT;
     layout.dataStart = layout.rootStart + layout.rootDirSectors;
+    *out = layout;
+    return true;
+}
+
+static uint64_t base_offset;   // partition start when formatting IMAGE@@partN
+
+static void wr16(uint8_t *p, uint32_t v) { p[0] = v & 0xFF; p[1] = (v >> 8) & 0xFF; }
+static void wr32(uint8_t *p, uint32_t v) { wr16(p, v & 0xFFFF); wr16(p + 2, v >> 16); }
+
+// --stats / MTOOLS_STATS and MTOOLS_TRACE: mformat writes the image
+// itself, so it keeps the counters and the trace of mtools.h on its own
+static mt_stats stats;
+static int stats_phase;
+static uint64_t stats_t0;
+static FILE *trace;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void phase(int next) {
+    uint64_t t = now_ns();
+    stats.phase_ns[stats_phase] += t - stats_t0;
+    stats_t0 = t;
+    stats_phase = next;
+}
 
-    return layout;
+static bool write_at(int fd, uint64_t off, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    stats.sectors_written += (len + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    off += base_offset;
+    if (trace)
+        fprintf(trace, "mformat %ld W %llu %zu %s\n", (long)getpid(), (unsigned long long)off, len,
+                mt_phase_name(stats_phase));
+    while (len) {
+        stats.syscalls++;
+        ssize_t n = pwrite(fd, p, len, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n; len -= (size_t)n; off += (uint64_t)n;
+    }
+    return true;
+}
+
+// Zero `count` sectors starting at `lba`.
+static bool zero_sectors(int fd, uint64_t lba, uint64_t count) {
+    static uint8_t zeros[64 * SECTOR_SIZE];
+    while (count) {
+        size_t n = count > 64 ? 64 : (size_t)count;
+        if (!write_at(fd, lba * SECTOR_SIZE, zeros, n * SECTOR_SIZE)) return false;
+        lba += n;
+        count -= n;
+    }
+    return true;
 }
 
 void usage(const char *progname) {
-    fprintf(stderr, "Usage: %s -i <image>\n", progname);
+    fprintf(stderr, "Usage: %s -i <image>[@@partN|@@OFFSET] [-F 12|16|32] [--stats]\n", progname);
     exit(1);
 }
 
 int main(int argc, char *argv[]) {
     const char *image = NULL;
-    size_t image_size = 0;
+    uint64_t image_size = 0;
+    int fat_bits = 0;
+    int want_stats = 0;
+    stats_t0 = now_ns();
 
     // Parse args
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-i")) {
             if (++i >= argc) usage(argv[0]);
             image = argv[i];
+        } else if (!strcmp(argv[i], "-F")) {
+            if (++i >= argc) usage(argv[0]);
+            fat_bits = atoi(argv[i]);
+            if (fat_bits != 12 && fat_bits != 16 && fat_bits != 32) usage(argv[0]);
+        } else if (!strcmp(argv[i], "--stats")) {
+            want_stats = 1;
         } else if (!strcmp(argv[i], "--version")) {
             printf("mformat version %s\n", VERSION);
             return 0;
@@ -67,25 +186,43 @@ int main(int argc, char *argv[]) {
     }
 
     if (!image) usage(argv[0]);
+    int stats_fmt = mt_env_stats(want_stats);
+    if (mt_env_trace() && !(trace = fopen(mt_env_trace(), "a"))) {
+        perror(mt_env_trace());
+        return 1;
+    }
 
-    // Open or create image
-    FILE *fp = fopen(image, "r+b");
+    // Open or create image; a partition is formatted in place
+    char file[PATH_MAX];
+    uint64_t part_len = 0;
+    int rc = mt_locate(image, file, sizeof(file), &base_offset, &part_len);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", image, mt_strerror(rc));
+        return 1;
+    }
+    stats.syscalls++;
+    FILE *fp = fopen(file, "r+b");
     if (fp) {
         struct stat st;
-        if (stat(image, &st) != 0) {
+        if (stat(file, &st) != 0) {
             perror("stat");
             fclose(fp);
             return 1;
         }
-        image_size = st.st_size;
+        image_size = part_len ? part_len
+                   : ((uint64_t)st.st_size > base_offset ? (uint64_t)st.st_size - base_offset : 0);
+    } else if (base_offset) {
+        perror(file);
+        return 1;
     } else {
-        fp = fopen(image, "w+b");
+        fp = fopen(file, "w+b");
         if (!fp) {
             perror("fopen");
             return 1;
         }
         image_size = DEFAULT_IMAGE_SIZE;
-        if (fseek(fp, image_size - 1, SEEK_SET) != 0 || fputc(0, fp) == EOF) {
+        stats.syscalls += 2;
+        if (fseeko(fp, (off_t)image_size - 1, SEEK_SET) != 0 || fputc(0, fp) == EOF || fflush(fp) != 0) {
             perror("fseek/fputc");
             fclose(fp);
             return 1;
@@ -93,54 +230,111 @@ int main(int argc, char *argv[]) {
     }
 
     // Compute layout
-    FatLayout layout = compute_layout_from_size(image_size);
+    FatLayout layout;
+    if (!compute_layout_from_size(image_size, fat_bits, &layout)) {
+        fprintf(stderr, "Image size %llu bytes does not fit a FAT%d file system\n",
+                (unsigned long long)image_size, fat_bits ? fat_bits : 12);
+        fclose(fp);
+        return 1;
+    }
+    bool fat32 = (layout.fatBits == 32);
+    // SOURCE_DATE_EPOCH pins the volume serial for reproducible images
+    const char *epoch = getenv("SOURCE_DATE_EPOCH");
+    uint32_t serial = (uint32_t)(epoch && *epoch ? strtoull(epoch, NULL, 10) : (unsigned long long)time(NULL));
 
     // Boot sector
     uint8_t boot[SECTOR_SIZE] = {0};
     boot[0x00] = 0xEB;
-    boot[0x01] = 0x3C;
+    boot[0x01] = fat32 ? 0x58 : 0x3C;
     boot[0x02] = 0x90;
     memcpy(&boot[0x03], "MSDOS5.0", 8);
-    boot[0x0B] = layout.bytesPerSector & 0xFF;
-    boot[0x0C] = layout.bytesPerSector >> 8;
+    wr16(&boot[0x0B], layout.bytesPerSector);
     boot[0x0D] = layout.sectorsPerCluster;
-    boot[0x0E] = layout.reservedSectors & 0xFF;
-    boot[0x0F] = layout.reservedSectors >> 8;
+    wr16(&boot[0x0E], layout.reservedSectors);
     boot[0x10] = layout.numFATs;
-    boot[0x11] = layout.rootEntryCount & 0xFF;
-    boot[0x12] = layout.rootEntryCount >> 8;
-	boot[0x13] = layout.totalSectors & 0xFF;
-	boot[0x14] = (layout.totalSectors >> 8) & 0xFF;
-    boot[0x15] = 0xF0;  // media descriptor
-    boot[0x16] = layout.sectorsPerFAT & 0xFF;
-    boot[0x17] = layout.sectorsPerFAT >> 8;
+    wr16(&boot[0x11], layout.rootEntryCount);
+    if (layout.totalSectors < 0x10000 && !fat32) {
+        wr16(&boot[0x13], layout.totalSectors);
+    } else {
+        wr32(&boot[0x20], layout.totalSectors);
+    }
+    boot[0x15] = layout.media;
+    if (!fat32) wr16(&boot[0x16], layout.sectorsPerFAT);
     boot[0x18] = 0x12;  // sectors per track (dummy)
     boot[0x19] = 0x02;  // number of heads (dummy)
+    wr32(&boot[0x1C], (uint32_t)(base_offset / SECTOR_SIZE));   // hidden sectors
+
+    // Extended BPB: FAT32 moves it behind its extra fields
+    uint8_t *ext = boot + (fat32 ? 0x40 : 0x24);
+    if (fat32) {
+        wr32(&boot[0x24], layout.sectorsPerFAT);
+        wr32(&boot[0x2C], 2);   // root directory cluster
+        wr16(&boot[0x30], 1);   // FSInfo sector
+        wr16(&boot[0x32], 6);   // backup boot sector
+    }
+    ext[0] = (layout.media == 0xF0) ? 0x00 : 0x80;   // drive number
+    ext[2] = 0x29;                                    // extended boot signature
+    wr32(&ext[3], serial);
+    memcpy(&ext[7], "NO NAME    ", 11);
+    memcpy(&ext[18], fat32 ? "FAT32   " : (layout.fatBits == 16) ? "FAT16   " : "FAT12   ", 8);
     boot[0x1FE] = 0x55;
     boot[0x1FF] = 0xAA;
 
-    fseek(fp, 0, SEEK_SET);
-    fwrite(boot, 1, SECTOR_SIZE, fp);
+    phase(MT_PHASE_BPB);
+    int fd = fileno(fp);
+    bool ok = write_at(fd, 0, boot, SECTOR_SIZE);
+    phase(MT_PHASE_WRITE);
 
-    // FATs
+    // FATs: clear, then reserve entries 0 and 1 (and the FAT32 root cluster)
     uint8_t fat[SECTOR_SIZE] = {0};
-    fat[0] = 0xF0;
-    fat[1] = 0xFF;
-    fat[2] = 0xFF;
+    if (layout.fatBits == 12) {
+        fat[0] = layout.media;
+        fat[1] = 0xFF;
+        fat[2] = 0xFF;
+    } else if (layout.fatBits == 16) {
+        wr16(&fat[0], 0xFF00 | layout.media);
+        wr16(&fat[2], 0xFFFF);
+    } else {
+        wr32(&fat[0], 0x0FFFFF00 | layout.media);
+        wr32(&fat[4], 0x0FFFFFFF);
+        wr32(&fat[8], 0x0FFFFFFF);   // cluster 2: root directory, end of chain
+    }
 
-    for (int i = 0; i < layout.numFATs; i++) {
-        fseek(fp, layout.fatStart * SECTOR_SIZE + i * layout.sectorsPerFAT * SECTOR_SIZE, SEEK_SET);
-        fwrite(fat, 1, SECTOR_SIZE, fp);
+    for (int i = 0; ok && i < layout.numFATs; i++) {
+        uint64_t start = layout.fatStart + (uint64_t)i * layout.sectorsPerFAT;
+        ok = zero_sectors(fd, start, layout.sectorsPerFAT) &&
+             write_at(fd, start * SECTOR_SIZE, fat, SECTOR_SIZE);
     }
 
     // Root directory
-    fseek(fp, layout.rootStart * SECTOR_SIZE, SEEK_SET);
-    uint8_t empty[SECTOR_SIZE] = {0};
-    for (int i = 0; i < layout.rootDirSectors; i++) {
-        fwrite(empty, 1, SECTOR_SIZE, fp);
+    if (ok && fat32) {
+        ok = zero_sectors(fd, layout.dataStart, layout.sectorsPerCluster);
+
+        uint8_t fsinfo[SECTOR_SIZE] = {0};
+        wr32(&fsinfo[0], 0x41615252);
+        wr32(&fsinfo[484], 0x61417272);
+        wr32(&fsinfo[488], layout.clusters - 1);   // all but the root cluster
+        wr32(&fsinfo[492], 3);
+        wr32(&fsinfo[508], 0xAA550000);
+        ok = ok && write_at(fd, 1ull * SECTOR_SIZE, fsinfo, SECTOR_SIZE) &&
+             write_at(fd, 6ull * SECTOR_SIZE, boot, SECTOR_SIZE) &&
+             write_at(fd, 7ull * SECTOR_SIZE, fsinfo, SECTOR_SIZE);
+    } else if (ok) {
+        ok = zero_sectors(fd, layout.rootStart, layout.rootDirSectors);
     }
 
-    fclose(fp);
-    printf("Formatted FAT12 image: %s\n", image);
+    phase(MT_PHASE_FLUSH);
+    stats.syscalls++;
+    if (fclose(fp) != 0 || !ok) {
+        perror("write");
+        return 1;
+    }
+    phase(MT_PHASE_OTHER);
+    if (trace && fclose(trace) != 0) {
+        perror(mt_env_trace());
+        return 1;
+    }
+    if (stats_fmt) mt_stats_print(stderr, "mformat", &stats, stats_fmt);
+    printf("Formatted FAT%d image: %s\n", layout.fatBits, image);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,11 +1,19 @@
-// minfo.c - Minimal info tool for FAT12/16/32 "super-floppy" images
+// minfo.c - Minimal info tool for FAT12/16/32 images ("super-floppy", or a
+// partition selected with IMAGE@@partN / IMAGE@@OFFSET)
 // Compile: gcc -Wall -O2 -o minfo.exe minfo.c   (Windows/MinGW) or minfo (POSIX)
 
+#define _FILE_OFFSET_BITS 64
+#define _XOPEN_SOURCE 700
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "mtools.h"
+#include "mtproto.h"
 
 #define SECTOR_SIZE_MIN 512
 
@@ -45,12 +53,26 @@ typedef struct {
     int isFat32Layout;     // internal: 1 if RootEntCnt==0
 } BPB;
 
-static int read_boot_sector(FILE *fp, uint8_t *buf, size_t sz) {
-    if (fseek(fp, 0, SEEK_SET) != 0) return -1;
+static int read_boot_sector(FILE *fp, uint64_t offset, uint8_t *buf, size_t sz) {
+    if (fseeko(fp, (off_t)offset, SEEK_SET) != 0) return -1;
     if (fread(buf, 1, sz, fp) != sz) return -1;
     return 0;
 }
 
+// Boot sector via mtoolsd. Returns 0 on success, -1 if no daemon served it.
+static int daemon_boot_sector(const char *image, uint8_t *buf, size_t sz) {
+    int sfd = mtc_connect();
+    if (sfd < 0) return -1;
+    uint8_t *payload = NULL;
+    uint32_t len = 0;
+    int st = mtc_call(sfd, MTP_INFO, 0, image, NULL, NULL, 0, &payload, &len);
+    close(sfd);
+    if (st != 0 || len < sz) { free(payload); return -1; }
+    memcpy(buf, payload, sz);
+    free(payload);
+    return 0;
+}
+
 static int parse_bpb(const uint8_t *b, BPB *o) {
     memset(o, 0, sizeof(*o));
     o->BytsPerSec = rd_le16(&b[11]);
@@ -100,14 +122,20 @@ static const char* fat_type_from_clusters(uint32_t clusters) {
 }
 
 static void usage(void) {
-    fprintf(stderr, "Usage: minfo -i <image.img> [::]\n");
+    fprintf(stderr, "Usage: minfo -i <image.img> [--overlay <file>] [--stats] [::]\n");
 }
 
 int main(int argc, char **argv) {
     const char *image = NULL;
+    const char *ovl = NULL;
+    int want_stats = 0;
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
             image = argv[++i];
+        } else if (strcmp(argv[i], "--overlay") == 0 && i + 1 < argc) {
+            ovl = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            want_stats = 1;
         } else if (strcmp(argv[i], "::") == 0) {
             continue;
         } else {
@@ -117,14 +145,36 @@ int main(int argc, char **argv) {
     }
     if (!image) { usage(); return 1; }
 
-    FILE *fp = fopen(image, "rb");
-    if (!fp) { perror("open image"); return 1; }
-
+    // With stats, a trace or an overlay the boot sector comes through
+    // libmtools, which counts the I/O; images it cannot mount are still
+    // read raw below.
+    int stats_fmt = mt_env_stats(want_stats);
+    int direct = stats_fmt || mt_env_trace() || ovl;
+    mt_stats stats = {0};
+    mt_image *img = NULL;
     uint8_t bs[SECTOR_SIZE_MIN];
-    if (read_boot_sector(fp, bs, sizeof(bs)) != 0) {
-        fprintf(stderr, "Failed to read boot sector\n");
+    if (direct && mt_open_overlay(&img, image, ovl, MT_RDONLY | mt_env_flags() | MT_STATS, NULL) == 0) {
+        mt_stats_attach(img, &stats);
+        mt_trace_attach(img, mt_env_trace(), "minfo");
+        memcpy(bs, mt_boot_sector(img), sizeof(bs));
+        mt_close(img);
+    } else if (direct || daemon_boot_sector(image, bs, sizeof(bs)) != 0) {
+        char file[PATH_MAX];
+        uint64_t offset, length;
+        int rc = mt_locate(image, file, sizeof(file), &offset, &length);
+        if (rc != 0) {
+            fprintf(stderr, "open image: %s\n", mt_strerror(rc));
+            return 1;
+        }
+        FILE *fp = fopen(file, "rb");
+        if (!fp) { perror("open image"); return 1; }
+
+        if (read_boot_sector(fp, offset, bs, sizeof(bs)) != 0) {
+            fprintf(stderr, "Failed to read boot sector\n");
+            fclose(fp);
+            return 1;
+        }
         fclose(fp);
-        return 1;
     }
 
     if (!(bs[510] == 0x55 && bs[511] == 0xAA)) {
@@ -208,7 +258,7 @@ int main(int argc, char **argv) {
     if (warn) {
         printf("\nNotes: One or more suspicious values detected (see warnings above).\n");
     }
+    if (stats_fmt) mt_stats_print(stderr, "minfo", &stats, stats_fmt);
 
-    fclose(fp);
     return 0;
 }
@@ -0,0 +1,137 @@
+// src/mresize.c
+// mresize: grow or shrink a FAT12/16/32 image in place.  Growing extends
+// the FAT and the BPB over the new space; shrinking first moves the
+// clusters past the new end into free space lower down, in large runs,
+// then truncates the image file.  --min shrinks to the smallest size that
+// still holds the data.  See resize.c for how.
+// Build: see Makefile (links libmtools)
+// Usage: mresize -i IMAGE (--size [+|-]N[K|M|G] | --min) [-n] [--stats] [--direct]
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mtools.h"
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s -i IMAGE (--size [+|-]N[K|M|G] | --min) [-n] [--stats] [--direct]\n"
+        "  -i IMAGE        image file (IMAGE@@partN selects a partition)\n"
+        "  --size N        new size of the file system; +N / -N grow or shrink it by N\n"
+        "  --min           shrink to the smallest size that holds the data\n"
+        "  -n              only report the current and the smallest size\n"
+        "  --stats         report I/O and timing counters on stderr\n"
+        "  --direct        O_DIRECT image access (block and loop devices)\n"
+        "The image is rewritten in place and not journaled: resize a copy\n"
+        "(mclone) if an interruption would hurt.\n",
+        prog);
+}
+
+static int parse_size(const char *s, int *sign, uint64_t *out) {
+    char *end;
+    *sign = (*s == '+') ? 1 : (*s == '-') ? -1 : 0;
+    if (*sign) s++;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (end == s) return -1;
+    switch (*end) {
+    case 'K': case 'k': v <<= 10; end++; break;
+    case 'M': case 'm': v <<= 20; end++; break;
+    case 'G': case 'g': v <<= 30; end++; break;
+    default: break;
+    }
+    if (*end) return -1;
+    *out = v;
+    return 0;
+}
+
+// Size of the file system, from the BPB
+static uint64_t fs_bytes(mt_image *img) {
+    const uint8_t *b = mt_boot_sector(img);
+    uint32_t bps = (uint32_t)b[11] | ((uint32_t)b[12] << 8);
+    uint32_t tot = (uint32_t)b[19] | ((uint32_t)b[20] << 8);
+    if (!tot) tot = (uint32_t)b[32] | ((uint32_t)b[33] << 8) | ((uint32_t)b[34] << 16) | ((uint32_t)b[35] << 24);
+    return (uint64_t)tot * bps;
+}
+
+static double mib(uint64_t bytes) {
+    return (double)bytes / (1024.0 * 1024.0);
+}
+
+int main(int argc, char **argv) {
+    const char *image = NULL, *size_arg = NULL;
+    int want_stats = 0, dio = 0, to_min = 0, dry = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            size_arg = argv[++i];
+        } else if (strcmp(argv[i], "--min") == 0) {
+            to_min = 1;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            dry = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            want_stats = 1;
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            dio = MT_DIRECT;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    int sign = 0;
+    uint64_t size = 0;
+    if (!image || (!dry && !!size_arg == to_min) || (size_arg && parse_size(size_arg, &sign, &size) != 0)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    int stats_fmt = mt_env_stats(want_stats);
+    mt_image *img;
+    int rc = mt_open(&img, image, (dry ? MT_RDONLY : MT_RDWR) | dio | mt_env_flags() | (stats_fmt ? MT_STATS : 0),
+                     NULL);
+    if (rc != 0) {
+        fprintf(stderr, "open image %s: %s\n", image, mt_strerror(rc));
+        return 1;
+    }
+    mt_stats stats = {0};
+    if (stats_fmt) mt_stats_attach(img, &stats);
+    mt_trace_attach(img, mt_env_trace(), "mresize");
+
+    uint64_t cur = fs_bytes(img), min = 0;
+    uint32_t moved = 0;
+
+    if (dry || to_min) rc = mt_resize_min(img, &min);
+    if (rc == 0 && dry) {
+        printf("%s: %llu bytes (%.1f MiB), smallest %llu bytes (%.1f MiB)\n", image,
+               (unsigned long long)cur, mib(cur), (unsigned long long)min, mib(min));
+    } else if (rc == 0) {
+        uint64_t want = to_min ? min : sign > 0 ? cur + size : sign < 0 ? (size < cur ? cur - size : 0) : size;
+        rc = mt_resize(img, want, &moved);
+        if (rc == -ERANGE)
+            fprintf(stderr, "%s: %llu bytes would need another FAT type (reformat instead)\n", image,
+                    (unsigned long long)want);
+        else if (rc == -ENOSPC)
+            fprintf(stderr, "%s: the data does not fit in %llu bytes (mresize -n tells the minimum)\n", image,
+                    (unsigned long long)want);
+        else if (rc)
+            fprintf(stderr, "%s: %s\n", image, mt_strerror(rc));
+    } else {
+        fprintf(stderr, "%s: %s\n", image, mt_strerror(rc));
+    }
+    uint64_t now = fs_bytes(img);
+
+    int crc = mt_close(img);
+    if (rc == 0 && crc != 0) {
+        fprintf(stderr, "%s: %s\n", image, mt_strerror(crc));
+        rc = crc;
+    }
+    if (stats_fmt) mt_stats_print(stderr, "mresize", &stats, stats_fmt);
+    if (rc != 0) return 1;
+    if (!dry)
+        printf("Resized %s from %.1f MiB to %.1f MiB, %u cluster%s moved\n", image, mib(cur), mib(now),
+               moved, moved == 1 ? "" : "s");
+    return 0;
+}
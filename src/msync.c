@@ -0,0 +1,409 @@
+// src/msync.c
+// msync: make a directory of a FAT12/16/32 image match a host directory
+// tree.  Files are compared by size and DOS write time (or, with
+// --checksum, by contents); only new and changed files are copied, and
+// image entries the host tree no longer has are deleted.  Everything is
+// one batch: one FAT and directory flush (one journal commit) at the end.
+// Build: see Makefile (links libmtools)
+// Usage: msync -i IMAGE [--overlay FILE] [--checksum] [--no-delete] [-n] [-v]
+//              [--alloc POLICY] [--stats] [--direct] HOSTDIR [::/DEST]
+
+#define _FILE_OFFSET_BITS 64
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE         // strcasecmp in <strings.h> on older libcs
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "mtools.h"
+
+#define PATH_BYTES 4096
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s -i IMAGE [options] HOSTDIR [::/DEST]\n"
+        "  -i IMAGE        image file (IMAGE@@partN selects a partition)\n"
+        "  --overlay FILE  leave IMAGE as it is and write the changes to FILE\n"
+        "  --checksum      compare file contents, not write times\n"
+        "  --no-delete     keep image entries that HOSTDIR does not have\n"
+        "  -n              only print what would change\n"
+        "  -v              print every change\n"
+        "  --alloc POLICY  first, next, best or near (after the file's directory)\n"
+        "  --stats         report I/O and timing counters on stderr\n"
+        "  --direct        O_DIRECT image access (block and loop devices)\n"
+        "  ::/DEST         image directory to update (default: the root)\n",
+        prog);
+}
+
+static int checksum, no_delete, dry_run, verbose;
+static int failed;                              // some entries could not be synced
+static unsigned n_copied, n_touched, n_deleted, n_mkdir, n_same;
+
+// --- image side ---
+typedef struct {
+    char     name[MT_NAME_MAX];
+    uint8_t  attr;
+    uint32_t size;
+    uint16_t date, time;
+    int      seen;
+} Ent;
+
+typedef struct {
+    Ent    *v;
+    size_t  n, cap;
+    int     oom;
+} Ents;
+
+static int add_ent(void *ctx, const mt_entry *e) {
+    Ents *l = ctx;
+    if (e->attr & MT_ATTR_VOLUME) return 0;
+    if (!strcmp(e->name, ".") || !strcmp(e->name, "..")) return 0;
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 64;
+        Ent *v = realloc(l->v, cap * sizeof(*v));
+        if (!v) return l->oom = 1;
+        l->v = v;
+        l->cap = cap;
+    }
+    Ent *d = &l->v[l->n++];
+    memcpy(d->name, e->name, sizeof(d->name));
+    d->attr = e->attr;
+    d->size = e->size;
+    d->date = e->date;
+    d->time = e->time;
+    d->seen = 0;
+    return 0;
+}
+
+// FAT names match without regard to case
+static Ent *find_ent(Ents *l, const char *name) {
+    for (size_t i = 0; i < l->n; ++i)
+        if (strcasecmp(l->v[i].name, name) == 0) return &l->v[i];
+    return NULL;
+}
+
+// DOS date and time of a host mtime (local time, 2-second steps, 1980-2107)
+static void dos_time(time_t t, uint16_t *date, uint16_t *tm) {
+    struct tm lt;
+    if (!localtime_r(&t, &lt) || lt.tm_year < 80) {
+        *date = (1 << 5) | 1;                   // 1980-01-01 00:00:00
+        *tm = 0;
+        return;
+    }
+    if (lt.tm_year > 207) lt.tm_year = 207;
+    *date = (uint16_t)(((lt.tm_year - 80) << 9) | ((lt.tm_mon + 1) << 5) | lt.tm_mday);
+    *tm   = (uint16_t)((lt.tm_hour << 11) | (lt.tm_min << 5) | (lt.tm_sec / 2));
+}
+
+static void note(const char *what, const char *path) {
+    if (verbose || dry_run) printf("%-8s %s\n", what, path);
+}
+
+// Whole host file; NULL (message printed) on failure
+static uint8_t *load(const char *path, uint32_t size) {
+    int fd = open(path, O_RDONLY), err = errno;
+    uint8_t *data = fd >= 0 ? malloc(size ? size : 1) : NULL;
+    if (fd >= 0 && !data) err = ENOMEM;
+    size_t got = 0;
+    while (data && got < size) {
+        ssize_t n = read(fd, data + got, size - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            err = n < 0 ? errno : EIO;          // shrank under us
+            free(data);
+            data = NULL;
+            break;
+        }
+        got += (size_t)n;
+    }
+    if (!data) fprintf(stderr, "%s: %s\n", path, strerror(err));
+    if (fd >= 0) close(fd);
+    return data;
+}
+
+// Same contents?  1 yes, 0 no, negative errno
+static int same_data(mt_image *img, const char *ipath, const uint8_t *data, uint32_t size) {
+    uint8_t *cur = malloc(size ? size : 1);
+    if (!cur) return -ENOMEM;
+    long n = mt_read(img, ipath, 0, cur, size);
+    int rc = n < 0 ? (int)n : ((uint32_t)n == size && memcmp(cur, data, size) == 0);
+    free(cur);
+    return rc;
+}
+
+// Returns 0, or a negative errno that ends the run (image errors)
+static int sync_file(mt_image *img, const char *hpath, const char *ipath,
+                     const struct stat *st, const Ent *old) {
+    uint16_t date, tm;
+    dos_time(st->st_mtime, &date, &tm);
+    int same_time = old && old->date == date && old->time == tm;
+    int same_size = old && old->size == (uint32_t)st->st_size;
+    if (same_size && same_time && !checksum) {
+        n_same++;
+        return 0;
+    }
+
+    uint8_t *data = NULL;
+    if (same_size && checksum) {
+        if (!(data = load(hpath, (uint32_t)st->st_size))) { failed = 1; return 0; }
+        int rc = same_data(img, ipath, data, (uint32_t)st->st_size);
+        if (rc < 0) { free(data); return rc; }
+        if (rc) {
+            free(data);
+            if (same_time) {
+                n_same++;
+                return 0;
+            }
+            note("time", ipath);
+            n_touched++;
+            return dry_run ? 0 : mt_set_time(img, ipath, date, tm);
+        }
+    }
+
+    note(old ? "update" : "add", ipath);
+    n_copied++;
+    if (dry_run) {
+        free(data);
+        return 0;
+    }
+    if (!data && !(data = load(hpath, (uint32_t)st->st_size))) {
+        n_copied--;
+        failed = 1;
+        return 0;
+    }
+    int rc = mt_write(img, ipath, data, (size_t)st->st_size, MT_OVERWRITE | MT_SPARSE);
+    free(data);
+    if (rc == 0) rc = mt_set_time(img, ipath, date, tm);
+    return rc;
+}
+
+// Delete an image file or directory tree
+static int remove_tree(mt_image *img, char *ipath, size_t ilen, const Ent *e) {
+    if (!(e->attr & MT_ATTR_DIR)) {
+        note("delete", ipath);
+        n_deleted++;
+        return dry_run ? 0 : mt_unlink(img, ipath);
+    }
+    Ents sub = {0};
+    int rc = mt_readdir(img, ipath, add_ent, &sub);
+    if (rc == 0 && sub.oom) rc = -ENOMEM;
+    for (size_t i = 0; rc == 0 && i < sub.n; ++i) {
+        size_t n = (size_t)snprintf(ipath + ilen, PATH_BYTES - ilen, "/%s", sub.v[i].name);
+        if (ilen + n >= PATH_BYTES) rc = -ENAMETOOLONG;
+        else rc = remove_tree(img, ipath, ilen + n, &sub.v[i]);
+        ipath[ilen] = '\0';
+    }
+    free(sub.v);
+    if (rc) return rc;
+    note("rmdir", ipath);
+    n_deleted++;
+    return dry_run ? 0 : mt_rmdir(img, ipath);
+}
+
+// Make image directory ipath hold what host directory hpath holds
+static int sync_dir(mt_image *img, char *hpath, size_t hlen, char *ipath, size_t ilen, int fresh) {
+    Ents have = {0};
+    int rc = 0;
+    if (!fresh) {                               // a directory just made is empty
+        rc = mt_readdir(img, ipath, add_ent, &have);
+        if (rc == 0 && have.oom) rc = -ENOMEM;
+        if (rc) {
+            free(have.v);
+            return rc;
+        }
+    }
+
+    DIR *d = opendir(hpath);
+    if (!d) {
+        fprintf(stderr, "%s: %s\n", hpath, strerror(errno));
+        free(have.v);
+        failed = 1;
+        return 0;
+    }
+    struct dirent *de;
+    while (rc == 0 && (de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        size_t hn = (size_t)snprintf(hpath + hlen, PATH_BYTES - hlen, "/%s", de->d_name);
+        size_t in = (size_t)snprintf(ipath + ilen, PATH_BYTES - ilen, "/%s", de->d_name);
+        struct stat st;
+        if (hlen + hn >= PATH_BYTES || ilen + in >= PATH_BYTES) {
+            fprintf(stderr, "%s: %s\n", hpath, strerror(ENAMETOOLONG));
+            failed = 1;
+        } else if (stat(hpath, &st) != 0) {
+            fprintf(stderr, "%s: %s\n", hpath, strerror(errno));
+            failed = 1;
+        } else if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "%s: not a file or directory, skipped\n", hpath);
+        } else if (S_ISREG(st.st_mode) && st.st_size > (off_t)UINT32_MAX) {
+            fprintf(stderr, "%s: larger than a FAT file can be\n", hpath);
+            failed = 1;
+        } else {
+            Ent *old = find_ent(&have, de->d_name);
+            if (old && old->seen) {
+                fprintf(stderr, "%s: name differs only in case from another one, skipped\n", hpath);
+                failed = 1;
+                old = NULL;
+            } else {
+                if (old) old->seen = 1;
+                // A file where a directory was, or the other way round
+                if (old && !(old->attr & MT_ATTR_DIR) == !!S_ISDIR(st.st_mode)) {
+                    rc = remove_tree(img, ipath, ilen + in, old);
+                    old = NULL;
+                }
+                if (rc == 0 && S_ISDIR(st.st_mode)) {
+                    if (!old) {
+                        note("mkdir", ipath);
+                        n_mkdir++;
+                        if (!dry_run) rc = mt_mkdir(img, ipath);
+                    }
+                    // In a dry run a new directory is not there to list
+                    if (rc == 0 && !(dry_run && !old))
+                        rc = sync_dir(img, hpath, hlen + hn, ipath, ilen + in, !old);
+                } else if (rc == 0) {
+                    rc = sync_file(img, hpath, ipath, &st, old);
+                }
+                if (rc) fprintf(stderr, "%s: %s\n", ipath, mt_strerror(rc));
+            }
+        }
+        hpath[hlen] = '\0';
+        ipath[ilen] = '\0';
+    }
+    closedir(d);
+
+    // What the host no longer has
+    for (size_t i = 0; rc == 0 && !no_delete && i < have.n; ++i) {
+        if (have.v[i].seen) continue;
+        size_t in = (size_t)snprintf(ipath + ilen, PATH_BYTES - ilen, "/%s", have.v[i].name);
+        rc = (ilen + in >= PATH_BYTES) ? -ENAMETOOLONG : remove_tree(img, ipath, ilen + in, &have.v[i]);
+        if (rc) fprintf(stderr, "%s: %s\n", ipath, mt_strerror(rc));
+        ipath[ilen] = '\0';
+    }
+    free(have.v);
+    return rc;
+}
+
+// Create DEST and its parents as needed
+static int make_dest(mt_image *img, char *ipath) {
+    mt_entry e;
+    int rc = mt_stat(img, ipath, &e);
+    if (rc == 0) return (e.attr & MT_ATTR_DIR) ? 0 : -ENOTDIR;
+    if (rc != -ENOENT) return rc;
+    for (char *p = ipath + 3; ; ++p) {          // past "::/"
+        if (*p != '/' && *p != '\0') continue;
+        char c = *p;
+        *p = '\0';
+        rc = mt_stat(img, ipath, &e);
+        if (rc == -ENOENT) {
+            note("mkdir", ipath);
+            n_mkdir++;
+            rc = dry_run ? 0 : mt_mkdir(img, ipath);
+        } else if (rc == 0 && !(e.attr & MT_ATTR_DIR)) {
+            rc = -ENOTDIR;
+        }
+        *p = c;
+        if (rc || !c) return rc;
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *image = NULL, *ovl = NULL, *host = NULL, *dest = NULL;
+    int want_stats = 0, dio = 0, alloc = -1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else if (strcmp(argv[i], "--overlay") == 0 && i + 1 < argc) {
+            ovl = argv[++i];
+        } else if (strcmp(argv[i], "--checksum") == 0) {
+            checksum = 1;
+        } else if (strcmp(argv[i], "--no-delete") == 0) {
+            no_delete = 1;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            dry_run = 1;
+        } else if (strcmp(argv[i], "-v") == 0) {
+            verbose = 1;
+        } else if (strcmp(argv[i], "--alloc") == 0 && i + 1 < argc) {
+            if ((alloc = mt_alloc_policy(argv[++i])) < 0) {
+                usage(argv[0]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            want_stats = 1;
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            dio = MT_DIRECT;
+        } else if (strncmp(argv[i], "::", 2) == 0 && !dest) {
+            dest = argv[i];
+        } else if (argv[i][0] != '-' && !host) {
+            host = argv[i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!image || !host) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // "::/DEST" without trailing slashes; "::" for the root
+    static char hpath[PATH_BYTES], ipath[PATH_BYTES];
+    size_t hlen = strlen(host), ilen;
+    while (hlen > 1 && host[hlen - 1] == '/') hlen--;
+    if (hlen >= PATH_BYTES) {
+        fprintf(stderr, "%s: %s\n", host, strerror(ENAMETOOLONG));
+        return 1;
+    }
+    memcpy(hpath, host, hlen);
+    const char *d = dest ? dest + 2 : "";
+    while (*d == '/' || *d == '\\') ++d;
+    ilen = (size_t)snprintf(ipath, sizeof(ipath), "::/%s", d);
+    while (ilen > 3 && (ipath[ilen - 1] == '/' || ipath[ilen - 1] == '\\')) ipath[--ilen] = '\0';
+    if (ilen == 3) ipath[--ilen] = '\0';        // "::" + "/NAME" below
+
+    struct stat st;
+    if (stat(hpath, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s: %s\n", host, strerror(errno ? errno : ENOTDIR));
+        return 1;
+    }
+
+    int stats_fmt = mt_env_stats(want_stats);
+    mt_image *img;
+    int mode = dry_run ? MT_RDONLY : MT_RDWR;
+    int flags = mt_env_flags();
+    if (alloc >= 0) flags = (flags & ~MT_ALLOC_MASK) | alloc;
+    int rc = mt_open_overlay(&img, image, ovl, mode | dio | flags | (stats_fmt ? MT_STATS : 0), NULL);
+    if (rc != 0) {
+        fprintf(stderr, "open image %s: %s\n", image, mt_strerror(rc));
+        return 1;
+    }
+    mt_stats stats = {0};
+    if (stats_fmt) mt_stats_attach(img, &stats);
+    mt_trace_attach(img, mt_env_trace(), "msync");
+
+    // One flush (one journal commit) for the whole run
+    mt_batch_begin(img);
+    int fresh = 0;
+    if (ilen > 2) {
+        unsigned before = n_mkdir;
+        if ((rc = make_dest(img, ipath)) != 0) fprintf(stderr, "%s: %s\n", ipath, mt_strerror(rc));
+        fresh = n_mkdir != before;
+    }
+    if (rc == 0 && !(dry_run && fresh))
+        rc = sync_dir(img, hpath, hlen, ipath, ilen, fresh);
+    int brc = mt_batch_end(img);
+    int crc = mt_close(img);
+    if (rc == 0 && (rc = brc ? brc : crc) != 0) fprintf(stderr, "%s: %s\n", image, mt_strerror(rc));
+    if (stats_fmt) mt_stats_print(stderr, "msync", &stats, stats_fmt);
+    if (rc != 0) return 1;
+    printf("%s%u copied, %u retimed, %u deleted, %u directories made, %u unchanged\n",
+           dry_run ? "(dry run) " : "", n_copied, n_touched, n_deleted, n_mkdir, n_same);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,138 @@
+// src/mtclient.c
+// Client half of the mtoolsd protocol (see mtproto.h).
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "mtproto.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// A daemon that hangs up (it serves only its own user) is "no daemon",
+// not a SIGPIPE
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) { if (errno == EINTR) continue; return -1; }
+        p += n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0) { if (errno == EINTR) continue; return -1; }
+        if (n == 0) return -1;
+        p += n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+int mtc_connect(void) {
+    const char *path = getenv(MTP_ENV);
+    if (!path || !*path) return -1;
+
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path)) return -1;
+    strcpy(sa.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+size_t mtp_put_entry(uint8_t *buf, const mt_entry *e) {
+    MtpEnt w;
+    size_t n = strlen(e->name);
+    if (n > MT_NAME_MAX - 1) n = MT_NAME_MAX - 1;
+    w.attr          = e->attr;
+    w.name_len      = (uint16_t)n;
+    memset(w.short_name, 0, sizeof(w.short_name));
+    memcpy(w.short_name, e->short_name, strnlen(e->short_name, sizeof(w.short_name)));
+    w.date          = e->date;
+    w.time          = e->time;
+    w.size          = e->size;
+    w.first_cluster = e->first_cluster;
+    w.extents       = e->extents;
+    memcpy(buf, &w, sizeof(w));
+    memcpy(buf + sizeof(w), e->name, n);
+    return sizeof(w) + n;
+}
+
+size_t mtp_get_entry(const uint8_t *buf, size_t avail, mt_entry *e) {
+    MtpEnt w;
+    if (avail < sizeof(w)) return 0;
+    memcpy(&w, buf, sizeof(w));
+    if (w.name_len > MT_NAME_MAX - 1 || avail < sizeof(w) + w.name_len) return 0;
+    memset(e, 0, sizeof(*e));
+    e->attr          = w.attr;
+    e->date          = w.date;
+    e->time          = w.time;
+    e->size          = w.size;
+    e->first_cluster = w.first_cluster;
+    e->extents       = w.extents;
+    memcpy(e->short_name, w.short_name, sizeof(w.short_name));
+    memcpy(e->name, buf + sizeof(w), w.name_len);
+    return sizeof(w) + w.name_len;
+}
+
+int mtc_call(int fd, uint8_t op, uint8_t flags, const char *image,
+             const char *name, const void *data, uint32_t data_len,
+             uint8_t **out, uint32_t *out_len) {
+    // Resolve the host file; an "@@partN" / "@@OFFSET" selector is kept
+    char abs[PATH_MAX], file[PATH_MAX];
+    const char *sel = strstr(image, "@@");
+    size_t flen = sel ? (size_t)(sel - image) : strlen(image);
+    if (flen >= sizeof(file)) return -1;
+    memcpy(file, image, flen);
+    file[flen] = '\0';
+    if (!realpath(file, abs)) return -1;
+    if (sel && strlen(abs) + strlen(sel) >= sizeof(abs)) return -1;
+    if (sel) strcat(abs, sel);
+    uint32_t name_len = name ? (uint32_t)strlen(name) : 0;
+
+    MtpReq rq;
+    rq.magic    = MTP_MAGIC;
+    rq.op       = op;
+    rq.flags    = flags;
+    rq.path_len = (uint16_t)strlen(abs);
+    rq.name_len = name_len;
+    rq.data_len = data_len;
+
+    if (write_all(fd, &rq, sizeof(rq)) != 0 ||
+        write_all(fd, abs, rq.path_len) != 0 ||
+        (name_len && write_all(fd, name, name_len) != 0) ||
+        (data_len && write_all(fd, data, data_len) != 0))
+        return -1;
+
+    MtpResp rs;
+    if (read_all(fd, &rs, sizeof(rs)) != 0) return -1;
+
+    uint8_t *buf = NULL;
+    if (rs.len) {
+        if (!(buf = malloc(rs.len))) return -1;
+        if (read_all(fd, buf, rs.len) != 0) { free(buf); return -1; }
+    }
+    if (out) *out = buf; else free(buf);
+    if (out_len) *out_len = rs.len;
+    return rs.status;
+}
@@ -0,0 +1,409 @@
+// src/mtools.c
+// libmtools public API (see mtools.h), layered on the fatvol engine.
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mtools.h"
+#include "fatvol.h"
+
+struct mt_image {
+    FatVol vol;
+};
+
+static inline uint16_t rd_le16(const uint8_t *p) {
+    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+static inline uint32_t rd_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// lfn may be NULL or empty: the entry then shows its 8.3 name, lower-cased
+// where the NT case bits (byte 12) ask for it.
+static void fill_entry(const uint8_t *ent, const FvLfn *lfn, mt_entry *out) {
+    memset(out, 0, sizeof(*out));
+    if (ent[11] & FV_ATTR_VOLUME) {
+        // volume labels keep all 11 characters, trailing blanks trimmed
+        memcpy(out->name, ent, 11);
+        for (int i = 10; i >= 0 && out->name[i] == ' '; --i) out->name[i] = '\0';
+    } else {
+        fv_ent_name(ent, out->short_name);
+        if (lfn && lfn->len) {
+            fv_lfn_utf8(lfn, out->name, sizeof(out->name));
+        } else {
+            strcpy(out->name, out->short_name);
+            int ext = 0;
+            for (char *p = out->name; *p; ++p) {
+                if (*p == '.') { ext = 1; continue; }
+                if ((ent[12] & (ext ? 0x10 : 0x08)) && *p >= 'A' && *p <= 'Z') *p += 'a' - 'A';
+            }
+        }
+    }
+    out->attr          = ent[11];
+    out->time          = rd_le16(ent + 22);
+    out->date          = rd_le16(ent + 24);
+    out->first_cluster = fv_ent_cluster(ent);
+    out->size          = rd_le32(ent + 28);
+}
+
+int mt_open(mt_image **out, const char *path, int flags, const mt_allocator *alloc) {
+    return mt_open_overlay(out, path, NULL, flags, alloc);
+}
+
+int mt_open_overlay(mt_image **out, const char *path, const char *overlay,
+                    int flags, const mt_allocator *alloc) {
+    *out = NULL;
+    mt_allocator mem;
+    if (alloc && alloc->alloc && alloc->free) {
+        mem = *alloc;
+    } else {
+        memset(&mem, 0, sizeof(mem));
+    }
+    mt_image *img = mem.alloc ? mem.alloc(mem.ctx, sizeof(*img)) : malloc(sizeof(*img));
+    if (!img) return -ENOMEM;
+
+    int rc = fv_open(&img->vol, path, overlay, flags, mem.alloc ? &mem : NULL);
+    if (rc) {
+        if (mem.free) mem.free(mem.ctx, img); else free(img);
+        return rc;
+    }
+    *out = img;
+    return 0;
+}
+
+int mt_flatten(const char *base, const char *overlay, const char *out) {
+    char file[4096];
+    uint64_t offset, length;
+    int rc = fv_locate(base, file, sizeof(file), &offset, &length);
+    return rc ? rc : fv_ovl_flatten(file, overlay, out);
+}
+
+int mt_flush(mt_image *img) {
+    return fv_flush(&img->vol);
+}
+
+int mt_close(mt_image *img) {
+    if (!img) return 0;
+    mt_allocator mem = img->vol.mem;
+    int rc = fv_close(&img->vol);
+    mem.free(mem.ctx, img);
+    return rc;
+}
+
+void mt_batch_begin(mt_image *img) {
+    fv_batch_begin(&img->vol);
+}
+
+int mt_batch_end(mt_image *img) {
+    return fv_batch_end(&img->vol);
+}
+
+int mt_env_flags(void) {
+    int flags = 0;
+    const char *j = getenv("MTOOLS_JOURNAL");
+    if (j && *j && strcmp(j, "0") != 0) flags |= MT_JOURNAL;
+    if (mt_env_stats(0) != MT_STATS_OFF) flags |= MT_STATS;
+    if (mt_env_trace()) flags |= MT_TRACE;
+    const char *io = getenv("MTOOLS_IO");
+    for (const char *p = io; p && *p; p += strcspn(p, ",")) {
+        if (*p == ',') ++p;
+        size_t n = strcspn(p, ",");
+        if (n == 4 && strncmp(p, "sync", 4) == 0) flags |= MT_SYNCIO;
+        if (n == 6 && strncmp(p, "direct", 6) == 0) flags |= MT_DIRECT;
+    }
+    const char *a = getenv("MTOOLS_ALLOC");
+    int pol = (a && *a) ? mt_alloc_policy(a) : -1;
+    if (pol > 0) flags |= pol;
+    return flags;
+}
+
+static const char *const alloc_names[] = { "first", "next", "best", "near" };
+
+int mt_alloc_policy(const char *name) {
+    for (int i = 0; i < 4; i++)
+        if (strcmp(name, alloc_names[i]) == 0) return i * MT_ALLOC_NEXT;
+    return -1;
+}
+
+const char *mt_alloc_name(int flags) {
+    return alloc_names[(flags & MT_ALLOC_MASK) / MT_ALLOC_NEXT];
+}
+
+const char *mt_env_trace(void) {
+    const char *t = getenv("MTOOLS_TRACE");
+    return (t && *t) ? t : NULL;
+}
+
+int mt_trace_attach(mt_image *img, const char *path, const char *tool) {
+    return path ? fv_trace_attach(&img->vol, path, tool) : 0;
+}
+
+const char *mt_phase_name(int phase) {
+    return fv_phase_name(phase);
+}
+
+int mt_env_stats(int requested) {
+    const char *s = getenv("MTOOLS_STATS");
+    if (s && strcmp(s, "json") == 0) return MT_STATS_JSON;
+    if (requested || (s && *s && strcmp(s, "0") != 0)) return MT_STATS_TEXT;
+    return MT_STATS_OFF;
+}
+
+void mt_stats_attach(mt_image *img, mt_stats *sink) {
+    img->vol.st_sink = sink;
+}
+
+void mt_stats_get(mt_image *img, mt_stats *out) {
+    fv_phase(&img->vol, img->vol.phase);      // charge the running phase
+    *out = img->vol.st;
+}
+
+void mt_stats_print(FILE *out, const char *tool, const mt_stats *s, int format) {
+    uint64_t wall = 0;
+    for (int i = 0; i < MT_PHASES; ++i) wall += s->phase_ns[i];
+    const struct { const char *name; uint64_t val; } c[] = {
+        { "sectors_read",    s->sectors_read },
+        { "sectors_written", s->sectors_written },
+        { "syscalls",        s->syscalls },
+        { "bytes_copied",    s->bytes_copied },
+        { "cache_hits",      s->cache_hits },
+        { "cache_misses",    s->cache_misses },
+        { "dirents_scanned", s->dirents_scanned },
+        { "alloc_probes",    s->alloc_probes },
+        { "sectors_punched", s->sectors_punched },
+    };
+    size_t n = sizeof(c) / sizeof(c[0]);
+
+    if (format == MT_STATS_JSON) {
+        fprintf(out, "{\"tool\": \"%s\"", tool);
+        for (size_t i = 0; i < n; ++i) fprintf(out, ", \"%s\": %llu", c[i].name, (unsigned long long)c[i].val);
+        fprintf(out, ", \"wall_ns\": %llu, \"phase_ns\": {", (unsigned long long)wall);
+        for (int i = 0; i < MT_PHASES; ++i)
+            fprintf(out, "%s\"%s\": %llu", i ? ", " : "", fv_phase_name(i), (unsigned long long)s->phase_ns[i]);
+        fprintf(out, "}}\n");
+        return;
+    }
+    fprintf(out, "%s statistics:\n", tool);
+    for (size_t i = 0; i < n; ++i) fprintf(out, "  %-16s %llu\n", c[i].name, (unsigned long long)c[i].val);
+    fprintf(out, "  %-16s %.3f ms\n", "wall", wall / 1e6);
+    for (int i = 0; i < MT_PHASES; ++i)
+        fprintf(out, "    %-14s %.3f ms\n", fv_phase_name(i), s->phase_ns[i] / 1e6);
+}
+
+int mt_locate(const char *image, char *file, size_t file_size,
+              uint64_t *offset, uint64_t *length) {
+    return fv_locate(image, file, file_size, offset, length);
+}
+
+const uint8_t *mt_boot_sector(const mt_image *img) {
+    return img->vol.boot;
+}
+
+int mt_clone(const char *image, const char *dst) {
+    char file[4096];
+    uint64_t offset, length;
+    int rc = fv_locate(image, file, sizeof(file), &offset, &length);
+    return rc ? rc : fv_clone(file, dst);
+}
+
+int mt_set_volume_id(mt_image *img, const char *label, uint32_t serial) {
+    FatVol *v = &img->vol;
+    if (!v->writable) return -EBADF;
+    uint8_t *ext = v->boot + (v->fat_bits == 32 ? 0x40 : 0x24);   // extended BPB
+    if (ext[2] != 0x29) return -EINVAL;
+
+    uint8_t name[11];
+    if (label) {
+        size_t n = strlen(label);
+        if (n > sizeof(name)) return -ENAMETOOLONG;
+        memset(name, ' ', sizeof(name));
+        for (size_t i = 0; i < n; ++i) {
+            unsigned char c = (unsigned char)label[i];
+            if (c < 0x20 || c >= 0x7F || strchr("\"*+,./:;<=>?[\\]|", c)) return -EINVAL;
+            name[i] = (c >= 'a' && c <= 'z') ? (uint8_t)(c - 'a' + 'A') : c;
+        }
+    }
+
+    int ph = fv_phase(v, MT_PHASE_BPB);
+    uint8_t boot[sizeof(v->boot)];
+    memcpy(boot, v->boot, sizeof(boot));
+    ext = boot + (ext - v->boot);
+    ext[3] = (uint8_t)serial;
+    ext[4] = (uint8_t)(serial >> 8);
+    ext[5] = (uint8_t)(serial >> 16);
+    ext[6] = (uint8_t)(serial >> 24);
+    if (label) memcpy(ext + 7, name, sizeof(name));
+    int rc = fv_pwrite(v, boot, sizeof(boot), 0);
+    // FAT32 keeps a copy (BPB_BkBootSec) in the reserved sectors
+    uint32_t bk = v->fat_bits == 32 ? rd_le16(boot + 0x32) : 0;
+    if (rc == 0 && bk && bk < v->first_fat_lba)
+        rc = fv_pwrite(v, boot, sizeof(boot), (uint64_t)bk * v->bytes_per_sector);
+    if (rc == 0) memcpy(v->boot, boot, sizeof(boot));
+    fv_phase(v, ph);
+    return rc;
+}
+
+// Locate the directory entry named by path.
+// The long name, if any, is returned in lfn.
+static int lookup(FatVol *v, const char *path, FvDirPos *pos, FvLfn *lfn, uint8_t **ent) {
+    uint32_t dir;
+    const char *name;
+    size_t len;
+    int rc = fv_resolve_parent(v, path, &dir, &name, &len);
+    if (rc) return rc;
+    if ((rc = fv_dir_lookup(v, dir, name, len, pos)) != 0) return rc;
+    pos->idx = pos->first;
+    return fv_dir_next(v, pos, lfn, ent);
+}
+
+int mt_stat(mt_image *img, const char *path, mt_entry *out) {
+    FvDirPos pos;
+    FvLfn lfn;
+    uint8_t *e;
+    int rc = lookup(&img->vol, path, &pos, &lfn, &e);
+    if (rc == -EISDIR) {            // the root itself
+        memset(out, 0, sizeof(*out));
+        strcpy(out->name, "/");
+        out->attr = MT_ATTR_DIR;
+        return 0;
+    }
+    if (rc) return rc;
+    fill_entry(e, &lfn, out);
+    return 0;
+}
+
+int mt_readdir(mt_image *img, const char *path, mt_readdir_cb cb, void *ctx) {
+    return mt_readdir_ex(img, path, 0, cb, ctx);
+}
+
+int mt_readdir_ex(mt_image *img, const char *path, int flags, mt_readdir_cb cb, void *ctx) {
+    FatVol *v = &img->vol;
+    uint32_t dir;
+    int rc = fv_resolve_dir(v, path, &dir);
+    if (rc) return rc;
+
+    FvDirPos pos;
+    FvLfn lfn;
+    uint8_t *e;
+    mt_entry ent;
+    int ph = fv_phase(v, MT_PHASE_SCAN);
+    for (fv_dir_begin(&pos, dir); (rc = fv_dir_next(v, &pos, &lfn, &e)) == 0; pos.idx++) {
+        fill_entry(e, &lfn, &ent);
+        // e may leave the cache during the walk; pos stays valid
+        if ((flags & MT_LIST_EXTENTS) && !(ent.attr & FV_ATTR_VOLUME) &&
+            (rc = fv_chain_extents(v, ent.first_cluster, &ent.extents)) != 0)
+            break;
+        fv_phase(v, ph);                    // the callback's time is its own
+        int stop = cb(ctx, &ent);
+        fv_phase(v, MT_PHASE_SCAN);
+        if (stop) break;
+    }
+    fv_phase(v, ph);
+    return (rc == -ENOENT) ? 0 : rc;
+}
+
+long mt_read(mt_image *img, const char *path, uint64_t off, void *buf, size_t len) {
+    FvDirPos pos;
+    FvLfn lfn;
+    uint8_t *e;
+    int rc = lookup(&img->vol, path, &pos, &lfn, &e);
+    if (rc) return rc;
+    if (e[11] & FV_ATTR_DIR) return -EISDIR;
+    return fv_read(&img->vol, fv_ent_cluster(e), rd_le32(e + 28), off, buf, len);
+}
+
+int mt_read_to(mt_image *img, const char *path, mt_sink_cb sink, void *ctx) {
+    FvDirPos pos;
+    FvLfn lfn;
+    uint8_t *e;
+    int rc = lookup(&img->vol, path, &pos, &lfn, &e);
+    if (rc) return rc;
+    if (e[11] & FV_ATTR_DIR) return -EISDIR;
+    return fv_read_stream(&img->vol, fv_ent_cluster(e), rd_le32(e + 28), sink, ctx);
+}
+
+int mt_write(mt_image *img, const char *path, const void *buf, size_t len, int flags) {
+    if (len > UINT32_MAX) return -EFBIG;
+    uint32_t dir;
+    const char *name;
+    size_t nlen;
+    int rc = fv_resolve_parent(&img->vol, path, &dir, &name, &nlen);
+    if (rc) return rc;
+    return fv_put(&img->vol, dir, name, nlen, buf, (uint32_t)len, flags);
+}
+
+int mt_write_from(mt_image *img, const char *path, mt_source_cb src, void *ctx, int flags,
+                  uint64_t *size) {
+    uint32_t dir;
+    const char *name;
+    size_t nlen;
+    int rc = fv_resolve_parent(&img->vol, path, &dir, &name, &nlen);
+    if (rc) return rc;
+    return fv_put_stream(&img->vol, dir, name, nlen, src, ctx, flags, size);
+}
+
+int mt_unlink(mt_image *img, const char *path) {
+    uint32_t dir;
+    const char *name;
+    size_t nlen;
+    int rc = fv_resolve_parent(&img->vol, path, &dir, &name, &nlen);
+    if (rc) return rc;
+    return fv_unlink(&img->vol, dir, name, nlen);
+}
+
+int mt_mkdir(mt_image *img, const char *path) {
+    uint32_t dir;
+    const char *name;
+    size_t nlen;
+    int rc = fv_resolve_parent(&img->vol, path, &dir, &name, &nlen);
+    if (rc) return rc;
+    return fv_mkdir(&img->vol, dir, name, nlen, NULL);
+}
+
+int mt_rmdir(mt_image *img, const char *path) {
+    uint32_t dir;
+    const char *name;
+    size_t nlen;
+    int rc = fv_resolve_parent(&img->vol, path, &dir, &name, &nlen);
+    if (rc) return rc;
+    return fv_rmdir(&img->vol, dir, name, nlen);
+}
+
+int mt_set_time(mt_image *img, const char *path, uint16_t date, uint16_t time) {
+    uint32_t dir;
+    const char *name;
+    size_t nlen;
+    int rc = fv_resolve_parent(&img->vol, path, &dir, &name, &nlen);
+    if (rc) return rc;
+    return fv_set_time(&img->vol, dir, name, nlen, date, time);
+}
+
+int mt_compact(mt_image *img, const char *path, uint32_t *slots, uint32_t *clusters) {
+    uint32_t dir;
+    int rc = fv_resolve_dir(&img->vol, path, &dir);
+    if (rc) return rc;
+    if ((rc = fv_dir_compact(&img->vol, dir, 0, slots, clusters)) != 0) return rc;
+    return fv_flush(&img->vol);
+}
+
+int mt_resize(mt_image *img, uint64_t bytes, uint32_t *moved) {
+    uint64_t sectors = bytes / img->vol.bytes_per_sector;
+    if (sectors > UINT32_MAX) return -EFBIG;
+    return fv_resize(&img->vol, (uint32_t)sectors, moved);
+}
+
+int mt_resize_min(mt_image *img, uint64_t *bytes) {
+    uint32_t sectors;
+    int rc = fv_resize_min(&img->vol, &sectors);
+    if (rc == 0) *bytes = (uint64_t)sectors * img->vol.bytes_per_sector;
+    return rc;
+}
+
+const char *mt_strerror(int err) {
+    if (err == -ENOTSUP) return "unsupported file system (inconsistent FAT type)";
+    return strerror(err < 0 ? -err : err);
+}
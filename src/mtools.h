@@ -0,0 +1,237 @@
+// src/mtools.h
+// libmtools: in-process access to FAT12/16/32 images.
+//
+// Every call works on an explicit mt_image handle; the library keeps no
+// global state, so different images may be used from different threads at
+// the same time (one thread per handle).  Memory comes from the caller's
+// allocator when one is passed to mt_open(), otherwise malloc/free.
+//
+// Paths are relative to the image root: "DIR/FILE.TXT", "/DIR/FILE.TXT" or
+// mtools-style "::/DIR/FILE.TXT"; '\\' is accepted as a separator.
+// Image paths may select a file system inside a partitioned disk image:
+// "disk.img@@part2" (MBR primary/logical or GPT partition 2) or
+// "disk.img@@1M" (byte offset; K/M/G/S suffixes, S = 512-byte sectors).
+// Functions return 0 (or a byte count where noted) on success and a
+// negative errno value on failure; mt_strerror() turns that into text.
+
+#ifndef MTOOLS_H
+#define MTOOLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MT_VERSION "0.1.0"
+
+typedef struct {
+    void *(*alloc)(void *ctx, size_t size);
+    void  (*free)(void *ctx, void *ptr);
+    void   *ctx;
+} mt_allocator;
+
+typedef struct mt_image mt_image;
+
+// mt_open flags
+//  MT_JOURNAL  crash-safe metadata updates through the "<image>.mtj" sidecar
+//              journal: each flush (or batch) costs one fdatasync of the
+//              journal.  A journal left behind is replayed by any open.
+//  MT_STATS    also time the phases of mt_stats (the counters are always kept)
+//  MT_TRACE    record every image read and write (see mt_trace_attach)
+//  MT_SYNCIO   no io_uring: bulk transfers use plain pread/pwrite
+//  MT_DIRECT   O_DIRECT: bypass the page cache (block devices, loop devices)
+//  MT_PUNCH    punch the clusters of deleted files out of the host file
+//              (FALLOC_FL_PUNCH_HOLE) once the deletion is flushed
+//  MT_ALLOC_*  where new files and directories get their first cluster
+//              (the rest of a chain follows its previous cluster):
+//              FIRST  lowest free cluster (the default)
+//              NEXT   after the last allocation, freed clusters are
+//                     only reused once the scan wraps around
+//              BEST   smallest free run that holds the file (one FAT
+//                     pass per file)
+//              NEAR   after the parent directory's last cluster
+enum { MT_RDONLY = 0x00, MT_RDWR = 0x01, MT_JOURNAL = 0x02, MT_STATS = 0x04,
+       MT_TRACE = 0x08, MT_SYNCIO = 0x10, MT_DIRECT = 0x20, MT_PUNCH = 0x40,
+       MT_ALLOC_FIRST = 0x000, MT_ALLOC_NEXT = 0x100, MT_ALLOC_BEST = 0x200,
+       MT_ALLOC_NEAR = 0x300, MT_ALLOC_MASK = 0x300 };
+
+// mt_write flags
+//  MT_SPARSE   clusters that are all zeros are punched out of the host
+//              file instead of written (plain writes where it cannot)
+enum { MT_OVERWRITE = 0x01, MT_SPARSE = 0x02 };
+
+// Attribute bits
+enum { MT_ATTR_READONLY=0x01, MT_ATTR_HIDDEN=0x02, MT_ATTR_SYSTEM=0x04,
+       MT_ATTR_VOLUME=0x08,   MT_ATTR_DIR=0x10,    MT_ATTR_ARCHIVE=0x20 };
+
+// Longest UTF-8 name: 255 UTF-16 units of up to 3 bytes, plus the NUL
+#define MT_NAME_MAX 768
+
+typedef struct {
+    char     name[MT_NAME_MAX];  // display name: the long name (UTF-8) or "README.TXT"
+    char     short_name[13];      // 8.3 name, e.g. "LONGFI~1.TXT"
+    uint8_t  attr;
+    uint32_t size;
+    uint32_t first_cluster;
+    uint32_t extents;         // runs of consecutive clusters (MT_LIST_EXTENTS), else 0
+    uint16_t date;            // DOS write date
+    uint16_t time;            // DOS write time
+} mt_entry;
+
+// Return nonzero from the callback to stop the listing early.
+typedef int (*mt_readdir_cb)(void *ctx, const mt_entry *e);
+
+int  mt_open(mt_image **out, const char *path, int flags, const mt_allocator *alloc);
+int  mt_flush(mt_image *img);
+int  mt_close(mt_image *img);    // flushes; the handle is freed either way
+
+// Open base read-only with a copy-on-write overlay: every change goes to
+// the file overlay (created on the first writable open), and reads of
+// sectors it does not hold fall through to base.  A missing overlay reads
+// as the unchanged base.  -EINVAL if overlay belongs to another base.
+int  mt_open_overlay(mt_image **out, const char *base, const char *overlay,
+                     int flags, const mt_allocator *alloc);
+
+// Write base with the changes in overlay applied to out, a new file;
+// with out NULL, apply them to base itself.  Holes stay holes.
+int  mt_flatten(const char *base, const char *overlay, const char *out);
+
+// Group the updates between begin and end into a single flush (and, with
+// MT_JOURNAL, a single journal commit).  Batches nest.
+void mt_batch_begin(mt_image *img);
+int  mt_batch_end(mt_image *img);
+
+// Extra mt_open flags requested through the environment, for CLI front
+// ends: MTOOLS_JOURNAL=1 adds MT_JOURNAL, MTOOLS_STATS adds MT_STATS,
+// MTOOLS_TRACE adds MT_TRACE; MTOOLS_IO=sync adds MT_SYNCIO, MTOOLS_IO=direct
+// MT_DIRECT (both: MTOOLS_IO=direct,sync); MTOOLS_ALLOC=first|next|best|near
+// an MT_ALLOC_* policy.
+int  mt_env_flags(void);
+
+// MT_ALLOC_* for a policy name ("first", "next", "best", "near"), -1 if
+// there is no such policy; and the name of one.
+int  mt_alloc_policy(const char *name);
+const char *mt_alloc_name(int flags);
+
+// Split an image path into the host file and the byte range holding the
+// file system (length 0 = up to the end of the file).
+int  mt_locate(const char *image, char *file, size_t file_size,
+               uint64_t *offset, uint64_t *length);
+
+const uint8_t *mt_boot_sector(const mt_image *img);   // 512 bytes
+
+// Copy the host file of image to dst, which must not exist yet: a reflink
+// sharing all blocks where the host file system supports it (FICLONE),
+// else a copy of the data that leaves holes as holes.
+int  mt_clone(const char *image, const char *dst);
+
+// Set the volume serial number and, unless label is NULL, the volume
+// label (up to 11 characters, stored upper case) in the boot sector and
+// its FAT32 backup.  -EINVAL without an extended boot signature.
+int  mt_set_volume_id(mt_image *img, const char *label, uint32_t serial);
+
+int  mt_stat(mt_image *img, const char *path, mt_entry *out);
+int  mt_readdir(mt_image *img, const char *path, mt_readdir_cb cb, void *ctx);
+
+// mt_readdir with MT_LIST_* flags: MT_LIST_EXTENTS also fills in
+// mt_entry.extents, walking every entry's cluster chain.
+enum { MT_LIST_EXTENTS = 0x01 };
+int  mt_readdir_ex(mt_image *img, const char *path, int flags, mt_readdir_cb cb, void *ctx);
+
+// Read up to len bytes at off; returns the number of bytes read.
+long mt_read(mt_image *img, const char *path, uint64_t off, void *buf, size_t len);
+
+// Sink of mt_read_to: take len bytes; nonzero stops the read, and
+// mt_read_to returns it.
+typedef int (*mt_sink_cb)(void *ctx, const void *buf, size_t len);
+
+// Read a whole file in order, in large batches, with one walk of its
+// cluster chain (runs of consecutive clusters are read in one request).
+int  mt_read_to(mt_image *img, const char *path, mt_sink_cb sink, void *ctx);
+
+// Create (or with MT_OVERWRITE replace) a file holding exactly buf[0..len).
+int  mt_write(mt_image *img, const char *path, const void *buf, size_t len, int flags);
+
+// Source of mt_write_from: store up to len bytes in buf and return how
+// many, 0 at the end of the data, or a negative errno.
+typedef long (*mt_source_cb)(void *ctx, void *buf, size_t len);
+
+// mt_write for data of unknown length (a pipe): clusters are allocated as
+// the data comes in, and the entry gets its size at the end.  *size (may
+// be NULL) is the number of bytes written.  -EFBIG past 4 GiB - 1.
+int  mt_write_from(mt_image *img, const char *path, mt_source_cb src, void *ctx, int flags,
+                   uint64_t *size);
+int  mt_unlink(mt_image *img, const char *path);
+int  mt_mkdir(mt_image *img, const char *path);
+int  mt_rmdir(mt_image *img, const char *path);    // empty directories only
+// Set the write date and time (DOS format, local time) of a file or directory
+int  mt_set_time(mt_image *img, const char *path, uint16_t date, uint16_t time);
+
+// Rewrite directory path without the slots of deleted entries and free the
+// clusters that leaves unused (mt_unlink does this by itself once most of a
+// directory is deleted).  *slots and *clusters (may be NULL) count what was
+// reclaimed.  Subdirectories are not touched.
+int  mt_compact(mt_image *img, const char *path, uint32_t *slots, uint32_t *clusters);
+
+// Grow or shrink the file system to bytes (whole sectors).  The FAT is
+// resized along with it, and clusters that no longer fit are first moved
+// into free space; an image that is a whole file is truncated or extended
+// to match.  *moved (may be NULL) counts the clusters moved.  -ERANGE if
+// the size calls for another FAT type, -ENOSPC if the data does not fit.
+// The metadata is rewritten in place, outside the journal: not crash-safe.
+int  mt_resize(mt_image *img, uint64_t bytes, uint32_t *moved);
+// Smallest size the file system can shrink to (its data plus metadata)
+int  mt_resize_min(mt_image *img, uint64_t *bytes);
+
+const char *mt_strerror(int err);
+
+// Per-image counters, kept from mt_open to mt_close.  With MT_STATS the
+// wall time is split into phases: reading the boot sector/FSInfo, directory
+// scans, cluster allocation and freeing, file data writes and reads,
+// flushing metadata, and everything else.
+enum { MT_PHASE_OTHER, MT_PHASE_BPB, MT_PHASE_SCAN, MT_PHASE_ALLOC,
+       MT_PHASE_WRITE, MT_PHASE_READ, MT_PHASE_FLUSH, MT_PHASES };
+
+typedef struct {
+    uint64_t sectors_read;        // image sectors read / written
+    uint64_t sectors_written;
+    uint64_t syscalls;            // I/O system calls on the image and journal
+    uint64_t bytes_copied;        // file contents read or written
+    uint64_t cache_hits;          // FAT/directory sector cache
+    uint64_t cache_misses;
+    uint64_t dirents_scanned;     // directory entries visited
+    uint64_t alloc_probes;        // FAT entries examined for a free cluster
+    uint64_t sectors_punched;     // image sectors turned into holes
+    uint64_t phase_ns[MT_PHASES];
+} mt_stats;
+
+// Add the image's counters to *sink when it is closed (NULL detaches), so
+// that the final flush is included.  mt_stats_get() reads them live.
+void mt_stats_attach(mt_image *img, mt_stats *sink);
+void mt_stats_get(mt_image *img, mt_stats *out);
+
+// Report format for CLI front ends: --stats (requested != 0) or any
+// MTOOLS_STATS value but "0" turns the report on; MTOOLS_STATS=json picks
+// JSON over text.  The report goes to stderr on exit.
+enum { MT_STATS_OFF = 0, MT_STATS_TEXT = 1, MT_STATS_JSON = 2 };
+int  mt_env_stats(int requested);
+void mt_stats_print(FILE *out, const char *tool, const mt_stats *s, int format);
+const char *mt_phase_name(int phase);     // "bpb", "scan", ...
+
+// I/O trace, for the mtrace analyser.  An image opened with MT_TRACE
+// records its reads and writes from the start; mt_trace_attach() names the
+// file they are appended to (on mt_close, or when the buffer fills) and the
+// tool they are tagged with.  path NULL is a no-op, so front ends can pass
+// mt_env_trace() (MTOOLS_TRACE, or NULL) as is.  One line per request:
+//   TOOL PID R|W OFFSET LENGTH PHASE     (OFFSET in the image file)
+int  mt_trace_attach(mt_image *img, const char *path, const char *tool);
+const char *mt_env_trace(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,370 @@
+// src/mtoolsd.c
+// mtoolsd: keeps FAT images open (with warm FAT/directory caches) and serves
+// the mdir/minfo/mcp/mdel operations over a local Unix-domain socket.
+// The CLI tools use it transparently when MTOOLS_SOCKET is set.
+//
+// Coherence: before every request the image is stat()ed; if its device,
+// inode, size or mtime changed since we last touched it, the cached volume
+// is dropped and reopened.
+//
+// Access: the daemon writes any image its clients name, so only its own
+// user may talk to it.  The socket is created mode 0600 and connections
+// from other uids (SO_PEERCRED / getpeereid) are closed unserved.
+//
+// Build: see Makefile (links libmtools)
+// Usage: mtoolsd [-s SOCKET] [-n MAXIMAGES]
+
+#define _FILE_OFFSET_BITS 64
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE             // struct ucred
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "mtools.h"
+#include "mtproto.h"
+
+#define PROGRAM_NAME  "mtoolsd"
+#define VERSION_STR   "0.0.1"
+#define MAX_CLIENTS   64
+#define DEFAULT_IMAGES 16
+
+typedef struct {
+    char     path[PATH_MAX];
+    int      open;
+    dev_t    dev;
+    ino_t    ino;
+    off_t    size;
+    struct timespec mtime;
+    unsigned long last_use;
+    mt_image *img;
+} HotImage;
+
+static HotImage     *images;
+static int           max_images = DEFAULT_IMAGES;
+static unsigned long use_clock;
+static const char   *sock_path;
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) { (void)sig; stop = 1; }
+
+static void usage(void) {
+    fprintf(stderr, "Usage: %s [-s SOCKET] [-n MAXIMAGES] [--version]\n"
+                    "  -s SOCKET     socket path (default: $%s)\n"
+                    "  -n MAXIMAGES  images kept open at once (default %d)\n",
+            PROGRAM_NAME, MTP_ENV, DEFAULT_IMAGES);
+}
+
+static int same_stat(const HotImage *h, const struct stat *st) {
+    return h->dev == st->st_dev && h->ino == st->st_ino && h->size == st->st_size &&
+           h->mtime.tv_sec == st->st_mtim.tv_sec && h->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// stat() the host file behind an image path ("disk.img@@part2" -> disk.img).
+// Partitions of one disk share the file, so any write revalidates them all.
+static int stat_image(const char *path, struct stat *st) {
+    char file[PATH_MAX];
+    const char *sel = strstr(path, "@@");
+    size_t n = sel ? (size_t)(sel - path) : strlen(path);
+    if (n >= sizeof(file)) return -ENAMETOOLONG;
+    memcpy(file, path, n);
+    file[n] = '\0';
+    return stat(file, st) == 0 ? 0 : -errno;
+}
+
+static void remember_stat(HotImage *h) {
+    struct stat st;
+    if (stat_image(h->path, &st) == 0) {
+        h->dev = st.st_dev; h->ino = st.st_ino; h->size = st.st_size;
+        h->mtime = st.st_mtim;
+    }
+}
+
+static void drop_image(HotImage *h) {
+    if (h->open) mt_close(h->img);
+    h->open = 0;
+    h->path[0] = '\0';
+}
+
+// Find (or open) a hot image, revalidating it against the file on disk.
+static int get_image(const char *path, HotImage **out) {
+    struct stat st;
+    int rc = stat_image(path, &st);
+    if (rc) return rc;
+
+    HotImage *slot = NULL;
+    for (int i = 0; i < max_images; ++i) {
+        HotImage *h = &images[i];
+        if (h->open && strcmp(h->path, path) == 0) {
+            if (same_stat(h, &st)) { h->last_use = ++use_clock; *out = h; return 0; }
+            drop_image(h);          // changed behind our back
+            slot = h;
+            break;
+        }
+    }
+    if (!slot) {
+        for (int i = 0; i < max_images; ++i) {
+            HotImage *h = &images[i];
+            if (!h->open) { slot = h; break; }
+            if (!slot || h->last_use < slot->last_use) slot = h;
+        }
+        drop_image(slot);           // LRU eviction
+    }
+
+    rc = mt_open(&slot->img, path, MT_RDWR | mt_env_flags(), NULL);
+    if (rc == -EACCES || rc == -EROFS) rc = mt_open(&slot->img, path, MT_RDONLY, NULL);
+    if (rc) return rc;
+    snprintf(slot->path, sizeof(slot->path), "%s", path);
+    slot->open = 1;
+    slot->last_use = ++use_clock;
+    slot->dev = st.st_dev; slot->ino = st.st_ino; slot->size = st.st_size;
+    slot->mtime = st.st_mtim;
+    *out = slot;
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0) { if (errno == EINTR) continue; return -1; }
+        if (n == 0) return -1;
+        p += n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) { if (errno == EINTR) continue; return -1; }
+        p += n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int reply(int fd, int status, const void *payload, uint32_t len) {
+    MtpResp rs = { status, status ? 0 : len };
+    if (write_all(fd, &rs, sizeof(rs)) != 0) return -1;
+    if (rs.len && write_all(fd, payload, rs.len) != 0) return -1;
+    return 0;
+}
+
+typedef struct {
+    uint8_t *buf;
+    size_t   len, cap;
+    int      err;
+} ListBuf;
+
+static int list_cb(void *ctx, const mt_entry *e) {
+    ListBuf *lb = ctx;
+    if (lb->len + MTP_ENT_MAX > lb->cap) {
+        size_t cap = lb->cap ? lb->cap * 2 : 4096;
+        uint8_t *nb = realloc(lb->buf, cap);
+        if (!nb) { lb->err = ENOMEM; return 1; }
+        lb->buf = nb;
+        lb->cap = cap;
+    }
+    lb->len += mtp_put_entry(lb->buf + lb->len, e);
+    return 0;
+}
+
+// Serve one request. Returns -1 when the connection should be closed.
+static int serve(int fd) {
+    MtpReq rq;
+    if (read_all(fd, &rq, sizeof(rq)) != 0) return -1;
+    if (rq.magic != MTP_MAGIC || rq.path_len == 0 || rq.path_len >= PATH_MAX ||
+        rq.name_len >= PATH_MAX || rq.data_len > MTP_MAX_DATA)
+        return -1;
+
+    char path[PATH_MAX];
+    char name[PATH_MAX];
+    uint8_t *data = NULL;
+    if (read_all(fd, path, rq.path_len) != 0) return -1;
+    path[rq.path_len] = '\0';
+    if (rq.name_len && read_all(fd, name, rq.name_len) != 0) return -1;
+    name[rq.name_len] = '\0';
+    if (rq.data_len) {
+        if (!(data = malloc(rq.data_len))) return -1;
+        if (read_all(fd, data, rq.data_len) != 0) { free(data); return -1; }
+    }
+
+    HotImage *h = NULL;
+    int rc = get_image(path, &h);
+    if (rc) { free(data); return reply(fd, -rc, NULL, 0); }
+    mt_image *img = h->img;
+
+    int out;
+    switch (rq.op) {
+    case MTP_INFO:
+        out = reply(fd, 0, mt_boot_sector(img), 512);
+        break;
+    case MTP_LIST: {
+        ListBuf lb = { NULL, 0, 0, 0 };
+        rc = mt_readdir_ex(img, name, (rq.flags & MTP_F_EXTENTS) ? MT_LIST_EXTENTS : 0, list_cb, &lb);
+        out = reply(fd, rc ? -rc : lb.err, lb.buf, (uint32_t)lb.len);
+        free(lb.buf);
+        break;
+    }
+    case MTP_STAT: {
+        mt_entry e;
+        uint8_t buf[MTP_ENT_MAX];
+        size_t n = 0;
+        rc = mt_stat(img, name, &e);
+        if (rc == 0) n = mtp_put_entry(buf, &e);
+        out = reply(fd, -rc, buf, (uint32_t)n);
+        break;
+    }
+    case MTP_PUT:
+        rc = mt_write(img, name, data, rq.data_len,
+                      ((rq.flags & MTP_F_OVERWRITE) ? MT_OVERWRITE : 0) |
+                      ((rq.flags & MTP_F_SPARSE) ? MT_SPARSE : 0));
+        remember_stat(h);
+        out = reply(fd, -rc, NULL, 0);
+        break;
+    case MTP_DEL:
+        rc = mt_unlink(img, name);
+        remember_stat(h);
+        out = reply(fd, -rc, NULL, 0);
+        break;
+    case MTP_MKDIR:
+        rc = mt_mkdir(img, name);
+        remember_stat(h);
+        out = reply(fd, -rc, NULL, 0);
+        break;
+    default:
+        out = reply(fd, EINVAL, NULL, 0);
+        break;
+    }
+    // never keep a cache that may reflect a half-applied update
+    if (rq.op >= MTP_PUT && rc && rc != -EEXIST && rc != -ENOENT) drop_image(h);
+    free(data);
+    return out;
+}
+
+// Is the peer of a connection the daemon's own user?
+static int peer_ok(int fd) {
+#if defined(SO_PEERCRED)
+    struct ucred cr;
+    socklen_t len = sizeof(cr);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cr, &len) == 0 && cr.uid == geteuid();
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(fd, &uid, &gid) == 0 && uid == geteuid();
+#else
+    (void)fd;
+    return 1;                   // the socket's 0600 mode is all there is
+#endif
+}
+
+static int listen_on(const char *path) {
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(sa.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) { perror("socket"); return -1; }
+    unlink(path);   // stale socket from a previous run
+    mode_t old = umask(0177);   // born 0600: no window where others may connect
+    int rc = bind(fd, (struct sockaddr*)&sa, sizeof(sa));
+    umask(old);
+    if (rc != 0 || listen(fd, 32) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    sock_path = getenv(MTP_ENV);
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            sock_path = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            max_images = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--version") == 0) {
+            printf("%s version %s\n", PROGRAM_NAME, VERSION_STR);
+            return 0;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (!sock_path || !*sock_path || max_images <= 0) { usage(); return 1; }
+
+    images = calloc((size_t)max_images, sizeof(HotImage));
+    if (!images) { fprintf(stderr, "Out of memory\n"); return 1; }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int lfd = listen_on(sock_path);
+    if (lfd < 0) return 1;
+
+    struct pollfd pfd[MAX_CLIENTS + 1];
+    int nclients = 0;
+    pfd[0].fd = lfd;
+    pfd[0].events = POLLIN;
+
+    while (!stop) {
+        if (poll(pfd, (nfds_t)nclients + 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        for (int i = 1; i <= nclients; ++i) {
+            if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            if (serve(pfd[i].fd) != 0) {
+                close(pfd[i].fd);
+                pfd[i] = pfd[nclients--];
+                --i;
+            }
+        }
+        if (pfd[0].revents & POLLIN) {
+            int cfd = accept(lfd, NULL, NULL);
+            if (cfd >= 0 && !peer_ok(cfd)) {
+                close(cfd);
+            } else if (cfd >= 0 && nclients < MAX_CLIENTS) {
+                // a stalled client must not wedge the daemon mid-request
+                struct timeval tv = { 5, 0 };
+                setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                pfd[++nclients].fd = cfd;
+                pfd[nclients].events = POLLIN;
+                pfd[nclients].revents = 0;
+            } else if (cfd >= 0) {
+                close(cfd);
+            }
+        }
+    }
+
+    for (int i = 1; i <= nclients; ++i) close(pfd[i].fd);
+    for (int i = 0; i < max_images; ++i) drop_image(&images[i]);
+    free(images);
+    close(lfd);
+    unlink(sock_path);
+    return 0;
+}
@@ -0,0 +1,85 @@
+// src/mtproto.h
+// Wire protocol between the CLI tools and mtoolsd (local Unix-domain socket).
+//
+// Every request is a fixed 16-byte header followed by three variable parts:
+//   image path (path_len bytes, absolute, no NUL)
+//   name       (name_len bytes; path inside the image, no NUL)
+//   data       (data_len bytes; file contents for PUT)
+// Every reply is an 8-byte header followed by len payload bytes.
+// Fields are in host byte order: both ends always live on the same machine.
+//
+//   op         payload on success
+//   MTP_INFO   boot sector (512 bytes)
+//   MTP_LIST   one packed entry per directory entry (see below); flags:
+//              MTP_F_EXTENTS fills in the extent counts
+//   MTP_STAT   one packed entry
+//   MTP_PUT    none (flags: MTP_F_OVERWRITE, MTP_F_SPARSE)
+//   MTP_DEL    none
+//   MTP_MKDIR  none
+//
+// A packed entry is an MtpEnt followed by name_len name bytes.
+// status is 0 or a positive errno value (ENOENT, EEXIST, ENOSPC, ...).
+
+#ifndef MTOOLS_MTPROTO_H
+#define MTOOLS_MTPROTO_H
+
+#include <stdint.h>
+
+#include "mtools.h"
+
+#define MTP_MAGIC     0x3444544Du   // "MTD4"
+#define MTP_MAX_DATA  (64u << 20)   // largest PUT payload accepted
+#define MTP_ENV       "MTOOLS_SOCKET"
+
+enum { MTP_INFO = 1, MTP_LIST = 2, MTP_STAT = 3, MTP_PUT = 4, MTP_DEL = 5, MTP_MKDIR = 6 };
+enum { MTP_F_OVERWRITE = 0x01, MTP_F_SPARSE = 0x02, MTP_F_EXTENTS = 0x04 };
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint8_t  op;
+    uint8_t  flags;
+    uint16_t path_len;
+    uint32_t name_len;
+    uint32_t data_len;
+} MtpReq;
+
+typedef struct {
+    int32_t  status;
+    uint32_t len;
+} MtpResp;
+
+typedef struct {
+    uint8_t  attr;
+    uint16_t name_len;
+    char     short_name[12];   // 8.3 name, NUL-padded
+    uint16_t date;
+    uint16_t time;
+    uint32_t size;
+    uint32_t first_cluster;
+    uint32_t extents;
+} MtpEnt;
+#pragma pack(pop)
+
+#define MTP_ENT_MAX (sizeof(MtpEnt) + MT_NAME_MAX - 1)
+
+// Entry packing shared by both ends. mtp_put_entry returns bytes written;
+// mtp_get_entry returns bytes consumed or 0 on a malformed buffer.
+size_t mtp_put_entry(uint8_t *buf, const mt_entry *e);
+size_t mtp_get_entry(const uint8_t *buf, size_t avail, mt_entry *e);
+
+// Client side (mtclient.c)
+
+// Connect to $MTOOLS_SOCKET. Returns a socket fd, or -1 when the variable is
+// unset or no daemon is listening (callers then fall back to direct access).
+int mtc_connect(void);
+
+// Issue one request. image is resolved to an absolute path; name is the path
+// inside the image (may be NULL). On success *out (malloc'd, may be NULL
+// when empty) and *out_len hold the payload.
+// Returns the daemon status (0 or errno), or -1 on a transport failure.
+int mtc_call(int fd, uint8_t op, uint8_t flags, const char *image,
+             const char *name, const void *data, uint32_t data_len,
+             uint8_t **out, uint32_t *out_len);
+
+#endif
@@ -0,0 +1,360 @@
+// src/mtrace.c
+// mtrace: analyse an I/O trace recorded with MTOOLS_TRACE=FILE and replay
+// it against a scratch image.
+//
+// The trace holds one line per image request ("TOOL PID R|W OFFSET LENGTH
+// PHASE", see mt_trace_attach).  mtrace reports, overall and per phase:
+//  - seeks: requests that do not start where the previous request of the
+//    same tool run ended, and the total distance jumped;
+//  - read amplification: 512-byte sectors read per distinct sector read;
+//  - rewrites: sector writes that hit a sector the same run already wrote,
+//    plus the most written sectors.
+// The replay then issues the same requests, in order, on a scratch file
+// (put it on the medium under test) and times them per phase.  Sectors
+// the trace reads are written first and dropped from the page cache, so
+// the reads reach the device where the OS allows it.
+//
+// Build: see Makefile (links libmtools for the phase names)
+// Usage: mtrace [-n] [-S] [-k] [-s SCRATCH] [-t TOOL] TRACE
+
+#define _FILE_OFFSET_BITS 64
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mtools.h"
+
+#define SECTOR    512u
+#define HOT_SECTORS 5
+
+typedef struct {
+    uint64_t off;
+    uint32_t len;
+    uint32_t run;         // consecutive records of one tool process
+    uint8_t  write;
+    uint8_t  phase;
+} Rec;
+
+typedef struct {
+    uint64_t requests, read_bytes, write_bytes;
+    uint64_t seeks, seek_bytes;
+    uint64_t sectors_read, rewrites;
+    uint64_t replay_ns;
+} Sum;
+
+// Per-sector counters in an open-addressing table
+typedef struct {
+    uint64_t sector;      // key + 1 (0 = empty slot)
+    uint32_t reads, writes;
+    uint32_t last_write_run;
+} Sec;
+
+typedef struct {
+    Sec     *tab;
+    uint64_t cap, used;
+} SecMap;
+
+static void die(const char *what, int err) {
+    fprintf(stderr, "mtrace: %s: %s\n", what, strerror(err));
+    exit(1);
+}
+
+static Sec *sec_get(SecMap *m, uint64_t sector) {
+    if (2 * (m->used + 1) > m->cap) {
+        uint64_t ncap = m->cap ? m->cap * 2 : 4096;
+        Sec *nt = calloc(ncap, sizeof(Sec));
+        if (!nt) die("sector table", ENOMEM);
+        for (uint64_t i = 0; i < m->cap; ++i) {
+            if (!m->tab[i].sector) continue;
+            uint64_t j = (m->tab[i].sector * 0x9E3779B97F4A7C15ull) & (ncap - 1);
+            while (nt[j].sector) j = (j + 1) & (ncap - 1);
+            nt[j] = m->tab[i];
+        }
+        free(m->tab);
+        m->tab = nt;
+        m->cap = ncap;
+    }
+    uint64_t key = sector + 1;
+    uint64_t j = (key * 0x9E3779B97F4A7C15ull) & (m->cap - 1);
+    while (m->tab[j].sector && m->tab[j].sector != key) j = (j + 1) & (m->cap - 1);
+    if (!m->tab[j].sector) {
+        m->tab[j].sector = key;
+        m->tab[j].last_write_run = UINT32_MAX;
+        m->used++;
+    }
+    return &m->tab[j];
+}
+
+static int phase_index(const char *name) {
+    for (int i = 0; i < MT_PHASES; ++i)
+        if (strcmp(mt_phase_name(i), name) == 0) return i;
+    return MT_PHASE_OTHER;
+}
+
+// Load the records, optionally of one tool only.
+static Rec *load(const char *path, const char *only, size_t *count) {
+    FILE *f = fopen(path, "r");
+    if (!f) die(path, errno);
+    Rec *recs = NULL;
+    size_t n = 0, cap = 0;
+    uint32_t run = 0;
+    char line[256], prev_tool[64] = "", tool[64], op[4], phase[32];
+    long prev_pid = -1, pid;
+    unsigned long long off;
+    unsigned len;
+    for (unsigned lineno = 1; fgets(line, sizeof(line), f); ++lineno) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        if (sscanf(line, "%63s %ld %3s %llu %u %31s", tool, &pid, op, &off, &len, phase) != 6 ||
+            (op[0] != 'R' && op[0] != 'W') || op[1]) {
+            fprintf(stderr, "mtrace: %s:%u: malformed record\n", path, lineno);
+            exit(1);
+        }
+        if (only && strcmp(tool, only) != 0) continue;
+        if (pid != prev_pid || strcmp(tool, prev_tool) != 0) {
+            if (n) ++run;
+            prev_pid = pid;
+            snprintf(prev_tool, sizeof(prev_tool), "%s", tool);
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            if (!(recs = realloc(recs, cap * sizeof(Rec)))) die("records", ENOMEM);
+        }
+        recs[n++] = (Rec){ off, len, run, (uint8_t)(op[0] == 'W'), (uint8_t)phase_index(phase) };
+    }
+    fclose(f);
+    *count = n;
+    return recs;
+}
+
+static void analyse(const Rec *r, size_t n, SecMap *map, Sum *total, Sum *ph) {
+    uint64_t prev_end = 0;
+    for (size_t i = 0; i < n; ++i) {
+        Sum *p = &ph[r[i].phase];
+        if (i > 0 && r[i].run == r[i - 1].run && r[i].off != prev_end) {
+            uint64_t d = r[i].off > prev_end ? r[i].off - prev_end : prev_end - r[i].off;
+            p->seeks++;
+            p->seek_bytes += d;
+        }
+        prev_end = r[i].off + r[i].len;
+        p->requests++;
+        if (r[i].write) p->write_bytes += r[i].len;
+        else            p->read_bytes += r[i].len;
+
+        uint64_t first = r[i].off / SECTOR, last = (prev_end + SECTOR - 1) / SECTOR;
+        for (uint64_t s = first; s < last; ++s) {
+            Sec *e = sec_get(map, s);
+            if (r[i].write) {
+                if (e->last_write_run == r[i].run) p->rewrites++;
+                e->last_write_run = r[i].run;
+                e->writes++;
+            } else {
+                e->reads++;
+                p->sectors_read++;
+            }
+        }
+    }
+    for (int k = 0; k < MT_PHASES; ++k) {
+        total->requests     += ph[k].requests;
+        total->read_bytes   += ph[k].read_bytes;
+        total->write_bytes  += ph[k].write_bytes;
+        total->seeks        += ph[k].seeks;
+        total->seek_bytes   += ph[k].seek_bytes;
+        total->sectors_read += ph[k].sectors_read;
+        total->rewrites     += ph[k].rewrites;
+    }
+}
+
+static int cmp_sector(const void *a, const void *b) {
+    uint64_t x = ((const Sec *)a)->sector, y = ((const Sec *)b)->sector;
+    return (x > y) - (x < y);
+}
+
+static int cmp_hot(const void *a, const void *b) {
+    const Sec *x = a, *y = b;
+    if (x->writes != y->writes) return x->writes < y->writes ? 1 : -1;
+    return cmp_sector(a, b);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void xpwrite(int fd, const void *buf, size_t len, uint64_t off) {
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t k = pwrite(fd, p, len, (off_t)off);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) die("scratch write", k < 0 ? errno : EIO);
+        p += k; len -= (size_t)k; off += (uint64_t)k;
+    }
+}
+
+// Replay the trace on path; returns the total time, per phase in ph[].
+static uint64_t replay(const char *path, int dsync, const Rec *r, size_t n,
+                       SecMap *map, Sum *ph) {
+    uint64_t end = 0;
+    uint32_t maxlen = SECTOR;
+    for (size_t i = 0; i < n; ++i) {
+        if (r[i].off + r[i].len > end) end = r[i].off + r[i].len;
+        if (r[i].len > maxlen) maxlen = r[i].len;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) die(path, errno);
+    if (ftruncate(fd, (off_t)end) != 0) die(path, errno);
+    uint8_t *buf = calloc(1, maxlen);
+    if (!buf) die("replay buffer", ENOMEM);
+
+    // Back every sector the trace reads with data, coalescing runs, so
+    // the reads are not served from holes; then drop them from the cache.
+    Sec *secs = malloc((map->used ? map->used : 1) * sizeof(Sec));
+    if (!secs) die("sector table", ENOMEM);
+    size_t ns = 0;
+    for (uint64_t i = 0; i < map->cap; ++i)
+        if (map->tab[i].sector && map->tab[i].reads) secs[ns++] = map->tab[i];
+    qsort(secs, ns, sizeof(Sec), cmp_sector);
+    for (size_t i = 0; i < ns; ) {
+        size_t j = i + 1;
+        while (j < ns && secs[j].sector == secs[j - 1].sector + 1 &&
+               (j - i + 1) * SECTOR <= maxlen) ++j;
+        xpwrite(fd, buf, (j - i) * SECTOR, (secs[i].sector - 1) * SECTOR);
+        i = j;
+    }
+    free(secs);
+    if (fsync(fd) != 0) die(path, errno);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    if (dsync) {
+        close(fd);
+        if ((fd = open(path, O_RDWR | O_DSYNC)) < 0) die(path, errno);
+    }
+
+    uint64_t t0 = now_ns(), total = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t a = now_ns();
+        if (r[i].write) {
+            xpwrite(fd, buf, r[i].len, r[i].off);
+        } else {
+            size_t done = 0;
+            while (done < r[i].len) {
+                ssize_t k = pread(fd, buf + done, r[i].len - done, (off_t)(r[i].off + done));
+                if (k < 0 && errno == EINTR) continue;
+                if (k <= 0) die("scratch read", k < 0 ? errno : EIO);
+                done += (size_t)k;
+            }
+        }
+        ph[r[i].phase].replay_ns += now_ns() - a;
+    }
+    if (fsync(fd) != 0) die(path, errno);
+    total = now_ns() - t0;
+    ph[MT_PHASE_FLUSH].replay_ns += total;              // the final fsync ...
+    for (int k = 0; k < MT_PHASES; ++k)
+        if (k != MT_PHASE_FLUSH) ph[MT_PHASE_FLUSH].replay_ns -= ph[k].replay_ns;   // ... is what is left
+    close(fd);
+    free(buf);
+    return total;
+}
+
+static void print_row(const char *name, const Sum *s, int timed) {
+    printf("%-8s %9llu %12llu %12llu %8llu %14llu %9llu",
+           name, (unsigned long long)s->requests,
+           (unsigned long long)s->read_bytes, (unsigned long long)s->write_bytes,
+           (unsigned long long)s->seeks, (unsigned long long)s->seek_bytes,
+           (unsigned long long)s->rewrites);
+    if (timed) printf(" %11.3f", s->replay_ns / 1e6);
+    printf("\n");
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: mtrace [-n] [-S] [-k] [-s SCRATCH] [-t TOOL] TRACE\n"
+        "  -n          analyse only, do not replay\n"
+        "  -s SCRATCH  scratch image for the replay (default TRACE.scratch)\n"
+        "  -S          open the scratch image O_DSYNC (every write reaches the medium)\n"
+        "  -k          keep the scratch image\n"
+        "  -t TOOL     only records of TOOL (mcp, mdir, ...)\n");
+}
+
+int main(int argc, char **argv) {
+    const char *trace = NULL, *scratch = NULL, *only = NULL;
+    int do_replay = 1, dsync = 0, keep = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-n"))                      do_replay = 0;
+        else if (!strcmp(argv[i], "-S"))                 dsync = 1;
+        else if (!strcmp(argv[i], "-k"))                 keep = 1;
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc) scratch = argv[++i];
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc) only = argv[++i];
+        else if (argv[i][0] != '-' && !trace)            trace = argv[i];
+        else { usage(); return 2; }
+    }
+    if (!trace) { usage(); return 2; }
+
+    size_t n;
+    Rec *recs = load(trace, only, &n);
+    if (n == 0) {
+        fprintf(stderr, "mtrace: %s: no records\n", trace);
+        free(recs);
+        return 1;
+    }
+
+    SecMap map = { NULL, 0, 0 };
+    Sum total = {0}, ph[MT_PHASES] = {{0}};
+    analyse(recs, n, &map, &total, ph);
+
+    char def_scratch[4096];
+    if (do_replay) {
+        if (!scratch) {
+            snprintf(def_scratch, sizeof(def_scratch), "%s.scratch", trace);
+            scratch = def_scratch;
+        }
+        total.replay_ns = replay(scratch, dsync, recs, n, &map, ph);
+        if (!keep) unlink(scratch);
+    }
+
+    uint64_t distinct_read = 0;
+    for (uint64_t i = 0; i < map.cap; ++i)
+        if (map.tab[i].sector && map.tab[i].reads) distinct_read++;
+
+    printf("%zu requests in %u tool runs (%s%s)\n\n", n, recs[n - 1].run + 1,
+           trace, only ? ", filtered" : "");
+    printf("%-8s %9s %12s %12s %8s %14s %9s%s\n", "phase", "requests", "read B",
+           "written B", "seeks", "seek dist B", "rewrites", do_replay ? "  replay ms" : "");
+    for (int k = 0; k < MT_PHASES; ++k)
+        if (ph[k].requests) print_row(mt_phase_name(k), &ph[k], do_replay);
+    print_row("total", &total, do_replay);
+
+    printf("\nread amplification : %.2f (%llu sectors read, %llu distinct)\n",
+           distinct_read ? (double)total.sectors_read / (double)distinct_read : 0.0,
+           (unsigned long long)total.sectors_read, (unsigned long long)distinct_read);
+    printf("mean seek distance : %.0f bytes\n",
+           total.seeks ? (double)total.seek_bytes / (double)total.seeks : 0.0);
+    if (do_replay)
+        printf("replay             : %.3f ms, %.1f us/request%s\n", total.replay_ns / 1e6,
+               total.replay_ns / 1e3 / (double)n, dsync ? " (O_DSYNC)" : "");
+
+    // The most written sectors: FAT and directory sectors a batch keeps
+    // rewriting show up here
+    size_t nhot = 0;
+    Sec *hot = malloc((map.used ? map.used : 1) * sizeof(Sec));
+    if (!hot) die("sector table", ENOMEM);
+    for (uint64_t i = 0; i < map.cap; ++i)
+        if (map.tab[i].sector && map.tab[i].writes > 1) hot[nhot++] = map.tab[i];
+    qsort(hot, nhot, sizeof(Sec), cmp_hot);
+    if (nhot) printf("\nmost written sectors (offset: writes, reads)\n");
+    for (size_t i = 0; i < nhot && i < HOT_SECTORS; ++i)
+        printf("  %12llu: %u, %u\n", (unsigned long long)(hot[i].sector - 1) * SECTOR,
+               hot[i].writes, hot[i].reads);
+
+    free(hot);
+    free(map.tab);
+    free(recs);
+    return 0;
+}
@@ -0,0 +1,349 @@
+// src/overlay.c
+// Copy-on-write images: overlays, which open a read-only base image with
+// every write going to a sidecar overlay file (mt_open_overlay) and merge
+// back into one image (mt_flatten, the mflatten tool); and clones, which
+// share the base's blocks where the host file system can (mt_clone).
+//
+// An overlay mirrors the base file byte for byte: a sector written
+// through the overlay lives at its own offset there, so the overlay is a
+// sparse file holding only the changed sectors.  Past the base data,
+// rounded up to OVL_ALIGN, follow a header and a bitmap with one bit per
+// 512-byte sector of the base, set once the overlay holds the sector:
+//
+//   [changed sectors, sparse] | OvlHdr (OVL_ALIGN bytes) | bitmap
+//
+// The engine opens the overlay as its image (v->fd), so writes, queued
+// I/O, hole punching and journal checkpoints work unchanged.  A write
+// first marks its sectors (copying up a partly written one from the
+// base); reads go to the overlay or fall through to the base per run of
+// sectors.  The bitmap is written back after the data, from fv_qwait().
+// An empty or missing overlay file is a valid, empty overlay.
+//
+// Header fields are in host byte order, like the journal's.
+
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE             // copy_file_range, fallocate, SEEK_DATA
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "fatvol.h"
+
+#define OVL_MAGIC   "MTOVL1\0"   // 8 bytes with the NUL
+#define OVL_SECTOR  512u
+#define OVL_ALIGN   4096u
+#define OVL_COPY    (1u << 20)   // mt_flatten copy buffer
+
+typedef struct {
+    char     magic[8];
+    uint32_t sector;             // bytes per bitmap bit
+    uint32_t reserved;
+    uint64_t base_size;          // bytes in the base file
+    uint64_t map_off;            // overlay offset of the bitmap
+    uint64_t map_bytes;
+} OvlHdr;
+
+struct FvOvl {
+    int      base;               // the base file, read-only
+    uint64_t base_size;
+    uint64_t map_off;
+    uint64_t map_bytes;
+    uint8_t *map;
+    uint64_t dirty_lo, dirty_hi; // bitmap bytes not yet written back
+};
+
+static uint64_t file_size(int fd) {
+    off_t end = lseek(fd, 0, SEEK_END);       // block devices too
+    return end > 0 ? (uint64_t)end : 0;
+}
+
+static void layout(uint64_t base_size, OvlHdr *h) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, OVL_MAGIC, sizeof(h->magic));
+    h->sector    = OVL_SECTOR;
+    h->base_size = base_size;
+    h->map_off   = (base_size + OVL_ALIGN - 1) / OVL_ALIGN * OVL_ALIGN + OVL_ALIGN;
+    h->map_bytes = (base_size + OVL_SECTOR * 8 - 1) / (OVL_SECTOR * 8);
+}
+
+static int read_full(int fd, void *buf, size_t len, uint64_t off) {
+    uint8_t *p = buf;
+    while (len) {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if (n < 0) { if (errno == EINTR) continue; return -errno; }
+        if (n == 0) return -EIO;
+        p += n; len -= (size_t)n; off += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len, uint64_t off) {
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t n = pwrite(fd, p, len, (off_t)off);
+        if (n < 0) { if (errno == EINTR) continue; return -errno; }
+        p += n; len -= (size_t)n; off += (uint64_t)n;
+    }
+    return 0;
+}
+
+// The header of an overlay on a base of base_size bytes.  *h is the
+// layout of a new overlay when the file is empty (returns 1).
+static int read_header(int fd, uint64_t base_size, OvlHdr *h) {
+    layout(base_size, h);
+    if (file_size(fd) == 0) return 1;
+    OvlHdr got;
+    int rc = read_full(fd, &got, sizeof(got), h->map_off - OVL_ALIGN);
+    if (rc == -EIO || (rc == 0 && memcmp(got.magic, OVL_MAGIC, sizeof(got.magic)) != 0))
+        return -EINVAL;                         // not an overlay of this base
+    if (rc) return rc;
+    if (got.sector != h->sector || got.base_size != h->base_size ||
+        got.map_off != h->map_off || got.map_bytes != h->map_bytes)
+        return -EINVAL;
+    return 0;
+}
+
+static int has(const uint8_t *map, uint64_t s) {
+    return (map[s >> 3] >> (s & 7)) & 1;
+}
+
+int fv_ovl_open(FatVol *v, const char *base, const char *overlay, int writable) {
+    FvOvl *o = fv_alloc(v, sizeof(*o));
+    if (!o) return -ENOMEM;
+    memset(o, 0, sizeof(*o));
+    v->ovl = o;                                 // fv_ovl_close() cleans up
+    v->st.syscalls += 2;
+    if ((o->base = open(base, O_RDONLY)) < 0) return -errno;
+    if ((v->fd = open(overlay, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644)) < 0) {
+        // a missing overlay is an empty one; readers need no file for that
+        if (writable || errno != ENOENT) return -errno;
+    }
+    o->base_size = file_size(o->base);
+
+    OvlHdr h;
+    int rc = v->fd >= 0 ? read_header(v->fd, o->base_size, &h) : (layout(o->base_size, &h), 1);
+    if (rc < 0) return rc;
+    o->map_off   = h.map_off;
+    o->map_bytes = h.map_bytes;
+    if (!(o->map = fv_alloc(v, o->map_bytes ? o->map_bytes : 1))) return -ENOMEM;
+    memset(o->map, 0, o->map_bytes);
+    if (rc == 0) {
+        v->st.syscalls++;
+        return read_full(v->fd, o->map, o->map_bytes, o->map_off);
+    }
+    if (!writable) return 0;
+    // New overlay: sized to hold everything, all holes but the header
+    v->st.syscalls += 2;
+    if (ftruncate(v->fd, (off_t)(o->map_off + o->map_bytes)) != 0) return -errno;
+    return write_full(v->fd, &h, sizeof(h), o->map_off - OVL_ALIGN);
+}
+
+void fv_ovl_close(FatVol *v) {
+    FvOvl *o = v->ovl;
+    if (!o) return;
+    if (o->base >= 0) close(o->base);
+    fv_free(v, o->map);
+    fv_free(v, o);
+    v->ovl = NULL;
+}
+
+int fv_ovl_sync(FatVol *v) {
+    FvOvl *o = v->ovl;
+    if (!o || o->dirty_lo >= o->dirty_hi) return 0;
+    uint64_t lo = o->dirty_lo, hi = o->dirty_hi;
+    o->dirty_lo = UINT64_MAX;
+    o->dirty_hi = 0;
+    v->st.syscalls++;
+    return write_full(v->fd, o->map + lo, (size_t)(hi - lo), o->map_off + lo);
+}
+
+static int copy_up(FatVol *v, uint64_t s) {
+    FvOvl *o = v->ovl;
+    uint8_t sec[OVL_SECTOR] = {0};
+    uint64_t off = s * OVL_SECTOR;
+    size_t n = o->base_size - off < OVL_SECTOR ? (size_t)(o->base_size - off) : OVL_SECTOR;
+    v->st.syscalls += 2;
+    int rc = read_full(o->base, sec, n, off);
+    return rc ? rc : write_full(v->fd, sec, n, off);
+}
+
+int fv_ovl_prepare(FatVol *v, uint64_t off, uint64_t len) {
+    FvOvl *o = v->ovl;
+    if (len == 0) return 0;
+    if (off + len > o->base_size) return -ENOSPC;
+    uint64_t first = off / OVL_SECTOR, last = (off + len - 1) / OVL_SECTOR;
+    int rc;
+    // A sector the request only partly covers keeps the rest from the base
+    if (off % OVL_SECTOR && !has(o->map, first) && (rc = copy_up(v, first)) != 0) return rc;
+    if ((off + len) % OVL_SECTOR && !has(o->map, last) && (rc = copy_up(v, last)) != 0) return rc;
+    for (uint64_t s = first; s <= last; ) {
+        if (!(s & 7) && s + 8 <= last + 1) {
+            o->map[s >> 3] = 0xFF;
+            s += 8;
+        } else {
+            o->map[s >> 3] |= (uint8_t)(1u << (s & 7));
+            s++;
+        }
+    }
+    if (o->dirty_lo > first >> 3) o->dirty_lo = first >> 3;
+    if (o->dirty_hi < (last >> 3) + 1) o->dirty_hi = (last >> 3) + 1;
+    return 0;
+}
+
+int fv_ovl_read(FatVol *v, void *buf, size_t len, uint64_t off) {
+    FvOvl *o = v->ovl;
+    uint8_t *p = buf;
+    if (off + len > o->base_size) return -EIO;  // short image
+    while (len) {
+        // the longest run of sectors from the same file
+        int in = has(o->map, off / OVL_SECTOR);
+        uint64_t end = (off / OVL_SECTOR + 1) * OVL_SECTOR;
+        while (end < off + len && has(o->map, end / OVL_SECTOR) == in) end += OVL_SECTOR;
+        size_t n = end < off + len ? (size_t)(end - off) : len;
+        v->st.syscalls++;
+        int rc = read_full(in ? v->fd : o->base, p, n, off);
+        if (rc) return rc;
+        p += n; off += n; len -= n;
+    }
+    return 0;
+}
+
+// --- mt_flatten, mt_clone ---
+
+static int copy_range(int in, int out, uint64_t off, uint64_t len, uint8_t *buf) {
+    while (len) {
+        loff_t a = (loff_t)off, b = (loff_t)off;
+        ssize_t n = copy_file_range(in, &a, out, &b, len, 0);
+        if (n > 0) { off += (uint64_t)n; len -= (uint64_t)n; continue; }
+        if (n == 0) return -EIO;
+        if (errno == EINTR) continue;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return -errno;
+        // no in-kernel copy between these files: through the buffer
+        while (len) {
+            size_t c = len < OVL_COPY ? (size_t)len : OVL_COPY;
+            int rc = read_full(in, buf, c, off);
+            if (rc == 0) rc = write_full(out, buf, c, off);
+            if (rc) return rc;
+            off += c; len -= c;
+        }
+    }
+    return 0;
+}
+
+static int zero_range(int fd, uint64_t off, uint64_t len, uint8_t *buf) {
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)off, (off_t)len) == 0) return 0;
+    memset(buf, 0, OVL_COPY);
+    while (len) {
+        size_t c = len < OVL_COPY ? (size_t)len : OVL_COPY;
+        int rc = write_full(fd, buf, c, off);
+        if (rc) return rc;
+        off += c; len -= c;
+    }
+    return 0;
+}
+
+// Copy the data extents of [off, off + len) from in to out; with holes,
+// the holes become holes (or zeros) in out too.
+static int copy_sparse(int in, int out, uint64_t off, uint64_t len, int holes, uint8_t *buf) {
+    uint64_t end = off + len;
+    while (off < end) {
+        off_t d = lseek(in, (off_t)off, SEEK_DATA), h;
+        if (d < 0 && errno == ENXIO) d = (off_t)end;       // a hole up to the end
+        else if (d < 0) d = (off_t)off;                     // no SEEK_DATA: all data
+        if ((uint64_t)d > end) d = (off_t)end;
+        if (holes && (uint64_t)d > off) {
+            int rc = zero_range(out, off, (uint64_t)d - off, buf);
+            if (rc) return rc;
+        }
+        if ((uint64_t)d >= end) break;
+        if ((h = lseek(in, d, SEEK_HOLE)) < 0 || (uint64_t)h > end) h = (off_t)end;
+        int rc = copy_range(in, out, (uint64_t)d, (uint64_t)(h - d), buf);
+        if (rc) return rc;
+        off = (uint64_t)h;
+    }
+    return 0;
+}
+
+// Make out (empty) a copy of the first size bytes of in: a reflink that
+// shares every block where the file system allows it, else a copy of
+// the data extents, leaving holes as holes.
+static int clone_fd(int in, int out, uint64_t size, uint8_t *buf) {
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) return 0;
+#endif
+    if (ftruncate(out, (off_t)size) != 0) return -errno;
+    return copy_sparse(in, out, 0, size, 0, buf);
+}
+
+int fv_clone(const char *src, const char *dst) {
+    int in = open(src, O_RDONLY), out = -1, rc = 0;
+    uint8_t *buf = malloc(OVL_COPY);
+    if (in < 0 || (out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) rc = -errno;
+    else if (!buf) rc = -ENOMEM;
+    else if ((rc = clone_fd(in, out, file_size(in), buf)) == 0 && fsync(out) != 0) rc = -errno;
+    if (out >= 0 && close(out) != 0 && rc == 0) rc = -errno;
+    if (in >= 0) close(in);
+    if (rc && out >= 0) unlink(dst);            // no half-made clone
+    free(buf);
+    return rc;
+}
+
+int fv_ovl_flatten(const char *base, const char *overlay, const char *out) {
+    int bfd = -1, ofd = -1, tfd = -1, rc = 0;
+    uint8_t *map = NULL, *buf = NULL;
+    OvlHdr h;
+
+    if ((bfd = open(base, out ? O_RDONLY : O_RDWR)) < 0 || (ofd = open(overlay, O_RDONLY)) < 0) {
+        rc = -errno;
+        goto done;
+    }
+    uint64_t size = file_size(bfd);
+    if ((rc = read_header(ofd, size, &h)) < 0) goto done;
+    int empty = rc == 1;
+    rc = 0;
+    if (!(buf = malloc(OVL_COPY)) || !(map = calloc(h.map_bytes ? h.map_bytes : 1, 1))) {
+        rc = -ENOMEM;
+        goto done;
+    }
+    if (!empty && (rc = read_full(ofd, map, h.map_bytes, h.map_off)) != 0) goto done;
+
+    // The base, unless the overlay is merged into the base itself
+    tfd = bfd;
+    if (out) {
+        if ((tfd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            rc = -errno;
+            goto done;
+        }
+        if ((rc = clone_fd(bfd, tfd, size, buf)) != 0) goto done;
+    }
+
+    // Then every run of sectors the overlay holds
+    uint64_t nsec = (size + OVL_SECTOR - 1) / OVL_SECTOR;
+    for (uint64_t s = 0; s < nsec && rc == 0; ) {
+        if (!map[s >> 3] && !(s & 7)) { s += 8; continue; }
+        if (!has(map, s)) { s++; continue; }
+        uint64_t e = s + 1;
+        while (e < nsec && has(map, e)) e++;
+        uint64_t off = s * OVL_SECTOR, end = e * OVL_SECTOR < size ? e * OVL_SECTOR : size;
+        rc = copy_sparse(ofd, tfd, off, end - off, 1, buf);
+        s = e;
+    }
+    if (rc == 0 && fsync(tfd) != 0) rc = -errno;
+
+done:
+    if (tfd >= 0 && tfd != bfd && close(tfd) != 0 && rc == 0) rc = -errno;
+    if (bfd >= 0) close(bfd);
+    if (ofd >= 0) close(ofd);
+    free(map);
+    free(buf);
+    return rc;
+}
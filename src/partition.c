@@ -0,0 +1,148 @@
+// src/partition.c
+// Image specs with a partition selector: "disk.img@@part2" (MBR primary or
+// logical partition, or GPT entry) and "disk.img@@1M" (byte offset, with an
+// optional K/M/G/S suffix; S = 512-byte sectors).  The file system is then
+// accessed in place, every read and write shifted by the partition start.
+
+#define _FILE_OFFSET_BITS 64
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fatvol.h"
+
+#define MBR_MAX_LOGICAL 128    // guards against EBR loops
+
+static inline uint32_t rd_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+static inline uint64_t rd_le64(const uint8_t *p) {
+    return (uint64_t)rd_le32(p) | ((uint64_t)rd_le32(p + 4) << 32);
+}
+
+static int read_at(int fd, void *buf, size_t len, uint64_t off) {
+    ssize_t n = pread(fd, buf, len, (off_t)off);
+    if (n < 0) return -errno;
+    return (size_t)n == len ? 0 : -EINVAL;    // table beyond the end: not a disk
+}
+
+static int is_extended(uint8_t type) {
+    return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+// GPT entry n (1-based slot number, as gdisk/parted number them).
+static int gpt_locate(int fd, uint32_t ss, unsigned n, uint64_t *off, uint64_t *len) {
+    uint8_t hdr[512];
+    int rc = read_at(fd, hdr, sizeof(hdr), ss);
+    if (rc) return rc;
+    if (memcmp(hdr, "EFI PART", 8) != 0) return -ENXIO;
+
+    uint64_t table  = rd_le64(hdr + 72);
+    uint32_t count  = rd_le32(hdr + 80);
+    uint32_t esize  = rd_le32(hdr + 84);
+    if (esize < 128 || esize > 4096 || n > count) return -ENXIO;
+
+    uint8_t ent[4096];
+    if ((rc = read_at(fd, ent, esize, table * ss + (uint64_t)(n - 1) * esize)) != 0) return rc;
+    static const uint8_t unused[16];
+    if (memcmp(ent, unused, 16) == 0) return -ENXIO;
+    uint64_t first = rd_le64(ent + 32), last = rd_le64(ent + 40);
+    if (last < first) return -EINVAL;
+    *off = first * ss;
+    *len = (last - first + 1) * ss;
+    return 0;
+}
+
+// MBR partition n: 1-4 are the primary slots, 5 and up the logical
+// partitions inside the extended partition, in chain order.
+static int mbr_locate(int fd, unsigned n, uint64_t *off, uint64_t *len) {
+    uint8_t mbr[512];
+    int rc = read_at(fd, mbr, sizeof(mbr), 0);
+    if (rc) return rc;
+    if (mbr[510] != 0x55 || mbr[511] != 0xAA) return -ENXIO;
+
+    const uint8_t *pe = mbr + 446;
+    for (int i = 0; i < 4; ++i)
+        if (pe[i * 16 + 4] == 0xEE) {                  // protective MBR
+            if ((rc = gpt_locate(fd, 512, n, off, len)) != -ENXIO) return rc;
+            return gpt_locate(fd, 4096, n, off, len);
+        }
+
+    if (n >= 1 && n <= 4) {
+        const uint8_t *e = pe + (n - 1) * 16;
+        if (e[4] == 0 || is_extended(e[4])) return -ENXIO;
+        *off = (uint64_t)rd_le32(e + 8) * 512;
+        *len = (uint64_t)rd_le32(e + 12) * 512;
+        return 0;
+    }
+
+    // Walk the EBR chain; each link is relative to the extended partition
+    uint64_t ext = 0;
+    for (int i = 0; i < 4 && !ext; ++i)
+        if (is_extended(pe[i * 16 + 4])) ext = rd_le32(pe + i * 16 + 8);
+    if (!ext) return -ENXIO;
+
+    uint64_t ebr = ext;
+    for (unsigned k = 5; k < 5 + MBR_MAX_LOGICAL; ++k) {
+        uint8_t sec[512];
+        if ((rc = read_at(fd, sec, sizeof(sec), ebr * 512)) != 0) return rc;
+        if (sec[510] != 0x55 || sec[511] != 0xAA) return -ENXIO;
+        const uint8_t *e = sec + 446;
+        if (k == n) {
+            if (e[4] == 0) return -ENXIO;
+            *off = (ebr + rd_le32(e + 8)) * 512;
+            *len = (uint64_t)rd_le32(e + 12) * 512;
+            return 0;
+        }
+        if (!is_extended(e[16 + 4])) return -ENXIO;
+        ebr = ext + rd_le32(e + 16 + 8);
+    }
+    return -ENXIO;
+}
+
+static int parse_offset(const char *s, uint64_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 0);
+    if (errno || end == s) return -EINVAL;
+    switch (*end) {
+    case '\0':           break;
+    case 'S': case 's':  v <<= 9;  end++; break;
+    case 'K': case 'k':  v <<= 10; end++; break;
+    case 'M': case 'm':  v <<= 20; end++; break;
+    case 'G': case 'g':  v <<= 30; end++; break;
+    default:             return -EINVAL;
+    }
+    if (*end) return -EINVAL;
+    *out = v;
+    return 0;
+}
+
+int fv_locate(const char *spec, char *file, size_t file_size, uint64_t *offset, uint64_t *length) {
+    const char *at = strstr(spec, "@@");
+    size_t flen = at ? (size_t)(at - spec) : strlen(spec);
+    if (flen == 0) return -ENOENT;
+    if (flen >= file_size) return -ENAMETOOLONG;
+    memcpy(file, spec, flen);
+    file[flen] = '\0';
+    *offset = 0;
+    *length = 0;
+    if (!at) return 0;
+
+    const char *sel = at + 2;
+    if (strncmp(sel, "part", 4) != 0) return parse_offset(sel, offset);
+
+    char *end;
+    unsigned long n = strtoul(sel + 4, &end, 10);
+    if (end == sel + 4 || *end || n == 0) return -EINVAL;
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return -errno;
+    int rc = mbr_locate(fd, (unsigned)n, offset, length);
+    close(fd);
+    return rc;
+}
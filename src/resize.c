@@ -0,0 +1,378 @@
+// src/resize.c
+// Growing and shrinking a file system in place (mt_resize, the mresize
+// tool).
+//
+// The FAT is sized for the new cluster count the way mformat sizes it,
+// then rounded up until the data area moves by whole clusters, so that a
+// FAT that grows or shrinks just renumbers the clusters by a constant
+// shift while their bytes stay where they are.  Clusters that would fall
+// outside the new data area (past its end, or under a grown FAT) are
+// first copied into its free clusters, lowest first, in runs of up to
+// FV_STREAM_CHUNK bytes.  Then the cluster fields of every directory
+// entry, the fixed root (which moves with the FATs), every FAT copy, the
+// boot sector and FSInfo are rewritten, and the host file is truncated or
+// extended to the new size.
+//
+// The rewrite happens in place, outside the journal (which is
+// checkpointed first): an interrupted resize leaves a damaged file
+// system.  Resize a copy (mclone) where that matters.
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fatvol.h"
+
+static inline uint16_t rd_le16(const uint8_t *p) {
+    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+static inline uint32_t rd_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+static inline void wr_le16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8);
+}
+static inline void wr_le32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24);
+}
+
+// Entry i of a FAT held in memory
+static uint32_t ent_get(const uint8_t *fat, int bits, uint32_t i) {
+    if (bits == 12) {
+        uint16_t pair = rd_le16(fat + i + i / 2);
+        return (i & 1) ? pair >> 4 : pair & 0x0FFF;
+    }
+    if (bits == 16) return rd_le16(fat + (size_t)i * 2);
+    return rd_le32(fat + (size_t)i * 4) & 0x0FFFFFFFu;
+}
+
+static void ent_set(uint8_t *fat, int bits, uint32_t i, uint32_t val) {
+    if (bits == 12) {
+        uint8_t *p = fat + i + i / 2;
+        if (i & 1) {
+            p[0] = (uint8_t)((p[0] & 0x0F) | ((val & 0x0F) << 4));
+            p[1] = (uint8_t)(val >> 4);
+        } else {
+            p[0] = (uint8_t)val;
+            p[1] = (uint8_t)((p[1] & 0xF0) | ((val >> 8) & 0x0F));
+        }
+    } else if (bits == 16) {
+        wr_le16(fat + (size_t)i * 2, (uint16_t)val);
+    } else {
+        uint8_t *p = fat + (size_t)i * 4;
+        wr_le32(p, (rd_le32(p) & 0xF0000000u) | (val & 0x0FFFFFFFu));
+    }
+}
+
+// The layout of the resized file system
+typedef struct {
+    uint32_t total;        // sectors
+    uint32_t fat_size;     // sectors per FAT
+    uint32_t root_lba;
+    uint32_t data_lba;
+    uint32_t clusters;
+    int64_t  shift;        // new cluster number - old cluster number
+} Layout;
+
+static uint32_t fat_sectors(const FatVol *v, uint64_t clusters) {
+    uint64_t bytes = ((clusters + 2) * (uint64_t)v->fat_bits + 7) / 8;
+    return (uint32_t)((bytes + v->bytes_per_sector - 1) / v->bytes_per_sector);
+}
+
+// Lay out total sectors: the smallest FAT that addresses what is left
+// behind it (mformat's loop), rounded up until the data area moves by
+// whole clusters.  -ERANGE if the cluster count calls for another FAT type.
+static int plan(const FatVol *v, uint32_t total, Layout *l) {
+    uint32_t spc = v->sectors_per_cluster;
+    uint64_t fixed = (uint64_t)v->first_fat_lba + v->root_dir_sectors;
+    uint32_t fat = 1;
+    for (;;) {
+        uint64_t meta = fixed + (uint64_t)v->num_fats * fat;
+        if (meta >= total) return -ENOSPC;
+        uint32_t need = fat_sectors(v, (total - meta) / spc);
+        if (need <= fat) break;
+        fat = need;
+    }
+    while (((int64_t)fat - v->fat_size_sectors) * v->num_fats % spc != 0) fat++;
+    uint64_t meta = fixed + (uint64_t)v->num_fats * fat;
+    if (meta >= total) return -ENOSPC;
+
+    l->total    = total;
+    l->fat_size = fat;
+    l->root_lba = (uint32_t)(meta - v->root_dir_sectors);
+    l->data_lba = (uint32_t)meta;
+    l->clusters = (uint32_t)((total - meta) / spc);
+    l->shift    = ((int64_t)v->first_data_lba - l->data_lba) / spc;
+    int bits = l->clusters < 4085 ? 12 : l->clusters < 65525 ? 16 : 32;
+    if (bits != v->fat_bits || l->clusters == 0 || l->clusters > 0x0FFFFFF5u) return -ERANGE;
+    return 0;
+}
+
+// FAT #0 of the volume, decoded into fat[0 .. total_clusters + 2)
+static int load_fat(FatVol *v, uint32_t *fat) {
+    size_t bytes = (size_t)v->fat_size_sectors * v->bytes_per_sector;
+    uint8_t *buf = fv_alloc(v, bytes);
+    if (!buf) return -ENOMEM;
+    int rc = fv_pread(v, buf, bytes, (uint64_t)v->first_fat_lba * v->bytes_per_sector);
+    for (uint32_t c = 0; rc == 0 && c < v->total_clusters + 2; ++c) fat[c] = ent_get(buf, v->fat_bits, c);
+    fv_free(v, buf);
+    return rc;
+}
+
+static int is_used(const FatVol *v, uint32_t val) {
+    return val != 0 && val != fv_eoc(v) - 8;        // bad clusters hold nothing
+}
+
+int fv_resize_min(FatVol *v, uint32_t *total) {
+    uint32_t n = v->total_clusters + 2, used = 0;
+    uint32_t *fat = fv_alloc(v, (size_t)n * sizeof(*fat));
+    if (!fat) return -ENOMEM;
+    int rc = fv_flush(v);
+    if (rc == 0) rc = load_fat(v, fat);
+    for (uint32_t c = 2; rc == 0 && c < n; ++c) used += is_used(v, fat[c]);
+    fv_free(v, fat);
+    if (rc) return rc;
+
+    // At least as many clusters as are in use, and as the FAT type needs
+    uint32_t floor = v->fat_bits == 12 ? 1 : v->fat_bits == 16 ? 4085 : 65525;
+    if (used < floor) used = floor;
+    uint64_t t = v->first_fat_lba + v->root_dir_sectors + (uint64_t)v->num_fats * fat_sectors(v, used) +
+                 (uint64_t)used * v->sectors_per_cluster;
+    Layout l;
+    for (;; t += v->sectors_per_cluster) {
+        if (t > UINT32_MAX) return -ERANGE;
+        rc = plan(v, (uint32_t)t, &l);
+        if (rc == 0 && l.clusters >= used) break;
+        if (rc && rc != -ENOSPC && rc != -ERANGE) return rc;
+    }
+    *total = l.data_lba + l.clusters * v->sectors_per_cluster;
+    return 0;
+}
+
+static uint64_t new_offset(const FatVol *v, const Layout *l, uint32_t clus) {
+    return ((uint64_t)l->data_lba + (uint64_t)(clus - 2) * v->sectors_per_cluster) * v->bytes_per_sector;
+}
+
+// Copy the clusters that leave their place (to[c] not 0 nor c + shift),
+// one run of clusters adjacent at both ends per request
+static int move_data(FatVol *v, const Layout *l, const uint32_t *to, uint32_t n) {
+    uint32_t cb = v->cluster_bytes;
+    uint32_t max = FV_STREAM_CHUNK / cb ? FV_STREAM_CHUNK / cb : 1;
+    uint8_t *buf = fv_alloc(v, (size_t)max * cb);
+    if (!buf) return -ENOMEM;
+    int rc = 0;
+    for (uint32_t c = 2; c < n && rc == 0; ) {
+        if (!to[c] || to[c] == c + l->shift) { c++; continue; }
+        uint32_t len = 1;
+        while (len < max && c + len < n && to[c + len] == to[c] + len) len++;
+        rc = fv_pread(v, buf, (size_t)len * cb, fv_cluster_offset(v, c));
+        if (rc == 0) rc = fv_pwrite(v, buf, (size_t)len * cb, new_offset(v, l, to[c]));
+        v->st.bytes_copied += (uint64_t)len * cb;
+        c += len;
+    }
+    fv_free(v, buf);
+    return rc;
+}
+
+// Renumber the cluster fields of the entries in buf (old number c becomes
+// to[c], unless that is 0); subdirectories, by their new first cluster, are pushed onto st.
+// Returns 1 if anything changed, 0 if not, -ENOMEM.
+typedef struct {
+    uint32_t *v;
+    uint32_t  n, cap;
+} Stack;
+
+static int patch_dir(FatVol *v, uint8_t *buf, size_t len, const uint32_t *to, uint32_t n, Stack *st, int *end) {
+    int changed = 0;
+    for (size_t off = 0; off < len; off += FV_DIRENT_SIZE) {
+        uint8_t *e = buf + off;
+        if (e[0] == 0) { *end = 1; break; }
+        if (e[0] == FV_DELETED || e[11] == FV_ATTR_LFN || (e[11] & FV_ATTR_VOLUME)) continue;
+        uint32_t c = fv_ent_cluster(e);
+        if (c < 2 || c >= n || !to[c]) continue;
+        if (to[c] != c) {
+            fv_ent_set_cluster(e, to[c]);
+            changed = 1;
+        }
+        if (!(e[11] & FV_ATTR_DIR) || e[0] == '.') continue;
+        if (st->n == st->cap) {
+            uint32_t cap = st->cap ? st->cap * 2 : 64;
+            uint32_t *p = fv_alloc(v, (size_t)cap * sizeof(*p));
+            if (!p) return -ENOMEM;
+            if (st->n) memcpy(p, st->v, (size_t)st->n * sizeof(*p));
+            fv_free(v, st->v);
+            st->v = p;
+            st->cap = cap;
+        }
+        st->v[st->n++] = to[c];
+    }
+    return changed;
+}
+
+// Walk every directory of the resized volume (its FAT in newfat, its
+// clusters in their final place) and renumber the entries.  root is the
+// fixed root, already in memory; the caller writes it to its new place.
+static int patch_dirs(FatVol *v, const Layout *l, const uint8_t *newfat, const uint32_t *to, uint32_t n,
+                      uint32_t new_root, uint8_t *root) {
+    uint32_t cb = v->cluster_bytes;
+    uint8_t *buf = fv_alloc(v, cb);
+    Stack st = {0};
+    if (!buf) return -ENOMEM;
+    int end = 0, rc = 0;
+    uint64_t dirs = 0;
+    if (root) {
+        rc = patch_dir(v, root, (size_t)v->root_dir_sectors * v->bytes_per_sector, to, n, &st, &end);
+        if (rc > 0) rc = 0;
+    } else if (!(st.v = fv_alloc(v, 64 * sizeof(*st.v)))) {
+        rc = -ENOMEM;
+    } else {
+        st.cap = 64;
+        st.v[st.n++] = new_root;
+    }
+    while (rc == 0 && st.n) {
+        uint32_t c = st.v[--st.n], steps = 0;
+        if (++dirs > l->clusters) { rc = -EIO; break; }          // a loop: not a tree
+        for (end = 0; !end && c >= 2 && c < l->clusters + 2 && steps++ <= l->clusters; ) {
+            uint64_t off = new_offset(v, l, c);
+            if ((rc = fv_pread(v, buf, cb, off)) != 0) break;
+            int ch = patch_dir(v, buf, cb, to, n, &st, &end);
+            if (ch < 0) { rc = ch; break; }
+            if (ch && (rc = fv_pwrite(v, buf, cb, off)) != 0) break;
+            uint32_t next = ent_get(newfat, v->fat_bits, c);
+            if (fv_is_eoc(v, next)) break;
+            c = next;
+        }
+    }
+    fv_free(v, st.v);
+    fv_free(v, buf);
+    return rc;
+}
+
+// New boot sector (and its FAT32 backup) and FSInfo
+static int write_bpb(FatVol *v, const Layout *l, uint32_t new_root, uint32_t free_count, uint32_t next) {
+    uint8_t boot[sizeof(v->boot)];
+    uint32_t bps = v->bytes_per_sector;
+    memcpy(boot, v->boot, sizeof(boot));
+    if (v->fat_bits != 32 && l->total < 0x10000) {
+        wr_le16(boot + 19, (uint16_t)l->total);
+        wr_le32(boot + 32, 0);
+    } else {
+        wr_le16(boot + 19, 0);
+        wr_le32(boot + 32, l->total);
+    }
+    if (v->fat_bits == 32) {
+        wr_le32(boot + 36, l->fat_size);
+        wr_le32(boot + 44, new_root);
+    } else {
+        wr_le16(boot + 22, (uint16_t)l->fat_size);
+    }
+    int rc = fv_pwrite(v, boot, sizeof(boot), 0);
+    uint32_t bk = v->fat_bits == 32 ? rd_le16(boot + 0x32) : 0;
+    if (rc == 0 && bk && bk < v->first_fat_lba) rc = fv_pwrite(v, boot, sizeof(boot), (uint64_t)bk * bps);
+    if (rc == 0 && v->fsinfo_lba) {
+        uint8_t *sec = fv_alloc(v, bps);
+        if (!sec) return -ENOMEM;
+        rc = fv_pread(v, sec, bps, (uint64_t)v->fsinfo_lba * bps);
+        wr_le32(sec + 488, free_count);
+        wr_le32(sec + 492, next);
+        if (rc == 0) rc = fv_pwrite(v, sec, bps, (uint64_t)v->fsinfo_lba * bps);
+        fv_free(v, sec);
+    }
+    return rc;
+}
+
+int fv_resize(FatVol *v, uint32_t total, uint32_t *moved) {
+    if (!v->writable) return -EBADF;
+    if (v->ovl) return -EINVAL;                 // an overlay mirrors its base's size
+    if (moved) *moved = 0;
+    Layout l;
+    int rc = plan(v, total, &l);
+    if (rc) return rc;
+    uint32_t bps = v->bytes_per_sector;
+    if (v->length && (uint64_t)total * bps > v->length) return -ENOSPC;     // the partition is full
+    if (total == v->total_sectors && l.fat_size == v->fat_size_sectors) return 0;
+    if ((rc = fv_flush(v)) != 0 || (rc = fvj_checkpoint(v)) != 0) return rc;
+
+    // Old cluster c stays in place as c + shift if that is in the new data
+    // area, i.e. if c is in [lo, hi)
+    uint32_t n = v->total_clusters + 2, end = l.clusters + 2;
+    int64_t lo = 2 - l.shift, hi = (int64_t)end - l.shift;
+    size_t fat_bytes = (size_t)l.fat_size * bps, root_bytes = (size_t)v->root_dir_sectors * bps;
+    uint32_t *fat = fv_alloc(v, (size_t)n * sizeof(*fat));
+    uint32_t *to  = fv_alloc(v, (size_t)n * sizeof(*to));
+    uint8_t *newfat = fv_alloc(v, fat_bytes);
+    uint8_t *root = root_bytes ? fv_alloc(v, root_bytes) : NULL;
+    if (!fat || !to || !newfat || (root_bytes && !root)) rc = -ENOMEM;
+    int ph = fv_phase(v, MT_PHASE_ALLOC);
+    if (rc == 0) rc = load_fat(v, fat);
+    // Moved clusters may land on the old FATs and root: keep them in memory
+    if (rc == 0 && root) rc = fv_pread(v, root, root_bytes, (uint64_t)v->first_root_lba * bps);
+
+    // The new FAT: first the clusters that stay, then each one that does
+    // not fit goes to the lowest free cluster of the new data area
+    uint32_t count = 0, taken = 0, d = 2, new_root = 0;
+    if (rc == 0) {
+        memset(newfat, 0, fat_bytes);
+        ent_set(newfat, v->fat_bits, 0, fat[0]);
+        ent_set(newfat, v->fat_bits, 1, fat[1]);
+        for (uint32_t c = 2; c < n; ++c) {
+            int stays = c >= lo && c < hi;
+            to[c] = stays ? (uint32_t)(c + l.shift) : 0;        // 0: free, or moved below
+            if (stays && fat[c]) {
+                ent_set(newfat, v->fat_bits, to[c], fv_eoc(v));     // taken; linked below
+                taken++;
+            }
+        }
+    }
+    for (uint32_t c = 2; rc == 0 && c < n; ++c) {
+        if ((c >= lo && c < hi) || !is_used(v, fat[c])) continue;
+        while (d < end && ent_get(newfat, v->fat_bits, d)) d++;
+        if (d >= end) { rc = -ENOSPC; break; }
+        to[c] = d;
+        ent_set(newfat, v->fat_bits, d, fv_eoc(v));
+        taken++;
+        count++;
+    }
+    for (uint32_t c = 2; rc == 0 && c < n; ++c) {
+        uint32_t val = fat[c];
+        if (!val || (!(c >= lo && c < hi) && !is_used(v, val))) continue;
+        if (val >= 2 && val < n) val = to[val] ? to[val] : fv_eoc(v);      // (a chain into free space)
+        ent_set(newfat, v->fat_bits, to[c], val);
+    }
+    if (rc == 0 && v->root_clus) new_root = to[v->root_clus];
+
+    // Everything below happens in place: no more going back
+    fv_phase(v, MT_PHASE_WRITE);
+    if (rc == 0) rc = move_data(v, &l, to, n);
+    fv_phase(v, MT_PHASE_SCAN);
+    if (rc == 0) rc = patch_dirs(v, &l, newfat, to, n, new_root, root);
+    fv_phase(v, MT_PHASE_FLUSH);
+    if (rc == 0 && root) rc = fv_pwrite(v, root, root_bytes, (uint64_t)l.root_lba * bps);
+    for (uint32_t i = 0; rc == 0 && i < v->num_fats; ++i)
+        rc = fv_pwrite(v, newfat, fat_bytes, ((uint64_t)v->first_fat_lba + (uint64_t)i * l.fat_size) * bps);
+    if (rc == 0) {
+        for (d = 2; d < end && ent_get(newfat, v->fat_bits, d); ++d) {}
+        rc = write_bpb(v, &l, new_root, l.clusters - taken, d < end ? d : 2);
+    }
+    if (rc == 0) rc = fv_qwait(v);
+
+    // The host file follows, unless a partition table fixes its size
+    struct stat sb;
+    if (rc == 0 && !v->length && fstat(v->fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+        v->st.syscalls++;
+        if (ftruncate(v->fd, (off_t)(v->offset + (uint64_t)total * bps)) != 0) rc = -errno;
+    }
+    if (rc == 0) rc = fv_reload(v);
+    fv_phase(v, ph);
+    fv_free(v, fat);
+    fv_free(v, to);
+    fv_free(v, newfat);
+    fv_free(v, root);
+    if (rc == 0 && moved) *moved = count;
+    return rc;
+}
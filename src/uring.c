@@ -0,0 +1,327 @@
+// src/uring.c
+// Queued bulk I/O for the fatvol engine (see fv_qread/fv_qwrite in fatvol.h).
+//
+// On Linux the requests go through an io_uring set up on first bulk use:
+// FV_URING_DEPTH requests in flight, each staged in one of a pool of
+// registered bounce buffers (READ_FIXED/WRITE_FIXED) on the registered
+// image descriptor.  A barrier (fv_qbarrier) makes the next request an
+// IOSQE_IO_DRAIN one, so a metadata flush only starts once the file data
+// queued before it has completed.  Requests that overlap one in flight
+// wait for it first, so reads never see stale sectors and writes to the
+// same sector land in order.
+//
+// Without io_uring (other systems, old kernels, seccomp, MT_SYNCIO) every
+// request is a plain pread/pwrite, issued at once.
+//
+// The ring is driven through the raw system calls; liburing is not needed.
+
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "fatvol.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING 1
+#endif
+#endif
+
+#ifdef HAVE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+    uint8_t *buf;         // bounce buffer (FV_URING_SLOT bytes)
+    uint8_t *dst;         // read: where the data goes on completion
+    uint64_t off;         // absolute image offset
+    uint32_t len;
+    uint8_t  busy, write;
+} Slot;
+
+struct FvRing {
+    int       fd;
+    int       fixed_bufs;          // bounce buffers registered
+    int       fixed_file;          // image descriptor registered
+    int       drain_next;
+    uint32_t  queued;              // in the SQ, not yet submitted
+    uint32_t  inflight;            // submitted or queued, not reaped
+    uint32_t  sq_mask, cq_mask;
+    uint32_t *sq_head, *sq_tail, *sq_array;
+    uint32_t *cq_head, *cq_tail;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void     *sq_map, *cq_map;
+    size_t    sq_map_len, cq_map_len, sqes_len;
+    uint8_t  *pool_mem, *pool;     // pool: pool_mem aligned
+    Slot      slot[FV_URING_DEPTH];
+    uint32_t  free[FV_URING_DEPTH];
+    uint32_t  nfree;
+};
+
+static int ring_enter(FatVol *v, uint32_t submit, uint32_t wait) {
+    FvRing *r = v->ring;
+    for (;;) {
+        v->st.syscalls++;
+        long n = syscall(__NR_io_uring_enter, r->fd, submit, wait,
+                         wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0) {
+            r->queued -= (uint32_t)n < submit ? (uint32_t)n : submit;
+            return 0;
+        }
+        if (errno != EINTR) return -errno;
+    }
+}
+
+// Finish a completed slot; a short transfer is completed synchronously.
+static int slot_done(FatVol *v, Slot *s, int res) {
+    int rc = 0;
+    if (res < 0) {
+        rc = res;
+    } else if ((uint32_t)res < s->len) {
+        uint32_t done = (uint32_t)res;
+        while (rc == 0 && done < s->len) {
+            ssize_t n = s->write ? pwrite(v->fd, s->buf + done, s->len - done, (off_t)(s->off + done))
+                                 : pread(v->fd, s->buf + done, s->len - done, (off_t)(s->off + done));
+            v->st.syscalls++;
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) rc = n < 0 ? -errno : -EIO;
+            else done += (uint32_t)n;
+        }
+    }
+    if (rc == 0 && !s->write) memcpy(s->dst, s->buf, s->len);
+    s->busy = 0;
+    return rc;
+}
+
+// Reap whatever has completed; with wait, at least one request.
+static int reap(FatVol *v, int wait) {
+    FvRing *r = v->ring;
+    int rc = 0;
+    if (wait && (rc = ring_enter(v, r->queued, 1)) != 0) return rc;
+    uint32_t head = *r->cq_head;
+    uint32_t tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe *c = &r->cqes[head & r->cq_mask];
+        Slot *s = &r->slot[c->user_data];
+        int src = slot_done(v, s, c->res);
+        if (src && !v->qerr) v->qerr = src;
+        r->free[r->nfree++] = (uint32_t)c->user_data;
+        r->inflight--;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return rc;
+}
+
+// Wait until no request in flight overlaps [off, off + len).
+static int fence(FatVol *v, uint64_t off, size_t len) {
+    FvRing *r = v->ring;
+    for (;;) {
+        int busy = 0;
+        for (uint32_t i = 0; i < FV_URING_DEPTH && !busy; ++i) {
+            const Slot *s = &r->slot[i];
+            busy = s->busy && s->off < off + len && off < s->off + s->len;
+        }
+        if (!busy) return 0;
+        int rc = reap(v, 1);
+        if (rc) return rc;
+    }
+}
+
+static int queue(FatVol *v, int write, uint8_t *dst, const void *src, size_t len, uint64_t off) {
+    FvRing *r = v->ring;
+    int rc = fence(v, off, len);
+    if (rc) return rc;
+    while (r->nfree == 0)
+        if ((rc = reap(v, 1)) != 0) return rc;
+
+    uint32_t i = r->free[--r->nfree];
+    Slot *s = &r->slot[i];
+    s->busy  = 1;
+    s->write = (uint8_t)write;
+    s->dst   = dst;
+    s->off   = off;
+    s->len   = (uint32_t)len;
+    if (write) memcpy(s->buf, src, len);
+
+    uint32_t tail = *r->sq_tail;
+    uint32_t idx = tail & r->sq_mask;
+    struct io_uring_sqe *e = &r->sqes[idx];
+    memset(e, 0, sizeof(*e));
+    if (r->fixed_bufs) {
+        e->opcode    = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        e->buf_index = (uint16_t)i;
+    } else {
+        e->opcode    = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    e->fd        = r->fixed_file ? 0 : v->fd;
+    e->flags     = (uint8_t)((r->fixed_file ? IOSQE_FIXED_FILE : 0) | (r->drain_next ? IOSQE_IO_DRAIN : 0));
+    e->addr      = (uint64_t)(uintptr_t)s->buf;
+    e->len       = s->len;
+    e->off       = off;
+    e->user_data = i;
+    r->drain_next = 0;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+    r->inflight++;
+
+    // Keep the kernel busy once a good share of the queue has built up
+    if (r->queued >= FV_URING_DEPTH / 4) return ring_enter(v, r->queued, 0);
+    return 0;
+}
+
+static void ring_free(FatVol *v, FvRing *r) {
+    if (r->sq_map && r->sq_map != MAP_FAILED) munmap(r->sq_map, r->sq_map_len);
+    if (r->cq_map && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_len);
+    if (r->sqes && (void *)r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+    if (r->fd >= 0) close(r->fd);
+    fv_free(v, r->pool_mem);
+    fv_free(v, r);
+}
+
+int fv_qstart(FatVol *v) {
+    if (v->ring) return 0;
+    if (v->no_ring) return -ENOTSUP;
+    v->no_ring = 1;                 // until the ring is up: one attempt only
+
+    FvRing *r = fv_alloc(v, sizeof(*r));
+    if (!r) return -ENOMEM;
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    v->st.syscalls++;
+    long fd = syscall(__NR_io_uring_setup, FV_URING_DEPTH, &p);
+    if (fd < 0) { int rc = -errno; ring_free(v, r); return rc; }
+    r->fd = (int)fd;
+
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_len > r->sq_map_len) r->sq_map_len = r->cq_map_len;
+        r->cq_map_len = r->sq_map_len;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    r->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_map
+              : mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_CQ_RING);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    r->pool_mem = fv_alloc(v, (size_t)FV_URING_DEPTH * FV_URING_SLOT + FV_DIO_ALIGN_MAX);
+    if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || (void *)r->sqes == MAP_FAILED || !r->pool_mem) {
+        ring_free(v, r);
+        return -ENOMEM;
+    }
+    // aligned for O_DIRECT (MT_DIRECT)
+    r->pool = (uint8_t *)(((uintptr_t)r->pool_mem + FV_DIO_ALIGN_MAX - 1) & ~(uintptr_t)(FV_DIO_ALIGN_MAX - 1));
+    uint8_t *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_head  = (uint32_t *)(sq + p.sq_off.head);
+    r->sq_tail  = (uint32_t *)(sq + p.sq_off.tail);
+    r->sq_mask  = *(uint32_t *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (uint32_t *)(sq + p.sq_off.array);
+    r->cq_head  = (uint32_t *)(cq + p.cq_off.head);
+    r->cq_tail  = (uint32_t *)(cq + p.cq_off.tail);
+    r->cq_mask  = *(uint32_t *)(cq + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    struct iovec iov[FV_URING_DEPTH];
+    for (uint32_t i = 0; i < FV_URING_DEPTH; ++i) {
+        r->slot[i].buf = r->pool + (size_t)i * FV_URING_SLOT;
+        iov[i].iov_base = r->slot[i].buf;
+        iov[i].iov_len  = FV_URING_SLOT;
+        r->free[r->nfree++] = FV_URING_DEPTH - 1 - i;
+    }
+    // Both registrations are optimisations: a locked-memory limit or an
+    // old kernel only costs the per-request buffer/file lookups
+    v->st.syscalls += 2;
+    r->fixed_bufs = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, FV_URING_DEPTH) == 0;
+    r->fixed_file = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, &v->fd, 1) == 0;
+
+    v->ring = r;
+    v->no_ring = 0;
+    return 0;
+}
+
+void fv_qclose(FatVol *v) {
+    if (!v->ring) return;
+    fv_qwait(v);
+    ring_free(v, v->ring);
+    v->ring = NULL;
+}
+
+void fv_qbarrier(FatVol *v) {
+    if (v->ring && v->ring->inflight) v->ring->drain_next = 1;
+}
+
+int fv_qfence(FatVol *v, uint64_t off, size_t len) {
+    return v->ring ? fence(v, v->offset + off, len) : 0;
+}
+
+int fv_qwait(FatVol *v) {
+    int rc = 0;
+    while (v->ring && v->ring->inflight && rc == 0) rc = reap(v, 1);
+    if (rc == 0) rc = v->qerr;
+    v->qerr = 0;
+    if (rc == 0) rc = fv_dio_spill(v);      // staged sub-block writes go last
+    if (rc == 0) rc = fv_ovl_sync(v);       // then the overlay map they fill
+    return rc;
+}
+#else  // no io_uring: every request is synchronous
+
+int  fv_qstart(FatVol *v)   { (void)v; return -ENOTSUP; }
+void fv_qclose(FatVol *v)   { (void)v; }
+void fv_qbarrier(FatVol *v) { (void)v; }
+int  fv_qfence(FatVol *v, uint64_t off, size_t len) { (void)v; (void)off; (void)len; return 0; }
+int  fv_qwait(FatVol *v) {
+    int rc = v->qerr;
+    v->qerr = 0;
+    if (rc == 0) rc = fv_dio_spill(v);
+    return rc ? rc : fv_ovl_sync(v);
+}
+#endif
+
+int fv_qread(FatVol *v, void *buf, size_t len, uint64_t off) {
+#ifdef HAVE_URING
+    // overlay reads split by sector origin: they stay synchronous
+    if (v->ring && !v->ovl && (!v->dio || fv_dio_direct(v, v->offset + off, len, 0))) {
+        uint8_t *p = buf;
+        while (len) {
+            size_t n = len < FV_URING_SLOT ? len : FV_URING_SLOT;
+            fv_io_account(v, 0, v->offset + off, n);
+            int rc = queue(v, 0, p, NULL, n, v->offset + off);
+            if (rc) return rc;
+            p += n; off += n; len -= n;
+        }
+        return 0;
+    }
+#endif
+    return fv_pread(v, buf, len, off);
+}
+
+int fv_qwrite(FatVol *v, const void *buf, size_t len, uint64_t off) {
+#ifdef HAVE_URING
+    if (v->ring && (!v->dio || fv_dio_direct(v, v->offset + off, len, 1))) {
+        const uint8_t *p = buf;
+        int rc;
+        if (v->ovl && (rc = fv_ovl_prepare(v, v->offset + off, len)) != 0) return rc;
+        while (len) {
+            size_t n = len < FV_URING_SLOT ? len : FV_URING_SLOT;
+            fv_io_account(v, 1, v->offset + off, n);
+            rc = queue(v, 1, NULL, p, n, v->offset + off);
+            if (rc) return rc;
+            p += n; off += n; len -= n;
+        }
+        return 0;
+    }
+#endif
+    return fv_pwrite(v, buf, len, off);
+}
@@ -0,0 +1,662 @@
+// src/vfat.c
+// VFAT long file names: reading and writing the 0x0F slots in front of an
+// 8.3 entry, ~N alias generation, and a per-directory name index.
+//
+// Creation makes one pass over the directory: it finds the first run of
+// free slots long enough for the long name plus its 8.3 entry and, in the
+// same pass, records which ~N numbers the alias basis already uses, so the
+// alias never needs a second scan per candidate.
+//
+// Lookups go through a hash of the case-folded name (long and 8.3 names
+// both) built on first use of a directory and kept up to date by create
+// and remove, so a directory with thousands of long names is scanned once
+// instead of once per lookup.  Case folding covers ASCII and Latin-1.
+//
+// Removal leaves 0xE5 tombstones behind.  Compaction slides the live slots
+// down over them in one pass, order kept (long-name slots stay in front of
+// their 8.3 entry, . and .. stay first), and gives trailing clusters of a
+// chain directory back to the FAT.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "fatvol.h"
+
+#define LFN_CHARS      13                  // UTF-16 units per long-name slot
+#define LFN_LAST       0x40                // ordinal flag of the first slot on disk
+#define ALIAS_NUMBERS  (FV_DIR_MAX_ENTS + 2)
+#define DX_FREE        0xFFFFFFFFu
+#define DX_TOMB        0xFFFFFFFEu
+
+typedef struct {
+    uint32_t hash;
+    uint32_t idx;      // 8.3 entry, or DX_FREE / DX_TOMB
+    uint32_t first;
+} DxSlot;
+
+struct FvDirIndex {
+    int      used;
+    uint32_t dir;
+    uint32_t cap;      // power of two
+    uint32_t live, tombs;
+    uint32_t slots, dead;  // directory slots before the end marker, and the 0xE5 ones
+    DxSlot  *tab;
+};
+
+// Byte offsets of the 13 name units inside a long-name slot
+static const uint8_t lfn_off[LFN_CHARS] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+uint8_t fv_lfn_checksum(const uint8_t name11[11]) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; ++i) sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + name11[i]);
+    return sum;
+}
+
+// --- UTF-8 <-> UTF-16 ---
+// Strict: overlong forms, surrogates and code points past U+10FFFF are
+// -EINVAL, so that one name has one spelling
+static int utf8_to_lfn(const char *s, size_t len, FvLfn *out) {
+    static const uint32_t least[4] = { 0, 0x80, 0x800, 0x10000 };
+    const uint8_t *p = (const uint8_t *)s, *end = p + len;
+    out->len = 0;
+    while (p < end) {
+        uint32_t cp = *p++;
+        int more = 0;
+        if (cp >= 0xF0 && cp < 0xF5)      { cp &= 0x07; more = 3; }
+        else if (cp >= 0xE0 && cp < 0xF0) { cp &= 0x0F; more = 2; }
+        else if (cp >= 0xC2 && cp < 0xE0) { cp &= 0x1F; more = 1; }
+        else if (cp >= 0x80)              return -EINVAL;
+        uint32_t min = least[more];
+        while (more--) {
+            if (p >= end || (*p & 0xC0) != 0x80) return -EINVAL;
+            cp = (cp << 6) | (*p++ & 0x3F);
+        }
+        if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp < 0xE000)) return -EINVAL;
+        if (out->len + (cp >= 0x10000 ? 2 : 1) > FV_LFN_MAX) return -ENAMETOOLONG;
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            out->name[out->len++] = (uint16_t)(0xD800 | (cp >> 10));
+            out->name[out->len++] = (uint16_t)(0xDC00 | (cp & 0x3FF));
+        } else {
+            out->name[out->len++] = (uint16_t)cp;
+        }
+    }
+    return 0;
+}
+
+size_t fv_lfn_utf8(const FvLfn *l, char *out, size_t size) {
+    size_t n = 0;
+    for (uint32_t i = 0; i < l->len; ++i) {
+        uint32_t cp = l->name[i];
+        if (cp >= 0xD800 && cp < 0xDC00 && i + 1 < l->len &&
+            l->name[i + 1] >= 0xDC00 && l->name[i + 1] < 0xE000) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (l->name[++i] - 0xDC00);
+        } else if (cp >= 0xD800 && cp < 0xE000) {
+            cp = '?';                               // unpaired surrogate
+        }
+        uint8_t b[4];
+        size_t k;
+        if (cp < 0x80)         { b[0] = (uint8_t)cp; k = 1; }
+        else if (cp < 0x800)   { b[0] = (uint8_t)(0xC0 | (cp >> 6)); b[1] = (uint8_t)(0x80 | (cp & 0x3F)); k = 2; }
+        else if (cp < 0x10000) { b[0] = (uint8_t)(0xE0 | (cp >> 12)); b[1] = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+                                 b[2] = (uint8_t)(0x80 | (cp & 0x3F)); k = 3; }
+        else                   { b[0] = (uint8_t)(0xF0 | (cp >> 18)); b[1] = (uint8_t)(0x80 | ((cp >> 12) & 0x3F));
+                                 b[2] = (uint8_t)(0x80 | ((cp >> 6) & 0x3F)); b[3] = (uint8_t)(0x80 | (cp & 0x3F)); k = 4; }
+        if (n + k >= size) break;
+        memcpy(out + n, b, k);
+        n += k;
+    }
+    if (size) out[n] = '\0';
+    return n;
+}
+
+// --- case folding and hashing ---
+static uint16_t fold(uint16_t c) {
+    if (c >= 'a' && c <= 'z') return (uint16_t)(c - 32);
+    if (c >= 0xE0 && c <= 0xFE && c != 0xF7) return (uint16_t)(c - 32);
+    return c;
+}
+
+static uint32_t name_hash(const FvLfn *l) {
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < l->len; ++i) {
+        uint16_t c = fold(l->name[i]);
+        h = (h ^ (c & 0xFF)) * 16777619u;
+        h = (h ^ (c >> 8)) * 16777619u;
+    }
+    return h;
+}
+
+static int name_eq(const FvLfn *a, const FvLfn *b) {
+    if (a->len != b->len) return 0;
+    for (uint32_t i = 0; i < a->len; ++i)
+        if (fold(a->name[i]) != fold(b->name[i])) return 0;
+    return 1;
+}
+
+// The 8.3 name of an entry as UTF-16 ("NAME.EXT"; bytes >= 0x80 as Latin-1).
+static void short_to_lfn(const uint8_t *ent, FvLfn *out) {
+    char s[13];
+    fv_ent_name(ent, s);
+    out->len = 0;
+    for (const char *p = s; *p; ++p) out->name[out->len++] = (uint8_t)*p;
+}
+
+// --- 8.3 names and aliases ---
+static int short_char_ok(uint16_t c) {
+    if (c >= 'A' && c <= 'Z') return 1;
+    if (c >= 'a' && c <= 'z') return 1;
+    if (c >= '0' && c <= '9') return 1;
+    return c < 0x80 && c && strchr("!#$%&'()-@^_`{}~", (int)c) != NULL;
+}
+
+static int lfn_char_ok(uint16_t c) {
+    return c >= 0x20 && !(c < 0x80 && strchr("\"*/:<>?\\|", (int)c));
+}
+
+// Does the 8.3 name fit a name?  0: as it is, each part all upper or all
+// lower case (*nt gets the NT case bits for byte 12: 0x08 lower-case
+// base, 0x10 lower-case extension); 1: only upper-cased, so the name
+// needs a long name; -1: not at all.  name11 is filled upper-cased.
+static int short_name(const FvLfn *l, uint8_t name11[11], uint8_t *nt) {
+    int upper[2] = {0, 0}, lower[2] = {0, 0};
+    memset(name11, ' ', 11);
+    uint32_t i = 0, n = 0;
+    for (; i < l->len && l->name[i] != '.'; ++i) {
+        if (n == 8 || !short_char_ok(l->name[i])) return -1;
+        upper[0] |= l->name[i] >= 'A' && l->name[i] <= 'Z';
+        lower[0] |= l->name[i] >= 'a' && l->name[i] <= 'z';
+        name11[n++] = (uint8_t)fold(l->name[i]);
+    }
+    if (n == 0) return -1;
+    if (i < l->len) {
+        for (n = 8, ++i; i < l->len; ++i) {
+            if (n == 11 || !short_char_ok(l->name[i])) return -1;
+            upper[1] |= l->name[i] >= 'A' && l->name[i] <= 'Z';
+            lower[1] |= l->name[i] >= 'a' && l->name[i] <= 'z';
+            name11[n++] = (uint8_t)fold(l->name[i]);
+        }
+        if (n == 8) return -1;                  // "NAME." is not a plain name
+    }
+    if ((upper[0] && lower[0]) || (upper[1] && lower[1])) return 1;
+    *nt = (uint8_t)((lower[0] ? 0x08 : 0) | (lower[1] ? 0x10 : 0));
+    return 0;
+}
+
+// Alias basis: upper-cased, spaces and extra dots dropped, everything else
+// that cannot appear in an 8.3 name turned into '_'.
+static void alias_basis(const FvLfn *l, uint8_t base[8], uint32_t *blen, uint8_t ext[3]) {
+    uint32_t start = 0, last_dot = l->len;
+    while (start < l->len && l->name[start] == '.') ++start;
+    for (uint32_t i = start; i < l->len; ++i) if (l->name[i] == '.') last_dot = i;
+
+    *blen = 0;
+    memset(ext, ' ', 3);
+    for (uint32_t i = start; i < last_dot && *blen < 8; ++i) {
+        uint16_t c = l->name[i];
+        if (c == ' ' || c == '.') continue;
+        base[(*blen)++] = short_char_ok(c) ? (uint8_t)fold(c) : '_';
+    }
+    for (uint32_t i = last_dot + 1, n = 0; i < l->len && n < 3; ++i) {
+        uint16_t c = l->name[i];
+        if (c == ' ') continue;
+        ext[n++] = short_char_ok(c) ? (uint8_t)fold(c) : '_';
+    }
+    if (*blen == 0) base[(*blen)++] = '_';
+}
+
+static uint32_t digits(uint32_t n) {
+    uint32_t d = 1;
+    while (n >= 10) { n /= 10; ++d; }
+    return d;
+}
+
+static void make_alias(const uint8_t base[8], uint32_t blen, const uint8_t ext[3],
+                       uint32_t num, uint8_t name11[11]) {
+    uint32_t d = digits(num);
+    uint32_t keep = blen < 7 - d ? blen : 7 - d;
+    memset(name11, ' ', 11);
+    memcpy(name11, base, keep);
+    name11[keep] = '~';
+    for (uint32_t i = 0; i < d; ++i, num /= 10) name11[keep + d - i] = (uint8_t)('0' + num % 10);
+    memcpy(name11 + 8, ext, 3);
+}
+
+// If ent is "<basis prefix>~N.<ext>", mark N as taken.
+static void mark_alias(const uint8_t *ent, const uint8_t base[8], uint32_t blen,
+                       const uint8_t ext[3], uint8_t *used) {
+    if (memcmp(ent + 8, ext, 3) != 0) return;
+    int t = -1;
+    for (int i = 7; i > 0; --i) if (ent[i] == '~') { t = i; break; }
+    if (t < 0) return;
+    uint32_t num = 0, d = 0;
+    int i = t + 1;
+    for (; i < 8 && ent[i] >= '0' && ent[i] <= '9'; ++i, ++d) num = num * 10 + (uint32_t)(ent[i] - '0');
+    for (; i < 8; ++i) if (ent[i] != ' ') return;
+    if (d == 0 || d > 6 || ent[t + 1] == '0') return;
+    uint32_t keep = blen < 7 - d ? blen : 7 - d;
+    if ((uint32_t)t != keep || memcmp(ent, base, keep) != 0) return;
+    if (num < ALIAS_NUMBERS) used[num >> 3] |= (uint8_t)(1u << (num & 7));
+}
+
+// --- directory iteration ---
+int fv_dir_next(FatVol *v, FvDirPos *p, FvLfn *lfn, uint8_t **ent) {
+    uint16_t buf[20 * LFN_CHARS];
+    uint32_t expect = 0, total = 0, first = 0;
+    int complete = 0;
+    uint8_t chk = 0;
+    uint8_t *e;
+    int rc;
+
+    lfn->len = 0;
+    for (;; p->idx++) {
+        if ((rc = fv_dir_ent(v, p, 0, &e)) != 0) return rc;
+        if (e[0] == 0x00) return -ENOENT;
+        if (e[0] == FV_DELETED) { expect = 0; complete = 0; continue; }
+
+        if (e[11] == FV_ATTR_LFN) {
+            uint8_t ord = e[0] & 0x1F;
+            if (e[0] & LFN_LAST) {                  // a new sequence starts here
+                if (ord == 0 || ord > 20) { expect = 0; complete = 0; continue; }
+                expect = ord;
+                total  = ord * LFN_CHARS;
+                chk    = e[13];
+                first  = p->idx;
+            } else if (!expect || ord != expect || e[13] != chk) {
+                expect = 0; complete = 0;
+                continue;
+            }
+            for (int k = 0; k < LFN_CHARS; ++k)
+                buf[(ord - 1) * LFN_CHARS + k] = (uint16_t)(e[lfn_off[k]] | (e[lfn_off[k] + 1] << 8));
+            complete = (--expect == 0);
+            continue;
+        }
+
+        p->first = p->idx;
+        if (complete && fv_lfn_checksum(e) == chk) {
+            uint32_t n = 0;
+            while (n < total && buf[n] != 0) ++n;
+            if (n > 0 && n <= FV_LFN_MAX) {
+                memcpy(lfn->name, buf, n * sizeof(uint16_t));
+                lfn->len = n;
+                p->first = first;
+            }
+        }
+        *ent = e;
+        return 0;
+    }
+}
+
+// Does the entry (long name lfn, 8.3 entry e) carry the name key?
+static int entry_matches(const FvLfn *key, const FvLfn *lfn, const uint8_t *e) {
+    if (lfn->len && name_eq(key, lfn)) return 1;
+    FvLfn s;
+    short_to_lfn(e, &s);
+    return name_eq(key, &s);
+}
+
+// --- name index ---
+static int dx_put(FatVol *v, FvDirIndex *x, uint32_t hash, uint32_t idx, uint32_t first);
+
+static int dx_grow(FatVol *v, FvDirIndex *x) {
+    uint32_t cap = 64;
+    while (cap < x->live * 4) cap *= 2;
+    DxSlot *old = x->tab;
+    uint32_t old_cap = x->cap;
+    if (!(x->tab = fv_alloc(v, (size_t)cap * sizeof(DxSlot)))) { x->tab = old; return -ENOMEM; }
+    for (uint32_t i = 0; i < cap; ++i) x->tab[i].idx = DX_FREE;
+    x->cap = cap;
+    x->live = x->tombs = 0;
+    for (uint32_t i = 0; i < old_cap; ++i)
+        if (old[i].idx < DX_TOMB) dx_put(v, x, old[i].hash, old[i].idx, old[i].first);
+    fv_free(v, old);
+    return 0;
+}
+
+static int dx_put(FatVol *v, FvDirIndex *x, uint32_t hash, uint32_t idx, uint32_t first) {
+    if ((x->live + x->tombs + 1) * 2 > x->cap) {
+        int rc = dx_grow(v, x);
+        if (rc) return rc;
+    }
+    uint32_t i = hash & (x->cap - 1);
+    while (x->tab[i].idx < DX_TOMB) i = (i + 1) & (x->cap - 1);
+    if (x->tab[i].idx == DX_TOMB) x->tombs--;
+    x->tab[i] = (DxSlot){ hash, idx, first };
+    x->live++;
+    return 0;
+}
+
+static void dx_del(FvDirIndex *x, uint32_t hash, uint32_t idx) {
+    for (uint32_t i = hash & (x->cap - 1); x->tab[i].idx != DX_FREE; i = (i + 1) & (x->cap - 1)) {
+        if (x->tab[i].idx == idx && x->tab[i].hash == hash) {
+            x->tab[i].idx = DX_TOMB;
+            x->live--;
+            x->tombs++;
+            return;
+        }
+    }
+}
+
+static void dx_drop(FatVol *v, FvDirIndex *x) {
+    fv_free(v, x->tab);
+    memset(x, 0, sizeof(*x));
+}
+
+// Index both names of one entry.
+static int dx_add_entry(FatVol *v, FvDirIndex *x, const FvLfn *lfn, const uint8_t *e,
+                        uint32_t idx, uint32_t first) {
+    FvLfn s;
+    short_to_lfn(e, &s);
+    int rc = dx_put(v, x, name_hash(&s), idx, first);
+    if (rc == 0 && lfn->len) rc = dx_put(v, x, name_hash(lfn), idx, first);
+    return rc;
+}
+
+// FAT32 addresses its root both as 0 and as root_clus
+static FvDirIndex *dx_find(FatVol *v, uint32_t dir) {
+    if (dir == 0) dir = v->root_clus;
+    if (!v->dirx) return NULL;
+    for (int i = 0; i < FV_DIR_INDEXES; ++i)
+        if (v->dirx[i].used && v->dirx[i].dir == dir) return &v->dirx[i];
+    return NULL;
+}
+
+// The index of dir, built on first use.  NULL (callers scan linearly) when
+// memory is short or the directory cannot be read.
+static FvDirIndex *dx_get(FatVol *v, uint32_t dir) {
+    FvDirIndex *x = dx_find(v, dir);
+    if (x) return x;
+    if (!v->dirx) {
+        if (!(v->dirx = fv_alloc(v, FV_DIR_INDEXES * sizeof(FvDirIndex)))) return NULL;
+        memset(v->dirx, 0, FV_DIR_INDEXES * sizeof(FvDirIndex));
+    }
+    x = &v->dirx[v->dirx_next++ % FV_DIR_INDEXES];
+    dx_drop(v, x);
+    x->used = 1;
+    x->dir  = dir ? dir : v->root_clus;
+    if (dx_grow(v, x) != 0) { dx_drop(v, x); return NULL; }
+
+    FvDirPos p;
+    FvLfn lfn;
+    uint8_t *e;
+    int rc;
+    for (fv_dir_begin(&p, dir); (rc = fv_dir_next(v, &p, &lfn, &e)) == 0; p.idx++) {
+        if (e[11] & FV_ATTR_VOLUME) continue;
+        if (dx_add_entry(v, x, &lfn, e, p.idx, p.first) != 0) { rc = -ENOMEM; break; }
+    }
+    if (rc != -ENOENT) { dx_drop(v, x); return NULL; }
+    // Slot counts for fv_dir_compact, kept up to date by create and remove
+    for (fv_dir_begin(&p, dir); (rc = fv_dir_ent(v, &p, 0, &e)) == 0 && e[0] != 0x00; p.idx++)
+        if (e[0] == FV_DELETED) x->dead++;
+    if (rc != 0 && rc != -ENOENT) { dx_drop(v, x); return NULL; }
+    x->slots = p.idx;
+    return x;
+}
+
+void fv_dirx_drop(FatVol *v, uint32_t dir) {
+    FvDirIndex *x = dx_find(v, dir);
+    if (x) dx_drop(v, x);
+}
+
+void fv_dirx_free(FatVol *v) {
+    if (!v->dirx) return;
+    for (int i = 0; i < FV_DIR_INDEXES; ++i) dx_drop(v, &v->dirx[i]);
+    fv_free(v, v->dirx);
+    v->dirx = NULL;
+}
+
+// --- lookup, create, remove ---
+static int dir_lookup(FatVol *v, uint32_t dir, const char *name, size_t len, FvDirPos *p) {
+    FvLfn key, lfn;
+    uint8_t *e;
+    int rc = utf8_to_lfn(name, len, &key);
+    if (rc) return rc;
+
+    FvDirIndex *x = dx_get(v, dir);
+    if (x) {
+        uint32_t h = name_hash(&key);
+        for (uint32_t i = h & (x->cap - 1); x->tab[i].idx != DX_FREE; i = (i + 1) & (x->cap - 1)) {
+            const DxSlot *s = &x->tab[i];
+            if (s->idx == DX_TOMB || s->hash != h) continue;
+            fv_dir_begin(p, dir);
+            p->idx = s->first;
+            if ((rc = fv_dir_next(v, p, &lfn, &e)) != 0) return rc;
+            if (p->idx == s->idx && entry_matches(&key, &lfn, e)) return 0;
+        }
+        return -ENOENT;
+    }
+
+    for (fv_dir_begin(p, dir); (rc = fv_dir_next(v, p, &lfn, &e)) == 0; p->idx++) {
+        if (e[11] & FV_ATTR_VOLUME) continue;
+        if (entry_matches(&key, &lfn, e)) return 0;
+    }
+    return rc;
+}
+
+int fv_dir_lookup(FatVol *v, uint32_t dir, const char *name, size_t len, FvDirPos *p) {
+    int ph = fv_phase(v, MT_PHASE_SCAN);
+    int rc = dir_lookup(v, dir, name, len, p);
+    fv_phase(v, ph);
+    return rc;
+}
+
+static int dir_create(FatVol *v, uint32_t dir, const char *name, size_t len, FvDirPos *p) {
+    FvLfn ln;
+    int rc = utf8_to_lfn(name, len, &ln);
+    if (rc) return rc;
+    if (ln.len == 0) return -EINVAL;
+    for (uint32_t i = 0; i < ln.len; ++i)
+        if (!lfn_char_ok(ln.name[i])) return -EINVAL;
+
+    // A name that fits 8.3 but for mixed case keeps its upper-cased 8.3
+    // form as the alias (no ~N) unless another entry has it already
+    uint8_t name11[11], base[8], ext[3], nt = 0;
+    uint32_t blen = 0;
+    int fit = short_name(&ln, name11, &nt), taken = 0;
+    int need_lfn = fit != 0;
+    uint32_t nslots = need_lfn ? (ln.len + LFN_CHARS - 1) / LFN_CHARS + 1 : 1;
+    uint8_t *used = NULL;
+    if (need_lfn) {
+        alias_basis(&ln, base, &blen, ext);
+        if (!(used = fv_alloc(v, ALIAS_NUMBERS / 8 + 1))) return -ENOMEM;
+        memset(used, 0, ALIAS_NUMBERS / 8 + 1);
+    }
+
+    // One pass: first run of nslots free slots, and the ~N numbers in use
+    uint32_t found = UINT32_MAX, run_start = 0, run_len = 0;
+    uint8_t *e;
+    for (fv_dir_begin(p, dir); (rc = fv_dir_ent(v, p, 0, &e)) == 0; p->idx++) {
+        if (e[0] == 0x00 || e[0] == FV_DELETED) {
+            if (run_len++ == 0) run_start = p->idx;
+            if (found == UINT32_MAX && run_len >= nslots) found = run_start;
+            if (e[0] == 0x00) break;                // nothing in use past here
+            continue;
+        }
+        run_len = 0;
+        if (used && e[11] != FV_ATTR_LFN && !(e[11] & FV_ATTR_VOLUME)) {
+            mark_alias(e, base, blen, ext, used);
+            if (fit == 1 && memcmp(e, name11, 11) == 0) taken = 1;
+        }
+    }
+    if (rc != 0 && rc != -ENOENT) { fv_free(v, used); return rc; }
+    if (found == UINT32_MAX) found = run_len ? run_start : p->idx;   // runs into the end
+
+    if (used) {
+        uint32_t num = 1;
+        while (num < ALIAS_NUMBERS && (used[num >> 3] & (1u << (num & 7)))) ++num;
+        fv_free(v, used);
+        if (fit != 1 || taken) {
+            if (num >= ALIAS_NUMBERS) return -ENOSPC;
+            make_alias(base, blen, ext, num, name11);
+        }
+    }
+
+    // Make room: grow a chain directory up to the FAT limit
+    if (found + nslots > FV_DIR_MAX_ENTS) return -ENOSPC;
+    FvDirPos q;
+    fv_dir_begin(&q, dir);
+    q.idx = found + nslots - 1;
+    while ((rc = fv_dir_ent(v, &q, 0, &e)) == -ENOENT) {
+        uint32_t c;
+        if (q.dir == 0) return -ENOSPC;             // fixed root is full
+        if ((rc = fv_dir_extend(v, q.clus, &c)) != 0) return rc;
+    }
+    if (rc) return rc;
+
+    // Long-name slots, last part first, then the 8.3 entry
+    FvDirIndex *x = dx_find(v, dir);
+    if (x) {
+        // reused tombstones, then slots taken from past the end marker
+        for (uint32_t k = 0; k < nslots && found + k < x->slots; ++k) x->dead--;
+        if (found + nslots > x->slots) x->slots = found + nslots;
+    }
+    uint8_t chk = fv_lfn_checksum(name11);
+    fv_dir_begin(p, dir);
+    for (uint32_t k = 0; k + 1 < nslots; ++k) {
+        uint32_t ord = nslots - 1 - k;
+        p->idx = found + k;
+        if ((rc = fv_dir_ent(v, p, 1, &e)) != 0) return rc;
+        memset(e, 0, FV_DIRENT_SIZE);
+        e[0]  = (uint8_t)(ord | (k == 0 ? LFN_LAST : 0));
+        e[11] = FV_ATTR_LFN;
+        e[13] = chk;
+        for (int j = 0; j < LFN_CHARS; ++j) {
+            uint32_t at = (ord - 1) * LFN_CHARS + (uint32_t)j;
+            uint16_t c = at < ln.len ? ln.name[at] : at == ln.len ? 0x0000 : 0xFFFF;
+            e[lfn_off[j]]     = (uint8_t)c;
+            e[lfn_off[j] + 1] = (uint8_t)(c >> 8);
+        }
+    }
+    p->idx = found + nslots - 1;
+    if ((rc = fv_dir_ent(v, p, 1, &e)) != 0) return rc;
+    memset(e, 0, FV_DIRENT_SIZE);
+    memcpy(e, name11, 11);
+    e[12] = nt;
+    p->first = found;
+
+    if (x && dx_add_entry(v, x, need_lfn ? &ln : &(FvLfn){ .len = 0 }, e, p->idx, p->first) != 0)
+        dx_drop(v, x);
+    return 0;
+}
+
+int fv_dir_create(FatVol *v, uint32_t dir, const char *name, size_t len, FvDirPos *p) {
+    int ph = fv_phase(v, MT_PHASE_SCAN);
+    int rc = dir_create(v, dir, name, len, p);
+    fv_phase(v, ph);
+    return rc;
+}
+
+int fv_dir_remove(FatVol *v, FvDirPos *p) {
+    FvDirIndex *x = dx_find(v, p->dir);
+    uint32_t idx = p->idx;
+    FvDirPos q = *p;
+    FvLfn lfn;
+    uint8_t *e;
+    int rc;
+
+    q.idx = p->first;
+    if ((rc = fv_dir_next(v, &q, &lfn, &e)) != 0) return rc;
+    if (q.idx != idx) return -EIO;
+    if (x) {
+        FvLfn s;
+        short_to_lfn(e, &s);
+        dx_del(x, name_hash(&s), idx);
+        if (lfn.len) dx_del(x, name_hash(&lfn), idx);
+        x->dead += idx - p->first + 1;
+    }
+    for (q.idx = p->first; q.idx <= idx; ++q.idx) {
+        if ((rc = fv_dir_ent(v, &q, 1, &e)) != 0) return rc;
+        e[0] = FV_DELETED;
+    }
+    return 0;
+}
+
+// --- compaction ---
+static int compact_pass(FatVol *v, uint32_t dir, uint32_t *slots, uint32_t *clusters) {
+    FvDirPos rp, wp;
+    uint8_t *e, slot[FV_DIRENT_SIZE];
+    uint32_t r, w = 0;
+    int rc;
+
+    fv_dir_begin(&rp, dir);
+    fv_dir_begin(&wp, dir);
+    for (r = 0; (rc = fv_dir_ent(v, &rp, 0, &e)) == 0 && e[0] != 0x00; rp.idx = ++r) {
+        if (e[0] == FV_DELETED) continue;
+        if (w != r) {
+            memcpy(slot, e, sizeof(slot));      // e may leave the cache below
+            wp.idx = w;
+            if ((rc = fv_dir_ent(v, &wp, 1, &e)) != 0) return rc;
+            memcpy(e, slot, sizeof(slot));
+        }
+        w++;
+    }
+    if (rc != 0 && rc != -ENOENT) return rc;
+    for (wp.idx = w; wp.idx < r; wp.idx++) {     // everything from w on is free
+        if ((rc = fv_dir_ent(v, &wp, 1, &e)) != 0) return rc;
+        memset(e, 0, FV_DIRENT_SIZE);
+    }
+    *slots = r - w;
+
+    // A chain directory keeps the clusters holding slot 0 .. w-1, one at least
+    uint32_t c = dir ? dir : v->root_clus, next, n = 0;
+    *clusters = 0;
+    if (!c) return 0;                           // the fixed root cannot shrink
+    uint32_t epc = v->cluster_bytes / FV_DIRENT_SIZE;
+    uint32_t keep = w ? (w + epc - 1) / epc : 1;
+    for (uint32_t k = 1; k < keep; ++k)
+        if ((rc = fv_fat_get(v, c, &c)) != 0) return rc;
+    if ((rc = fv_fat_get(v, c, &next)) != 0) return rc;
+    if (next < 2 || fv_is_eoc(v, next) || next >= v->total_clusters + 2) return 0;
+    for (uint32_t t = next, u; t >= 2 && t < v->total_clusters + 2 && n <= v->total_clusters; t = u) {
+        n++;
+        if ((rc = fv_fat_get(v, t, &u)) != 0) return rc;
+        if (fv_is_eoc(v, u)) break;
+    }
+    if ((rc = fv_fat_set(v, c, fv_eoc(v))) != 0) return rc;
+    if ((rc = fv_free_chain(v, next)) != 0) return rc;
+    *clusters = n;
+    return 0;
+}
+
+int fv_dir_compact(FatVol *v, uint32_t dir, uint32_t min_ratio, uint32_t *slots, uint32_t *clusters) {
+    uint32_t s = 0, c = 0;
+    int rc = 0;
+    int ph = fv_phase(v, MT_PHASE_SCAN);
+    if (min_ratio) {
+        // Worth it?  The name index keeps the counts, so that a run of
+        // deletes does not rescan the directory each time; without one
+        // (short of memory), count here
+        FvDirIndex *x = dx_get(v, dir);
+        uint32_t dead = 0, total = 0;
+        if (x) {
+            dead  = x->dead;
+            total = x->slots;
+        } else {
+            FvDirPos p;
+            uint8_t *e;
+            fv_dir_begin(&p, dir);
+            for (; (rc = fv_dir_ent(v, &p, 0, &e)) == 0 && e[0] != 0x00; p.idx++, total++)
+                if (e[0] == FV_DELETED) dead++;
+            if (rc == -ENOENT) rc = 0;
+        }
+        if (rc || dead < FV_COMPACT_MIN || (uint64_t)dead * 100 < (uint64_t)total * min_ratio) {
+            fv_phase(v, ph);
+            if (slots) *slots = 0;
+            if (clusters) *clusters = 0;
+            return rc;
+        }
+    }
+    if (v->writable) {
+        rc = compact_pass(v, dir, &s, &c);
+        fv_dirx_drop(v, dir);      // slot numbers changed: rebuilt on next use
+    } else {
+        rc = -EROFS;
+    }
+    fv_phase(v, ph);
+    if (slots) *slots = s;
+    if (clusters) *clusters = c;
+    return rc;
+}
@@ -0,0 +1,357 @@
+// tests/fatcheck.c
+// fatcheck: check that a FAT12/16/32 image is consistent, for the behaviour
+// tests.  It reads the image by itself, without libmtools, so a bug in the
+// engine cannot hide in the checker too.
+//
+// Walks the directory tree from the root and checks that:
+//   - every chain stays inside the data area and ends in end-of-chain,
+//     through no free or bad cluster;
+//   - no cluster belongs to two chains, or twice to one (cross-links, loops);
+//   - a file's chain is exactly as long as its size needs (none for size 0);
+//   - "." and ".." point at the directory itself and at its parent;
+//   - every long name run is complete, numbered down to 1, and carries the
+//     checksum of the 8.3 entry that follows it;
+//   - no cluster is allocated in the FAT without belonging to a chain;
+//   - all FAT copies are equal, and the FAT32 FSInfo free count (when set)
+//     is the real one.
+//
+// -o checks the file system that starts OFFSET bytes into IMAGE (a
+// partition, or an image placed past 4 GiB).
+//
+// Build: see Makefile (`make test`)
+// Usage: fatcheck [-q] [-o OFFSET] IMAGE
+// Exit status: 0 consistent, 1 problems found (listed on stderr), 2 trouble.
+
+#define _FILE_OFFSET_BITS 64
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MAX_DEPTH    64
+#define MAX_REPORTS  20
+
+typedef struct {
+    int       fd;
+    const char *image;
+    uint64_t  base;                     // byte offset of the file system in the image
+    uint32_t  bps, spc, cs;             // bytes per sector, sectors and bytes per cluster
+    uint32_t  fat_lba, fat_secs, nfats;
+    uint32_t  root_lba, root_secs;      // FAT12/16 fixed root
+    uint32_t  root_clus;                // FAT32 root
+    uint32_t  data_lba, nclus;          // clusters 2 .. nclus + 1
+    uint32_t  fsinfo;
+    int       bits;
+    uint8_t  *fat;
+    uint32_t *owner;                    // 1-based index of the claiming chain, 0 free
+    uint32_t  chains;
+    uint32_t  files, dirs, used;
+    int       problems;
+} Check;
+
+static uint16_t rd16(const uint8_t *p) { return (uint16_t)(p[0] | p[1] << 8); }
+static uint32_t rd32(const uint8_t *p) { return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24; }
+
+static void problem(Check *c, const char *path, const char *fmt, ...) {
+    if (++c->problems > MAX_REPORTS) return;
+    fprintf(stderr, "%s: %s: ", c->image, path[0] ? path : "/");
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+static int read_at(Check *c, uint64_t off, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len) {
+        ssize_t n = pread(c->fd, p, len, (off_t)(c->base + off));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "%s: read at %llu: %s\n", c->image, (unsigned long long)off,
+                    n < 0 ? strerror(errno) : "short image");
+            return -1;
+        }
+        p += n; off += (uint64_t)n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+static uint32_t fat_get(const Check *c, uint32_t n) {
+    if (c->bits == 12) {
+        uint16_t v = rd16(c->fat + n + n / 2);
+        return n & 1 ? v >> 4 : v & 0xFFF;
+    }
+    if (c->bits == 16) return rd16(c->fat + n * 2);
+    return rd32(c->fat + n * 4) & 0x0FFFFFFF;
+}
+
+static int end_of_chain(const Check *c, uint32_t v) {
+    return v >= (c->bits == 12 ? 0xFF8u : c->bits == 16 ? 0xFFF8u : 0x0FFFFFF8u);
+}
+
+static int bad_cluster(const Check *c, uint32_t v) {
+    return v == (c->bits == 12 ? 0xFF7u : c->bits == 16 ? 0xFFF7u : 0x0FFFFFF7u);
+}
+
+// Claim the chain from `first` for one owner; the number of clusters, or
+// 0 when it is broken (reported).  *list gets the clusters if asked for.
+static uint32_t walk_chain(Check *c, const char *path, uint32_t first, uint32_t **list) {
+    uint32_t id = ++c->chains, n = 0, cap = 0, clus = first;
+    if (list) *list = NULL;
+    for (;;) {
+        if (clus < 2 || clus >= c->nclus + 2) {
+            problem(c, path, "cluster %u out of range (after %u clusters)", clus, n);
+            return 0;
+        }
+        if (c->owner[clus]) {
+            problem(c, path, c->owner[clus] == id ? "cluster %u loops back (after %u clusters)"
+                                                  : "cluster %u cross-linked (after %u clusters)", clus, n);
+            return 0;
+        }
+        c->owner[clus] = id;
+        if (list) {
+            if (n == cap) {
+                cap = cap ? cap * 2 : 16;
+                uint32_t *grown = realloc(*list, cap * sizeof(**list));
+                if (!grown) { fprintf(stderr, "fatcheck: out of memory\n"); exit(2); }
+                *list = grown;
+            }
+            (*list)[n] = clus;
+        }
+        ++n;
+        uint32_t next = fat_get(c, clus);
+        if (end_of_chain(c, next)) return n;
+        if (next == 0 || bad_cluster(c, next)) {
+            problem(c, path, "cluster %u links to a %s cluster", clus, next ? "bad" : "free");
+            return 0;
+        }
+        clus = next;
+    }
+}
+
+static uint8_t sfn_checksum(const uint8_t *name11) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; ++i) sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + name11[i]);
+    return sum;
+}
+
+static void name83(const uint8_t *e, char out[13]) {
+    size_t n = 0;
+    for (int i = 0; i < 8 && e[i] != ' '; ++i) out[n++] = (char)(i == 0 && e[i] == 0x05 ? 0xE5 : e[i]);
+    if (e[8] != ' ') {
+        out[n++] = '.';
+        for (int i = 8; i < 11 && e[i] != ' '; ++i) out[n++] = (char)e[i];
+    }
+    out[n] = '\0';
+}
+
+static void check_dir(Check *c, const char *path, uint32_t self, uint32_t parent, int depth);
+
+// The entries of one directory, `len` bytes of 32-byte slots
+static void check_entries(Check *c, const char *path, const uint8_t *buf, size_t len,
+                          uint32_t self, uint32_t parent, int depth) {
+    // Long name run in progress: slots still expected, 0 when none, -1
+    // when complete and waiting for its 8.3 entry
+    int lfn_left = 0;
+    uint8_t lfn_sum = 0;
+    for (size_t off = 0; off < len; off += 32) {
+        const uint8_t *e = buf + off;
+        uint32_t slot = (uint32_t)(off / 32);
+        if (e[0] == 0x00) break;
+        if (e[0] == 0xE5) {
+            if (lfn_left) problem(c, path, "long name run ends in deleted slot %u", slot);
+            lfn_left = 0;
+            continue;
+        }
+        if ((e[11] & 0x3F) == 0x0F) {
+            int seq = e[0] & 0x1F;
+            if (e[0] & 0x40) {
+                if (lfn_left) problem(c, path, "long name run cut short by a new one at slot %u", slot);
+                lfn_left = 0;
+                if (seq == 0 || seq > 20) {
+                    problem(c, path, "long name slot %u has sequence number %d", slot, seq);
+                    continue;
+                }
+                lfn_left = seq;
+                lfn_sum = e[13];
+            } else if (lfn_left <= 0 || seq != lfn_left || e[13] != lfn_sum) {
+                problem(c, path, "stray long name slot %u (sequence number %d)", slot, seq);
+                lfn_left = 0;
+                continue;
+            }
+            if (--lfn_left == 0) lfn_left = -1;
+            continue;
+        }
+
+        char name[13];
+        name83(e, name);
+        if (lfn_left > 0)
+            problem(c, path, "long name run for %s lacks %d slots", name, lfn_left);
+        else if (lfn_left < 0 && sfn_checksum(e) != lfn_sum)
+            problem(c, path, "long name checksum %02X does not match %s (%02X)", lfn_sum, name, sfn_checksum(e));
+        lfn_left = 0;
+        if (e[11] & 0x08) continue;     // volume label
+
+        char sub[1024];
+        snprintf(sub, sizeof(sub), "%s/%s", path, name);
+        uint32_t first = (uint32_t)rd16(e + 26) | (c->bits == 32 ? (uint32_t)rd16(e + 20) << 16 : 0);
+        uint32_t size = rd32(e + 28);
+
+        if (memcmp(e, ".          ", 11) == 0) {
+            if (first != self) problem(c, path, "\".\" points at %u, not %u", first, self);
+            continue;
+        }
+        if (memcmp(e, "..         ", 11) == 0) {
+            if (first != parent) problem(c, path, "\"..\" points at %u, not %u", first, parent);
+            continue;
+        }
+        if (e[11] & 0x10) {
+            ++c->dirs;
+            if (first == 0) { problem(c, sub, "directory without a cluster"); continue; }
+            if (depth >= MAX_DEPTH) { problem(c, sub, "nested deeper than %d directories", MAX_DEPTH); continue; }
+            check_dir(c, sub, first, self, depth + 1);
+            continue;
+        }
+        ++c->files;
+        if (size == 0) {
+            if (first != 0) problem(c, sub, "empty file owns cluster %u", first);
+            continue;
+        }
+        uint32_t want = (uint32_t)(((uint64_t)size + c->cs - 1) / c->cs);
+        uint32_t got = walk_chain(c, sub, first, NULL);
+        if (got && got != want) problem(c, sub, "chain of %u clusters, size needs %u", got, want);
+    }
+    if (lfn_left) problem(c, path, "long name run without its 8.3 entry at the end of the directory");
+}
+
+// A directory in clusters (every one but the FAT12/16 root)
+static void check_dir(Check *c, const char *path, uint32_t self, uint32_t parent, int depth) {
+    uint32_t *list;
+    uint32_t n = walk_chain(c, path, self, &list);
+    if (!n) { free(list); return; }
+    uint8_t *buf = malloc((size_t)n * c->cs);
+    if (!buf) { fprintf(stderr, "fatcheck: out of memory\n"); exit(2); }
+    for (uint32_t i = 0; i < n; ++i)
+        if (read_at(c, ((uint64_t)c->data_lba + (uint64_t)(list[i] - 2) * c->spc) * c->bps,
+                    buf + (size_t)i * c->cs, c->cs) != 0) exit(2);
+    free(list);
+    // ".." of a first-level directory is 0, also on FAT32
+    check_entries(c, path, buf, (size_t)n * c->cs, self, depth == 1 ? 0 : parent, depth);
+    free(buf);
+}
+
+static int load(Check *c) {
+    uint8_t bs[512];
+    if (read_at(c, 0, bs, sizeof(bs)) != 0) return -1;
+    c->bps = rd16(bs + 11);
+    c->spc = bs[13];
+    uint32_t rsvd = rd16(bs + 14), rootent = rd16(bs + 17);
+    uint32_t tot = rd16(bs + 19) ? rd16(bs + 19) : rd32(bs + 32);
+    c->nfats = bs[16];
+    c->fat_secs = rd16(bs + 22) ? rd16(bs + 22) : rd32(bs + 36);
+    if (bs[510] != 0x55 || bs[511] != 0xAA || c->bps < 512 || c->bps > 4096 || (c->bps & (c->bps - 1)) ||
+        !c->spc || (c->spc & (c->spc - 1)) || !rsvd || !c->nfats || !c->fat_secs) {
+        fprintf(stderr, "%s: not a FAT boot sector\n", c->image);
+        return -1;
+    }
+    c->cs = c->bps * c->spc;
+    c->fat_lba = rsvd;
+    c->root_lba = rsvd + c->nfats * c->fat_secs;
+    c->root_secs = (rootent * 32 + c->bps - 1) / c->bps;
+    c->data_lba = c->root_lba + c->root_secs;
+    if (tot <= c->data_lba) {
+        fprintf(stderr, "%s: no data area\n", c->image);
+        return -1;
+    }
+    c->nclus = (tot - c->data_lba) / c->spc;
+    c->bits = c->nclus < 4085 ? 12 : c->nclus < 65525 ? 16 : 32;
+    if (c->bits == 32) {
+        c->root_clus = rd32(bs + 44);
+        c->fsinfo = rd16(bs + 48);
+    }
+    if ((uint64_t)c->fat_secs * c->bps * 8 < (uint64_t)(c->nclus + 2) * (uint32_t)c->bits) {
+        fprintf(stderr, "%s: FAT too small for %u clusters\n", c->image, c->nclus);
+        return -1;
+    }
+
+    size_t fat_len = (size_t)c->fat_secs * c->bps;
+    uint8_t *copy = malloc(fat_len);
+    c->fat = malloc(fat_len);
+    c->owner = calloc((size_t)c->nclus + 2, sizeof(*c->owner));
+    if (!copy || !c->fat || !c->owner) {
+        fprintf(stderr, "fatcheck: out of memory\n");
+        free(copy);
+        return -1;
+    }
+    if (read_at(c, (uint64_t)c->fat_lba * c->bps, c->fat, fat_len) != 0) { free(copy); return -1; }
+    for (uint32_t i = 1; i < c->nfats; ++i) {
+        if (read_at(c, ((uint64_t)c->fat_lba + (uint64_t)i * c->fat_secs) * c->bps, copy, fat_len) != 0) { free(copy); return -1; }
+        if (memcmp(copy, c->fat, fat_len) != 0) problem(c, "", "FAT copy %u differs from FAT 0", i);
+    }
+    free(copy);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    Check c;
+    memset(&c, 0, sizeof(c));
+    int quiet = 0;
+    int i = 1;
+    if (i < argc && strcmp(argv[i], "-q") == 0) { quiet = 1; ++i; }
+    if (i + 1 < argc && strcmp(argv[i], "-o") == 0) { c.base = strtoull(argv[i + 1], NULL, 0); i += 2; }
+    if (i + 1 != argc) {
+        fprintf(stderr, "Usage: fatcheck [-q] [-o OFFSET] IMAGE\n");
+        return 2;
+    }
+    c.image = argv[i];
+    if ((c.fd = open(c.image, O_RDONLY)) < 0) {
+        fprintf(stderr, "%s: %s\n", c.image, strerror(errno));
+        return 2;
+    }
+    if (load(&c) != 0) return 2;
+
+    if (c.bits == 32) {
+        check_dir(&c, "", c.root_clus, 0, 0);
+    } else {
+        size_t len = (size_t)c.root_secs * c.bps;
+        uint8_t *root = malloc(len ? len : 1);
+        if (!root || read_at(&c, (uint64_t)c.root_lba * c.bps, root, len) != 0) return 2;
+        check_entries(&c, "", root, len, 0, 0, 0);
+        free(root);
+    }
+
+    uint32_t lost = 0, first_lost = 0;
+    for (uint32_t n = 2; n < c.nclus + 2; ++n) {
+        uint32_t v = fat_get(&c, n);
+        if (v == 0 || bad_cluster(&c, v)) continue;
+        ++c.used;
+        if (!c.owner[n] && !lost++) first_lost = n;
+    }
+    if (lost) problem(&c, "", "%u lost clusters, the first %u", lost, first_lost);
+
+    if (c.bits == 32 && c.fsinfo && c.fsinfo != 0xFFFF) {
+        uint8_t fi[512];
+        if (read_at(&c, (uint64_t)c.fsinfo * c.bps, fi, sizeof(fi)) != 0) return 2;
+        uint32_t free_count = rd32(fi + 488);
+        if (rd32(fi) == 0x41615252 && free_count != 0xFFFFFFFF && free_count != c.nclus - c.used)
+            problem(&c, "", "FSInfo free count %u, really %u", free_count, c.nclus - c.used);
+    }
+    close(c.fd);
+    free(c.fat);
+    free(c.owner);
+
+    if (c.problems) {
+        if (c.problems > MAX_REPORTS) fprintf(stderr, "%s: ... %d problems in all\n", c.image, c.problems);
+        return 1;
+    }
+    if (!quiet)
+        printf("%s: FAT%d, %u clusters, %u used, %u files, %u directories: OK\n",
+               c.image, c.bits, c.nclus, c.used, c.files, c.dirs);
+    return 0;
+}
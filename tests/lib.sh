@@ -0,0 +1,97 @@
+# tests/lib.sh
+# Helpers for the behaviour tests, sourced by every tests/*.test script.
+#
+# A script runs the tools from BUILD_DIR on images it generates in a
+# scratch directory, and checks each image with fatcheck afterwards.  Its
+# cases are shell functions run through `tcase`; a case stops at its first
+# failed step and the script reports how many cases passed.
+#
+# Usage: sh tests/NAME.test [BUILD_DIR]
+
+B=${1:-build}
+T=$(mktemp -d "${TMPDIR:-/tmp}/mtest.XXXXXX") || exit 2
+trap 'rm -rf "$T"' EXIT INT TERM
+
+# the tools must neither use a running mtoolsd nor pick up the caller's knobs
+unset MTOOLS_SOCKET MTOOLS_JOURNAL MTOOLS_IO MTOOLS_ALLOC MTOOLS_TRACE MTOOLS_STATS
+SOURCE_DATE_EPOCH=1700000000
+export SOURCE_DATE_EPOCH
+
+suite=$(basename "$0" .test)
+cases=0
+failed=0
+current=
+
+fail() {
+    echo "FAIL $suite/$current: $*" >&2
+    return 1
+}
+
+# tcase FUNCTION [ARGS...]: run one case, named after its arguments
+tcase() {
+    current="$*"
+    cases=$((cases + 1))
+    if ! "$@"; then
+        failed=$((failed + 1))
+    fi
+}
+
+# finish: report and give the script's exit status
+finish() {
+    echo "$suite: $((cases - failed))/$cases passed"
+    [ "$failed" -eq 0 ]
+}
+
+# mt TOOL ARGS...: run a tool, which must succeed; its output is in $T/out
+mt() {
+    tool=$1
+    shift
+    "$B/$tool" "$@" >"$T/out" 2>&1 && return 0
+    fail "$tool $* exited $?: $(head -3 "$T/out")"
+}
+
+# mt_fails TOOL ARGS...: run a tool, which must fail
+mt_fails() {
+    tool=$1
+    shift
+    "$B/$tool" "$@" >"$T/out" 2>&1 || return 0
+    fail "$tool $* should have failed"
+}
+
+# mkimg FILE SIZE FAT: a freshly formatted image
+mkimg() {
+    rm -f "$1" "$1.mtj"
+    truncate -s "$2" "$1" && "$B/mformat" -i "$1" -F "$3" >/dev/null 2>&1 || fail "mformat -F $3 $1 ($2)"
+}
+
+# fsck IMAGE [OFFSET]: the image (or the file system OFFSET bytes into
+# it) must be consistent
+fsck() {
+    "$B/fatcheck" -q -o "${2:-0}" "$1" 2>"$T/fsck" && return 0
+    fail "$(basename "$1") is inconsistent: $(head -5 "$T/fsck")"
+}
+
+# expect WHAT ACTUAL EXPECTED
+expect() {
+    [ "$2" = "$3" ] || fail "$1: got '$2', expected '$3'"
+}
+
+# names IMAGE [DIR]: "name,short_name" per entry of DIR, in listing order
+names() {
+    "$B/mdir" -i "$1" --format=csv "${2:-::}" | tail -n +2 | cut -d, -f2,3
+}
+
+# content IMAGE PATH: the SHA-256 of file PATH ("/DIR/NAME") in the image
+content() {
+    "$B/mdigest" -i "$1" -j 1 | awk -v p="$2" 'substr($0, 67) == p { print $1 }'
+}
+
+# sum FILE: the SHA-256 of a host file
+sum() {
+    sha256sum <"$1" | cut -d' ' -f1
+}
+
+# mkfile FILE BYTES
+mkfile() {
+    head -c "$2" /dev/urandom >"$1"
+}
@@ -0,0 +1,173 @@
+// tests/mtapi.c
+// mtapi: drive libmtools in-process, for the behaviour tests.  One thread
+// per image, each with its own handle and its own counting allocator, makes
+// a directory, writes, stats, lists, reads back, overwrites and deletes
+// files through the public API, then checks that every allocation went
+// through the allocator and was given back by mt_close().  A read-only
+// reopen must list the same files and refuse writes.
+//
+// Build: see Makefile (`make test`)
+// Usage: mtapi FILES IMAGE...
+// Exit status: 0 all calls behaved, 1 a check failed (on stderr), 2 trouble.
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "mtools.h"
+
+typedef struct {
+    const char *image;
+    int         files;
+    long        live, total;    // allocator: outstanding and all allocations
+    int         failed;
+} Job;
+
+static void *count_alloc(void *ctx, size_t size) {
+    Job *j = ctx;
+    void *p = malloc(size);
+    if (p) { j->live++; j->total++; }
+    return p;
+}
+
+static void count_free(void *ctx, void *ptr) {
+    Job *j = ctx;
+    if (ptr) j->live--;
+    free(ptr);
+}
+
+static void bad(Job *j, const char *fmt, ...) {
+    va_list ap;
+    flockfile(stderr);
+    fprintf(stderr, "mtapi: %s: ", j->image);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    funlockfile(stderr);
+    j->failed = 1;
+}
+
+// file i holds i * 1000 + 1 bytes of a pattern that depends on i and gen
+static size_t fill(unsigned char *buf, int i, int gen) {
+    size_t n = (size_t)i * 1000 + 1, k;
+    for (k = 0; k < n; k++) buf[k] = (unsigned char)(k * 7 + i * 13 + gen);
+    return n;
+}
+
+static int count_cb(void *ctx, const mt_entry *e) {
+    if (strcmp(e->name, ".") && strcmp(e->name, "..")) ++*(int *)ctx;
+    return 0;
+}
+
+// the files left by run(): the even ones, the first of them rewritten
+static int check_left(Job *j, mt_image *img, unsigned char *want, unsigned char *got) {
+    char path[64];
+    int i, n = 0, rc = mt_readdir(img, "DIR", count_cb, &n);
+    if (rc) { bad(j, "mt_readdir: %s", mt_strerror(rc)); return -1; }
+    if (n != (j->files + 1) / 2) { bad(j, "%d entries listed, not %d", n, (j->files + 1) / 2); return -1; }
+    for (i = 0; i < j->files; i += 2) {
+        size_t len = fill(want, i, i == 0);
+        long got_len;
+        snprintf(path, sizeof path, "::/DIR/File %d.bin", i);
+        got_len = mt_read(img, path, 0, got, len + 100);
+        if (got_len != (long)len || memcmp(got, want, len)) {
+            bad(j, "%s reads back wrong (%ld bytes)", path, got_len);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void run(Job *j) {
+    mt_allocator a = { count_alloc, count_free, j };
+    mt_image *img;
+    mt_entry e;
+    char path[64];
+    size_t max = (size_t)j->files * 1000 + 1;
+    unsigned char *want = malloc(max + 100), *got = malloc(max + 100);
+    int i, rc;
+
+    if (!want || !got) { bad(j, "out of memory"); goto out; }
+    if ((rc = mt_open(&img, j->image, MT_RDWR, &a))) { bad(j, "mt_open: %s", mt_strerror(rc)); goto out; }
+    if ((rc = mt_mkdir(img, "DIR"))) bad(j, "mt_mkdir: %s", mt_strerror(rc));
+    if ((rc = mt_mkdir(img, "/DIR")) != -EEXIST) bad(j, "mt_mkdir twice gave %d", rc);
+    for (i = 0; i < j->files && !j->failed; i++) {
+        size_t len = fill(want, i, 0);
+        snprintf(path, sizeof path, "DIR/File %d.bin", i);
+        if ((rc = mt_write(img, path, want, len, 0))) bad(j, "mt_write %s: %s", path, mt_strerror(rc));
+    }
+    for (i = 0; i < j->files && !j->failed; i++) {
+        size_t len = fill(want, i, 0);
+        long n;
+        snprintf(path, sizeof path, "/DIR/File %d.bin", i);
+        if ((rc = mt_stat(img, path, &e)) || e.size != len || (e.attr & MT_ATTR_DIR))
+            bad(j, "mt_stat %s: %d, size %u", path, rc, (unsigned)e.size);
+        n = mt_read(img, path, len / 2, got, len);    // from the middle to the end
+        if (n != (long)(len - len / 2) || memcmp(got, want + len / 2, len - len / 2))
+            bad(j, "mt_read %s at %zu: %ld bytes", path, len / 2, n);
+    }
+    if (j->failed) goto close;
+    if ((rc = mt_stat(img, "DIR", &e)) || !(e.attr & MT_ATTR_DIR)) bad(j, "mt_stat DIR: %d", rc);
+    if ((rc = mt_stat(img, "DIR/NONE", &e)) != -ENOENT) bad(j, "mt_stat of a missing file gave %d", rc);
+
+    fill(want, 0, 1);
+    if ((rc = mt_write(img, "DIR/File 0.bin", want, 1, 0)) != -EEXIST)
+        bad(j, "mt_write over a file without MT_OVERWRITE gave %d", rc);
+    if ((rc = mt_write(img, "DIR/File 0.bin", want, 1, MT_OVERWRITE)))
+        bad(j, "mt_write MT_OVERWRITE: %s", mt_strerror(rc));
+    for (i = 1; i < j->files; i += 2) {
+        snprintf(path, sizeof path, "DIR/File %d.bin", i);
+        if ((rc = mt_unlink(img, path))) bad(j, "mt_unlink %s: %s", path, mt_strerror(rc));
+    }
+    if ((rc = mt_unlink(img, "DIR/File 1.bin")) != -ENOENT) bad(j, "mt_unlink twice gave %d", rc);
+    if (!j->failed) check_left(j, img, want, got);
+close:
+    if ((rc = mt_close(img))) bad(j, "mt_close: %s", mt_strerror(rc));
+    if (j->live || !j->total) bad(j, "%ld of %ld allocations not freed", j->live, j->total);
+    if (j->failed) goto out;
+
+    if ((rc = mt_open(&img, j->image, MT_RDONLY, NULL))) { bad(j, "mt_open read-only: %s", mt_strerror(rc)); goto out; }
+    check_left(j, img, want, got);
+    if (mt_write(img, "NEW.BIN", want, 1, 0) >= 0) bad(j, "mt_write on a read-only handle worked");
+    if (mt_mkdir(img, "NEWDIR") >= 0) bad(j, "mt_mkdir on a read-only handle worked");
+    mt_close(img);
+out:
+    free(want);
+    free(got);
+}
+
+static void *thread_main(void *arg) {
+    run(arg);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    Job *jobs;
+    pthread_t *tids;
+    int i, n = argc - 2, failed = 0;
+
+    if (argc < 3 || atoi(argv[1]) < 1) {
+        fprintf(stderr, "Usage: %s FILES IMAGE...\n", argv[0]);
+        return 2;
+    }
+    jobs = calloc((size_t)n, sizeof(*jobs));
+    tids = calloc((size_t)n, sizeof(*tids));
+    if (!jobs || !tids) { perror("mtapi"); return 2; }
+    for (i = 0; i < n; i++) {
+        jobs[i].image = argv[i + 2];
+        jobs[i].files = atoi(argv[1]);
+        if (pthread_create(&tids[i], NULL, thread_main, &jobs[i])) { perror("mtapi: pthread_create"); return 2; }
+    }
+    for (i = 0; i < n; i++) {
+        pthread_join(tids[i], NULL);
+        failed |= jobs[i].failed;
+    }
+    free(jobs);
+    free(tids);
+    return failed;
+}